@@ -0,0 +1,1409 @@
+#include "rmov_ext.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+  Native QuickTime atom parser. The movie file is memory mapped and the
+  moov atom is walked in place, building a small tree of atom headers and
+  the track/media records the Movie and Track classes report from. Sample
+  tables are only located here, never copied.
+  
+  A probed movie is not mapped. Only the atom headers and the small leaf
+  atoms of moov are read, each trak is descended into when the track is 
+  first asked for, and sample tables are read when something needs them.
+  A streamed movie is probed the same way from its moov atom held in
+  memory, see atom_stream.c.
+*/
+
+static uint16_t atom_u16(const unsigned char *p)
+{
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t atom_u32(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t atom_u64(const unsigned char *p)
+{
+  return ((uint64_t)atom_u32(p) << 32) | atom_u32(p + 4);
+}
+
+static int atom_is_container(uint32_t type)
+{
+  switch (type) {
+    case FOURCC('m','o','o','v'):
+    case FOURCC('t','r','a','k'):
+    case FOURCC('e','d','t','s'):
+    case FOURCC('m','d','i','a'):
+    case FOURCC('m','i','n','f'):
+    case FOURCC('d','i','n','f'):
+    case FOURCC('s','t','b','l'):
+    case FOURCC('u','d','t','a'):
+    case FOURCC('t','r','e','f'):
+    case FOURCC('t','a','p','t'):
+    case FOURCC('g','m','h','d'):
+    case FOURCC('m','v','e','x'):
+    case FOURCC('m','o','o','f'):
+    case FOURCC('t','r','a','f'):
+    case FOURCC('m','f','r','a'):
+      return 1;
+  }
+  return 0;
+}
+
+/*  helper function, true for the stbl atoms which grow with the number
+    of samples. These are never read while probing.
+*/
+static int atom_is_sample_table(uint32_t type)
+{
+  switch (type) {
+    case FOURCC('s','t','t','s'):
+    case FOURCC('c','t','t','s'):
+    case FOURCC('s','t','s','s'):
+    case FOURCC('s','t','p','s'):
+    case FOURCC('s','d','t','p'):
+    case FOURCC('s','t','s','c'):
+    case FOURCC('s','t','s','z'):
+    case FOURCC('s','t','z','2'):
+    case FOURCC('s','t','c','o'):
+    case FOURCC('c','o','6','4'):
+      return 1;
+  }
+  return 0;
+}
+
+static void atom_free_tree(struct Atom *atom)
+{
+  struct Atom *next;
+  while (atom) {
+    next = atom->next;
+    atom_free_tree(atom->children);
+    free(atom->buffer);
+    free(atom);
+    atom = next;
+  }
+}
+
+/*  helper function, returns length bytes of the file at offset, either
+    straight from the map or read into scratch. NULL if they can't be read.
+*/
+static const unsigned char *atom_peek(struct AtomMovie *movie, uint64_t offset, size_t length, unsigned char *scratch)
+{
+  if (offset + length > movie->file_size) return NULL;
+  if (movie->map) return movie->map + offset;
+  if (movie->moov_buffer && offset >= movie->moov_buffer_offset && offset + length <= movie->moov_buffer_offset + movie->moov_buffer_size)
+    return movie->moov_buffer + (offset - movie->moov_buffer_offset);
+  if (pread(movie->fd, scratch, length, offset) != (ssize_t)length) return NULL;
+  return scratch;
+}
+
+/*
+  Returns the payload of an atom, reading it from the file first if the 
+  movie is not mapped. Returns NULL if it can't be read.
+*/
+const unsigned char *atom_data(struct AtomMovie *movie, struct Atom *atom)
+{
+  uint64_t size = ATOM_DATA_SIZE(atom);
+
+  if (atom->data) return atom->data;
+  // a streamed movie holds its moov atom in memory
+  if (movie->moov_buffer && atom->offset >= movie->moov_buffer_offset && atom->offset + atom->size <= movie->moov_buffer_offset + movie->moov_buffer_size) {
+    atom->data = movie->moov_buffer + (atom->offset - movie->moov_buffer_offset) + atom->header_size;
+    return atom->data;
+  }
+  if (movie->fd < 0 || size > SIZE_MAX) return NULL;
+
+  atom->buffer = (unsigned char*)malloc(size ? size : 1);
+  if (atom->buffer == NULL) return NULL;
+  if (pread(movie->fd, atom->buffer, size, atom->offset + atom->header_size) != (ssize_t)size) {
+    free(atom->buffer);
+    atom->buffer = NULL;
+    return NULL;
+  }
+  atom->data = atom->buffer;
+  return atom->data;
+}
+
+/*  helper function, builds the list of atoms found between start and end
+    of the file and descends into known container atoms. When probing, the
+    top level and trak atoms are left for later and sample tables unread.
+    returns 0 if an atom header runs past its parent.
+*/
+static int atom_parse_children(struct AtomMovie *movie, struct Atom *parent, struct Atom **list, uint64_t start, uint64_t end)
+{
+  const unsigned char *p;
+  unsigned char scratch[16];
+  struct Atom *atom, **tail = list;
+  uint64_t offset = start, size;
+  uint32_t header_size;
+
+  while (offset + 8 <= end) {
+    p = atom_peek(movie, offset, (end - offset >= 16) ? 16 : 8, scratch);
+    if (p == NULL) return 0;
+    size = atom_u32(p);
+    header_size = 8;
+    if (size == 1) {
+      if (offset + 16 > end) return 0;
+      size = atom_u64(p + 8);
+      header_size = 16;
+    } else if (size == 0) {
+      size = end - offset; // atom extends to the end of its parent
+    }
+    if (size < header_size || size > end - offset) {
+      // QuickTime allows a 32 bit zero terminator inside containers such as udta
+      if (parent && atom_u32(p) == 0) break;
+      return 0;
+    }
+
+    atom = (struct Atom*)calloc(1, sizeof(struct Atom));
+    if (atom == NULL) return 0;
+    atom->type = atom_u32(p + 4);
+    atom->offset = offset;
+    atom->size = size;
+    atom->header_size = header_size;
+    atom->parent = parent;
+    *tail = atom;
+    tail = &atom->next;
+
+    if (movie->map) {
+      atom->data = movie->map + offset + header_size;
+    } else if (parent && !atom_is_container(atom->type) && !atom_is_sample_table(atom->type)) {
+      if (!atom_data(movie, atom)) return 0;
+    }
+
+    if (atom_is_container(atom->type) && (movie->map || (parent && atom->type != FOURCC('t','r','a','k')))) {
+      if (!atom_parse_children(movie, atom, &atom->children, offset + header_size, offset + size))
+        return 0;
+    }
+    offset += size;
+  }
+  return 1;
+}
+
+/*
+  Parses the children of a container atom which a probed movie left 
+  unread, such as a trak or moof atom. Returns 0 if they can't be read.
+*/
+int atom_load_children(struct AtomMovie *movie, struct Atom *atom)
+{
+  if (atom->children || movie->map) return 1;
+  return atom_parse_children(movie, atom, &atom->children, atom->offset + atom->header_size, atom->offset + atom->size);
+}
+
+/*
+  Returns the first direct child of atom with the given type, or NULL.
+*/
+struct Atom *atom_find(struct Atom *atom, uint32_t type)
+{
+  struct Atom *child;
+  if (atom == NULL) return NULL;
+  for (child = atom->children; child; child = child->next) {
+    if (child->type == type) return child;
+  }
+  return NULL;
+}
+
+static void atom_parse_matrix(int32_t *matrix, const unsigned char *p)
+{
+  int i;
+  for (i = 0; i < 9; i++) {
+    matrix[i] = (int32_t)atom_u32(p + i*4);
+  }
+}
+
+static void atom_parse_mvhd(struct AtomMovie *movie, struct Atom *mvhd)
+{
+  const unsigned char *p = mvhd->data;
+  uint64_t size = ATOM_DATA_SIZE(mvhd);
+
+  if (size < 100) return;
+  if (p[0] == 1) {
+    if (size < 112) return;
+    movie->time_scale = atom_u32(p + 20);
+    movie->duration = atom_u64(p + 24);
+    p += 12;
+  } else {
+    movie->time_scale = atom_u32(p + 12);
+    movie->duration = atom_u32(p + 16);
+  }
+  atom_parse_matrix(movie->matrix, p + 36);
+  movie->poster_time = atom_u32(p + 80);
+}
+
+static void atom_parse_tkhd(struct AtomTrack *track, struct Atom *tkhd)
+{
+  const unsigned char *p = tkhd->data;
+  uint64_t size = ATOM_DATA_SIZE(tkhd);
+
+  if (size < 84) return;
+  track->flags = atom_u32(p) & 0x00ffffff;
+  if (p[0] == 1) {
+    if (size < 96) return;
+    track->id = atom_u32(p + 20);
+    track->duration = atom_u64(p + 28);
+    p += 12;
+  } else {
+    track->id = atom_u32(p + 12);
+    track->duration = atom_u32(p + 20);
+  }
+  track->volume = (int16_t)atom_u16(p + 36);
+  atom_parse_matrix(track->matrix, p + 40);
+  track->width = atom_u32(p + 76);
+  track->height = atom_u32(p + 80);
+}
+
+static void atom_parse_elst(struct AtomTrack *track, struct Atom *elst)
+{
+  const unsigned char *p = elst->data;
+  uint64_t size = ATOM_DATA_SIZE(elst);
+  uint32_t i, count, entry_size;
+
+  if (size < 8) return;
+  entry_size = (p[0] == 1) ? 20 : 12;
+  count = atom_u32(p + 4);
+  if (count > (size - 8) / entry_size) return;
+
+  track->edits = (struct AtomEdit*)calloc(count ? count : 1, sizeof(struct AtomEdit));
+  if (track->edits == NULL) return;
+  track->edit_count = count;
+
+  for (i = 0, p += 8; i < count; i++, p += entry_size) {
+    if (entry_size == 20) {
+      track->edits[i].segment_duration = (int64_t)atom_u64(p);
+      track->edits[i].media_time = (int64_t)atom_u64(p + 8);
+      track->edits[i].media_rate = (int32_t)atom_u32(p + 16);
+    } else {
+      track->edits[i].segment_duration = atom_u32(p);
+      track->edits[i].media_time = (int32_t)atom_u32(p + 4);
+      track->edits[i].media_rate = (int32_t)atom_u32(p + 8);
+    }
+    if (track->edits[i].media_time != -1)
+      track->edits[i].media = track;
+  }
+}
+
+static void atom_parse_mdhd(struct AtomTrack *track, struct Atom *mdhd)
+{
+  const unsigned char *p = mdhd->data;
+  uint64_t size = ATOM_DATA_SIZE(mdhd);
+
+  if (size < 20) return;
+  if (p[0] == 1) {
+    if (size < 32) return;
+    track->media_time_scale = atom_u32(p + 20);
+    track->media_duration = atom_u64(p + 24);
+  } else {
+    track->media_time_scale = atom_u32(p + 12);
+    track->media_duration = atom_u32(p + 16);
+  }
+}
+
+/*  helper function, locates an extension atom (such as pasp or chan)
+    among the atoms trailing the fixed part of a sample description.
+*/
+static const unsigned char *atom_find_extension(const unsigned char *p, uint64_t size, uint32_t type, uint32_t *found_size)
+{
+  uint64_t offset = 0;
+  uint32_t ext_size;
+  const unsigned char *nested;
+
+  while (offset + 8 <= size) {
+    ext_size = atom_u32(p + offset);
+    if (ext_size < 8 || ext_size > size - offset) break;
+    if (atom_u32(p + offset + 4) == type) {
+      *found_size = ext_size - 8;
+      return p + offset + 8;
+    }
+    // sound descriptions may keep their extensions inside a 'wave' atom
+    if (atom_u32(p + offset + 4) == FOURCC('w','a','v','e')) {
+      nested = atom_find_extension(p + offset + 8, ext_size - 8, type, found_size);
+      if (nested) return nested;
+    }
+    offset += ext_size;
+  }
+  return NULL;
+}
+
+static void atom_parse_video_description(struct AtomSampleDescription *desc, const unsigned char *p, uint32_t size)
+{
+  const unsigned char *ext;
+  uint32_t ext_size, name_length;
+
+  if (size < 86) return;
+  desc->width = atom_u16(p + 32);
+  desc->height = atom_u16(p + 34);
+  name_length = p[50];
+  if (name_length > 31) name_length = 31;
+  memcpy(desc->compressor_name, p + 51, name_length);
+  desc->compressor_name[name_length] = '\0';
+  desc->depth = atom_u16(p + 82);
+
+  ext = atom_find_extension(p + 86, size - 86, FOURCC('p','a','s','p'), &ext_size);
+  if (ext && ext_size >= 8) {
+    desc->pasp_h_spacing = atom_u32(ext);
+    desc->pasp_v_spacing = atom_u32(ext + 4);
+  }
+  ext = atom_find_extension(p + 86, size - 86, FOURCC('c','l','a','p'), &ext_size);
+  if (ext && ext_size >= 16 && atom_u32(ext + 4) && atom_u32(ext + 12)) {
+    desc->clap_width = atom_u32(ext) / atom_u32(ext + 4);
+    desc->clap_height = atom_u32(ext + 8) / atom_u32(ext + 12);
+  }
+
+  // no 'pasp' extension means square pixels
+  if (!desc->pasp_h_spacing || !desc->pasp_v_spacing)
+    desc->pasp_h_spacing = desc->pasp_v_spacing = 1;
+
+  // the clean aperture (if any) scaled by the pixel aspect ratio
+  desc->display_width = desc->clap_width ? desc->clap_width : desc->width;
+  desc->display_height = desc->clap_height ? desc->clap_height : desc->height;
+  desc->display_width = (uint32_t)((double)desc->display_width * desc->pasp_h_spacing / desc->pasp_v_spacing);
+}
+
+static void atom_parse_sound_description(struct AtomSampleDescription *desc, const unsigned char *p, uint32_t size)
+{
+  const unsigned char *chan, *enda;
+  uint32_t i, chan_size, enda_size, count, fixed_size = 36;
+  union { uint64_t i; double d; } rate;
+
+  if (size < 36) return;
+  desc->sound_version = atom_u16(p + 16);
+  desc->channels = atom_u16(p + 24);
+  desc->sample_size = atom_u16(p + 26);
+  desc->sample_rate = atom_u32(p + 32) / 65536.0;
+
+  if (desc->sound_version == 1) {
+    fixed_size = 52;
+    if (size < fixed_size) return;
+    desc->bytes_per_frame = atom_u32(p + 44);
+  } else if (desc->sound_version == 2) {
+    fixed_size = 72;
+    if (size < fixed_size) return;
+    rate.i = atom_u64(p + 40);
+    desc->sample_rate = rate.d;
+    desc->channels = atom_u32(p + 48);
+    desc->sample_size = atom_u32(p + 56);
+    desc->format_flags = atom_u32(p + 60);
+    desc->bytes_per_frame = atom_u32(p + 64);
+  }
+  if (size < fixed_size) return;
+
+  enda = atom_find_extension(p + fixed_size, size - fixed_size, FOURCC('e','n','d','a'), &enda_size);
+  if (enda && enda_size >= 2)
+    desc->little_endian = atom_u16(enda) != 0;
+
+  chan = atom_find_extension(p + fixed_size, size - fixed_size, FOURCC('c','h','a','n'), &chan_size);
+  if (chan == NULL || chan_size < 16) return;
+
+  count = atom_u32(chan + 12);
+  if (count > (chan_size - 16) / 20) return;
+  desc->channel_labels = (uint32_t*)calloc(count ? count : 1, sizeof(uint32_t));
+  if (desc->channel_labels == NULL) return;
+
+  desc->has_channel_layout = 1;
+  desc->channel_layout_tag = atom_u32(chan + 4);
+  desc->channel_bitmap = atom_u32(chan + 8);
+  desc->channel_description_count = count;
+  for (i = 0; i < count; i++) {
+    desc->channel_labels[i] = atom_u32(chan + 16 + i*20);
+  }
+}
+
+static void atom_parse_stsd(struct AtomTrack *track, struct Atom *stsd)
+{
+  const unsigned char *p = stsd->data;
+  uint64_t size = ATOM_DATA_SIZE(stsd), offset = 8;
+  uint32_t i, count, entry_size;
+  struct AtomSampleDescription *desc;
+
+  if (size < 8) return;
+  count = atom_u32(p + 4);
+  if (count > (size - 8) / 16) return;
+
+  track->sample_descriptions = (struct AtomSampleDescription*)calloc(count ? count : 1, sizeof(struct AtomSampleDescription));
+  if (track->sample_descriptions == NULL) return;
+
+  for (i = 0; i < count && offset + 16 <= size; i++) {
+    entry_size = atom_u32(p + offset);
+    if (entry_size < 16 || entry_size > size - offset) break;
+
+    desc = &track->sample_descriptions[i];
+    desc->format = atom_u32(p + offset + 4);
+    desc->data_reference_index = atom_u16(p + offset + 14);
+    if (track->handler_type == VideoMediaType) {
+      atom_parse_video_description(desc, p + offset, entry_size);
+    } else if (track->handler_type == SoundMediaType) {
+      atom_parse_sound_description(desc, p + offset, entry_size);
+    }
+    offset += entry_size;
+  }
+  track->sample_description_count = i;
+}
+
+static void atom_parse_stbl(struct AtomTrack *track, struct Atom *stbl)
+{
+  struct Atom *atom;
+
+  for (atom = stbl->children; atom; atom = atom->next) {
+    switch (atom->type) {
+      case FOURCC('s','t','s','d'): atom_parse_stsd(track, atom); break;
+      case FOURCC('s','t','t','s'): track->stts = atom; break;
+      case FOURCC('c','t','t','s'): track->ctts = atom; break;
+      case FOURCC('s','t','s','s'): track->stss = atom; break;
+      case FOURCC('s','t','s','c'): track->stsc = atom; break;
+      case FOURCC('s','t','s','z'): track->stsz = atom; break;
+      case FOURCC('s','t','z','2'): track->stsz = atom; break;
+      case FOURCC('s','t','c','o'): track->stco = atom; break;
+      case FOURCC('c','o','6','4'): track->stco = atom; break;
+    }
+  }
+}
+
+static struct AtomTrack *atom_parse_trak(struct AtomMovie *movie, struct Atom *trak)
+{
+  struct Atom *atom, *mdia, *stbl;
+  struct AtomTrack *track;
+
+  // a probed trak is only descended into now
+  if (!atom_load_children(movie, trak)) return NULL;
+
+  track = (struct AtomTrack*)calloc(1, sizeof(struct AtomTrack));
+  if (track == NULL) return NULL;
+  track->movie = movie;
+  track->trak = trak;
+
+  if ((atom = atom_find(trak, FOURCC('t','k','h','d'))))
+    atom_parse_tkhd(track, atom);
+  if ((atom = atom_find(atom_find(trak, FOURCC('e','d','t','s')), FOURCC('e','l','s','t'))))
+    atom_parse_elst(track, atom);
+
+  mdia = atom_find(trak, FOURCC('m','d','i','a'));
+  if ((atom = atom_find(mdia, FOURCC('m','d','h','d'))))
+    atom_parse_mdhd(track, atom);
+  if ((atom = atom_find(mdia, FOURCC('h','d','l','r'))) && ATOM_DATA_SIZE(atom) >= 12)
+    track->handler_type = atom_u32(atom->data + 8);
+
+  stbl = atom_find(atom_find(mdia, FOURCC('m','i','n','f')), FOURCC('s','t','b','l'));
+  if (stbl)
+    atom_parse_stbl(track, stbl);
+
+  // without an edit list the whole media plays once from the start
+  if (!track->edits && (track->edits = (struct AtomEdit*)calloc(1, sizeof(struct AtomEdit)))) {
+    track->edit_count = 1;
+    track->edits[0].segment_duration = track->duration;
+    if (!track->duration && track->media_time_scale)
+      track->edits[0].segment_duration = track->media_duration * movie->time_scale / track->media_time_scale;
+    track->edits[0].media_rate = 0x00010000;
+    track->edits[0].media = track;
+  }
+
+  return track;
+}
+
+void atom_track_free(struct AtomTrack *track)
+{
+  uint32_t i;
+
+  if (track == NULL) return;
+  atom_edits_release(track, track->edits, track->edit_count);
+  free(track->edits);
+  // a track made by editing shares the media of another track
+  if (track->media_source) {
+    if (track->media_source->movie != track->movie)
+      atom_movie_free(track->media_source->movie);
+    free(track);
+    return;
+  }
+  for (i = 0; i < track->sample_description_count; i++) {
+    free(track->sample_descriptions[i].channel_labels);
+  }
+  free(track->sample_descriptions);
+  atom_sample_index_free(track->sample_index);
+  free(track->runs);
+  free(track);
+}
+
+static int atom_parse_moov(struct AtomMovie *movie)
+{
+  struct Atom *atom;
+  uint32_t i;
+
+  if ((atom = atom_find(movie->moov, FOURCC('m','v','h','d'))))
+    atom_parse_mvhd(movie, atom);
+
+  for (atom = movie->moov->children; atom; atom = atom->next) {
+    if (atom->type == FOURCC('t','r','a','k')) movie->track_count++;
+  }
+  movie->tracks = (struct AtomTrack**)calloc(movie->track_count ? movie->track_count : 1, sizeof(struct AtomTrack*));
+  if (movie->tracks == NULL) return 0;
+
+  // a mapped movie parses all its tracks up front, a probed one on demand
+  for (i = 0; movie->map && i < movie->track_count; i++) {
+    if (!atom_movie_track(movie, i)) return 0;
+  }
+  return 1;
+}
+
+/*
+  Returns the track at index (0 based), parsing its trak atom the first 
+  time it's asked for. Returns NULL if the index is out of range or the 
+  trak can not be parsed.
+*/
+struct AtomTrack *atom_movie_track(struct AtomMovie *movie, uint32_t index)
+{
+  struct Atom *atom;
+  uint32_t i = 0;
+
+  if (index >= movie->track_count) return NULL;
+  if (movie->tracks[index]) return movie->tracks[index];
+
+  for (atom = movie->moov->children; atom; atom = atom->next) {
+    if (atom->type == FOURCC('t','r','a','k') && i++ == index) {
+      movie->tracks[index] = atom_parse_trak(movie, atom);
+      break;
+    }
+  }
+  return movie->tracks[index];
+}
+
+/*
+  Returns the number of samples in the track. Only the header of the 
+  sample size table is read.
+*/
+uint32_t atom_track_sample_count(struct AtomTrack *track)
+{
+  unsigned char scratch[12];
+  const unsigned char *p;
+
+  track = ATOM_TRACK_MEDIA(track);
+  // the index of a fragmented track also has the samples of its fragments
+  if (track->sample_index) return track->sample_index->count;
+  if (!track->stsz || ATOM_DATA_SIZE(track->stsz) < 12) return 0;
+  if (track->stsz->data) {
+    p = track->stsz->data;
+  } else {
+    p = atom_peek(track->movie, track->stsz->offset + track->stsz->header_size, 12, scratch);
+    if (p == NULL) return 0;
+  }
+  // both stsz and stz2 keep the sample count at the same position
+  return atom_u32(p + 8);
+}
+
+/*  helper function, returns the payload of a full atom table with at 
+    least entry_count entries of entry_size bytes following header_size 
+    bytes, or NULL if it can't be read or is too short.
+*/
+static const unsigned char *atom_table(struct AtomTrack *track, struct Atom *atom, uint32_t header_size, uint32_t entry_size, uint32_t *entry_count)
+{
+  const unsigned char *p;
+
+  if (!atom || ATOM_DATA_SIZE(atom) < 8) return NULL;
+  if (!(p = atom_data(track->movie, atom))) return NULL;
+  *entry_count = atom_u32(p + 4);
+  if ((uint64_t)*entry_count * entry_size > ATOM_DATA_SIZE(atom) - header_size) return NULL;
+  return p;
+}
+
+void atom_sample_index_free(struct AtomSampleIndex *index)
+{
+  if (index == NULL) return;
+  free(index->offsets);
+  free(index->sizes);
+  free(index->dts);
+  free(index->cts_offsets);
+  free(index->descriptions);
+  free(index->sync_samples);
+  free(index);
+}
+
+/*  helper function, returns the bytes of a frame of an uncompressed sound
+    track, 0 for any other track. Compressed formats pack several frames
+    in a packet and have no whole number of bytes per frame.
+*/
+static uint32_t atom_sound_frame_bytes(struct AtomTrack *track)
+{
+  struct AtomSampleDescription *desc;
+  uint32_t bytes;
+
+  if (track->handler_type != FOURCC('s','o','u','n') || !track->sample_description_count) return 0;
+  desc = &track->sample_descriptions[0];
+  switch (desc->format) {
+    case FOURCC('t','w','o','s'):
+    case FOURCC('s','o','w','t'):
+    case FOURCC('r','a','w',' '):
+    case FOURCC('N','O','N','E'):
+    case FOURCC('l','p','c','m'):
+      bytes = desc->sample_size / 8;
+      break;
+    case FOURCC('i','n','2','4'):
+      bytes = 3;
+      break;
+    case FOURCC('i','n','3','2'):
+    case FOURCC('f','l','3','2'):
+      bytes = 4;
+      break;
+    case FOURCC('f','l','6','4'):
+      bytes = 8;
+      break;
+    default:
+      return 0;
+  }
+  if (desc->bytes_per_frame) return desc->bytes_per_frame;
+  return bytes * desc->channels;
+}
+
+/*  helper function, fills in the sample sizes from stsz or stz2. Older
+    sound tracks make every frame a sample of size 1 whatever its actual
+    size, those get the bytes of a frame instead.
+*/
+static int atom_index_sizes(struct AtomTrack *track, struct AtomSampleIndex *index)
+{
+  const unsigned char *p;
+  uint32_t i, sample_size, field_size, frame_bytes;
+
+  if (!track->stsz || ATOM_DATA_SIZE(track->stsz) < 12) return 0;
+  if (!(p = atom_data(track->movie, track->stsz))) return 0;
+
+  if (track->stsz->type == FOURCC('s','t','s','z')) {
+    sample_size = atom_u32(p + 4);
+    if (sample_size == 1 && (frame_bytes = atom_sound_frame_bytes(track)) > 1) {
+      sample_size = frame_bytes;
+      index->frame_sized = 1;
+    }
+    if (sample_size) {
+      for (i = 0; i < index->count; i++) index->sizes[i] = sample_size;
+      return 1;
+    }
+    if ((uint64_t)index->count * 4 > ATOM_DATA_SIZE(track->stsz) - 12) return 0;
+    for (i = 0; i < index->count; i++) index->sizes[i] = atom_u32(p + 12 + i * 4);
+  } else {
+    field_size = p[7];
+    if (field_size != 4 && field_size != 8 && field_size != 16) return 0;
+    if (((uint64_t)index->count * field_size + 7) / 8 > ATOM_DATA_SIZE(track->stsz) - 12) return 0;
+    for (i = 0; i < index->count; i++) {
+      if (field_size == 16)
+        index->sizes[i] = atom_u16(p + 12 + i * 2);
+      else if (field_size == 8)
+        index->sizes[i] = p[12 + i];
+      else
+        index->sizes[i] = (i & 1) ? (p[12 + i / 2] & 0x0F) : (p[12 + i / 2] >> 4);
+    }
+  }
+  return 1;
+}
+
+/*  helper function, fills in the decode times from stts and the 
+    composition offsets from ctts. Samples past the end of stts keep the
+    last duration.
+*/
+static int atom_index_times(struct AtomTrack *track, struct AtomSampleIndex *index)
+{
+  const unsigned char *p;
+  uint32_t i, j, n = 0, entries, count, delta = 0;
+  int64_t time = 0;
+
+  if (!(p = atom_table(track, track->stts, 8, 8, &entries))) return 0;
+  for (i = 0; i < entries && n < index->count; i++) {
+    count = atom_u32(p + 8 + i * 8);
+    delta = atom_u32(p + 12 + i * 8);
+    for (j = 0; j < count && n < index->count; j++, n++) {
+      index->dts[n] = time;
+      time += delta;
+    }
+  }
+  for (; n < index->count; n++) {
+    index->dts[n] = time;
+    time += delta;
+  }
+  index->end_time = time;
+
+  if (!track->ctts) return 1;
+  if (!(p = atom_table(track, track->ctts, 8, 8, &entries))) return 0;
+  index->cts_offsets = (int32_t*)calloc(index->count, sizeof(int32_t));
+  if (!index->cts_offsets) return 0;
+  for (i = 0, n = 0; i < entries && n < index->count; i++) {
+    count = atom_u32(p + 8 + i * 8);
+    // version 0 offsets are unsigned but written signed by most muxers
+    for (j = 0; j < count && n < index->count; j++, n++)
+      index->cts_offsets[n] = (int32_t)atom_u32(p + 12 + i * 8);
+  }
+  return 1;
+}
+
+/*  helper function, fills in the file offset of every sample from the 
+    chunk offsets, the sample to chunk table and the sample sizes.
+*/
+static int atom_index_offsets(struct AtomTrack *track, struct AtomSampleIndex *index)
+{
+  const unsigned char *stsc, *stco;
+  uint32_t i, n = 0, k, chunk, last_chunk, stsc_count, chunk_count, per_chunk, description;
+  int is_co64;
+  uint64_t offset;
+
+  if (!track->stco) return 0;
+  is_co64 = track->stco->type == FOURCC('c','o','6','4');
+  if (!(stco = atom_table(track, track->stco, 8, is_co64 ? 8 : 4, &chunk_count))) return 0;
+  if (!(stsc = atom_table(track, track->stsc, 8, 12, &stsc_count))) return 0;
+
+  for (i = 0; i < stsc_count && n < index->count; i++) {
+    chunk = atom_u32(stsc + 8 + i * 12);
+    per_chunk = atom_u32(stsc + 12 + i * 12);
+    description = atom_u32(stsc + 16 + i * 12);
+    // most tracks use a single description, only keep them otherwise
+    if (description != 1 && !index->descriptions) {
+      if (!(index->descriptions = (uint32_t*)malloc(index->count * sizeof(uint32_t)))) return 0;
+      for (k = 0; k < n; k++) index->descriptions[k] = 1;
+    }
+    last_chunk = (i + 1 < stsc_count) ? atom_u32(stsc + 8 + (i + 1) * 12) : chunk_count + 1;
+    if (chunk < 1 || last_chunk > chunk_count + 1) return 0;
+
+    for (; chunk < last_chunk && n < index->count; chunk++) {
+      offset = is_co64 ? atom_u64(stco + 8 + (chunk - 1) * 8) : atom_u32(stco + 8 + (chunk - 1) * 4);
+      for (k = 0; k < per_chunk && n < index->count; k++, n++) {
+        index->offsets[n] = offset;
+        offset += index->sizes[n];
+        if (index->descriptions) index->descriptions[n] = description;
+      }
+    }
+  }
+  return n == index->count;
+}
+
+/*  helper function, fills in the sync samples from stss. Without stss 
+    every sample is a sync sample and sync_samples stays NULL.
+*/
+static int atom_index_sync_samples(struct AtomTrack *track, struct AtomSampleIndex *index)
+{
+  const unsigned char *p;
+  uint32_t i, entries, sample;
+
+  if (!track->stss) return 1;
+  if (!(p = atom_table(track, track->stss, 8, 4, &entries))) return 0;
+  index->sync_samples = (uint32_t*)malloc((entries ? entries : 1) * sizeof(uint32_t));
+  if (!index->sync_samples) return 0;
+  for (i = 0; i < entries; i++) {
+    sample = atom_u32(p + 8 + i * 4);
+    // keep them 0 based and sorted, dropping anything out of range
+    if (sample < 1 || sample > index->count) continue;
+    if (index->sync_count && sample - 1 <= index->sync_samples[index->sync_count - 1]) continue;
+    index->sync_samples[index->sync_count++] = sample - 1;
+  }
+  return 1;
+}
+
+/*  helper function, checks the sample count against what the tables and
+    the file can hold before anything is allocated for it, so a corrupt
+    count fails instead of asking for gigabytes.
+*/
+static int atom_index_count_fits(struct AtomTrack *track, uint32_t count)
+{
+  const unsigned char *p;
+  uint32_t i, entries, chunk_count, chunk, last_chunk, sample_size;
+  uint64_t capacity = 0;
+
+  if (!track->stsz || ATOM_DATA_SIZE(track->stsz) < 12 || !(p = atom_data(track->movie, track->stsz))) return 0;
+  if (track->stsz->type == FOURCC('s','t','z','2')) {
+    if (((uint64_t)count * p[7] + 7) / 8 > ATOM_DATA_SIZE(track->stsz) - 12) return 0;
+  } else if ((sample_size = atom_u32(p + 4)) == 0) {
+    if ((uint64_t)count * 4 > ATOM_DATA_SIZE(track->stsz) - 12) return 0;
+  } else if (track->movie->file_size && (uint64_t)count * sample_size > track->movie->file_size) {
+    return 0;
+  }
+
+  if (!track->stco || !atom_table(track, track->stco, 8, track->stco->type == FOURCC('c','o','6','4') ? 8 : 4, &chunk_count)) return 0;
+  if (!(p = atom_table(track, track->stsc, 8, 12, &entries))) return 0;
+  for (i = 0; i < entries && capacity < count; i++) {
+    chunk = atom_u32(p + 8 + i * 12);
+    last_chunk = (i + 1 < entries) ? atom_u32(p + 8 + (i + 1) * 12) : chunk_count + 1;
+    if (chunk < 1 || last_chunk < chunk || last_chunk > chunk_count + 1) return 0;
+    capacity += (uint64_t)(last_chunk - chunk) * atom_u32(p + 12 + i * 12);
+  }
+  return capacity >= count;
+}
+
+/*
+  Returns the sample index of the track, building it from the sample 
+  tables the first time. Returns NULL if the tables are missing or don't
+  agree with each other.
+*/
+struct AtomSampleIndex *atom_track_sample_index(struct AtomTrack *track)
+{
+  struct AtomSampleIndex *index;
+  uint32_t count;
+
+  track = ATOM_TRACK_MEDIA(track);
+  if (track->sample_index) return track->sample_index;
+
+  index = (struct AtomSampleIndex*)calloc(1, sizeof(struct AtomSampleIndex));
+  if (index == NULL) return NULL;
+  count = index->count = atom_track_sample_count(track);
+  if (count && !atom_index_count_fits(track, count)) {
+    free(index);
+    return NULL;
+  }
+  if (count) {
+    index->offsets = (uint64_t*)malloc(count * sizeof(uint64_t));
+    index->sizes = (uint32_t*)malloc(count * sizeof(uint32_t));
+    index->dts = (int64_t*)malloc(count * sizeof(int64_t));
+    if (!index->offsets || !index->sizes || !index->dts ||
+        !atom_index_sizes(track, index) || !atom_index_times(track, index) ||
+        !atom_index_offsets(track, index) || !atom_index_sync_samples(track, index)) {
+      atom_sample_index_free(index);
+      return NULL;
+    }
+  }
+  track->sample_index = index;
+  return index;
+}
+
+/*
+  Returns the sample (0 based) being decoded at the given time in the 
+  media time scale, that is the last sample starting at or before it. 
+  Returns -1 if there are no samples.
+*/
+int64_t atom_sample_at_time(struct AtomSampleIndex *index, int64_t time)
+{
+  uint32_t low = 0, high, middle;
+
+  if (index->count == 0) return -1;
+  high = index->count - 1;
+  while (low < high) {
+    middle = low + (high - low + 1) / 2;
+    if (index->dts[middle] <= time)
+      low = middle;
+    else
+      high = middle - 1;
+  }
+  return low;
+}
+
+/*
+  Returns the last sync sample (0 based) at or before the given sample, 
+  or -1 if there is none.
+*/
+int64_t atom_sync_sample_before(struct AtomSampleIndex *index, uint32_t sample)
+{
+  uint32_t low = 0, high;
+
+  if (sample >= index->count) return -1;
+  if (!index->sync_samples) return sample;
+  high = index->sync_count;
+  // find the first sync sample past the given one
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (index->sync_samples[middle] <= sample)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low ? (int64_t)index->sync_samples[low - 1] : -1;
+}
+
+/*
+  Returns true if the given sample (0 based) is a sync sample.
+*/
+int atom_sample_is_sync(struct AtomSampleIndex *index, uint32_t sample)
+{
+  return atom_sync_sample_before(index, sample) == (int64_t)sample;
+}
+
+/*  helper function, orders histogram entries by duration for qsort.
+*/
+static int atom_compare_durations(const void *a, const void *b)
+{
+  uint32_t x = ((const struct AtomDurationCount*)a)->duration;
+  uint32_t y = ((const struct AtomDurationCount*)b)->duration;
+  return (x > y) - (x < y);
+}
+
+/*
+  Returns the length bytes at offset of the movie file as mapped in
+  memory, or NULL if the movie is probed or they are outside the file.
+*/
+const unsigned char *atom_movie_bytes(struct AtomMovie *movie, uint64_t offset, uint64_t length)
+{
+  if (!movie->map || offset > movie->file_size || length > movie->file_size - offset) return NULL;
+  return movie->map + offset;
+}
+
+/*
+  Tells the kernel the mapped bytes from start to end are about to be read
+  once in order, so it reads ahead and drops them early. Does nothing for a
+  probed movie.
+*/
+void atom_movie_advise_sequential(struct AtomMovie *movie, uint64_t start, uint64_t end)
+{
+  uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+
+  if (!movie->map || start >= end || end > movie->file_size) return;
+  start -= start % page;
+  madvise((void*)(movie->map + start), end - start, MADV_SEQUENTIAL);
+}
+
+/*
+  Fills in timing with statistics of the sample durations of the track, 
+  making a single pass over the time to sample table. Returns 0 if the 
+  table can't be read. The histogram must be freed with free.
+*/
+int atom_track_frame_timing(struct AtomTrack *track, struct AtomFrameTiming *timing)
+{
+  const unsigned char *p;
+  struct AtomDurationCount *histogram;
+  uint32_t i, n = 0, entries, count, duration;
+
+  memset(timing, 0, sizeof(struct AtomFrameTiming));
+  track = ATOM_TRACK_MEDIA(track);
+  if (!(p = atom_table(track, track->stts, 8, 8, &entries))) return 0;
+  histogram = (struct AtomDurationCount*)malloc((entries ? entries : 1) * sizeof(struct AtomDurationCount));
+  if (histogram == NULL) return 0;
+
+  for (i = 0; i < entries; i++) {
+    count = atom_u32(p + 8 + i * 8);
+    duration = atom_u32(p + 12 + i * 8);
+    if (count == 0) continue;
+
+    if (timing->sample_count == 0 || duration < timing->min_duration) timing->min_duration = duration;
+    if (duration > timing->max_duration) timing->max_duration = duration;
+    timing->sample_count += count;
+    timing->total_duration += (uint64_t)count * duration;
+    histogram[n].duration = duration;
+    histogram[n++].count = count;
+  }
+
+  // merge the runs of equal durations
+  qsort(histogram, n, sizeof(struct AtomDurationCount), atom_compare_durations);
+  for (i = 0; i < n; i++) {
+    if (timing->histogram_size && histogram[timing->histogram_size - 1].duration == histogram[i].duration)
+      histogram[timing->histogram_size - 1].count += histogram[i].count;
+    else
+      histogram[timing->histogram_size++] = histogram[i];
+  }
+  timing->histogram = histogram;
+  return 1;
+}
+
+/*
+  Walks the top level atoms of an opened movie file and parses its moov 
+  atom. A streamed movie comes with its top level atoms already. Frees 
+  the movie and returns NULL on failure.
+*/
+struct AtomMovie *atom_movie_load(struct AtomMovie *movie, const char *filepath, char *error, size_t error_size)
+{
+  struct Atom *atom;
+
+  if (!movie->moov_buffer && !atom_parse_children(movie, NULL, &movie->atoms, 0, movie->file_size)) {
+    for (atom = movie->atoms; atom && atom->type != FOURCC('m','o','o','v'); atom = atom->next);
+    if (atom == NULL) {
+      atom_movie_free(movie);
+      snprintf(error, error_size, "Unable to find movie data in file at %s", filepath);
+      return NULL;
+    }
+  }
+  for (atom = movie->atoms; atom; atom = atom->next) {
+    if (atom->type == FOURCC('m','o','o','v')) movie->moov = atom;
+  }
+  if (movie->moov == NULL) {
+    atom_movie_free(movie);
+    snprintf(error, error_size, "Unable to find movie data in file at %s", filepath);
+    return NULL;
+  }
+
+  // a probed movie only walked the top level so far
+  if (!movie->map && !atom_parse_children(movie, movie->moov, &movie->moov->children, movie->moov->offset + movie->moov->header_size, movie->moov->offset + movie->moov->size)) {
+    atom_movie_free(movie);
+    snprintf(error, error_size, "Unable to parse movie data in file at %s", filepath);
+    return NULL;
+  }
+
+  if (!atom_parse_moov(movie) || !atom_movie_init_fragments(movie)) {
+    atom_movie_free(movie);
+    snprintf(error, error_size, "Unable to parse movie data in file at %s", filepath);
+    return NULL;
+  }
+  return movie;
+}
+
+/*
+  Maps the file at filepath and parses its moov atom. Returns NULL and
+  fills in error if the file can not be read or is not a movie.
+*/
+struct AtomMovie *atom_movie_open(const char *filepath, char *error, size_t error_size)
+{
+  struct AtomMovie *movie;
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open(filepath, O_RDONLY);
+  if (fd < 0) {
+    snprintf(error, error_size, "Error %d occurred while reading file at %s", errno, filepath);
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < 8) {
+    close(fd);
+    snprintf(error, error_size, "Unable to find movie data in file at %s", filepath);
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    snprintf(error, error_size, "Error %d occurred while mapping file at %s", errno, filepath);
+    return NULL;
+  }
+
+  movie = atom_movie_empty();
+  movie->fd = fd;
+  movie->map = (const unsigned char*)map;
+  movie->file_size = movie->map_size = st.st_size;
+
+  return atom_movie_load(movie, filepath, error, error_size);
+}
+
+/*
+  Parses the moov atom of the file at filepath without mapping it. Only
+  atom headers and the small header atoms are read, tracks are parsed on
+  demand and sample tables are left on disk until needed.
+*/
+struct AtomMovie *atom_movie_probe(const char *filepath, char *error, size_t error_size)
+{
+  int fd = open(filepath, O_RDONLY);
+  if (fd < 0) {
+    snprintf(error, error_size, "Error %d occurred while reading file at %s", errno, filepath);
+    return NULL;
+  }
+  return atom_movie_probe_fd(fd, filepath, error, error_size);
+}
+
+/*
+  Probes the movie file already opened as fd, see atom_movie_probe. The
+  movie takes over fd, it is closed on failure.
+*/
+struct AtomMovie *atom_movie_probe_fd(int fd, const char *filepath, char *error, size_t error_size)
+{
+  struct AtomMovie *movie;
+  struct stat st;
+
+  if (fstat(fd, &st) != 0 || st.st_size < 8) {
+    close(fd);
+    snprintf(error, error_size, "Unable to find movie data in file at %s", filepath);
+    return NULL;
+  }
+
+  movie = atom_movie_empty();
+  movie->fd = fd;
+  movie->file_size = st.st_size;
+
+  return atom_movie_load(movie, filepath, error, error_size);
+}
+
+/*  helper function, moves the payloads of the atoms from the old mapping
+    of the file to the new one.
+*/
+static void atom_rebase_tree(struct Atom *atom, const unsigned char *old_map, const unsigned char *map)
+{
+  for (; atom; atom = atom->next) {
+    if (atom->data) atom->data = map + (atom->data - old_map);
+    atom_rebase_tree(atom->children, old_map, map);
+  }
+}
+
+/*
+  Reads what was added to the end of the movie file since it was opened 
+  or last refreshed, such as the fragments a recorder appends to a 
+  fragmented movie. Only the new top level atoms are walked and only the 
+  new fragments are added to the tracks, see atom_movie_read_fragments. 
+  A mapped file outgrowing its mapping is mapped again with as much room 
+  to grow, so it's rarely remapped. The old mapping is kept until the 
+  movie is freed. Sets count to the number of fragments read. Returns 0 
+  and fills in error if the file shrank or can't be read.
+*/
+int atom_movie_refresh(struct AtomMovie *movie, uint32_t *count, char *error, size_t error_size)
+{
+  struct Atom *last;
+  struct AtomRetiredMap *retired;
+  struct stat st;
+  unsigned char scratch[8];
+  const unsigned char *p;
+  uint64_t size, old_size = movie->file_size;
+  void *map;
+
+  *count = 0;
+  if (movie->fd < 0 || fstat(movie->fd, &st) != 0) {
+    snprintf(error, error_size, "Unable to read movie file");
+    return 0;
+  }
+  size = st.st_size;
+  if (size < old_size) {
+    snprintf(error, error_size, "Unable to refresh movie because its file is shorter than when it was read");
+    return 0;
+  }
+  if (size == old_size) return 1;
+
+  if (movie->map && size > movie->map_size) {
+    if (!(retired = (struct AtomRetiredMap*)malloc(sizeof(struct AtomRetiredMap)))) {
+      snprintf(error, error_size, "Unable to refresh movie, out of memory");
+      return 0;
+    }
+    // the pages past the end of the file can be read once the file reaches them
+    map = mmap(NULL, size * 2, PROT_READ, MAP_SHARED, movie->fd, 0);
+    if (map == MAP_FAILED) {
+      free(retired);
+      snprintf(error, error_size, "Error %d occurred while mapping movie file", errno);
+      return 0;
+    }
+    atom_rebase_tree(movie->atoms, movie->map, (const unsigned char*)map);
+    // sample data handed out and threads reading it still point into the old map
+    retired->map = movie->map;
+    retired->size = movie->map_size;
+    retired->next = movie->retired_maps;
+    movie->retired_maps = retired;
+    movie->map = (const unsigned char*)map;
+    movie->map_size = size * 2;
+  }
+  movie->file_size = size;
+
+  // the atoms before the last fragment read don't change
+  for (last = movie->fragment_atom ? movie->fragment_atom : movie->atoms; last && last->next; last = last->next);
+  if (last) {
+    p = atom_peek(movie, last->offset, 8, scratch);
+    // an atom of size 0 lasts until the end of the file
+    if (p && atom_u32(p) == 0 && last->offset + last->size == old_size)
+      last->size = size - last->offset;
+    else
+      atom_parse_children(movie, NULL, &last->next, last->offset + last->size, size);
+  }
+  return atom_movie_read_fragments(movie, count);
+}
+
+/*
+  Returns a new batch with room for count jobs, NULL if out of memory.
+  The caller fills in the filepath of each job.
+*/
+struct AtomProbeBatch *atom_probe_batch_new(uint32_t count)
+{
+  struct AtomProbeBatch *batch = (struct AtomProbeBatch*)calloc(1, sizeof(struct AtomProbeBatch));
+  if (batch == NULL) return NULL;
+  batch->jobs = (struct AtomProbeJob*)calloc(count ? count : 1, sizeof(struct AtomProbeJob));
+  if (batch->jobs == NULL) {
+    free(batch);
+    return NULL;
+  }
+  batch->count = count;
+  pthread_mutex_init(&batch->lock, NULL);
+  return batch;
+}
+
+/*
+  Frees the batch along with the filepaths and any movies still held by
+  its jobs.
+*/
+void atom_probe_batch_free(struct AtomProbeBatch *batch)
+{
+  uint32_t i;
+
+  for (i = 0; i < batch->count; i++) {
+    free(batch->jobs[i].filepath);
+    if (batch->jobs[i].movie) atom_movie_free(batch->jobs[i].movie);
+  }
+  free(batch->jobs);
+  pthread_mutex_destroy(&batch->lock);
+  free(batch);
+}
+
+/*  helper function, worker thread of atom_probe_many. Takes the next
+    unclaimed job until none are left or the batch is cancelled.
+*/
+static void *atom_probe_worker(void *arg)
+{
+  struct AtomProbeBatch *batch = (struct AtomProbeBatch*)arg;
+  struct AtomProbeJob *job;
+  uint32_t i;
+
+  for (;;) {
+    pthread_mutex_lock(&batch->lock);
+    job = (batch->next < batch->count && !batch->cancelled) ? &batch->jobs[batch->next++] : NULL;
+    pthread_mutex_unlock(&batch->lock);
+    if (job == NULL) break;
+
+    job->movie = atom_movie_probe(job->filepath, job->error, sizeof(job->error));
+    // parse every track here rather than on first use by the caller
+    for (i = 0; job->movie && i < job->movie->track_count; i++) {
+      atom_movie_track(job->movie, i);
+    }
+  }
+  return NULL;
+}
+
+/*
+  Probes every job of the batch using up to thread_count threads and 
+  returns when all are done. Each job ends up with either a movie or an 
+  error. Jobs not started before atom_probe_cancel is called are left 
+  with neither.
+*/
+void atom_probe_many(struct AtomProbeBatch *batch, uint32_t thread_count)
+{
+  pthread_t *threads;
+  uint32_t i, started = 0;
+
+  if (thread_count > batch->count) thread_count = batch->count;
+  if (thread_count < 1) thread_count = 1;
+
+  threads = (pthread_t*)malloc(thread_count * sizeof(pthread_t));
+  for (i = 0; threads && i < thread_count; i++) {
+    if (pthread_create(&threads[i], NULL, atom_probe_worker, batch) != 0) break;
+    started++;
+  }
+  // fall back to probing in this thread if none could be started
+  if (started == 0) atom_probe_worker(batch);
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+}
+
+/*
+  Stops the batch from starting any more jobs. Jobs already being probed
+  are finished.
+*/
+void atom_probe_cancel(void *arg)
+{
+  struct AtomProbeBatch *batch = (struct AtomProbeBatch*)arg;
+  pthread_mutex_lock(&batch->lock);
+  batch->cancelled = 1;
+  pthread_mutex_unlock(&batch->lock);
+}
+
+/*
+  Returns a new movie record without any file or tracks.
+*/
+struct AtomMovie *atom_movie_empty(void)
+{
+  struct AtomMovie *movie = (struct AtomMovie*)calloc(1, sizeof(struct AtomMovie));
+  if (movie == NULL) return NULL;
+  movie->fd = -1;
+  movie->refs = 1;
+  movie->time_scale = 600;
+  movie->matrix[0] = movie->matrix[4] = 0x00010000;
+  movie->matrix[8] = 0x40000000;
+  return movie;
+}
+
+/*
+  Adds a reference to the movie, see atom_movie_free.
+*/
+void atom_movie_retain(struct AtomMovie *movie)
+{
+  movie->refs++;
+}
+
+/*
+  Drops a reference to the movie and frees it once the last one is gone.
+  Besides its Movie instance, a movie is referenced by other movies whose
+  edits play its media.
+*/
+void atom_movie_free(struct AtomMovie *movie)
+{
+  struct AtomRetiredMap *retired;
+  uint32_t i;
+
+  if (--movie->refs > 0) return;
+  for (i = 0; i < movie->track_count + movie->deleted_count; i++) {
+    atom_track_free(movie->tracks[i]);
+  }
+  free(movie->tracks);
+  atom_free_tree(movie->atoms);
+  if (movie->map)
+    munmap((void*)movie->map, movie->map_size);
+  while (movie->retired_maps) {
+    retired = movie->retired_maps;
+    movie->retired_maps = retired->next;
+    munmap((void*)retired->map, retired->size);
+    free(retired);
+  }
+  if (movie->fd >= 0)
+    close(movie->fd);
+  free(movie->moov_buffer);
+  free(movie);
+}
+
+/*  helper function, transforms a rectangle by a QuickTime matrix and
+    returns the bounding box of the result.
+*/
+static void atom_transform_bounds(const int32_t *matrix, double x0, double y0, double x1, double y1, double *left, double *top, double *right, double *bottom)
+{
+  double a = matrix[0] / 65536.0, b = matrix[1] / 65536.0;
+  double c = matrix[3] / 65536.0, d = matrix[4] / 65536.0;
+  double tx = matrix[6] / 65536.0, ty = matrix[7] / 65536.0;
+  double xs[4] = {x0, x1, x0, x1}, ys[4] = {y0, y0, y1, y1};
+  double x, y;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    x = a*xs[i] + c*ys[i] + tx;
+    y = b*xs[i] + d*ys[i] + ty;
+    if (i == 0 || x < *left) *left = x;
+    if (i == 0 || x > *right) *right = x;
+    if (i == 0 || y < *top) *top = y;
+    if (i == 0 || y > *bottom) *bottom = y;
+  }
+}
+
+/*
+  Calculates the display bounds of a track from its dimensions and matrix.
+*/
+void atom_track_bounds(struct AtomTrack *track, double *left, double *top, double *right, double *bottom)
+{
+  atom_transform_bounds(track->matrix, 0, 0, track->width / 65536.0, track->height / 65536.0, left, top, right, bottom);
+}
+
+/*
+  Calculates the movie box: the union of all enabled track bounds,
+  transformed by the movie matrix.
+*/
+void atom_movie_bounds(struct AtomMovie *movie, double *left, double *top, double *right, double *bottom)
+{
+  struct AtomTrack *track;
+  double l, t, r, b, ml = 0, mt = 0, mr = 0, mb = 0;
+  int found = 0;
+  uint32_t i;
+
+  for (i = 0; i < movie->track_count; i++) {
+    track = atom_movie_track(movie, i);
+    if (!track || !(track->flags & 1) || !track->width || !track->height) continue;
+    atom_track_bounds(track, &l, &t, &r, &b);
+    if (!found || l < ml) ml = l;
+    if (!found || t < mt) mt = t;
+    if (!found || r > mr) mr = r;
+    if (!found || b > mb) mb = b;
+    found = 1;
+  }
+  if (!found) {
+    *left = *top = *right = *bottom = 0;
+    return;
+  }
+  atom_transform_bounds(movie->matrix, ml, mt, mr, mb, left, top, right, bottom);
+}
+
+/*
+  Returns the time (in movie time scale) before a track starts playing,
+  which is the length of the empty edits at the start of its edit list.
+*/
+int64_t atom_track_offset(struct AtomTrack *track)
+{
+  int64_t offset = 0;
+  uint32_t i;
+
+  for (i = 0; i < track->edit_count && track->edits[i].media_time == -1; i++) {
+    offset += track->edits[i].segment_duration;
+  }
+  return offset;
+}
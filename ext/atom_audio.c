@@ -0,0 +1,886 @@
+#include "rmov_ext.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+  Level measurement and waveforms of uncompressed PCM audio tracks in a
+  single pass over the sample data. Chunks are decoded a block of frames at a time into a
+  float buffer per channel. Peak and RMS are taken from those buffers, and
+  each channel also runs through the K-weighting filter of ITU-R BS.1770,
+  whose mean square is kept for every 100 ms so the gated (EBU R128)
+  integrated loudness can be worked out afterwards for any weighting of the
+  channels.
+*/
+
+#define ATOM_AUDIO_BLOCK_FRAMES 4096
+#define ATOM_AUDIO_READ_SIZE (1 << 20)  /* bytes read at a time from probed movies */
+
+static uint32_t atom_u32_be(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint32_t atom_u32_le(const unsigned char *p)
+{
+  return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | (uint32_t)p[0];
+}
+
+/*
+  How the frames of a PCM sample description are laid out.
+*/
+struct AtomPcmFormat {
+  uint32_t channels;
+  uint32_t bytes;            /* per channel sample */
+  uint32_t frame_bytes;
+  int is_float;
+  int is_signed;
+  int big_endian;
+};
+
+/*
+  A biquad section of the K-weighting filter, transposed direct form II.
+*/
+struct AtomBiquad {
+  double b0, b1, b2, a1, a2;
+};
+
+/*
+  Reads the PCM samples of a track in file order, decoding a block of
+  frames at a time for a callback, see atom_pcm_read.
+*/
+struct AtomPcmReader {
+  struct AtomPcmFormat pcm;
+  double sample_rate;
+  struct AtomTrack *media;
+  struct AtomSampleIndex *index;
+  float *planes;             /* ATOM_AUDIO_BLOCK_FRAMES per channel */
+  unsigned char *buffer;     /* for probed movies */
+  volatile int *cancelled;
+};
+
+struct AtomAudioState {
+  struct AtomAudioLevels *levels;
+  struct AtomBiquad shelf, highpass;
+  double *filter_state;      /* four values per channel */
+  double *gate_sums;         /* K weighted sum of squares of the current 100 ms */
+  uint32_t gate_frames;
+  uint32_t gate_fill;
+  uint32_t block_capacity;
+};
+
+struct AtomWaveformState {
+  struct AtomWaveform *waveform;
+  float *mins;               /* of the bucket being filled, per channel */
+  float *maxs;
+  uint32_t fill;
+  uint32_t capacity;
+};
+
+/*  helper function, works out the layout of a PCM sample description.
+    Returns 0 for compressed or unsupported formats.
+*/
+static int atom_pcm_format(struct AtomSampleDescription *desc, struct AtomPcmFormat *pcm)
+{
+  memset(pcm, 0, sizeof(struct AtomPcmFormat));
+  pcm->channels = desc->channels;
+  pcm->is_signed = 1;
+  pcm->big_endian = !desc->little_endian;
+  pcm->bytes = desc->sample_size / 8;
+
+  switch (desc->format) {
+    case FOURCC('t','w','o','s'):
+      pcm->big_endian = 1;
+      break;
+    case FOURCC('s','o','w','t'):
+      pcm->big_endian = 0;
+      break;
+    case FOURCC('i','n','2','4'):
+      pcm->bytes = 3;
+      break;
+    case FOURCC('i','n','3','2'):
+      pcm->bytes = 4;
+      break;
+    case FOURCC('f','l','3','2'):
+      pcm->bytes = 4;
+      pcm->is_float = 1;
+      break;
+    case FOURCC('f','l','6','4'):
+      pcm->bytes = 8;
+      pcm->is_float = 1;
+      break;
+    case FOURCC('l','p','c','m'):
+      // kAudioFormatFlagIsNonInterleaved
+      if (desc->format_flags & 0x20) return 0;
+      pcm->is_float = (desc->format_flags & 0x1) != 0;
+      pcm->big_endian = (desc->format_flags & 0x2) != 0;
+      pcm->is_signed = (desc->format_flags & 0x4) != 0;
+      break;
+    default:
+      return 0;
+  }
+  // version 1 'twos' and 'sowt' keep 16 in the sample size whatever it is
+  if ((desc->format == FOURCC('t','w','o','s') || desc->format == FOURCC('s','o','w','t')) &&
+      desc->sound_version == 1 && desc->channels && desc->bytes_per_frame)
+    pcm->bytes = desc->bytes_per_frame / desc->channels;
+
+  pcm->frame_bytes = pcm->bytes * pcm->channels;
+  if (pcm->channels == 0 || (desc->bytes_per_frame && desc->bytes_per_frame != pcm->frame_bytes)) return 0;
+  if (pcm->is_float) return pcm->bytes == 4 || pcm->bytes == 8;
+  if (!pcm->is_signed) return pcm->bytes == 1;
+  return pcm->bytes >= 1 && pcm->bytes <= 4;
+}
+
+/*  helper function, decodes frames into the channel planes scaled to -1..1.
+    Each layout gets its own loop so the conversion is vectorized.
+*/
+static void atom_pcm_decode(const struct AtomPcmFormat *pcm, const unsigned char *p, uint32_t frames, float *planes)
+{
+  uint32_t i, c, channels = pcm->channels, step = pcm->frame_bytes;
+  union { uint32_t i; float f; } f32;
+  union { uint64_t i; double d; } f64;
+  const unsigned char *q;
+  float *plane;
+
+  for (c = 0; c < channels; c++) {
+    plane = planes + (size_t)c * ATOM_AUDIO_BLOCK_FRAMES;
+    q = p + c * pcm->bytes;
+    if (pcm->is_float && pcm->bytes == 4) {
+      for (i = 0; i < frames; i++, q += step) {
+        f32.i = pcm->big_endian ? ((uint32_t)q[0] << 24) | ((uint32_t)q[1] << 16) | ((uint32_t)q[2] << 8) | q[3]
+                                : ((uint32_t)q[3] << 24) | ((uint32_t)q[2] << 16) | ((uint32_t)q[1] << 8) | q[0];
+        plane[i] = f32.f;
+      }
+    } else if (pcm->is_float) {
+      for (i = 0; i < frames; i++, q += step) {
+        if (pcm->big_endian) {
+          f64.i = ((uint64_t)atom_u32_be(q) << 32) | atom_u32_be(q + 4);
+        } else {
+          f64.i = ((uint64_t)atom_u32_le(q + 4) << 32) | atom_u32_le(q);
+        }
+        plane[i] = (float)f64.d;
+      }
+    } else if (pcm->bytes == 1) {
+      if (pcm->is_signed) {
+        for (i = 0; i < frames; i++, q += step) plane[i] = (int8_t)q[0] * (1.0f / 128);
+      } else {
+        for (i = 0; i < frames; i++, q += step) plane[i] = ((int)q[0] - 128) * (1.0f / 128);
+      }
+    } else if (pcm->bytes == 2) {
+      if (pcm->big_endian) {
+        for (i = 0; i < frames; i++, q += step) plane[i] = (int16_t)((q[0] << 8) | q[1]) * (1.0f / 32768);
+      } else {
+        for (i = 0; i < frames; i++, q += step) plane[i] = (int16_t)((q[1] << 8) | q[0]) * (1.0f / 32768);
+      }
+    } else if (pcm->bytes == 3) {
+      if (pcm->big_endian) {
+        for (i = 0; i < frames; i++, q += step)
+          plane[i] = ((int32_t)(((uint32_t)q[0] << 24) | ((uint32_t)q[1] << 16) | ((uint32_t)q[2] << 8)) >> 8) * (1.0f / 8388608);
+      } else {
+        for (i = 0; i < frames; i++, q += step)
+          plane[i] = ((int32_t)(((uint32_t)q[2] << 24) | ((uint32_t)q[1] << 16) | ((uint32_t)q[0] << 8)) >> 8) * (1.0f / 8388608);
+      }
+    } else {
+      if (pcm->big_endian) {
+        for (i = 0; i < frames; i++, q += step) plane[i] = (int32_t)atom_u32_be(q) * (1.0f / 2147483648.0f);
+      } else {
+        for (i = 0; i < frames; i++, q += step) plane[i] = (int32_t)atom_u32_le(q) * (1.0f / 2147483648.0f);
+      }
+    }
+  }
+}
+
+/*  helper function, the K-weighting filter of BS.1770 for any sample rate
+    (a high shelf followed by a high pass).
+*/
+static void atom_k_weighting(double sample_rate, struct AtomBiquad *shelf, struct AtomBiquad *highpass)
+{
+  double f0 = 1681.974450955533, gain = 3.999843853973347, q = 0.7071752369554196;
+  double k, vh, vb, a0;
+
+  k = tan(M_PI * f0 / sample_rate);
+  vh = pow(10.0, gain / 20.0);
+  vb = pow(vh, 0.4996667741545416);
+  a0 = 1.0 + k / q + k * k;
+  shelf->b0 = (vh + vb * k / q + k * k) / a0;
+  shelf->b1 = 2.0 * (k * k - vh) / a0;
+  shelf->b2 = (vh - vb * k / q + k * k) / a0;
+  shelf->a1 = 2.0 * (k * k - 1.0) / a0;
+  shelf->a2 = (1.0 - k / q + k * k) / a0;
+
+  f0 = 38.13547087602444;
+  q = 0.5003270373238773;
+  k = tan(M_PI * f0 / sample_rate);
+  a0 = 1.0 + k / q + k * k;
+  highpass->b0 = 1.0;
+  highpass->b1 = -2.0;
+  highpass->b2 = 1.0;
+  highpass->a1 = 2.0 * (k * k - 1.0) / a0;
+  highpass->a2 = (1.0 - k / q + k * k) / a0;
+}
+
+/*  helper function, sets up a reader of the samples of track, which must
+    be uncompressed PCM using a single sample description.
+*/
+static int atom_pcm_open(struct AtomPcmReader *reader, struct AtomTrack *track, volatile int *cancelled, char *error, size_t error_size)
+{
+  struct AtomTrack *media = ATOM_TRACK_MEDIA(track);
+  struct AtomSampleDescription *desc;
+  uint32_t i;
+
+  memset(reader, 0, sizeof(struct AtomPcmReader));
+  reader->media = media;
+  reader->cancelled = cancelled;
+  if (media->handler_type != SoundMediaType || media->sample_description_count == 0) {
+    snprintf(error, error_size, "Track %d is not an audio track", track->id);
+    return 0;
+  }
+  desc = &media->sample_descriptions[0];
+  if (!atom_pcm_format(desc, &reader->pcm)) {
+    snprintf(error, error_size, "Audio format '%c%c%c%c' of track %d is not uncompressed PCM",
+      (char)(desc->format >> 24), (char)(desc->format >> 16), (char)(desc->format >> 8), (char)desc->format, track->id);
+    return 0;
+  }
+  if (!(reader->index = atom_track_sample_index(track))) {
+    snprintf(error, error_size, "Unable to read sample tables of track %d", track->id);
+    return 0;
+  }
+  for (i = 0; reader->index->descriptions && i < reader->index->count; i++) {
+    if (reader->index->descriptions[i] != 1) {
+      snprintf(error, error_size, "Audio format of track %d changes between samples", track->id);
+      return 0;
+    }
+  }
+  reader->sample_rate = desc->sample_rate > 0 ? desc->sample_rate : media->media_time_scale;
+  reader->planes = (float*)malloc((size_t)reader->pcm.channels * ATOM_AUDIO_BLOCK_FRAMES * sizeof(float));
+  if (reader->planes == NULL) {
+    snprintf(error, error_size, "Unable to allocate audio buffer");
+    return 0;
+  }
+  return 1;
+}
+
+static void atom_pcm_close(struct AtomPcmReader *reader)
+{
+  free(reader->planes);
+  free(reader->buffer);
+  reader->planes = NULL;
+  reader->buffer = NULL;
+}
+
+/*  helper function, decodes a run of whole frames at offset in the file
+    for the callback.
+*/
+static int atom_pcm_run(struct AtomPcmReader *reader, uint64_t offset, uint64_t length,
+                        int (*block)(void *context, const float *planes, uint32_t frames), void *context,
+                        char *error, size_t error_size)
+{
+  const struct AtomPcmFormat *pcm = &reader->pcm;
+  struct AtomMovie *movie = reader->media->movie;
+  const unsigned char *bytes;
+  uint64_t piece_size = ATOM_AUDIO_READ_SIZE - ATOM_AUDIO_READ_SIZE % pcm->frame_bytes, piece;
+  uint32_t frames, n, count;
+
+  length -= length % pcm->frame_bytes;
+  while (length) {
+    if (*reader->cancelled) {
+      snprintf(error, error_size, "Reading audio was interrupted");
+      return 0;
+    }
+    piece = length < piece_size ? length : piece_size;
+    if (movie->map) {
+      if (!(bytes = atom_movie_bytes(movie, offset, piece))) {
+        snprintf(error, error_size, "Audio samples are outside of the movie file");
+        return 0;
+      }
+    } else {
+      if (reader->buffer == NULL && !(reader->buffer = (unsigned char*)malloc(ATOM_AUDIO_READ_SIZE))) {
+        snprintf(error, error_size, "Unable to allocate audio buffer");
+        return 0;
+      }
+      if (pread(movie->fd, reader->buffer, piece, (off_t)offset) != (ssize_t)piece) {
+        snprintf(error, error_size, "Unable to read audio samples of the movie file");
+        return 0;
+      }
+      bytes = reader->buffer;
+    }
+    frames = (uint32_t)(piece / pcm->frame_bytes);
+    for (n = 0; n < frames; n += count) {
+      count = frames - n < ATOM_AUDIO_BLOCK_FRAMES ? frames - n : ATOM_AUDIO_BLOCK_FRAMES;
+      atom_pcm_decode(pcm, bytes + (uint64_t)n * pcm->frame_bytes, count, reader->planes);
+      if (!block(context, reader->planes, count)) {
+        snprintf(error, error_size, "Out of memory reading audio");
+        return 0;
+      }
+    }
+    offset += piece;
+    length -= piece;
+  }
+  return 1;
+}
+
+/*  helper function, passes every frame of the track to the callback in
+    blocks of up to ATOM_AUDIO_BLOCK_FRAMES, as one float plane of 
+    ATOM_AUDIO_BLOCK_FRAMES per channel. The callback returns 0 when it
+    runs out of memory.
+*/
+static int atom_pcm_read(struct AtomPcmReader *reader, int (*block)(void *context, const float *planes, uint32_t frames),
+                         void *context, char *error, size_t error_size)
+{
+  struct AtomSampleIndex *index = reader->index;
+  uint64_t run_offset = 0, run_length = 0, start = UINT64_MAX, end = 0, size;
+  uint32_t i;
+
+  for (i = 0; i < index->count; i++) {
+    if (index->offsets[i] < start) start = index->offsets[i];
+    if (index->offsets[i] + index->sizes[i] > end) end = index->offsets[i] + index->sizes[i];
+  }
+  atom_movie_advise_sequential(reader->media->movie, start, end);
+
+  // samples following on in the file are read as one run
+  for (i = 0; i < index->count; i++) {
+    size = index->sizes[i];
+    if (i > 0 && index->offsets[i] == index->offsets[i-1] + index->sizes[i-1]) {
+      run_length += size;
+      continue;
+    }
+    if (run_length && !atom_pcm_run(reader, run_offset, run_length, block, context, error, error_size)) return 0;
+    run_offset = index->offsets[i];
+    run_length = size;
+  }
+  if (run_length && !atom_pcm_run(reader, run_offset, run_length, block, context, error, error_size)) return 0;
+  return 1;
+}
+
+
+/*** LEVELS ***/
+
+/*  helper function, stores the mean square of each channel for the 100 ms
+    just completed.
+*/
+static int atom_audio_gate_block(struct AtomAudioState *state)
+{
+  struct AtomAudioLevels *levels = state->levels;
+  uint32_t c, channels = levels->channels;
+  double *blocks;
+
+  if (levels->block_count == state->block_capacity) {
+    state->block_capacity = state->block_capacity ? state->block_capacity * 2 : 1024;
+    blocks = (double*)realloc(levels->blocks, (size_t)state->block_capacity * channels * sizeof(double));
+    if (blocks == NULL) return 0;
+    levels->blocks = blocks;
+  }
+  for (c = 0; c < channels; c++) {
+    levels->blocks[(size_t)levels->block_count * channels + c] = state->gate_sums[c] / state->gate_frames;
+    state->gate_sums[c] = 0;
+  }
+  levels->block_count++;
+  state->gate_fill = 0;
+  return 1;
+}
+
+/*  helper function, measures a block of decoded frames.
+*/
+static int atom_audio_measure(void *context, const float *planes, uint32_t frames)
+{
+  struct AtomAudioState *state = (struct AtomAudioState*)context;
+  struct AtomAudioLevels *levels = state->levels;
+  const struct AtomBiquad *s = &state->shelf, *h = &state->highpass;
+  uint32_t i, c, start, count, channels = levels->channels;
+  double *z, x, y, sum;
+  const float *plane;
+  float peak, v;
+
+  for (c = 0; c < channels; c++) {
+    plane = planes + (size_t)c * ATOM_AUDIO_BLOCK_FRAMES;
+    peak = 0;
+    sum = 0;
+    for (i = 0; i < frames; i++) {
+      v = fabsf(plane[i]);
+      peak = v > peak ? v : peak;
+      sum += (double)plane[i] * plane[i];
+    }
+    if (peak > levels->peaks[c]) levels->peaks[c] = peak;
+    levels->squares[c] += sum;
+  }
+
+  for (start = 0; start < frames; start += count) {
+    count = state->gate_frames - state->gate_fill;
+    if (count > frames - start) count = frames - start;
+    for (c = 0; c < channels; c++) {
+      plane = planes + (size_t)c * ATOM_AUDIO_BLOCK_FRAMES;
+      z = state->filter_state + c * 4;
+      sum = 0;
+      for (i = start; i < start + count; i++) {
+        x = plane[i];
+        y = s->b0 * x + z[0];
+        z[0] = s->b1 * x - s->a1 * y + z[1];
+        z[1] = s->b2 * x - s->a2 * y;
+        x = y;
+        y = h->b0 * x + z[2];
+        z[2] = h->b1 * x - h->a1 * y + z[3];
+        z[3] = h->b2 * x - h->a2 * y;
+        sum += y * y;
+      }
+      state->gate_sums[c] += sum;
+    }
+    state->gate_fill += count;
+    if (state->gate_fill == state->gate_frames && !atom_audio_gate_block(state)) return 0;
+  }
+  levels->frames += frames;
+  return 1;
+}
+
+/*
+  Measures every sample of the track media, which must be uncompressed
+  PCM. Fills in levels (see atom_audio_levels_free) and returns 1, or 0
+  with an error message. Stops early if levels->cancelled gets set.
+*/
+int atom_track_audio_levels(struct AtomTrack *track, struct AtomAudioLevels *levels, char *error, size_t error_size)
+{
+  struct AtomPcmReader reader;
+  struct AtomAudioState state;
+  uint32_t channels;
+  int ok = 1;
+
+  levels->frames = 0;
+  levels->block_count = 0;
+  if (!atom_pcm_open(&reader, track, &levels->cancelled, error, error_size)) {
+    atom_pcm_close(&reader);
+    return 0;
+  }
+
+  memset(&state, 0, sizeof(struct AtomAudioState));
+  channels = reader.pcm.channels;
+  levels->channels = channels;
+  levels->sample_rate = reader.sample_rate;
+  state.levels = levels;
+  state.gate_frames = (uint32_t)floor(levels->sample_rate / 10 + 0.5);
+  if (state.gate_frames == 0) state.gate_frames = 1;
+  atom_k_weighting(levels->sample_rate, &state.shelf, &state.highpass);
+  levels->peaks = (double*)calloc(channels, sizeof(double));
+  levels->squares = (double*)calloc(channels, sizeof(double));
+  state.filter_state = (double*)calloc((size_t)channels * 4, sizeof(double));
+  state.gate_sums = (double*)calloc(channels, sizeof(double));
+  if (!levels->peaks || !levels->squares || !state.filter_state || !state.gate_sums) {
+    snprintf(error, error_size, "Unable to allocate audio levels");
+    ok = 0;
+  }
+  if (ok) ok = atom_pcm_read(&reader, atom_audio_measure, &state, error, error_size);
+
+  atom_pcm_close(&reader);
+  free(state.filter_state);
+  free(state.gate_sums);
+  if (!ok) atom_audio_levels_free(levels);
+  return ok;
+}
+
+/*
+  Frees the arrays of levels filled in by atom_track_audio_levels.
+*/
+void atom_audio_levels_free(struct AtomAudioLevels *levels)
+{
+  free(levels->peaks);
+  free(levels->squares);
+  free(levels->blocks);
+  levels->peaks = levels->squares = levels->blocks = NULL;
+  levels->block_count = 0;
+}
+
+/*  helper function, weighted mean square of the 400 ms block starting at
+    the given 100 ms block.
+*/
+static double atom_audio_block_power(const struct AtomAudioLevels *levels, const double *weights, uint32_t block)
+{
+  uint32_t j, c;
+  double power = 0;
+
+  for (j = block; j < block + 4; j++) {
+    for (c = 0; c < levels->channels; c++) power += weights[c] * levels->blocks[(size_t)j * levels->channels + c];
+  }
+  return power / 4;
+}
+
+/*
+  Returns the integrated loudness in LUFS of the channels with the given
+  weights (see BS.1770: 0 leaves a channel out, surround channels get
+  1.41). Overlapping 400 ms blocks are gated at -70 LUFS and then 10 LU
+  below their mean. Returns -HUGE_VAL if no block passes the gates.
+*/
+double atom_audio_loudness(const struct AtomAudioLevels *levels, const double *weights)
+{
+  uint32_t i, count = 0;
+  double power, total = 0, gate = -70;
+  int pass;
+
+  // the absolute gate first, then the relative gate below the mean of those
+  for (pass = 0; pass < 2; pass++) {
+    total = 0;
+    count = 0;
+    for (i = 0; i + 4 <= levels->block_count; i++) {
+      power = atom_audio_block_power(levels, weights, i);
+      if (power > 0 && -0.691 + 10 * log10(power) > gate) {
+        total += power;
+        count++;
+      }
+    }
+    if (count == 0) return -HUGE_VAL;
+    if (pass == 0) gate = -0.691 + 10 * log10(total / count) - 10;
+  }
+  return -0.691 + 10 * log10(total / count);
+}
+
+
+/*** WAVEFORMS ***/
+
+/*  helper function, stores the bucket being filled as the next bucket of
+    the lowest level.
+*/
+static int atom_waveform_bucket(struct AtomWaveformState *state)
+{
+  struct AtomWaveform *waveform = state->waveform;
+  uint32_t c, channels = waveform->channels;
+  int16_t *values;
+
+  if (waveform->counts[0] == state->capacity) {
+    state->capacity = state->capacity ? state->capacity * 2 : 1024;
+    values = (int16_t*)realloc(waveform->levels[0], (size_t)state->capacity * channels * 2 * sizeof(int16_t));
+    if (values == NULL) return 0;
+    waveform->levels[0] = values;
+  }
+  values = waveform->levels[0] + (size_t)waveform->counts[0] * channels * 2;
+  for (c = 0; c < channels; c++) {
+    values[c*2] = (int16_t)floor(state->mins[c] * 32767 + 0.5);
+    values[c*2+1] = (int16_t)floor(state->maxs[c] * 32767 + 0.5);
+    state->mins[c] = 1;
+    state->maxs[c] = -1;
+  }
+  waveform->counts[0]++;
+  state->fill = 0;
+  return 1;
+}
+
+/*  helper function, takes the minimum and maximum of a block of decoded
+    frames.
+*/
+static int atom_waveform_scan(void *context, const float *planes, uint32_t frames)
+{
+  struct AtomWaveformState *state = (struct AtomWaveformState*)context;
+  struct AtomWaveform *waveform = state->waveform;
+  uint32_t i, c, start, count;
+  const float *plane;
+  float low, high, v;
+
+  for (start = 0; start < frames; start += count) {
+    count = waveform->bucket_frames - state->fill;
+    if (count > frames - start) count = frames - start;
+    for (c = 0; c < waveform->channels; c++) {
+      plane = planes + (size_t)c * ATOM_AUDIO_BLOCK_FRAMES;
+      low = state->mins[c];
+      high = state->maxs[c];
+      for (i = start; i < start + count; i++) {
+        v = plane[i] > 1 ? 1 : (plane[i] < -1 ? -1 : plane[i]);
+        low = v < low ? v : low;
+        high = v > high ? v : high;
+      }
+      state->mins[c] = low;
+      state->maxs[c] = high;
+    }
+    state->fill += count;
+    if (state->fill == waveform->bucket_frames && !atom_waveform_bucket(state)) return 0;
+  }
+  waveform->frames += frames;
+  return 1;
+}
+
+/*  helper function, builds each level above the lowest by merging pairs
+    of buckets, up to a single bucket.
+*/
+static int atom_waveform_pyramid(struct AtomWaveform *waveform)
+{
+  uint32_t level, i, c, count, channels = waveform->channels;
+  const int16_t *below, *pair;
+  int16_t *values;
+
+  for (level = 1; waveform->counts[level-1] > 1; level++) {
+    if (level == ATOM_WAVEFORM_MAX_LEVELS) break;
+    count = (waveform->counts[level-1] + 1) / 2;
+    if (!(values = (int16_t*)malloc((size_t)count * channels * 2 * sizeof(int16_t)))) return 0;
+    below = waveform->levels[level-1];
+    for (i = 0; i < count; i++) {
+      for (c = 0; c < channels; c++) {
+        pair = below + (size_t)i * 2 * channels * 2;
+        values[(i*channels + c)*2] = pair[c*2];
+        values[(i*channels + c)*2+1] = pair[c*2+1];
+        if (i * 2 + 1 < waveform->counts[level-1]) {
+          pair += channels * 2;
+          if (pair[c*2] < values[(i*channels + c)*2]) values[(i*channels + c)*2] = pair[c*2];
+          if (pair[c*2+1] > values[(i*channels + c)*2+1]) values[(i*channels + c)*2+1] = pair[c*2+1];
+        }
+      }
+    }
+    waveform->levels[level] = values;
+    waveform->counts[level] = count;
+    waveform->level_count = level + 1;
+  }
+  return 1;
+}
+
+/*  helper function, identifies the file and samples a waveform was made
+    from, so a stale sidecar is recognized.
+*/
+static int atom_waveform_source(struct AtomTrack *track, struct AtomWaveformSource *source)
+{
+  struct AtomTrack *media = ATOM_TRACK_MEDIA(track);
+  struct AtomSampleIndex *index = atom_track_sample_index(track);
+  struct stat info;
+
+  memset(source, 0, sizeof(struct AtomWaveformSource));
+  if (!index || fstat(media->movie->fd, &info) != 0) return 0;
+  source->track_id = track->id;
+  source->sample_count = index->count;
+  source->device = (uint64_t)info.st_dev;
+  source->inode = (uint64_t)info.st_ino;
+  source->size = (uint64_t)info.st_size;
+  source->mtime = (int64_t)info.st_mtime;
+  return 1;
+}
+
+static void atom_waveform_put32(unsigned char *p, uint32_t value)
+{
+  p[0] = (unsigned char)(value >> 24);
+  p[1] = (unsigned char)(value >> 16);
+  p[2] = (unsigned char)(value >> 8);
+  p[3] = (unsigned char)value;
+}
+
+static void atom_waveform_put64(unsigned char *p, uint64_t value)
+{
+  atom_waveform_put32(p, (uint32_t)(value >> 32));
+  atom_waveform_put32(p + 4, (uint32_t)value);
+}
+
+static uint64_t atom_u64_be(const unsigned char *p)
+{
+  return ((uint64_t)atom_u32_be(p) << 32) | atom_u32_be(p + 4);
+}
+
+/*  helper function, the fixed sidecar header: 'RMWF', format version, the
+    source (track id, sample count, device, inode, size and modification
+    time of the file), channels, frames per bucket of the lowest level,
+    frames and the number of levels.
+*/
+static void atom_waveform_header(unsigned char *p, const struct AtomWaveform *waveform, const struct AtomWaveformSource *source)
+{
+  atom_waveform_put32(p, FOURCC('R','M','W','F'));
+  atom_waveform_put32(p + 4, ATOM_WAVEFORM_VERSION);
+  atom_waveform_put32(p + 8, source->track_id);
+  atom_waveform_put32(p + 12, source->sample_count);
+  atom_waveform_put64(p + 16, source->device);
+  atom_waveform_put64(p + 24, source->inode);
+  atom_waveform_put64(p + 32, source->size);
+  atom_waveform_put64(p + 40, (uint64_t)source->mtime);
+  atom_waveform_put32(p + 48, waveform->channels);
+  atom_waveform_put32(p + 52, waveform->bucket_frames);
+  atom_waveform_put64(p + 56, waveform->frames);
+  atom_waveform_put32(p + 64, waveform->level_count);
+}
+
+/*  helper function, writes the waveform to path through a temporary file
+    which replaces it at the end. Each level is its bucket count followed
+    by the minimum and maximum of each channel in each bucket, all big
+    endian.
+*/
+static int atom_waveform_save(const struct AtomWaveform *waveform, const struct AtomWaveformSource *source, const char *path)
+{
+  unsigned char header[ATOM_WAVEFORM_HEADER_SIZE], count[4], *values;
+  char temp_path[4096];
+  size_t i, length;
+  uint32_t level;
+  FILE *file;
+  int ok = 1;
+
+  if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path)) return 0;
+  if (!(file = fopen(temp_path, "wb"))) return 0;
+  atom_waveform_header(header, waveform, source);
+  ok = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+  for (level = 0; ok && level < waveform->level_count; level++) {
+    atom_waveform_put32(count, waveform->counts[level]);
+    length = (size_t)waveform->counts[level] * waveform->channels * 2;
+    if (!(values = (unsigned char*)malloc(length * 2 + 1))) {
+      ok = 0;
+      break;
+    }
+    for (i = 0; i < length; i++) {
+      values[i*2] = (unsigned char)((uint16_t)waveform->levels[level][i] >> 8);
+      values[i*2+1] = (unsigned char)waveform->levels[level][i];
+    }
+    ok = fwrite(count, 1, 4, file) == 4 && fwrite(values, 1, length * 2, file) == length * 2;
+    free(values);
+  }
+  if (fclose(file) != 0) ok = 0;
+  if (ok && rename(temp_path, path) != 0) ok = 0;
+  if (!ok) unlink(temp_path);
+  return ok;
+}
+
+/*  helper function, reads the waveform stored at path. Returns 0 if there
+    is none or it does not match the source.
+*/
+static int atom_waveform_load(struct AtomWaveform *waveform, const struct AtomWaveformSource *source, const char *path)
+{
+  unsigned char header[ATOM_WAVEFORM_HEADER_SIZE], expected[ATOM_WAVEFORM_HEADER_SIZE], count[4], *values = NULL;
+  size_t i, length;
+  uint32_t level;
+  FILE *file;
+  int ok;
+
+  if (!(file = fopen(path, "rb"))) return 0;
+  ok = fread(header, 1, sizeof(header), file) == sizeof(header);
+  if (ok) {
+    waveform->channels = atom_u32_be(header + 48);
+    waveform->bucket_frames = atom_u32_be(header + 52);
+    waveform->frames = atom_u64_be(header + 56);
+    waveform->level_count = atom_u32_be(header + 64);
+    atom_waveform_header(expected, waveform, source);
+    ok = memcmp(header, expected, sizeof(header)) == 0 && waveform->channels > 0 &&
+         waveform->level_count > 0 && waveform->level_count <= ATOM_WAVEFORM_MAX_LEVELS;
+  }
+  for (level = 0; ok && level < waveform->level_count; level++) {
+    if (!(ok = fread(count, 1, 4, file) == 4)) break;
+    waveform->counts[level] = atom_u32_be(count);
+    length = (size_t)waveform->counts[level] * waveform->channels * 2;
+    values = (unsigned char*)malloc(length * 2 + 1);
+    waveform->levels[level] = (int16_t*)malloc(length * sizeof(int16_t) + 1);
+    ok = values && waveform->levels[level] && fread(values, 1, length * 2, file) == length * 2;
+    for (i = 0; ok && i < length; i++) {
+      waveform->levels[level][i] = (int16_t)(uint16_t)((values[i*2] << 8) | values[i*2+1]);
+    }
+    free(values);
+  }
+  fclose(file);
+  if (!ok) {
+    atom_waveform_free(waveform);
+    memset(waveform->counts, 0, sizeof(waveform->counts));
+    waveform->frames = 0;
+  }
+  return ok;
+}
+
+/*
+  Fills in the waveform pyramid of the track media, which must be
+  uncompressed PCM. With a sidecar path the pyramid is read from there
+  when it was made from the same file, otherwise it is computed and then
+  stored there (waveform->cached and waveform->save_failed tell which
+  happened). Returns 0 with an error message if the samples can't be read.
+*/
+int atom_track_waveform(struct AtomTrack *track, const char *sidecar, struct AtomWaveform *waveform, char *error, size_t error_size)
+{
+  struct AtomPcmReader reader;
+  struct AtomWaveformState state;
+  struct AtomWaveformSource source;
+  uint32_t c;
+  int ok = 1, identified;
+
+  memset(waveform->counts, 0, sizeof(waveform->counts));
+  memset(waveform->levels, 0, sizeof(waveform->levels));
+  waveform->frames = 0;
+  waveform->level_count = 0;
+  waveform->cached = 0;
+  waveform->save_failed = 0;
+
+  identified = sidecar && atom_waveform_source(track, &source);
+  if (identified && atom_waveform_load(waveform, &source, sidecar)) {
+    waveform->cached = 1;
+    return 1;
+  }
+
+  if (!atom_pcm_open(&reader, track, &waveform->cancelled, error, error_size)) {
+    atom_pcm_close(&reader);
+    return 0;
+  }
+  memset(&state, 0, sizeof(struct AtomWaveformState));
+  state.waveform = waveform;
+  waveform->channels = reader.pcm.channels;
+  waveform->bucket_frames = ATOM_WAVEFORM_BUCKET_FRAMES;
+  waveform->level_count = 1;
+  state.mins = (float*)malloc(waveform->channels * sizeof(float));
+  state.maxs = (float*)malloc(waveform->channels * sizeof(float));
+  if (!state.mins || !state.maxs) {
+    snprintf(error, error_size, "Unable to allocate waveform");
+    ok = 0;
+  }
+  for (c = 0; ok && c < waveform->channels; c++) {
+    state.mins[c] = 1;
+    state.maxs[c] = -1;
+  }
+  if (ok) ok = atom_pcm_read(&reader, atom_waveform_scan, &state, error, error_size);
+  // the frames past the last full bucket make a bucket of their own
+  if (ok && ((state.fill && !atom_waveform_bucket(&state)) || !atom_waveform_pyramid(waveform))) {
+    snprintf(error, error_size, "Unable to allocate waveform");
+    ok = 0;
+  }
+
+  atom_pcm_close(&reader);
+  free(state.mins);
+  free(state.maxs);
+  if (!ok) {
+    atom_waveform_free(waveform);
+    return 0;
+  }
+  if (sidecar && (!identified || !atom_waveform_save(waveform, &source, sidecar)))
+    waveform->save_failed = 1;
+  return 1;
+}
+
+/*
+  Frees the levels of a waveform filled in by atom_track_waveform.
+*/
+void atom_waveform_free(struct AtomWaveform *waveform)
+{
+  uint32_t level;
+
+  for (level = 0; level < ATOM_WAVEFORM_MAX_LEVELS; level++) {
+    free(waveform->levels[level]);
+    waveform->levels[level] = NULL;
+  }
+}
+
+/*
+  Summarizes the waveform into count buckets of the given channel, filling
+  in the minimum and maximum (-1 to 1) of each. Uses the coarsest level
+  with at least count buckets, so no more than a few values are merged
+  into each one.
+*/
+void atom_waveform_buckets(const struct AtomWaveform *waveform, uint32_t channel, uint32_t count, double *mins, double *maxs)
+{
+  uint32_t level = 0, i, first, last, n;
+  const int16_t *values;
+  int16_t low, high;
+  uint64_t entries;
+
+  while (level + 1 < waveform->level_count && waveform->counts[level+1] >= count) level++;
+  entries = waveform->counts[level];
+  values = waveform->levels[level];
+  for (i = 0; i < count; i++) {
+    if (entries == 0) {
+      mins[i] = maxs[i] = 0;
+      continue;
+    }
+    first = (uint32_t)(i * entries / count);
+    last = (uint32_t)((i + 1) * entries / count);
+    if (last <= first) last = first + 1;
+    low = values[((size_t)first * waveform->channels + channel) * 2];
+    high = values[((size_t)first * waveform->channels + channel) * 2 + 1];
+    for (n = first + 1; n < last; n++) {
+      if (values[((size_t)n * waveform->channels + channel) * 2] < low) low = values[((size_t)n * waveform->channels + channel) * 2];
+      if (values[((size_t)n * waveform->channels + channel) * 2 + 1] > high) high = values[((size_t)n * waveform->channels + channel) * 2 + 1];
+    }
+    mins[i] = low / 32767.0;
+    maxs[i] = high / 32767.0;
+  }
+}
@@ -0,0 +1,657 @@
+#include "rmov_ext.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+  A persistent cache of probe reports, see QuickTime::ProbeCache. The
+  cache file is a 16 byte header ('RMPC', format version, 8 reserved bytes)
+  followed by records which are only ever appended:
+
+    size (4)        whole record, header included
+    checksum (4)    CRC-32C of the rest of the record
+    device (8), inode (8), size (8), mtime in nanoseconds (8)
+                    the file the report is of, when it was reported
+    path length (4), value length (4)
+    path, value
+
+  all big endian. A record for a file supersedes earlier records with the
+  same device and inode. The records are indexed in memory by device and
+  inode when the cache is opened, the values are read from a map of the
+  file.
+
+  Appends hold an exclusive flock on the file, so several processes can
+  share a cache. A torn record left by a crash ends the valid records and
+  is cut off by the next append.
+
+  Once superseded records take more room than live ones the cache is
+  compacted on a background thread. Live records whose file no longer
+  matches them are dropped, the rest are copied into a new file which
+  replaces the cache. Records appended meanwhile are copied over at the
+  end, while holding the lock of the old file.
+*/
+
+#define ATOM_CACHE_MAGIC FOURCC('R','M','P','C')
+
+static void atom_cache_put32(unsigned char *p, uint32_t value)
+{
+  p[0] = (unsigned char)(value >> 24);
+  p[1] = (unsigned char)(value >> 16);
+  p[2] = (unsigned char)(value >> 8);
+  p[3] = (unsigned char)value;
+}
+
+static void atom_cache_put64(unsigned char *p, uint64_t value)
+{
+  atom_cache_put32(p, (uint32_t)(value >> 32));
+  atom_cache_put32(p + 4, (uint32_t)value);
+}
+
+static uint32_t atom_cache_u32(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t atom_cache_u64(const unsigned char *p)
+{
+  return ((uint64_t)atom_cache_u32(p) << 32) | atom_cache_u32(p + 4);
+}
+
+/*
+  Fills key with the identity of a file from its stat information.
+*/
+void atom_cache_key_from_stat(const struct stat *info, struct AtomCacheKey *key)
+{
+  key->device = (uint64_t)info->st_dev;
+  key->inode = (uint64_t)info->st_ino;
+  key->size = (uint64_t)info->st_size;
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+  key->mtime = (int64_t)info->st_mtim.tv_sec * 1000000000 + info->st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+  key->mtime = (int64_t)info->st_mtimespec.tv_sec * 1000000000 + info->st_mtimespec.tv_nsec;
+#else
+  key->mtime = (int64_t)info->st_mtime * 1000000000;
+#endif
+}
+
+/*  helper function, finds the slot of device and inode in the index, the
+    empty slot where they belong when they aren't indexed.
+*/
+static struct AtomCacheEntry *atom_cache_slot(struct AtomCacheIndex *index, uint64_t device, uint64_t inode)
+{
+  uint64_t hash = (inode ^ (device * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+  uint32_t mask = index->capacity - 1, i = (uint32_t)(hash >> 32) & mask;
+  struct AtomCacheEntry *entry;
+
+  for (;;) {
+    entry = &index->entries[i];
+    if (entry->offset == 0 || (entry->key.device == device && entry->key.inode == inode))
+      return entry;
+    i = (i + 1) & mask;
+  }
+}
+
+/*  helper function, indexes the record at offset, superseding the record
+    of the same file. Returns 0 if out of memory.
+*/
+static int atom_cache_index_add(struct AtomCacheIndex *index, const struct AtomCacheKey *key, uint64_t offset, uint32_t size)
+{
+  struct AtomCacheEntry *entries, *entry;
+  struct AtomCacheIndex grown;
+  uint32_t i, capacity;
+
+  if ((index->count + 1) * 2 > index->capacity) {
+    capacity = index->capacity ? index->capacity * 2 : 1024;
+    entries = (struct AtomCacheEntry*)calloc(capacity, sizeof(struct AtomCacheEntry));
+    if (entries == NULL) return 0;
+    grown.entries = entries;
+    grown.capacity = capacity;
+    for (i = 0; i < index->capacity; i++) {
+      if (index->entries[i].offset)
+        *atom_cache_slot(&grown, index->entries[i].key.device, index->entries[i].key.inode) = index->entries[i];
+    }
+    free(index->entries);
+    index->entries = entries;
+    index->capacity = capacity;
+  }
+
+  entry = atom_cache_slot(index, key->device, key->inode);
+  if (entry->offset) {
+    index->live_bytes -= entry->size;
+  } else {
+    index->count++;
+  }
+  entry->key = *key;
+  entry->offset = offset;
+  entry->size = size;
+  index->live_bytes += size;
+  return 1;
+}
+
+/*  helper function, checks the record at the start of bytes, at most
+    length long, and reads its key. Returns its size, 0 if it's torn or
+    corrupt.
+*/
+static uint32_t atom_cache_record(const unsigned char *bytes, uint64_t length, struct AtomCacheKey *key)
+{
+  uint32_t size;
+
+  if (length < ATOM_CACHE_RECORD_HEADER_SIZE) return 0;
+  size = atom_cache_u32(bytes);
+  if (size < ATOM_CACHE_RECORD_HEADER_SIZE || size > length) return 0;
+  if ((uint64_t)ATOM_CACHE_RECORD_HEADER_SIZE + atom_cache_u32(bytes + 40) + atom_cache_u32(bytes + 44) != size) return 0;
+  if (atom_crc32c(0, bytes + 8, size - 8) != atom_cache_u32(bytes + 4)) return 0;
+  key->device = atom_cache_u64(bytes + 8);
+  key->inode = atom_cache_u64(bytes + 16);
+  key->size = atom_cache_u64(bytes + 24);
+  key->mtime = (int64_t)atom_cache_u64(bytes + 32);
+  return size;
+}
+
+/*  helper function, indexes the records in bytes which start at offset of
+    the file. Returns how many bytes hold valid records, -1 if out of memory.
+*/
+static int64_t atom_cache_scan(struct AtomCacheIndex *index, const unsigned char *bytes, uint64_t length, uint64_t offset)
+{
+  struct AtomCacheKey key;
+  uint64_t position = 0;
+  uint32_t size;
+
+  while ((size = atom_cache_record(bytes + position, length - position, &key))) {
+    if (!atom_cache_index_add(index, &key, offset + position, size)) return -1;
+    position += size;
+  }
+  return (int64_t)position;
+}
+
+/*  helper function, unmaps the map a compaction replaced. Maps are only
+    unmapped by the owner of the cache, which may still use the old map
+    until its next call.
+*/
+static void atom_cache_release(struct AtomProbeCache *cache)
+{
+  if (cache->retired_map) {
+    munmap(cache->retired_map, cache->retired_size);
+    cache->retired_map = NULL;
+  }
+}
+
+/*  helper function, maps at least the first length bytes of the cache file.
+*/
+static int atom_cache_map(struct AtomProbeCache *cache, uint64_t length)
+{
+  void *map;
+
+  atom_cache_release(cache);
+  if (cache->map && cache->map_size >= length) return 1;
+  if (cache->map) munmap(cache->map, cache->map_size);
+  cache->map = NULL;
+  cache->map_size = 0;
+  map = mmap(NULL, length, PROT_READ, MAP_SHARED, cache->fd, 0);
+  if (map == MAP_FAILED) return 0;
+  cache->map = (unsigned char*)map;
+  cache->map_size = length;
+  return 1;
+}
+
+/*  helper function, indexes records appended by other processes since the
+    cache was last read. A torn record at the end is cut off when truncate
+    is set, which needs the lock of the file.
+*/
+static int atom_cache_read_tail(struct AtomProbeCache *cache, int truncate, char *error, size_t error_size)
+{
+  struct stat info;
+  int64_t valid;
+
+  if (fstat(cache->fd, &info) != 0) {
+    snprintf(error, error_size, "Error %d occurred while reading probe cache at %s", errno, cache->path);
+    return 0;
+  }
+  if ((uint64_t)info.st_size <= cache->end) return 1;
+  if (!atom_cache_map(cache, (uint64_t)info.st_size)) {
+    snprintf(error, error_size, "Error %d occurred while mapping probe cache at %s", errno, cache->path);
+    return 0;
+  }
+  valid = atom_cache_scan(&cache->index, cache->map + cache->end, (uint64_t)info.st_size - cache->end, cache->end);
+  if (valid < 0) {
+    snprintf(error, error_size, "Memory Error when reading probe cache at %s", cache->path);
+    return 0;
+  }
+  cache->end += (uint64_t)valid;
+  if (truncate && cache->end < (uint64_t)info.st_size && ftruncate(cache->fd, (off_t)cache->end) != 0) {
+    snprintf(error, error_size, "Error %d occurred while repairing probe cache at %s", errno, cache->path);
+    return 0;
+  }
+  return 1;
+}
+
+/*  helper function, (re)opens the cache file at the path of the cache and
+    indexes all of it. A new file gets its header.
+*/
+static int atom_cache_load(struct AtomProbeCache *cache, char *error, size_t error_size)
+{
+  unsigned char header[ATOM_CACHE_HEADER_SIZE];
+  struct stat info;
+  int fd;
+
+  // reports are unmarshaled, so only the owner may read or write them
+  fd = open(cache->path, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    snprintf(error, error_size, "Error %d occurred while opening probe cache at %s", errno, cache->path);
+    return 0;
+  }
+  if (cache->fd >= 0) close(cache->fd);
+  cache->fd = fd;
+  if (cache->map) {
+    munmap(cache->map, cache->map_size);
+    cache->map = NULL;
+    cache->map_size = 0;
+  }
+  free(cache->index.entries);
+  memset(&cache->index, 0, sizeof(struct AtomCacheIndex));
+  cache->end = ATOM_CACHE_HEADER_SIZE;
+
+  flock(fd, LOCK_EX);
+  if (fstat(fd, &info) != 0) {
+    snprintf(error, error_size, "Error %d occurred while reading probe cache at %s", errno, cache->path);
+    goto bail;
+  }
+  if (info.st_size == 0) {
+    atom_cache_put32(header, ATOM_CACHE_MAGIC);
+    atom_cache_put32(header + 4, ATOM_CACHE_VERSION);
+    memset(header + 8, 0, 8);
+    if (pwrite(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+      snprintf(error, error_size, "Error %d occurred while writing probe cache at %s", errno, cache->path);
+      goto bail;
+    }
+  } else if (info.st_size < ATOM_CACHE_HEADER_SIZE || pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+             atom_cache_u32(header) != ATOM_CACHE_MAGIC || atom_cache_u32(header + 4) != ATOM_CACHE_VERSION) {
+    snprintf(error, error_size, "File at %s is not a probe cache", cache->path);
+    goto bail;
+  }
+  if (!atom_cache_read_tail(cache, 1, error, error_size)) goto bail;
+  flock(fd, LOCK_UN);
+  return 1;
+
+  bail:
+    flock(fd, LOCK_UN);
+    return 0;
+}
+
+/*  helper function, checks that the cache file is still the one at the
+    path of the cache, another process may have replaced it by compacting.
+*/
+static int atom_cache_replaced(struct AtomProbeCache *cache)
+{
+  struct stat opened, current;
+  if (fstat(cache->fd, &opened) != 0 || stat(cache->path, &current) != 0) return 1;
+  return opened.st_dev != current.st_dev || opened.st_ino != current.st_ino;
+}
+
+/*
+  Opens the probe cache at path, creating it when there's no file there.
+  Returns NULL and sets error when it can't be read.
+*/
+struct AtomProbeCache *atom_probe_cache_open(const char *path, char *error, size_t error_size)
+{
+  struct AtomProbeCache *cache = (struct AtomProbeCache*)calloc(1, sizeof(struct AtomProbeCache));
+
+  if (cache == NULL || (cache->path = strdup(path)) == NULL) {
+    free(cache);
+    snprintf(error, error_size, "Memory Error when opening probe cache at %s", path);
+    return NULL;
+  }
+  cache->fd = -1;
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_cond_init(&cache->finished, NULL);
+  if (!atom_cache_load(cache, error, error_size)) {
+    atom_probe_cache_close(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+/*
+  Waits for a compaction to finish and frees the cache.
+*/
+void atom_probe_cache_close(struct AtomProbeCache *cache)
+{
+  if (cache->compacting) pthread_join(cache->compactor, NULL);
+
+  if (cache->retired_map) munmap(cache->retired_map, cache->retired_size);
+  if (cache->map) munmap(cache->map, cache->map_size);
+  if (cache->fd >= 0) close(cache->fd);
+  pthread_mutex_destroy(&cache->lock);
+  pthread_cond_destroy(&cache->finished);
+  free(cache->index.entries);
+  free(cache->path);
+  free(cache);
+}
+
+/*
+  Looks up the value stored for the file identified by key. Returns 1 and
+  points value into the cache on a hit. The value stays valid until the
+  next call on the cache. Records added by other processes are read on a
+  miss. Returns 0 on a miss and -1 with error set when the cache can't be
+  read.
+*/
+int atom_probe_cache_find(struct AtomProbeCache *cache, const struct AtomCacheKey *key, const unsigned char **value, uint32_t *length, char *error, size_t error_size)
+{
+  struct AtomCacheEntry *entry = NULL;
+  int pass, found = 0;
+
+  pthread_mutex_lock(&cache->lock);
+  atom_cache_release(cache);
+  for (pass = 0; pass < 2 && !found; pass++) {
+    if (pass == 1) {
+      // a miss, the cache may have grown or been replaced by another process
+      if (atom_cache_replaced(cache)) {
+        if (!atom_cache_load(cache, error, error_size)) goto bail;
+      } else if (!atom_cache_read_tail(cache, 0, error, error_size)) {
+        goto bail;
+      }
+    }
+    if (cache->index.capacity == 0) continue;
+    entry = atom_cache_slot(&cache->index, key->device, key->inode);
+    found = entry->offset && entry->key.size == key->size && entry->key.mtime == key->mtime;
+  }
+  if (found) {
+    if (!atom_cache_map(cache, cache->end)) {
+      snprintf(error, error_size, "Error %d occurred while mapping probe cache at %s", errno, cache->path);
+      goto bail;
+    }
+    *value = cache->map + entry->offset + ATOM_CACHE_RECORD_HEADER_SIZE + atom_cache_u32(cache->map + entry->offset + 40);
+    *length = atom_cache_u32(cache->map + entry->offset + 44);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return found;
+
+  bail:
+    pthread_mutex_unlock(&cache->lock);
+    return -1;
+}
+
+/*  helper function, the path of the temporary file a compaction writes.
+*/
+static void atom_cache_compact_path(struct AtomProbeCache *cache, char *path, size_t size)
+{
+  snprintf(path, size, "%s.%ld.compact", cache->path, (long)getpid());
+}
+
+/*  helper function, copies the live records of the snapshot taken when
+    the compaction started into a new file, then under the lock the ones
+    appended since, and replaces the cache file with it.
+*/
+static void *atom_cache_compact(void *arg)
+{
+  struct AtomProbeCache *cache = (struct AtomProbeCache*)arg;
+  struct AtomCacheIndex index = { NULL, 0, 0, 0 };
+  struct AtomCacheKey key, current;
+  struct stat info;
+  unsigned char header[ATOM_CACHE_HEADER_SIZE], *record = NULL, *tail = NULL;
+  uint32_t i, size, record_size = 0;
+  uint64_t end = ATOM_CACHE_HEADER_SIZE, tail_size;
+  int64_t valid;
+  char path[4096], *file = NULL;
+  int fd, locked = 0, ok = 0;
+
+  atom_cache_compact_path(cache, path, sizeof(path));
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) goto done;
+  atom_cache_put32(header, ATOM_CACHE_MAGIC);
+  atom_cache_put32(header + 4, ATOM_CACHE_VERSION);
+  memset(header + 8, 0, 8);
+  if (write(fd, header, sizeof(header)) != (ssize_t)sizeof(header)) goto done;
+
+  for (i = 0; i < cache->snapshot_count; i++) {
+    size = cache->snapshot[i].size;
+    if (size > record_size) {
+      free(record);
+      if ((record = (unsigned char*)malloc(size)) == NULL) goto done;
+      record_size = size;
+    }
+    if (pread(cache->snapshot_fd, record, size, (off_t)cache->snapshot[i].offset) != (ssize_t)size) goto done;
+    if (atom_cache_record(record, size, &key) != size) continue;
+
+    // drop reports of files which have changed or are gone
+    free(file);
+    if ((file = strndup((char*)record + ATOM_CACHE_RECORD_HEADER_SIZE, atom_cache_u32(record + 40))) == NULL) goto done;
+    if (stat(file, &info) != 0) continue;
+    atom_cache_key_from_stat(&info, &current);
+    if (key.device != current.device || key.inode != current.inode || key.size != current.size || key.mtime != current.mtime) continue;
+
+    if (write(fd, record, size) != (ssize_t)size) goto done;
+    if (!atom_cache_index_add(&index, &key, end, size)) goto done;
+    end += size;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  flock(cache->snapshot_fd, LOCK_EX);
+  locked = 1;
+  // give up if another process replaced the cache or the owner reopened it
+  if (fstat(cache->snapshot_fd, &info) != 0 || cache->snapshot_inode != (uint64_t)info.st_ino) goto done;
+  if (stat(cache->path, &info) != 0 || cache->snapshot_inode != (uint64_t)info.st_ino) goto done;
+  if (fstat(cache->fd, &info) != 0 || cache->snapshot_inode != (uint64_t)info.st_ino) goto done;
+
+  // records appended after the snapshot
+  if (fstat(cache->snapshot_fd, &info) != 0) goto done;
+  if ((uint64_t)info.st_size > cache->snapshot_end) {
+    tail_size = (uint64_t)info.st_size - cache->snapshot_end;
+    if ((tail = (unsigned char*)malloc(tail_size)) == NULL) goto done;
+    if (pread(cache->snapshot_fd, tail, tail_size, (off_t)cache->snapshot_end) != (ssize_t)tail_size) goto done;
+    if ((valid = atom_cache_scan(&index, tail, tail_size, end)) < 0) goto done;
+    if (write(fd, tail, (size_t)valid) != (ssize_t)valid) goto done;
+    end += (uint64_t)valid;
+  }
+  if (fsync(fd) != 0 || rename(path, cache->path) != 0) goto done;
+
+  // the map stays in use by the owner until its next call
+  cache->retired_map = cache->map;
+  cache->retired_size = cache->map_size;
+  cache->map = NULL;
+  cache->map_size = 0;
+  close(cache->fd);
+  cache->fd = fd;
+  fd = -1;
+  free(cache->index.entries);
+  cache->index = index;
+  index.entries = NULL;
+  cache->end = end;
+  ok = 1;
+
+  done:
+    if (locked) {
+      flock(cache->snapshot_fd, LOCK_UN);
+    } else {
+      pthread_mutex_lock(&cache->lock);
+    }
+    close(cache->snapshot_fd);
+    free(cache->snapshot);
+    cache->snapshot = NULL;
+    cache->compacted = ok;
+    pthread_cond_broadcast(&cache->finished);
+    pthread_mutex_unlock(&cache->lock);
+    if (fd >= 0) {
+      close(fd);
+      unlink(path);
+    }
+    free(index.entries);
+    free(record);
+    free(tail);
+    free(file);
+    return NULL;
+}
+
+/*  helper function, joins the compaction thread once it has finished, or
+    waits for it when wait is set. Called with the cache locked, which the
+    compaction needs to finish.
+*/
+static void atom_cache_join(struct AtomProbeCache *cache, int wait)
+{
+  if (!cache->compacting) return;
+  if (cache->compacted < 0 && !wait) return;
+  pthread_mutex_unlock(&cache->lock);
+  pthread_join(cache->compactor, NULL);
+  pthread_mutex_lock(&cache->lock);
+  cache->compacting = 0;
+}
+
+static int atom_cache_compare_offsets(const void *a, const void *b)
+{
+  uint64_t x = ((const struct AtomCacheEntry*)a)->offset, y = ((const struct AtomCacheEntry*)b)->offset;
+  return x < y ? -1 : x > y;
+}
+
+/*  helper function, starts compacting the cache on a background thread.
+    Called with the cache locked.
+*/
+static int atom_cache_start_compaction(struct AtomProbeCache *cache)
+{
+  struct AtomCacheEntry *entry;
+  struct stat info;
+  uint32_t i, count = 0;
+
+  if (fstat(cache->fd, &info) != 0) return 0;
+  cache->snapshot = (struct AtomCacheEntry*)malloc((cache->index.count ? cache->index.count : 1) * sizeof(struct AtomCacheEntry));
+  if (cache->snapshot == NULL) return 0;
+  for (i = 0; i < cache->index.capacity; i++) {
+    entry = &cache->index.entries[i];
+    if (entry->offset) cache->snapshot[count++] = *entry;
+  }
+  qsort(cache->snapshot, count, sizeof(struct AtomCacheEntry), atom_cache_compare_offsets);
+  cache->snapshot_count = count;
+  cache->snapshot_end = cache->end;
+  cache->snapshot_inode = (uint64_t)info.st_ino;
+  if ((cache->snapshot_fd = dup(cache->fd)) < 0) {
+    free(cache->snapshot);
+    cache->snapshot = NULL;
+    return 0;
+  }
+  cache->compacted = -1;
+  if (pthread_create(&cache->compactor, NULL, atom_cache_compact, cache) != 0) {
+    close(cache->snapshot_fd);
+    free(cache->snapshot);
+    cache->snapshot = NULL;
+    return 0;
+  }
+  cache->compacting = 1;
+  return 1;
+}
+
+/*
+  Returns the number of files with a stored record. A compaction may be
+  replacing the index, so it's read with the cache locked.
+*/
+uint32_t atom_probe_cache_size(struct AtomProbeCache *cache)
+{
+  uint32_t count;
+
+  pthread_mutex_lock(&cache->lock);
+  count = cache->index.count;
+  pthread_mutex_unlock(&cache->lock);
+  return count;
+}
+
+/*
+  Compacts the cache on a background thread unless it's already being
+  compacted. Returns 1 while a compaction is running, see
+  atom_probe_cache_wait.
+*/
+int atom_probe_cache_compact(struct AtomProbeCache *cache)
+{
+  int running;
+
+  pthread_mutex_lock(&cache->lock);
+  // a finished compaction's map is released before a new one retires another
+  atom_cache_join(cache, 0);
+  atom_cache_release(cache);
+  if (!cache->compacting) atom_cache_start_compaction(cache);
+  running = cache->compacting;
+  pthread_mutex_unlock(&cache->lock);
+  return running;
+}
+
+/*
+  Waits for a running compaction to finish and returns 1 if it replaced
+  the cache file. Neither the maps nor the compaction thread are touched,
+  they're left to the owner's next call, so the owner may keep using the
+  cache from other threads meanwhile.
+*/
+int atom_probe_cache_wait(struct AtomProbeCache *cache)
+{
+  int compacted;
+
+  pthread_mutex_lock(&cache->lock);
+  while (cache->compacting && cache->compacted < 0)
+    pthread_cond_wait(&cache->finished, &cache->lock);
+  compacted = cache->compacted > 0;
+  pthread_mutex_unlock(&cache->lock);
+  return compacted;
+}
+
+/*
+  Appends a record storing value for the file at path identified by key.
+  Starts a compaction when superseded records outgrow the live ones.
+  Returns 0 and sets error when the cache can't be written.
+*/
+int atom_probe_cache_store(struct AtomProbeCache *cache, const struct AtomCacheKey *key, const char *path, const unsigned char *value, uint32_t length, char *error, size_t error_size)
+{
+  uint32_t path_length = (uint32_t)strlen(path);
+  uint64_t size = (uint64_t)ATOM_CACHE_RECORD_HEADER_SIZE + path_length + length;
+  unsigned char *record;
+  int ok = 0;
+
+  if (size > 0xffffffffULL) {
+    snprintf(error, error_size, "Report of %s is too large for the probe cache", path);
+    return 0;
+  }
+  record = (unsigned char*)malloc(size);
+  if (record == NULL) {
+    snprintf(error, error_size, "Memory Error when writing probe cache at %s", cache->path);
+    return 0;
+  }
+  atom_cache_put32(record, (uint32_t)size);
+  atom_cache_put64(record + 8, key->device);
+  atom_cache_put64(record + 16, key->inode);
+  atom_cache_put64(record + 24, key->size);
+  atom_cache_put64(record + 32, (uint64_t)key->mtime);
+  atom_cache_put32(record + 40, path_length);
+  atom_cache_put32(record + 44, length);
+  memcpy(record + ATOM_CACHE_RECORD_HEADER_SIZE, path, path_length);
+  memcpy(record + ATOM_CACHE_RECORD_HEADER_SIZE + path_length, value, length);
+  atom_cache_put32(record + 4, atom_crc32c(0, record + 8, size - 8));
+
+  pthread_mutex_lock(&cache->lock);
+  atom_cache_join(cache, 0);
+  atom_cache_release(cache);
+  if (atom_cache_replaced(cache) && !atom_cache_load(cache, error, error_size)) goto done;
+  flock(cache->fd, LOCK_EX);
+  if (!atom_cache_read_tail(cache, 1, error, error_size)) goto unlock;
+  if (pwrite(cache->fd, record, size, (off_t)cache->end) != (ssize_t)size) {
+    snprintf(error, error_size, "Error %d occurred while writing probe cache at %s", errno, cache->path);
+    goto unlock;
+  }
+  if (!atom_cache_index_add(&cache->index, key, cache->end, (uint32_t)size)) {
+    snprintf(error, error_size, "Memory Error when writing probe cache at %s", cache->path);
+    goto unlock;
+  }
+  cache->end += size;
+  ok = 1;
+
+  unlock:
+    flock(cache->fd, LOCK_UN);
+  done:
+    if (ok && !cache->compacting && cache->end - ATOM_CACHE_HEADER_SIZE - cache->index.live_bytes > cache->index.live_bytes &&
+        cache->end - ATOM_CACHE_HEADER_SIZE - cache->index.live_bytes >= ATOM_CACHE_COMPACT_SIZE)
+      atom_cache_start_compaction(cache);
+    pthread_mutex_unlock(&cache->lock);
+    free(record);
+    return ok;
+}
@@ -0,0 +1,431 @@
+#include "rmov_ext.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  Non-destructive editing of parsed movies. An edit only rewrites the
+  edit lists of the tracks, so it costs time in the number of edits and
+  never in the length of the media. The media and sample tables stay in
+  place and are shared by reference, also with other movies. A movie
+  which plays media of another one holds a reference on it (see
+  atom_movie_retain) so the media stays around as long as it's needed.
+
+  All times here are in the time scale of the movie being edited.
+*/
+
+/*  A growing edit list, see atom_edit_list_push.
+*/
+struct AtomEditList {
+  struct AtomEdit *edits;
+  uint32_t count;
+  uint32_t capacity;
+};
+
+/*  helper function, converts a duration between time scales.
+*/
+static int64_t atom_rescale(int64_t time, uint32_t to_scale, uint32_t from_scale)
+{
+  if (to_scale == from_scale || !from_scale) return time;
+  return (int64_t)floor((double)time * to_scale / from_scale + 0.5);
+}
+
+static int64_t atom_edits_total(struct AtomEdit *edits, uint32_t count)
+{
+  int64_t total = 0;
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    total += edits[i].segment_duration;
+  }
+  return total;
+}
+
+/*  helper function, takes a reference on the movies holding the media of
+    the given edits when it's not the movie of the track itself.
+*/
+static void atom_edits_retain(struct AtomTrack *track, struct AtomEdit *edits, uint32_t count)
+{
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    if (edits[i].media && edits[i].media->movie != track->movie)
+      atom_movie_retain(edits[i].media->movie);
+  }
+}
+
+/*
+  Drops the references taken by atom_edits_retain.
+*/
+void atom_edits_release(struct AtomTrack *track, struct AtomEdit *edits, uint32_t count)
+{
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    if (edits[i].media && edits[i].media->movie != track->movie)
+      atom_movie_free(edits[i].media->movie);
+  }
+}
+
+/*  helper function, appends an edit to the list. Zero length edits are
+    dropped and neighbouring empty edits merged. Returns 0 if out of memory.
+*/
+static int atom_edit_list_push(struct AtomEditList *list, struct AtomEdit edit)
+{
+  struct AtomEdit *edits;
+
+  if (edit.segment_duration <= 0) return 1;
+  if (edit.media_time == -1) {
+    edit.media = NULL;
+    if (list->count && list->edits[list->count - 1].media_time == -1) {
+      list->edits[list->count - 1].segment_duration += edit.segment_duration;
+      return 1;
+    }
+  }
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 8;
+    edits = (struct AtomEdit*)realloc(list->edits, list->capacity * sizeof(struct AtomEdit));
+    if (edits == NULL) return 0;
+    list->edits = edits;
+  }
+  list->edits[list->count++] = edit;
+  return 1;
+}
+
+static int atom_edit_list_push_empty(struct AtomEditList *list, int64_t duration)
+{
+  struct AtomEdit edit;
+
+  memset(&edit, 0, sizeof(edit));
+  edit.segment_duration = duration;
+  edit.media_time = -1;
+  return atom_edit_list_push(list, edit);
+}
+
+/*  helper function, appends the part of the edits between start and end
+    to the list. The edits, start and end are in from_scale and the pushed
+    edits are converted to to_scale. Edits cut in two start their media
+    that much later.
+*/
+static int atom_edit_list_push_range(struct AtomEditList *list, struct AtomEdit *edits, uint32_t count, int64_t start, int64_t end, uint32_t to_scale, uint32_t from_scale)
+{
+  struct AtomEdit edit;
+  int64_t position = 0, from, to;
+  uint32_t i;
+
+  for (i = 0; i < count && position < end; position += edits[i++].segment_duration) {
+    from = position > start ? position : start;
+    to = position + edits[i].segment_duration < end ? position + edits[i].segment_duration : end;
+    if (from >= to) continue;
+
+    edit = edits[i];
+    edit.segment_duration = atom_rescale(to - from, to_scale, from_scale);
+    if (edit.media_time != -1 && from > position && from_scale) {
+      edit.media_time += (int64_t)floor((double)(from - position) * edit.media->media_time_scale / from_scale * edit.media_rate / 65536.0 + 0.5);
+    }
+    if (!atom_edit_list_push(list, edit)) return 0;
+  }
+  return 1;
+}
+
+/*  helper function, makes the list the edit list of the track.
+*/
+static void atom_track_set_edits(struct AtomTrack *track, struct AtomEditList *list)
+{
+  atom_edits_retain(track, list->edits, list->count);
+  atom_edits_release(track, track->edits, track->edit_count);
+  free(track->edits);
+  track->edits = list->edits;
+  track->edit_count = list->count;
+  track->duration = atom_edits_total(list->edits, list->count);
+  list->edits = NULL;
+  list->count = list->capacity = 0;
+}
+
+/*  helper function, sets the movie duration to that of its longest track.
+*/
+static void atom_movie_update_duration(struct AtomMovie *movie)
+{
+  uint32_t i;
+
+  movie->duration = 0;
+  for (i = 0; i < movie->track_count; i++) {
+    if (movie->tracks[i]->duration > movie->duration)
+      movie->duration = movie->tracks[i]->duration;
+  }
+}
+
+/*  helper function, adds a new track to the movie sharing the media of
+    the given track, but without any edits yet. Returns NULL if out of
+    memory.
+*/
+static struct AtomTrack *atom_movie_add_track(struct AtomMovie *movie, struct AtomTrack *source)
+{
+  struct AtomTrack *track, **tracks;
+  uint32_t i, id = 0;
+
+  tracks = (struct AtomTrack**)realloc(movie->tracks, (movie->track_count + movie->deleted_count + 1) * sizeof(struct AtomTrack*));
+  if (tracks == NULL) return NULL;
+  movie->tracks = tracks;
+  track = (struct AtomTrack*)calloc(1, sizeof(struct AtomTrack));
+  if (track == NULL) return NULL;
+  // deleted tracks stay after the live ones
+  memmove(tracks + movie->track_count + 1, tracks + movie->track_count, movie->deleted_count * sizeof(struct AtomTrack*));
+
+  for (i = 0; i < movie->track_count; i++) {
+    if (movie->tracks[i]->id > id) id = movie->tracks[i]->id;
+  }
+  source = ATOM_TRACK_MEDIA(source);
+  track->movie = movie;
+  track->media_source = source;
+  track->id = id + 1;
+  track->flags = source->flags;
+  track->volume = source->volume;
+  memcpy(track->matrix, source->matrix, sizeof(track->matrix));
+  track->width = source->width;
+  track->height = source->height;
+  track->handler_type = source->handler_type;
+  track->media_time_scale = source->media_time_scale;
+  track->media_duration = source->media_duration;
+  track->sample_description_count = source->sample_description_count;
+  track->sample_descriptions = source->sample_descriptions;
+  if (source->movie != movie)
+    atom_movie_retain(source->movie);
+
+  movie->tracks[movie->track_count++] = track;
+  return track;
+}
+
+/*
+  Parses every track of a probed movie so it can be edited. Returns 0 if
+  one can't be parsed.
+*/
+int atom_movie_load_tracks(struct AtomMovie *movie)
+{
+  uint32_t i;
+
+  for (i = 0; i < movie->track_count; i++) {
+    if (!atom_movie_track(movie, i)) return 0;
+  }
+  return 1;
+}
+
+/*
+  Starts the track offset into the movie, replacing the empty edits it
+  starts with. Returns 0 if out of memory.
+*/
+int atom_track_set_offset(struct AtomTrack *track, int64_t offset)
+{
+  struct AtomEditList list;
+  uint32_t i;
+  int ok;
+
+  memset(&list, 0, sizeof(list));
+  for (i = 0; i < track->edit_count && track->edits[i].media_time == -1; i++);
+  ok = atom_edit_list_push_empty(&list, offset);
+  for (; ok && i < track->edit_count; i++) {
+    ok = atom_edit_list_push(&list, track->edits[i]);
+  }
+  if (ok) atom_track_set_edits(track, &list);
+  free(list.edits);
+  atom_movie_update_duration(track->movie);
+  return ok;
+}
+
+/*
+  Removes the track from the movie. Edits of other movies may still play
+  its media, so the track is kept after the live tracks until the movie is
+  freed. Returns 0 if the tracks can't be parsed.
+*/
+int atom_movie_delete_track(struct AtomMovie *movie, struct AtomTrack *track)
+{
+  uint32_t i;
+
+  // tracks are parsed by index, which is about to change
+  if (!atom_movie_load_tracks(movie)) return 0;
+  for (i = 0; i < movie->track_count && movie->tracks[i] != track; i++);
+  if (i == movie->track_count) return 0;
+
+  memmove(movie->tracks + i, movie->tracks + i + 1, (movie->track_count - i - 1) * sizeof(struct AtomTrack*));
+  movie->track_count--;
+  movie->deleted_count++;
+  movie->tracks[movie->track_count] = track;
+  atom_movie_update_duration(movie);
+  return 1;
+}
+
+/*
+  Inserts all of src into the movie at time, moving everything after it
+  back by the duration of src. Like QuickTime, each track of src is
+  pasted into the first unused track of the movie with the same media
+  type and added as a new track otherwise. Returns 0 on failure.
+*/
+int atom_movie_insert(struct AtomMovie *movie, int64_t time, struct AtomMovie *src)
+{
+  struct AtomEditList list;
+  struct AtomTrack *track, *src_track;
+  int64_t src_duration, total;
+  uint32_t i, j, track_count;
+  char *used;
+  int ok = 1;
+
+  if (!atom_movie_load_tracks(movie) || !atom_movie_load_tracks(src)) return 0;
+  // inserting a movie into itself works from a copy
+  if (src == movie) {
+    if (!(src = atom_movie_copy(movie, 0, movie->duration))) return 0;
+    ok = atom_movie_insert(movie, time, src);
+    atom_movie_free(src);
+    return ok;
+  }
+
+  src_duration = atom_rescale(src->duration, movie->time_scale, src->time_scale);
+  track_count = movie->track_count;
+  used = (char*)calloc(track_count ? track_count : 1, 1);
+  if (used == NULL) return 0;
+  memset(&list, 0, sizeof(list));
+
+  for (i = 0; ok && i < src->track_count; i++) {
+    src_track = src->tracks[i];
+    for (j = 0; j < track_count; j++) {
+      if (!used[j] && movie->tracks[j]->handler_type == src_track->handler_type) break;
+    }
+    if (j < track_count) {
+      used[j] = 1;
+      track = movie->tracks[j];
+      total = atom_edits_total(track->edits, track->edit_count);
+      ok = atom_edit_list_push_range(&list, track->edits, track->edit_count, 0, time, movie->time_scale, movie->time_scale) &&
+           atom_edit_list_push_empty(&list, time - total);
+    } else {
+      ok = (track = atom_movie_add_track(movie, src_track)) && atom_edit_list_push_empty(&list, time);
+      total = 0;
+    }
+    ok = ok && atom_edit_list_push_range(&list, src_track->edits, src_track->edit_count, 0, src->duration, movie->time_scale, src->time_scale);
+    if (ok && total > time) {
+      // keep the track as long as the movie if the pasted one is shorter
+      ok = atom_edit_list_push_empty(&list, src_duration - atom_edits_total(list.edits, list.count) + time) &&
+           atom_edit_list_push_range(&list, track->edits, track->edit_count, time, total, movie->time_scale, movie->time_scale);
+    }
+    if (ok) atom_track_set_edits(track, &list);
+  }
+
+  // tracks not pasted into are moved back as well
+  for (j = 0; ok && j < track_count; j++) {
+    track = movie->tracks[j];
+    total = atom_edits_total(track->edits, track->edit_count);
+    if (used[j] || total <= time) continue;
+    ok = atom_edit_list_push_range(&list, track->edits, track->edit_count, 0, time, movie->time_scale, movie->time_scale) &&
+         atom_edit_list_push_empty(&list, src_duration) &&
+         atom_edit_list_push_range(&list, track->edits, track->edit_count, time, total, movie->time_scale, movie->time_scale);
+    if (ok) atom_track_set_edits(track, &list);
+  }
+
+  free(list.edits);
+  free(used);
+  atom_movie_update_duration(movie);
+  return ok;
+}
+
+/*
+  Adds the tracks of src to the movie as new tracks starting at time,
+  playing along with what's there. A duration other than 0 limits how
+  much of src is added. Returns 0 on failure.
+*/
+int atom_movie_add(struct AtomMovie *movie, int64_t time, int64_t duration, struct AtomMovie *src)
+{
+  struct AtomEditList list;
+  struct AtomTrack *track, *src_track;
+  int64_t end = src->duration;
+  uint32_t i, track_count;
+  int ok = 1;
+
+  if (!atom_movie_load_tracks(movie) || !atom_movie_load_tracks(src)) return 0;
+  if (duration > 0 && atom_rescale(duration, src->time_scale, movie->time_scale) < end)
+    end = atom_rescale(duration, src->time_scale, movie->time_scale);
+
+  memset(&list, 0, sizeof(list));
+  track_count = src->track_count;
+  for (i = 0; ok && i < track_count; i++) {
+    src_track = src->tracks[i];
+    ok = atom_edit_list_push_empty(&list, time) &&
+         atom_edit_list_push_range(&list, src_track->edits, src_track->edit_count, 0, end, movie->time_scale, src->time_scale) &&
+         (track = atom_movie_add_track(movie, src_track));
+    if (ok) atom_track_set_edits(track, &list);
+  }
+
+  free(list.edits);
+  atom_movie_update_duration(movie);
+  return ok;
+}
+
+/*
+  Removes duration from the movie starting at start, moving everything
+  after it forward. Returns 0 on failure.
+*/
+int atom_movie_delete(struct AtomMovie *movie, int64_t start, int64_t duration)
+{
+  struct AtomEditList list;
+  struct AtomTrack *track;
+  int64_t total;
+  uint32_t i;
+  int ok = 1;
+
+  if (!atom_movie_load_tracks(movie)) return 0;
+  if (duration <= 0) return 1;
+
+  memset(&list, 0, sizeof(list));
+  for (i = 0; ok && i < movie->track_count; i++) {
+    track = movie->tracks[i];
+    total = atom_edits_total(track->edits, track->edit_count);
+    if (total <= start) continue;
+    ok = atom_edit_list_push_range(&list, track->edits, track->edit_count, 0, start, movie->time_scale, movie->time_scale) &&
+         atom_edit_list_push_range(&list, track->edits, track->edit_count, start + duration, total, movie->time_scale, movie->time_scale);
+    if (ok) atom_track_set_edits(track, &list);
+  }
+
+  free(list.edits);
+  atom_movie_update_duration(movie);
+  return ok;
+}
+
+/*
+  Returns a new movie with duration of the movie starting at start. Its
+  tracks share the media of the movie, which is left as it is. Tracks
+  without any media in that section are left out. Returns NULL on failure.
+*/
+struct AtomMovie *atom_movie_copy(struct AtomMovie *movie, int64_t start, int64_t duration)
+{
+  struct AtomEditList list;
+  struct AtomMovie *copy;
+  struct AtomTrack *track;
+  uint32_t i, j;
+  int ok = 1;
+
+  if (!atom_movie_load_tracks(movie)) return NULL;
+  if (!(copy = atom_movie_empty())) return NULL;
+  copy->time_scale = movie->time_scale;
+  memcpy(copy->matrix, movie->matrix, sizeof(copy->matrix));
+
+  memset(&list, 0, sizeof(list));
+  for (i = 0; ok && i < movie->track_count; i++) {
+    track = movie->tracks[i];
+    ok = atom_edit_list_push_range(&list, track->edits, track->edit_count, start, start + duration, movie->time_scale, movie->time_scale);
+    for (j = 0; ok && j < list.count && list.edits[j].media_time == -1; j++);
+    if (!ok || j == list.count) {
+      list.count = 0;
+      continue;
+    }
+    if ((ok = (track = atom_movie_add_track(copy, track)) != NULL)) {
+      atom_track_set_edits(track, &list);
+      track->id = movie->tracks[i]->id;
+    }
+  }
+
+  free(list.edits);
+  if (!ok) {
+    atom_movie_free(copy);
+    return NULL;
+  }
+  atom_movie_update_duration(copy);
+  return copy;
+}
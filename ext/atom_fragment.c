@@ -0,0 +1,456 @@
+#include "rmov_ext.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  Reads fragmented movies. Their moov atom has an 'mvex' atom with the
+  defaults of the samples of each track ('trex') and usually no samples
+  of its own. The samples are described by the track runs ('trun') of the
+  track fragments ('traf') in the moof atoms which follow, each before
+  the mdat atom holding its media. They are appended to the sample index
+  of their track, so everything built on it works as for other movies,
+  and the media duration and the last edit of each track grow with them.
+
+  A recorder appends fragments while the file is read. Fragments are read
+  in file order and reading stops at the first one whose media isn't in
+  the file yet, atom_movie_refresh picks up from there. The 'tfra' atoms
+  of the 'mfra' atom ending a finished movie list the random access
+  samples of each track, which replace the sync flags of the fragments.
+*/
+
+#define ATOM_TFHD_BASE_DATA_OFFSET  0x000001
+#define ATOM_TFHD_DESCRIPTION       0x000002
+#define ATOM_TFHD_DURATION          0x000008
+#define ATOM_TFHD_SIZE              0x000010
+#define ATOM_TFHD_FLAGS             0x000020
+#define ATOM_TFHD_BASE_IS_MOOF      0x020000
+
+#define ATOM_TRUN_DATA_OFFSET       0x000001
+#define ATOM_TRUN_FIRST_FLAGS       0x000004
+#define ATOM_TRUN_DURATION          0x000100
+#define ATOM_TRUN_SIZE              0x000200
+#define ATOM_TRUN_FLAGS             0x000400
+#define ATOM_TRUN_CTS               0x000800
+
+#define ATOM_SAMPLE_NON_SYNC        0x010000
+
+static uint32_t atom_u32(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t atom_u64(const unsigned char *p)
+{
+  return ((uint64_t)atom_u32(p) << 32) | atom_u32(p + 4);
+}
+
+/*  helper function, returns the media track with the given id.
+*/
+static struct AtomTrack *atom_fragment_track(struct AtomMovie *movie, uint32_t id)
+{
+  struct AtomTrack *track;
+  uint32_t i;
+
+  for (i = 0; i < movie->track_count; i++) {
+    if ((track = atom_movie_track(movie, i)) && !track->media_source && track->id == id && track->sample_index)
+      return track;
+  }
+  return NULL;
+}
+
+/*  helper function, makes room for count more samples in the index. The
+    arrays double so appending fragments one by one stays linear.
+*/
+static int atom_index_reserve(struct AtomSampleIndex *index, uint32_t count)
+{
+  uint32_t capacity = index->capacity > index->count ? index->capacity : index->count;
+  void *p;
+
+  if (index->count + (uint64_t)count <= capacity) return 1;
+  if (index->count + (uint64_t)count > 0xFFFFFFFFULL / 2) return 0;
+  capacity = capacity * 2 > index->count + count ? capacity * 2 : index->count + count;
+  if (capacity < 256) capacity = 256;
+
+  if (!(p = realloc(index->offsets, capacity * sizeof(uint64_t)))) return 0;
+  index->offsets = (uint64_t*)p;
+  if (!(p = realloc(index->sizes, capacity * sizeof(uint32_t)))) return 0;
+  index->sizes = (uint32_t*)p;
+  if (!(p = realloc(index->dts, capacity * sizeof(int64_t)))) return 0;
+  index->dts = (int64_t*)p;
+  if (index->cts_offsets) {
+    if (!(p = realloc(index->cts_offsets, capacity * sizeof(int32_t)))) return 0;
+    index->cts_offsets = (int32_t*)p;
+  }
+  if (index->descriptions) {
+    if (!(p = realloc(index->descriptions, capacity * sizeof(uint32_t)))) return 0;
+    index->descriptions = (uint32_t*)p;
+  }
+  index->capacity = capacity;
+  return 1;
+}
+
+/*  helper function, adds a sync sample to the index. The first sample
+    which isn't one makes the list of every sample before it.
+*/
+static int atom_index_sync(struct AtomSampleIndex *index, uint32_t sample, int sync)
+{
+  uint32_t capacity = index->sync_capacity > index->sync_count ? index->sync_capacity : index->sync_count, i;
+  uint32_t *p;
+
+  if (!index->sync_samples && sync) return 1;
+  if (!index->sync_samples) {
+    capacity = sample > 256 ? sample * 2 : 256;
+    if (!(index->sync_samples = (uint32_t*)malloc(capacity * sizeof(uint32_t)))) return 0;
+    for (i = 0; i < sample; i++) index->sync_samples[i] = i;
+    index->sync_count = sample;
+    index->sync_capacity = capacity;
+    return 1;
+  }
+  if (!sync) return 1;
+  if (index->sync_count == capacity) {
+    capacity = capacity ? capacity * 2 : 256;
+    if (!(p = (uint32_t*)realloc(index->sync_samples, capacity * sizeof(uint32_t)))) return 0;
+    index->sync_samples = p;
+    index->sync_capacity = capacity;
+  }
+  index->sync_samples[index->sync_count++] = sample;
+  return 1;
+}
+
+/*  helper function, remembers where a track run starts for 'tfra'.
+*/
+static int atom_track_add_run(struct AtomTrack *track, uint64_t moof, uint32_t traf, uint32_t trun, uint32_t first)
+{
+  struct AtomFragmentRun *runs;
+  uint32_t capacity;
+
+  if (track->run_count == track->run_capacity) {
+    capacity = track->run_capacity ? track->run_capacity * 2 : 64;
+    if (!(runs = (struct AtomFragmentRun*)realloc(track->runs, capacity * sizeof(struct AtomFragmentRun)))) return 0;
+    track->runs = runs;
+    track->run_capacity = capacity;
+  }
+  runs = &track->runs[track->run_count++];
+  runs->moof = moof;
+  runs->traf = traf;
+  runs->trun = trun;
+  runs->first = first;
+  return 1;
+}
+
+/*  helper function, reads the track runs of a track fragment, starting
+    where the media of the one before it ended (data_end) unless it says
+    otherwise. Only checks the runs are whole and their media is in the
+    file unless append is set, then adds their samples to the track.
+    Returns 0 if the fragment can't be read (yet).
+*/
+static int atom_read_traf(struct AtomMovie *movie, struct Atom *moof, struct Atom *traf, uint32_t traf_number, uint64_t *data_end, int append)
+{
+  struct Atom *tfhd = atom_find(traf, FOURCC('t','f','h','d')), *tfdt = atom_find(traf, FOURCC('t','f','d','t')), *trun;
+  struct AtomTrack *track;
+  struct AtomSampleIndex *index;
+  const unsigned char *p, *q;
+  uint32_t flags, trun_flags, description, duration, size, sample_flags, first_flags = 0, count, entry_size, i, trun_number = 0;
+  uint64_t base, offset, length;
+  int64_t time;
+
+  if (!tfhd || ATOM_DATA_SIZE(tfhd) < 8 || !(p = atom_data(movie, tfhd))) return 0;
+  flags = atom_u32(p) & 0x00FFFFFF;
+  length = 8 + ((flags & ATOM_TFHD_BASE_DATA_OFFSET) ? 8 : 0) + ((flags & ATOM_TFHD_DESCRIPTION) ? 4 : 0) +
+           ((flags & ATOM_TFHD_DURATION) ? 4 : 0) + ((flags & ATOM_TFHD_SIZE) ? 4 : 0) + ((flags & ATOM_TFHD_FLAGS) ? 4 : 0);
+  if (ATOM_DATA_SIZE(tfhd) < length) return 0;
+  // fragments of unknown tracks are skipped
+  if (!(track = atom_fragment_track(movie, atom_u32(p + 4)))) return 1;
+  index = track->sample_index;
+
+  description = track->trex_description;
+  duration = track->trex_duration;
+  size = track->trex_size;
+  sample_flags = track->trex_flags;
+  q = p + 8;
+  if (flags & ATOM_TFHD_BASE_DATA_OFFSET) {
+    base = atom_u64(q);
+    q += 8;
+  } else {
+    base = ((flags & ATOM_TFHD_BASE_IS_MOOF) || traf_number == 1) ? moof->offset : *data_end;
+  }
+  if (flags & ATOM_TFHD_DESCRIPTION) { description = atom_u32(q); q += 4; }
+  if (flags & ATOM_TFHD_DURATION) { duration = atom_u32(q); q += 4; }
+  if (flags & ATOM_TFHD_SIZE) { size = atom_u32(q); q += 4; }
+  if (flags & ATOM_TFHD_FLAGS) sample_flags = atom_u32(q);
+  if (description == 0) description = 1;
+
+  time = index->end_time;
+  if (tfdt && ATOM_DATA_SIZE(tfdt) >= 8 && (p = atom_data(movie, tfdt))) {
+    // the decode time only moves forward, whatever a fragment says
+    if (p[0] == 1 && ATOM_DATA_SIZE(tfdt) >= 12) {
+      if ((int64_t)atom_u64(p + 4) > time) time = (int64_t)atom_u64(p + 4);
+    } else if (p[0] != 1 && (int64_t)atom_u32(p + 4) > time) {
+      time = atom_u32(p + 4);
+    }
+  }
+
+  offset = base;
+  for (trun = traf->children; trun; trun = trun->next) {
+    if (trun->type != FOURCC('t','r','u','n')) continue;
+    trun_number++;
+    if (ATOM_DATA_SIZE(trun) < 8 || !(p = atom_data(movie, trun))) return 0;
+    trun_flags = atom_u32(p) & 0x00FFFFFF;
+    count = atom_u32(p + 4);
+    entry_size = ((trun_flags & ATOM_TRUN_DURATION) ? 4 : 0) + ((trun_flags & ATOM_TRUN_SIZE) ? 4 : 0) +
+                 ((trun_flags & ATOM_TRUN_FLAGS) ? 4 : 0) + ((trun_flags & ATOM_TRUN_CTS) ? 4 : 0);
+    length = 8 + ((trun_flags & ATOM_TRUN_DATA_OFFSET) ? 4 : 0) + ((trun_flags & ATOM_TRUN_FIRST_FLAGS) ? 4 : 0);
+    if (length + (uint64_t)count * entry_size > ATOM_DATA_SIZE(trun)) return 0;
+    q = p + 8;
+    if (trun_flags & ATOM_TRUN_DATA_OFFSET) {
+      offset = base + (int64_t)(int32_t)atom_u32(q);
+      q += 4;
+    }
+    if (trun_flags & ATOM_TRUN_FIRST_FLAGS) {
+      first_flags = atom_u32(q);
+      q += 4;
+    }
+    if (append) {
+      if (!atom_index_reserve(index, count) || !atom_track_add_run(track, moof->offset, traf_number, trun_number, index->count)) return 0;
+      if ((trun_flags & ATOM_TRUN_CTS) && !index->cts_offsets) {
+        if (!(index->cts_offsets = (int32_t*)calloc(index->capacity, sizeof(int32_t)))) return 0;
+      }
+      if (description != 1 && !index->descriptions) {
+        if (!(index->descriptions = (uint32_t*)malloc(index->capacity * sizeof(uint32_t)))) return 0;
+        for (i = 0; i < index->count; i++) index->descriptions[i] = 1;
+      }
+    }
+
+    for (i = 0; i < count; i++) {
+      uint32_t sample_duration = duration, sample_size = size, flags_of_sample = sample_flags;
+      int32_t cts = 0;
+
+      if (trun_flags & ATOM_TRUN_DURATION) { sample_duration = atom_u32(q); q += 4; }
+      if (trun_flags & ATOM_TRUN_SIZE) { sample_size = atom_u32(q); q += 4; }
+      if (trun_flags & ATOM_TRUN_FLAGS) { flags_of_sample = atom_u32(q); q += 4; }
+      if (trun_flags & ATOM_TRUN_CTS) { cts = (int32_t)atom_u32(q); q += 4; }
+      if (i == 0 && (trun_flags & ATOM_TRUN_FIRST_FLAGS)) flags_of_sample = first_flags;
+
+      if (append) {
+        index->offsets[index->count] = offset;
+        index->sizes[index->count] = sample_size;
+        index->dts[index->count] = time;
+        if (index->cts_offsets) index->cts_offsets[index->count] = cts;
+        if (index->descriptions) index->descriptions[index->count] = description;
+        if (!atom_index_sync(index, index->count, !(flags_of_sample & ATOM_SAMPLE_NON_SYNC))) return 0;
+        index->count++;
+      }
+      offset += sample_size;
+      time += sample_duration;
+    }
+    // the media of the fragment hasn't been written yet
+    if (offset > movie->file_size) return 0;
+    if (append) index->end_time = time;
+  }
+  *data_end = offset;
+  return 1;
+}
+
+/*  helper function, adds the samples of a movie fragment to its tracks,
+    once all of its media is in the file. Returns 0 if it can't be read 
+    yet and -1 if memory ran out adding it.
+*/
+static int atom_read_moof(struct AtomMovie *movie, struct Atom *moof)
+{
+  struct Atom *traf;
+  uint64_t data_end;
+  uint32_t traf_number;
+  int append;
+
+  if (!atom_load_children(movie, moof)) return 0;
+  for (append = 0; append < 2; append++) {
+    data_end = moof->offset;
+    traf_number = 0;
+    for (traf = moof->children; traf; traf = traf->next) {
+      if (traf->type == FOURCC('t','r','a','f') && !atom_read_traf(movie, moof, traf, ++traf_number, &data_end, append))
+        return append ? -1 : 0;
+    }
+  }
+  return 1;
+}
+
+/*  helper function, orders sample numbers for qsort.
+*/
+static int atom_compare_samples(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+/*  helper function, returns the number of bytes bytes at p.
+*/
+static uint32_t atom_read_number(const unsigned char *p, uint32_t bytes)
+{
+  uint32_t value = 0;
+
+  while (bytes-- > 0) value = (value << 8) | *p++;
+  return value;
+}
+
+/*  helper function, makes the samples listed by a 'tfra' atom the sync
+    samples of its track. Entries of fragments not read are ignored.
+*/
+static void atom_read_tfra(struct AtomMovie *movie, struct Atom *tfra)
+{
+  const unsigned char *p;
+  struct AtomTrack *track;
+  struct AtomSampleIndex *index;
+  struct AtomFragmentRun *run;
+  uint32_t count, lengths, traf_size, trun_size, sample_size, entry_size, i, j, low, high, middle, *samples, n = 0;
+  uint32_t traf, trun, sample;
+  uint64_t moof;
+  int wide;
+
+  if (ATOM_DATA_SIZE(tfra) < 16 || !(p = atom_data(movie, tfra))) return;
+  if (!(track = atom_fragment_track(movie, atom_u32(p + 4))) || track->run_count == 0) return;
+  index = track->sample_index;
+  wide = p[0] == 1;
+  lengths = atom_u32(p + 8);
+  traf_size = ((lengths >> 4) & 3) + 1;
+  trun_size = ((lengths >> 2) & 3) + 1;
+  sample_size = (lengths & 3) + 1;
+  count = atom_u32(p + 12);
+  entry_size = (wide ? 16 : 8) + traf_size + trun_size + sample_size;
+  if ((uint64_t)count * entry_size > ATOM_DATA_SIZE(tfra) - 16) return;
+  if (!(samples = (uint32_t*)malloc((count ? count : 1) * sizeof(uint32_t)))) return;
+
+  for (i = 0, p += 16; i < count; i++, p += entry_size) {
+    moof = wide ? atom_u64(p + 8) : atom_u32(p + 4);
+    traf = atom_read_number(p + (wide ? 16 : 8), traf_size);
+    trun = atom_read_number(p + (wide ? 16 : 8) + traf_size, trun_size);
+    sample = atom_read_number(p + (wide ? 16 : 8) + traf_size + trun_size, sample_size);
+    // the runs are in file order, find the first of the moof atom
+    for (low = 0, high = track->run_count; low < high; ) {
+      middle = low + (high - low) / 2;
+      if (track->runs[middle].moof < moof) low = middle + 1; else high = middle;
+    }
+    for (j = low; j < track->run_count && track->runs[j].moof == moof; j++) {
+      run = &track->runs[j];
+      if (run->traf == traf && run->trun == trun && sample >= 1 && run->first + sample - 1 < index->count) {
+        samples[n++] = run->first + sample - 1;
+        break;
+      }
+    }
+  }
+  if (n == 0) {
+    free(samples);
+    return;
+  }
+  qsort(samples, n, sizeof(uint32_t), atom_compare_samples);
+  for (i = 1, j = 1; i < n; i++) {
+    if (samples[i] != samples[j - 1]) samples[j++] = samples[i];
+  }
+  free(index->sync_samples);
+  index->sync_samples = samples;
+  index->sync_count = j;
+  index->sync_capacity = n;
+}
+
+/*  helper function, grows the durations of the tracks and the movie with
+    the samples of the fragments.
+*/
+static void atom_fragment_durations(struct AtomMovie *movie)
+{
+  struct AtomTrack *track;
+  struct AtomEdit *edit;
+  uint64_t duration;
+  uint32_t i, j;
+
+  for (i = 0; i < movie->track_count; i++) {
+    if (!(track = movie->tracks[i]) || track->media_source || !track->sample_index) continue;
+    if (track->sample_index->end_time > 0 && (uint64_t)track->sample_index->end_time > track->media_duration)
+      track->media_duration = track->sample_index->end_time;
+    if (track->open_edit && track->media_time_scale) {
+      edit = &track->edits[track->open_edit - 1];
+      duration = track->media_duration > (uint64_t)edit->media_time ? track->media_duration - edit->media_time : 0;
+      edit->segment_duration = (int64_t)((double)duration * movie->time_scale / track->media_time_scale * 65536.0 / edit->media_rate + 0.5);
+    }
+    for (j = 0, duration = 0; j < track->edit_count; j++) {
+      duration += track->edits[j].segment_duration;
+    }
+    if (duration > track->duration) track->duration = duration;
+    if (track->duration > movie->duration) movie->duration = track->duration;
+  }
+}
+
+/*
+  Reads the defaults of the tracks of a fragmented movie and then its
+  fragments. The last edit of a track plays its whole media when it's the
+  one made up for a track without edits or it has no duration, as
+  fragmented movies write it, and grows with the fragments. Does nothing
+  for a movie without an 'mvex' atom. Returns 0 if out of memory.
+*/
+int atom_movie_init_fragments(struct AtomMovie *movie)
+{
+  struct Atom *mvex = atom_find(movie->moov, FOURCC('m','v','e','x')), *atom;
+  struct AtomTrack *track;
+  const unsigned char *p;
+  uint32_t i, count;
+
+  if (!mvex) return 1;
+  movie->fragmented = 1;
+  for (i = 0; i < movie->track_count; i++) {
+    if (!(track = atom_movie_track(movie, i))) continue;
+    track->trex_description = 1;
+    // the samples of the moov atom come before those of the fragments
+    if (!atom_track_sample_index(track)) continue;
+    if (!atom_find(atom_find(track->trak, FOURCC('e','d','t','s')), FOURCC('e','l','s','t')))
+      track->open_edit = track->edit_count;
+    else if (track->edit_count && track->edits[track->edit_count - 1].segment_duration == 0 && track->edits[track->edit_count - 1].media_time >= 0)
+      track->open_edit = track->edit_count;
+    if (track->open_edit && track->edits[track->open_edit - 1].media_rate <= 0) track->open_edit = 0;
+  }
+  for (atom = mvex->children; atom; atom = atom->next) {
+    if (!(p = atom_data(movie, atom))) continue;
+    if (atom->type == FOURCC('t','r','e','x') && ATOM_DATA_SIZE(atom) >= 24 && (track = atom_fragment_track(movie, atom_u32(p + 4)))) {
+      track->trex_description = atom_u32(p + 8) ? atom_u32(p + 8) : 1;
+      track->trex_duration = atom_u32(p + 12);
+      track->trex_size = atom_u32(p + 16);
+      track->trex_flags = atom_u32(p + 20);
+    } else if (atom->type == FOURCC('m','e','h','d') && ATOM_DATA_SIZE(atom) >= 8) {
+      // the duration of a finished movie
+      if (p[0] == 1 && ATOM_DATA_SIZE(atom) >= 12 && atom_u64(p + 4) > movie->duration)
+        movie->duration = atom_u64(p + 4);
+      else if (p[0] != 1 && atom_u32(p + 4) > movie->duration)
+        movie->duration = atom_u32(p + 4);
+    }
+  }
+  return atom_movie_read_fragments(movie, &count);
+}
+
+/*
+  Reads the fragments of the movie after the last one read, up to the
+  first one whose media isn't all in the file yet, and an 'mfra' atom.
+  Sets count to the number of fragments read. Returns 0 if out of memory
+  reading one, those before it are kept.
+*/
+int atom_movie_read_fragments(struct AtomMovie *movie, uint32_t *count)
+{
+  struct Atom *atom, *child;
+  int ok = 1, read;
+
+  *count = 0;
+  if (!movie->fragmented) return 1;
+  for (atom = movie->fragment_atom ? movie->fragment_atom->next : movie->atoms; ok && atom; atom = atom->next) {
+    if (atom->type == FOURCC('m','o','o','f')) {
+      // a fragment partly added isn't read again
+      if ((read = atom_read_moof(movie, atom)) == 0) break;
+      ok = read > 0;
+      (*count)++;
+    } else if (atom->type == FOURCC('m','f','r','a') && atom_load_children(movie, atom)) {
+      for (child = atom->children; child; child = child->next) {
+        if (child->type == FOURCC('t','f','r','a')) atom_read_tfra(movie, child);
+      }
+    }
+    movie->fragment_atom = atom;
+  }
+  movie->fragment_count += *count;
+  atom_fragment_durations(movie);
+  return ok;
+}
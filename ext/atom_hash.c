@@ -0,0 +1,563 @@
+#include "rmov_ext.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#define ATOM_CRC32C_SSE42 1
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/*
+  Content fingerprints of the sample data of tracks. Only the bytes of the
+  samples are hashed, in decode order, so the layout of the file (chunking,
+  interleaving, where the moov atom is) does not change a fingerprint.
+
+  The samples of each track are split into shards of about
+  ATOM_FINGERPRINT_SHARD_SIZE bytes which are hashed on a pool of threads.
+  Shards only end between samples, and where they end depends only on the
+  sample sizes, so the same track always gives the same shards.
+
+  The crc32c fingerprint is the plain CRC-32C of all the sample data, the
+  shard checksums are combined as if computed in a single pass. The xxh64
+  fingerprint is the XXH64 (seed 0) of the big endian XXH64 digests of the
+  shards in order.
+*/
+
+/*** CRC-32C ***/
+
+#define ATOM_CRC32C_POLY 0x82f63b78
+
+static uint32_t atom_crc32c_table[8][256];
+static uint32_t atom_crc32c_x2n[32];
+static int atom_crc32c_hardware;
+static pthread_once_t atom_crc32c_once = PTHREAD_ONCE_INIT;
+
+/*  helper function, multiplies a and b modulo the CRC-32C polynomial.
+*/
+static uint32_t atom_crc32c_multiply(uint32_t a, uint32_t b)
+{
+  uint32_t m = (uint32_t)1 << 31, p = 0;
+
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ ATOM_CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+static void atom_crc32c_init(void)
+{
+  uint32_t i, j, crc;
+
+  for (i = 0; i < 256; i++) {
+    crc = i;
+    for (j = 0; j < 8; j++) crc = crc & 1 ? (crc >> 1) ^ ATOM_CRC32C_POLY : crc >> 1;
+    atom_crc32c_table[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++) {
+    for (j = 1; j < 8; j++) {
+      crc = atom_crc32c_table[j-1][i];
+      atom_crc32c_table[j][i] = (crc >> 8) ^ atom_crc32c_table[0][crc & 0xff];
+    }
+  }
+  // x^(2^n) modulo the polynomial, for combining checksums
+  atom_crc32c_x2n[0] = (uint32_t)1 << 30;
+  for (i = 1; i < 32; i++) {
+    atom_crc32c_x2n[i] = atom_crc32c_multiply(atom_crc32c_x2n[i-1], atom_crc32c_x2n[i-1]);
+  }
+#ifdef ATOM_CRC32C_SSE42
+  {
+    unsigned int eax, ebx, ecx, edx;
+    atom_crc32c_hardware = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+  }
+#elif defined(__ARM_FEATURE_CRC32)
+  atom_crc32c_hardware = 1;
+#endif
+}
+
+/*  helper function, slicing by 8 bytes at a time. Works on the inverted
+    checksum.
+*/
+static uint32_t atom_crc32c_software(uint32_t crc, const unsigned char *p, size_t length)
+{
+  uint32_t low, high;
+
+  while (length && ((uintptr_t)p & 7)) {
+    crc = (crc >> 8) ^ atom_crc32c_table[0][(crc ^ *p++) & 0xff];
+    length--;
+  }
+  while (length >= 8) {
+    low = crc ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+    high = (uint32_t)p[4] | ((uint32_t)p[5] << 8) | ((uint32_t)p[6] << 16) | ((uint32_t)p[7] << 24);
+    crc = atom_crc32c_table[7][low & 0xff] ^ atom_crc32c_table[6][(low >> 8) & 0xff] ^
+          atom_crc32c_table[5][(low >> 16) & 0xff] ^ atom_crc32c_table[4][low >> 24] ^
+          atom_crc32c_table[3][high & 0xff] ^ atom_crc32c_table[2][(high >> 8) & 0xff] ^
+          atom_crc32c_table[1][(high >> 16) & 0xff] ^ atom_crc32c_table[0][high >> 24];
+    p += 8;
+    length -= 8;
+  }
+  while (length--) {
+    crc = (crc >> 8) ^ atom_crc32c_table[0][(crc ^ *p++) & 0xff];
+  }
+  return crc;
+}
+
+#ifdef ATOM_CRC32C_SSE42
+/*  helper function, uses the crc32 instruction of SSE 4.2.
+*/
+__attribute__((target("sse4.2")))
+static uint32_t atom_crc32c_hardware_update(uint32_t crc, const unsigned char *p, size_t length)
+{
+  uint64_t crc64, word;
+
+  while (length && ((uintptr_t)p & 7)) {
+    crc = _mm_crc32_u8(crc, *p++);
+    length--;
+  }
+  crc64 = crc;
+  while (length >= 8) {
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    p += 8;
+    length -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while (length--) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+/*  helper function, uses the crc32c instructions of ARMv8.
+*/
+static uint32_t atom_crc32c_hardware_update(uint32_t crc, const unsigned char *p, size_t length)
+{
+  uint64_t word;
+
+  while (length && ((uintptr_t)p & 7)) {
+    crc = __crc32cb(crc, *p++);
+    length--;
+  }
+  while (length >= 8) {
+    memcpy(&word, p, 8);
+    crc = __crc32cd(crc, word);
+    p += 8;
+    length -= 8;
+  }
+  while (length--) {
+    crc = __crc32cb(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+/*
+  Continues the CRC-32C checksum crc (0 to start) over length bytes.
+*/
+uint32_t atom_crc32c(uint32_t crc, const unsigned char *p, size_t length)
+{
+  pthread_once(&atom_crc32c_once, atom_crc32c_init);
+  crc = ~crc;
+#if defined(ATOM_CRC32C_SSE42) || defined(__ARM_FEATURE_CRC32)
+  if (atom_crc32c_hardware) return ~atom_crc32c_hardware_update(crc, p, length);
+#endif
+  return ~atom_crc32c_software(crc, p, length);
+}
+
+/*
+  Returns the checksum of two runs of bytes from the checksum of each and
+  the length of the second.
+*/
+static uint32_t atom_crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t length2)
+{
+  uint32_t p = (uint32_t)1 << 31, k = 3;
+
+  pthread_once(&atom_crc32c_once, atom_crc32c_init);
+  // multiply crc1 by x^(8 * length2)
+  while (length2) {
+    if (length2 & 1) p = atom_crc32c_multiply(atom_crc32c_x2n[k & 31], p);
+    length2 >>= 1;
+    k++;
+  }
+  return atom_crc32c_multiply(p, crc1) ^ crc2;
+}
+
+
+/*** XXH64 ***/
+
+#define XXH_PRIME64_1 0x9e3779b185ebca87ULL
+#define XXH_PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME64_3 0x165667b19e3779f9ULL
+#define XXH_PRIME64_4 0x85ebca77c2b2ae63ULL
+#define XXH_PRIME64_5 0x27d4eb2f165667c5ULL
+
+struct AtomXXH64 {
+  uint64_t v[4];
+  uint64_t total;
+  unsigned char buffer[32];
+  uint32_t buffered;
+};
+
+static uint64_t xxh_rotl(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh_read64(const unsigned char *p)
+{
+  return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+         ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint32_t xxh_read32(const unsigned char *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+  acc += input * XXH_PRIME64_2;
+  acc = xxh_rotl(acc, 31);
+  return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh_merge_round(uint64_t acc, uint64_t v)
+{
+  acc ^= xxh_round(0, v);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void atom_xxh64_init(struct AtomXXH64 *state)
+{
+  memset(state, 0, sizeof(struct AtomXXH64));
+  state->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+  state->v[1] = XXH_PRIME64_2;
+  state->v[2] = 0;
+  state->v[3] = 0 - XXH_PRIME64_1;
+}
+
+/*  helper function, consumes 32 byte stripes and returns where it stopped.
+*/
+static const unsigned char *atom_xxh64_stripes(struct AtomXXH64 *state, const unsigned char *p, const unsigned char *end)
+{
+  uint64_t v0 = state->v[0], v1 = state->v[1], v2 = state->v[2], v3 = state->v[3];
+
+  while (p + 32 <= end) {
+    v0 = xxh_round(v0, xxh_read64(p));
+    v1 = xxh_round(v1, xxh_read64(p + 8));
+    v2 = xxh_round(v2, xxh_read64(p + 16));
+    v3 = xxh_round(v3, xxh_read64(p + 24));
+    p += 32;
+  }
+  state->v[0] = v0;
+  state->v[1] = v1;
+  state->v[2] = v2;
+  state->v[3] = v3;
+  return p;
+}
+
+static void atom_xxh64_update(struct AtomXXH64 *state, const unsigned char *p, size_t length)
+{
+  const unsigned char *end;
+  uint32_t fill;
+
+  // empty shards pass no data at all
+  if (length == 0) return;
+  end = p + length;
+  state->total += length;
+  if (state->buffered + length < 32) {
+    memcpy(state->buffer + state->buffered, p, length);
+    state->buffered += (uint32_t)length;
+    return;
+  }
+  if (state->buffered) {
+    fill = 32 - state->buffered;
+    memcpy(state->buffer + state->buffered, p, fill);
+    atom_xxh64_stripes(state, state->buffer, state->buffer + 32);
+    p += fill;
+    state->buffered = 0;
+  }
+  p = atom_xxh64_stripes(state, p, end);
+  if (p < end) {
+    memcpy(state->buffer, p, end - p);
+    state->buffered = (uint32_t)(end - p);
+  }
+}
+
+static uint64_t atom_xxh64_digest(struct AtomXXH64 *state)
+{
+  const unsigned char *p = state->buffer, *end = state->buffer + state->buffered;
+  uint64_t h;
+
+  if (state->total >= 32) {
+    h = xxh_rotl(state->v[0], 1) + xxh_rotl(state->v[1], 7) + xxh_rotl(state->v[2], 12) + xxh_rotl(state->v[3], 18);
+    h = xxh_merge_round(h, state->v[0]);
+    h = xxh_merge_round(h, state->v[1]);
+    h = xxh_merge_round(h, state->v[2]);
+    h = xxh_merge_round(h, state->v[3]);
+  } else {
+    h = state->v[2] + XXH_PRIME64_5;
+  }
+  h += state->total;
+
+  while (p + 8 <= end) {
+    h ^= xxh_round(0, xxh_read64(p));
+    h = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+    h = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= (*p++) * XXH_PRIME64_5;
+    h = xxh_rotl(h, 11) * XXH_PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+
+/*** FINGERPRINTS ***/
+
+/*
+  Returns a new batch fingerprinting each of the tracks, or NULL with an
+  error message if the sample tables of one can't be read. The movies
+  holding the media are retained until the batch is freed, so the batch
+  can run while the Ruby objects go away.
+*/
+struct AtomFingerprintBatch *atom_fingerprint_batch_new(struct AtomTrack **tracks, uint32_t count, int algorithm, char *error, size_t error_size)
+{
+  struct AtomFingerprintBatch *batch;
+  struct AtomFingerprintShard *shard = NULL;
+  struct AtomSampleIndex *index;
+  uint32_t i, s, capacity = 16;
+
+  batch = (struct AtomFingerprintBatch*)calloc(1, sizeof(struct AtomFingerprintBatch));
+  if (batch == NULL) return NULL;
+  batch->algorithm = algorithm;
+  batch->indexes = (struct AtomSampleIndex**)calloc(count ? count : 1, sizeof(struct AtomSampleIndex*));
+  batch->movies = (struct AtomMovie**)calloc(count ? count : 1, sizeof(struct AtomMovie*));
+  batch->digests = (uint64_t*)calloc(count ? count : 1, sizeof(uint64_t));
+  batch->shards = (struct AtomFingerprintShard*)malloc(capacity * sizeof(struct AtomFingerprintShard));
+  pthread_mutex_init(&batch->lock, NULL);
+  if (!batch->indexes || !batch->movies || !batch->digests || !batch->shards) {
+    atom_fingerprint_batch_free(batch);
+    snprintf(error, error_size, "Unable to allocate fingerprint batch");
+    return NULL;
+  }
+
+  for (i = 0; i < count; i++) {
+    // the index is built here so the workers only ever read it
+    if (!(index = atom_track_sample_index(tracks[i]))) {
+      atom_fingerprint_batch_free(batch);
+      snprintf(error, error_size, "Unable to read sample tables of track %d", tracks[i]->id);
+      return NULL;
+    }
+    batch->indexes[i] = index;
+    batch->movies[i] = ATOM_TRACK_MEDIA(tracks[i])->movie;
+    atom_movie_retain(batch->movies[i]);
+    batch->count++;
+
+    for (s = 0; s < index->count; s++) {
+      if (s == 0 || shard->bytes >= ATOM_FINGERPRINT_SHARD_SIZE) {
+        if (batch->shard_count == capacity) {
+          capacity *= 2;
+          shard = (struct AtomFingerprintShard*)realloc(batch->shards, capacity * sizeof(struct AtomFingerprintShard));
+          if (shard == NULL) {
+            atom_fingerprint_batch_free(batch);
+            snprintf(error, error_size, "Unable to allocate fingerprint batch");
+            return NULL;
+          }
+          batch->shards = shard;
+        }
+        shard = &batch->shards[batch->shard_count++];
+        memset(shard, 0, sizeof(struct AtomFingerprintShard));
+        shard->track = i;
+        shard->first = s;
+      }
+      shard->count++;
+      shard->bytes += index->sizes[s];
+    }
+  }
+  return batch;
+}
+
+/*
+  Releases the movies held by the batch and frees it.
+*/
+void atom_fingerprint_batch_free(struct AtomFingerprintBatch *batch)
+{
+  uint32_t i;
+
+  for (i = 0; i < batch->count; i++) {
+    atom_movie_free(batch->movies[i]);
+  }
+  free(batch->indexes);
+  free(batch->movies);
+  free(batch->digests);
+  free(batch->shards);
+  pthread_mutex_destroy(&batch->lock);
+  free(batch);
+}
+
+/*  helper function, marks the batch failed with the first error message.
+*/
+static void atom_fingerprint_fail(struct AtomFingerprintBatch *batch, const char *message, uint32_t sample, uint32_t track)
+{
+  pthread_mutex_lock(&batch->lock);
+  if (!batch->failed) {
+    batch->failed = 1;
+    snprintf(batch->error, sizeof(batch->error), message, sample, track);
+  }
+  pthread_mutex_unlock(&batch->lock);
+}
+
+/*  helper function, hashes the samples of a shard. Mapped movies are hashed
+    in place, probed ones are read into the buffer.
+*/
+static int atom_fingerprint_shard(struct AtomFingerprintBatch *batch, struct AtomFingerprintShard *shard, unsigned char **buffer, size_t *buffer_size)
+{
+  struct AtomSampleIndex *index = batch->indexes[shard->track];
+  struct AtomMovie *movie = batch->movies[shard->track];
+  const unsigned char *bytes;
+  unsigned char *grown;
+  struct AtomXXH64 state;
+  uint32_t i, crc = 0, size;
+  uint64_t offset;
+
+  atom_movie_advise_sequential(movie, index->offsets[shard->first],
+    index->offsets[shard->first + shard->count - 1] + index->sizes[shard->first + shard->count - 1]);
+  atom_xxh64_init(&state);
+  for (i = shard->first; i < shard->first + shard->count; i++) {
+    offset = index->offsets[i];
+    size = index->sizes[i];
+    if (movie->map) {
+      if (!(bytes = atom_movie_bytes(movie, offset, size))) {
+        atom_fingerprint_fail(batch, "Sample %u of track %u is outside of the movie file", i + 1, shard->track + 1);
+        return 0;
+      }
+    } else {
+      if (size > *buffer_size) {
+        if (!(grown = (unsigned char*)realloc(*buffer, size))) {
+          atom_fingerprint_fail(batch, "Unable to allocate sample %u of track %u", i + 1, shard->track + 1);
+          return 0;
+        }
+        *buffer = grown;
+        *buffer_size = size;
+      }
+      if (pread(movie->fd, *buffer, size, (off_t)offset) != (ssize_t)size) {
+        atom_fingerprint_fail(batch, "Unable to read sample %u of track %u", i + 1, shard->track + 1);
+        return 0;
+      }
+      bytes = *buffer;
+    }
+    if (batch->algorithm == ATOM_FINGERPRINT_CRC32C) {
+      crc = atom_crc32c(crc, bytes, size);
+    } else {
+      atom_xxh64_update(&state, bytes, size);
+    }
+  }
+  shard->digest = batch->algorithm == ATOM_FINGERPRINT_CRC32C ? crc : atom_xxh64_digest(&state);
+  return 1;
+}
+
+/*  helper function, worker thread of atom_fingerprint_many. Takes the next
+    unclaimed shard until none are left or the batch is stopped.
+*/
+static void *atom_fingerprint_worker(void *arg)
+{
+  struct AtomFingerprintBatch *batch = (struct AtomFingerprintBatch*)arg;
+  struct AtomFingerprintShard *shard;
+  unsigned char *buffer = NULL;
+  size_t buffer_size = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&batch->lock);
+    shard = (batch->next < batch->shard_count && !batch->cancelled && !batch->failed) ? &batch->shards[batch->next++] : NULL;
+    pthread_mutex_unlock(&batch->lock);
+    if (shard == NULL) break;
+    if (!atom_fingerprint_shard(batch, shard, &buffer, &buffer_size)) break;
+  }
+  free(buffer);
+  return NULL;
+}
+
+/*
+  Hashes every shard of the batch using up to thread_count threads and
+  combines them in order into the digest of each track. Returns 0 if the
+  batch failed (see its error) or was cancelled.
+*/
+int atom_fingerprint_many(struct AtomFingerprintBatch *batch, uint32_t thread_count)
+{
+  struct AtomXXH64 state;
+  unsigned char digest[8];
+  pthread_t *threads;
+  uint32_t i, j, started = 0;
+
+  if (thread_count > batch->shard_count) thread_count = batch->shard_count;
+  if (thread_count < 1) thread_count = 1;
+
+  threads = (pthread_t*)malloc(thread_count * sizeof(pthread_t));
+  for (i = 0; threads && i < thread_count; i++) {
+    if (pthread_create(&threads[i], NULL, atom_fingerprint_worker, batch) != 0) break;
+    started++;
+  }
+  // fall back to hashing in this thread if none could be started
+  if (started == 0) atom_fingerprint_worker(batch);
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  if (batch->failed || batch->cancelled) return 0;
+
+  for (i = 0, j = 0; i < batch->count; i++) {
+    if (batch->algorithm == ATOM_FINGERPRINT_CRC32C) {
+      for (; j < batch->shard_count && batch->shards[j].track == i; j++) {
+        batch->digests[i] = atom_crc32c_combine((uint32_t)batch->digests[i], (uint32_t)batch->shards[j].digest, batch->shards[j].bytes);
+      }
+    } else {
+      atom_xxh64_init(&state);
+      for (; j < batch->shard_count && batch->shards[j].track == i; j++) {
+        digest[0] = (unsigned char)(batch->shards[j].digest >> 56);
+        digest[1] = (unsigned char)(batch->shards[j].digest >> 48);
+        digest[2] = (unsigned char)(batch->shards[j].digest >> 40);
+        digest[3] = (unsigned char)(batch->shards[j].digest >> 32);
+        digest[4] = (unsigned char)(batch->shards[j].digest >> 24);
+        digest[5] = (unsigned char)(batch->shards[j].digest >> 16);
+        digest[6] = (unsigned char)(batch->shards[j].digest >> 8);
+        digest[7] = (unsigned char)batch->shards[j].digest;
+        atom_xxh64_update(&state, digest, 8);
+      }
+      batch->digests[i] = atom_xxh64_digest(&state);
+    }
+  }
+  return 1;
+}
+
+/*
+  Stops the batch from starting any more shards. Shards already being
+  hashed are finished.
+*/
+void atom_fingerprint_cancel(void *arg)
+{
+  struct AtomFingerprintBatch *batch = (struct AtomFingerprintBatch*)arg;
+  pthread_mutex_lock(&batch->lock);
+  batch->cancelled = 1;
+  pthread_mutex_unlock(&batch->lock);
+}
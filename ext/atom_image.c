@@ -0,0 +1,532 @@
+#include "rmov_ext.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+/*
+  Extracts video frames which are already still images, Photo-JPEG,
+  Motion-JPEG and PNG samples, without decoding them. The sample shown at
+  each time is located through the edit list and sample tables, all the
+  samples are then read in a single pass ordered by file offset, and each
+  is turned into a standalone image file:
+
+  - JPEG and PNG samples are copied as they are.
+  - Motion-JPEG A samples keep only their first field, the size of which
+    is given by the 'mjpg' APP1 segment.
+  - Motion-JPEG B samples have no markers, these are put back from the
+    offsets of its header and the scan data is byte stuffed again.
+  - Uncompressed RGB and 2vuy samples are converted to RGB rows and
+    compressed into a PNG file, when built with zlib.
+
+  Motion-JPEG often leaves out the Huffman tables and relies on the ones
+  suggested by the JPEG standard, these are inserted where missing.
+*/
+
+/*  the standard Huffman tables of ITU T.81 Annex K.3 as a DHT segment,
+    luminance and chrominance DC then AC.
+*/
+static const unsigned char atom_image_standard_dht[] = {
+  0xFF, 0xC4, 0x01, 0xA2,
+  0x00, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+  0x01, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+  0x10, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d,
+  0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+  0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+  0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+  0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+  0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+  0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+  0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+  0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+  0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+  0xf9, 0xfa,
+  0x11, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+  0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+  0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+  0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+  0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+  0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+  0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+  0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+  0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+  0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+  0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+  0xf9, 0xfa
+};
+
+static const unsigned char atom_image_png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+static uint32_t atom_image_u16(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 8) | p[1];
+}
+
+static uint32_t atom_image_u32(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/*
+  Returns the image format samples of the codec can be written as without
+  decoding them, ATOM_IMAGE_NONE if they can't.
+*/
+int atom_image_format(uint32_t codec)
+{
+  switch (codec) {
+    case FOURCC('j','p','e','g'):
+    case FOURCC('m','j','p','a'):
+    case FOURCC('m','j','p','b'):
+    case FOURCC('d','m','b','1'):
+      return ATOM_IMAGE_JPEG;
+    case FOURCC('p','n','g',' '):
+      return ATOM_IMAGE_PNG;
+  }
+  return ATOM_IMAGE_NONE;
+}
+
+/*  helper function, copies a JPEG sample up to the end of its first field,
+    inserting the standard Huffman tables when it has none.
+*/
+static unsigned char *atom_image_jpeg(const unsigned char *p, size_t size, size_t *length)
+{
+  size_t position = 2, end = size, segment;
+  unsigned char *image;
+  int tables = 0, marker = 0;
+
+  if (size < 4 || p[0] != 0xFF || p[1] != 0xD8) return NULL;
+
+  // walk the marker segments up to the start of scan
+  while (position + 4 <= size) {
+    if (p[position] != 0xFF) return NULL;
+    marker = p[position + 1];
+    if (marker == 0xFF) {
+      position++;  // fill byte
+      continue;
+    }
+    segment = atom_image_u16(p + position + 2);
+    if (segment < 2 || position + 2 + segment > size) return NULL;
+    if (marker == 0xC4) tables = 1;
+    if (marker == 0xE1 && segment >= 14 && memcmp(p + position + 8, "mjpg", 4) == 0) {
+      // Motion-JPEG A, each field is a whole JPEG and the first one is kept
+      if (atom_image_u32(p + position + 12) > position && atom_image_u32(p + position + 12) <= size)
+        end = atom_image_u32(p + position + 12);
+    }
+    if (marker == 0xDA) break;
+    position += 2 + segment;
+  }
+  if (marker != 0xDA || end <= position) return NULL;
+
+  image = (unsigned char*)malloc(end + (tables ? 0 : sizeof(atom_image_standard_dht)));
+  if (image == NULL) return NULL;
+  *length = 0;
+  memcpy(image, p, 2);
+  *length += 2;
+  if (!tables) {
+    memcpy(image + *length, atom_image_standard_dht, sizeof(atom_image_standard_dht));
+    *length += sizeof(atom_image_standard_dht);
+  }
+  memcpy(image + *length, p + 2, end - 2);
+  *length += end - 2;
+  return image;
+}
+
+/*  helper function, returns the length of the marker segment found at 
+    offset of a Motion-JPEG B field, which has a length but no marker. 
+    Returns 0 if it lies outside of the field.
+*/
+static size_t atom_image_segment_size(const unsigned char *p, size_t field, uint32_t offset)
+{
+  uint32_t segment;
+
+  if ((size_t)offset + 2 > field) return 0;
+  segment = atom_image_u16(p + offset);
+  if (segment < 2 || (size_t)offset + segment > field) return 0;
+  return segment;
+}
+
+/*  helper function, appends the marker and the segment at offset.
+*/
+static void atom_image_segment(unsigned char *image, size_t *length, int marker, const unsigned char *p, uint32_t offset, size_t segment)
+{
+  image[(*length)++] = 0xFF;
+  image[(*length)++] = (unsigned char)marker;
+  memcpy(image + *length, p + offset, segment);
+  *length += segment;
+}
+
+/*  helper function, rebuilds the JPEG of the first field of a Motion-JPEG
+    B sample from the table offsets of its header.
+*/
+static unsigned char *atom_image_mjpb(const unsigned char *p, size_t size, size_t *length)
+{
+  uint32_t quantization, huffman, frame, scan, data;
+  size_t field, i, quantization_size = 0, huffman_size = 0, frame_size, scan_size;
+  unsigned char *image;
+
+  if (size < 40 || memcmp(p + 4, "mjpg", 4) != 0) return NULL;
+  field = atom_image_u32(p + 8);
+  if (field == 0 || field > size) field = size;
+  quantization = atom_image_u32(p + 20);
+  huffman = atom_image_u32(p + 24);
+  frame = atom_image_u32(p + 28);
+  scan = atom_image_u32(p + 32);
+  data = atom_image_u32(p + 36);
+  if (data < 40 || data > field) return NULL;
+  if (quantization && !(quantization_size = atom_image_segment_size(p, field, quantization))) return NULL;
+  if (huffman && !(huffman_size = atom_image_segment_size(p, field, huffman))) return NULL;
+  if (!(frame_size = atom_image_segment_size(p, field, frame))) return NULL;
+  if (!(scan_size = atom_image_segment_size(p, field, scan))) return NULL;
+
+  // markers, segments, and scan data which may double with byte stuffing
+  image = (unsigned char*)malloc(12 + quantization_size + (huffman ? huffman_size : sizeof(atom_image_standard_dht)) + frame_size + scan_size + (field - data) * 2);
+  if (image == NULL) return NULL;
+  image[0] = 0xFF;
+  image[1] = 0xD8;
+  *length = 2;
+  if (quantization)
+    atom_image_segment(image, length, 0xDB, p, quantization, quantization_size);
+  if (huffman) {
+    atom_image_segment(image, length, 0xC4, p, huffman, huffman_size);
+  } else {
+    memcpy(image + *length, atom_image_standard_dht, sizeof(atom_image_standard_dht));
+    *length += sizeof(atom_image_standard_dht);
+  }
+  atom_image_segment(image, length, 0xC0, p, frame, frame_size);
+  atom_image_segment(image, length, 0xDA, p, scan, scan_size);
+  for (i = data; i < field; i++) {
+    image[(*length)++] = p[i];
+    if (p[i] == 0xFF) image[(*length)++] = 0x00;
+  }
+  image[(*length)++] = 0xFF;
+  image[(*length)++] = 0xD9;
+  return image;
+}
+
+/*  helper function, turns a sample of the codec into a standalone image
+    file. Returns NULL if the sample is not a valid image.
+*/
+static unsigned char *atom_image_convert(uint32_t codec, const unsigned char *p, size_t size, size_t *length)
+{
+  unsigned char *image;
+
+  if (codec == FOURCC('m','j','p','b'))
+    return atom_image_mjpb(p, size, length);
+  if (atom_image_format(codec) == ATOM_IMAGE_JPEG)
+    return atom_image_jpeg(p, size, length);
+  if (size < sizeof(atom_image_png_signature) || memcmp(p, atom_image_png_signature, sizeof(atom_image_png_signature)) != 0)
+    return NULL;
+  if ((image = (unsigned char*)malloc(size)) == NULL) return NULL;
+  memcpy(image, p, size);
+  *length = size;
+  return image;
+}
+
+/*  helper function, returns the bytes per row of pixels of an uncompressed
+    sample description this can convert, 0 for any other.
+*/
+static size_t atom_image_raw_row(const struct AtomSampleDescription *description)
+{
+  if (description->format == FOURCC('r','a','w',' ') && description->depth == 24)
+    return (size_t)description->width * 3;
+  if (description->format == FOURCC('r','a','w',' ') && description->depth == 32)
+    return (size_t)description->width * 4;
+  if (description->format == FOURCC('2','v','u','y'))
+    return (size_t)((description->width + 1) / 2) * 4;
+  return 0;
+}
+
+/*
+  Returns the image format samples of the description can be written as
+  without decoding them, ATOM_IMAGE_NONE if they can't. Uncompressed
+  samples are written as PNG.
+*/
+int atom_image_description_format(const struct AtomSampleDescription *description)
+{
+#ifdef HAVE_LIBZ
+  if (description->width && description->height && atom_image_raw_row(description))
+    return ATOM_IMAGE_PNG;
+#endif
+  return atom_image_format(description->format);
+}
+
+#ifdef HAVE_LIBZ
+/*  fixed point coefficients (times 256) of Cr for red, Cb and Cr for green
+    and Cb for blue, for video range Y'CbCr.
+*/
+static const int atom_image_bt601[4] = { 409, 100, 208, 516 };
+static const int atom_image_bt709[4] = { 459, 55, 136, 541 };
+
+static unsigned char atom_image_clamp(int value)
+{
+  return value < 0 ? 0 : value > 255 ? 255 : (unsigned char)value;
+}
+
+/*  helper function, converts a row of 2vuy pixels (Cb Y0 Cr Y1 for each
+    pair) to RGB. Only integer arithmetic on independent pixels, so the
+    compiler can vectorize it.
+*/
+static void atom_image_2vuy_row(const unsigned char *p, unsigned char *rgb, uint32_t width, const int *m)
+{
+  const unsigned char *pair;
+  uint32_t x;
+  int y, cb, cr;
+
+  for (x = 0; x < width; x++) {
+    pair = p + (x >> 1) * 4;
+    y = 298 * (pair[1 + (x & 1) * 2] - 16) + 128;
+    cb = pair[0] - 128;
+    cr = pair[2] - 128;
+    rgb[x * 3] = atom_image_clamp((y + m[0] * cr) >> 8);
+    rgb[x * 3 + 1] = atom_image_clamp((y - m[1] * cb - m[2] * cr) >> 8);
+    rgb[x * 3 + 2] = atom_image_clamp((y + m[3] * cb) >> 8);
+  }
+}
+
+/*  helper function, appends a PNG chunk whose data is already in place
+    after the room left for its length and type.
+*/
+static void atom_image_png_chunk(unsigned char *image, size_t *length, uint32_t type, size_t size)
+{
+  unsigned char *chunk = image + *length;
+  uint32_t crc;
+
+  memcpy(chunk, (unsigned char[8]){ size >> 24, size >> 16, size >> 8, size, type >> 24, type >> 16, type >> 8, type }, 8);
+  crc = (uint32_t)crc32(0, chunk + 4, (uInt)size + 4);
+  memcpy(chunk + 8 + size, (unsigned char[4]){ crc >> 24, crc >> 16, crc >> 8, crc }, 4);
+  *length += 12 + size;
+}
+
+/*  helper function, converts an uncompressed sample to a PNG file. Rows
+    may be padded, their length is taken from the size of the sample.
+    HD sizes use the BT.709 coefficients for 2vuy, smaller ones BT.601.
+*/
+static unsigned char *atom_image_raw_png(const struct AtomSampleDescription *description, const unsigned char *p, size_t size, size_t *length)
+{
+  const int *m = description->height > 576 ? atom_image_bt709 : atom_image_bt601;
+  int alpha = description->format == FOURCC('r','a','w',' ') && description->depth == 32;
+  size_t row = atom_image_raw_row(description), stride, line, x;
+  unsigned char *rows, *image, *out;
+  const unsigned char *in;
+  uLongf compressed;
+  uint32_t y;
+
+  if (!row || !description->height || size / description->height < row) return NULL;
+  stride = size / description->height;
+  line = 1 + (size_t)description->width * (alpha ? 4 : 3);
+  if (!(rows = (unsigned char*)malloc(line * description->height))) return NULL;
+
+  for (y = 0; y < description->height; y++) {
+    in = p + y * stride;
+    out = rows + y * line;
+    out[0] = 0;  // no filter
+    if (description->format == FOURCC('2','v','u','y')) {
+      atom_image_2vuy_row(in, out + 1, description->width, m);
+    } else if (alpha) {
+      // ARGB to RGBA
+      for (x = 0; x < description->width; x++) {
+        out[1 + x * 4] = in[x * 4 + 1];
+        out[2 + x * 4] = in[x * 4 + 2];
+        out[3 + x * 4] = in[x * 4 + 3];
+        out[4 + x * 4] = in[x * 4];
+      }
+    } else {
+      memcpy(out + 1, in, row);
+    }
+  }
+
+  compressed = compressBound(line * description->height);
+  if (!(image = (unsigned char*)malloc(sizeof(atom_image_png_signature) + 25 + 12 + compressed + 12))) {
+    free(rows);
+    return NULL;
+  }
+  memcpy(image, atom_image_png_signature, sizeof(atom_image_png_signature));
+  *length = sizeof(atom_image_png_signature);
+  out = image + *length + 8;
+  memcpy(out, (unsigned char[13]){ description->width >> 24, description->width >> 16, description->width >> 8, description->width,
+    description->height >> 24, description->height >> 16, description->height >> 8, description->height, 8, alpha ? 6 : 2, 0, 0, 0 }, 13);
+  atom_image_png_chunk(image, length, FOURCC('I','H','D','R'), 13);
+  if (compress2(image + *length + 8, &compressed, rows, line * description->height, Z_BEST_SPEED) != Z_OK) {
+    free(rows);
+    free(image);
+    return NULL;
+  }
+  free(rows);
+  atom_image_png_chunk(image, length, FOURCC('I','D','A','T'), compressed);
+  atom_image_png_chunk(image, length, FOURCC('I','E','N','D'), 0);
+  return image;
+}
+#endif
+
+/*
+  Turns a sample of the description into a standalone image file of the
+  format given by atom_image_description_format. Returns NULL if the
+  sample is not a valid image.
+*/
+unsigned char *atom_image_sample(const struct AtomSampleDescription *description, const unsigned char *p, size_t size, size_t *length)
+{
+#ifdef HAVE_LIBZ
+  if (atom_image_raw_row(description))
+    return atom_image_raw_png(description, p, size, length);
+#endif
+  return atom_image_convert(description->format, p, size, length);
+}
+
+/*
+  Finds the sample of the first enabled video track which is shown at the
+  time of frame, starting from the key frame before it, and whether it
+  can be written as an image without decoding. Returns 0 if no video track
+  shows anything then.
+*/
+int atom_movie_image_locate(struct AtomMovie *movie, struct AtomImageFrame *frame)
+{
+  struct AtomTrack *track, *media;
+  struct AtomSampleIndex *index;
+  struct AtomEdit *edit;
+  int64_t position, time, sample, sync;
+  uint32_t i, e, description;
+
+  for (i = 0; i < movie->track_count; i++) {
+    track = atom_movie_track(movie, i);
+    if (!track || !(track->flags & 1) || track->handler_type != VideoMediaType) continue;
+    for (position = 0, e = 0; e < track->edit_count; position += track->edits[e++].segment_duration) {
+      edit = &track->edits[e];
+      if (frame->time < position || frame->time >= position + edit->segment_duration) continue;
+      if (edit->media_time < 0 || !edit->media) break;
+      media = ATOM_TRACK_MEDIA(edit->media);
+      if (!media->media_time_scale || !(index = atom_track_sample_index(media)) || index->count == 0) break;
+
+      time = edit->media_time + (int64_t)((double)(frame->time - position) * media->media_time_scale / movie->time_scale * edit->media_rate / 65536.0);
+      if ((sample = atom_sample_at_time(index, time)) < 0) break;
+      if ((sync = atom_sync_sample_before(index, sample)) >= 0) sample = sync;
+
+      description = index->descriptions ? index->descriptions[sample] : 1;
+      frame->media = media;
+      frame->sample = (uint32_t)sample;
+      frame->offset = index->offsets[sample];
+      frame->size = index->sizes[sample];
+      frame->description = (description >= 1 && description <= media->sample_description_count) ? &media->sample_descriptions[description - 1] : NULL;
+      frame->codec = frame->description ? frame->description->format : 0;
+      frame->format = frame->description ? atom_image_description_format(frame->description) : ATOM_IMAGE_NONE;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*  helper function, the position of a frame's sample, frames are read in
+    this order.
+*/
+struct AtomImageOrder {
+  uintptr_t source;
+  uint64_t offset;
+  uint32_t frame;
+};
+
+static int atom_image_compare(const void *a, const void *b)
+{
+  const struct AtomImageOrder *x = (const struct AtomImageOrder*)a;
+  const struct AtomImageOrder *y = (const struct AtomImageOrder*)b;
+
+  if (x->source != y->source)
+    return x->source < y->source ? -1 : 1;
+  if (x->offset != y->offset)
+    return x->offset < y->offset ? -1 : 1;
+  return x->frame < y->frame ? -1 : (x->frame > y->frame);
+}
+
+/*
+  Locates the sample shown at the time of each frame (in the movie time
+  scale) and, for those which can be written without decoding, reads the
+  samples in a single pass ordered by file offset and turns them into
+  image files. Frames showing the same sample share the image of the
+  first of them (see original). Frames without a video sample are left
+  without media, those needing decoding without data. Returns 0 and fills
+  in error if a sample can not be read or is not a valid image. Stops 
+  early, returning 0, once cancelled gets set.
+*/
+int atom_movie_image_frames(struct AtomMovie *movie, struct AtomImageFrame *frames, uint32_t count, volatile int *cancelled, char *error, size_t error_size)
+{
+  struct AtomImageOrder *order;
+  struct AtomImageFrame *frame, *previous = NULL;
+  struct AtomMovie *source;
+  const unsigned char *bytes;
+  unsigned char *buffer = NULL, *grown;
+  size_t buffer_size = 0;
+  uint32_t i, n = 0;
+  int ok = 1;
+
+  if (!(order = (struct AtomImageOrder*)malloc((count ? count : 1) * sizeof(struct AtomImageOrder)))) {
+    snprintf(error, error_size, "Unable to allocate frames");
+    return 0;
+  }
+  for (i = 0; i < count; i++) {
+    frames[i].original = i;
+    if (movie->duration && frames[i].time >= (int64_t)movie->duration)
+      frames[i].time = movie->duration - 1;
+    if (atom_movie_image_locate(movie, &frames[i]) && frames[i].format != ATOM_IMAGE_NONE) {
+      order[n].source = (uintptr_t)frames[i].media->movie;
+      order[n].offset = frames[i].offset;
+      order[n++].frame = i;
+    }
+  }
+  qsort(order, n, sizeof(struct AtomImageOrder), atom_image_compare);
+
+  for (i = 0; ok && i < n; i++) {
+    if (*cancelled) {
+      snprintf(error, error_size, "Reading the frames was interrupted.");
+      ok = 0;
+      break;
+    }
+    frame = &frames[order[i].frame];
+    if (previous && previous->media->movie == frame->media->movie && previous->offset == frame->offset) {
+      frame->original = previous->original;
+      continue;
+    }
+    previous = frame;
+
+    source = frame->media->movie;
+    if (!(bytes = atom_movie_bytes(source, frame->offset, frame->size)) && !source->map && source->fd >= 0) {
+      if (frame->size > buffer_size) {
+        if (!(grown = (unsigned char*)realloc(buffer, frame->size))) {
+          snprintf(error, error_size, "Unable to allocate %u bytes for sample %u of track %u", frame->size, frame->sample + 1, frame->media->id);
+          ok = 0;
+          break;
+        }
+        buffer = grown;
+        buffer_size = frame->size;
+      }
+      if (pread(source->fd, buffer, frame->size, frame->offset) == (ssize_t)frame->size)
+        bytes = buffer;
+    }
+    if (!bytes) {
+      snprintf(error, error_size, "Unable to read sample %u of track %u", frame->sample + 1, frame->media->id);
+      ok = 0;
+    } else if (!(frame->data = atom_image_sample(frame->description, bytes, frame->size, &frame->length))) {
+      snprintf(error, error_size, "Sample %u of track %u is not a valid %s image", frame->sample + 1, frame->media->id, frame->format == ATOM_IMAGE_PNG ? "PNG" : "JPEG");
+      ok = 0;
+    }
+  }
+  free(buffer);
+  free(order);
+  return ok;
+}
+
+/*
+  Frees the images read into frames.
+*/
+void atom_image_frames_free(struct AtomImageFrame *frames, uint32_t count)
+{
+  uint32_t i;
+  for (i = 0; i < count; i++) {
+    free(frames[i].data);
+  }
+  free(frames);
+}
@@ -0,0 +1,299 @@
+#include "rmov_ext.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  Reads the metadata of a movie from the three places QuickTime and MP4
+  files keep it:
+
+  - User data atoms of the moov atom named after the field, such as 0xA9
+    'nam' for the title, each holding a list of texts in different
+    languages of which the first is read.
+  - The iTunes item list, an 'ilst' in a 'meta' atom of the user data,
+    with an item named like the user data atom holding a 'data' atom.
+  - QuickTime metadata, a 'meta' atom of the moov atom with an 'mdta'
+    handler, the items of its 'ilst' are numbered after the reverse DNS
+    keys listed in its 'keys' atom.
+
+  Only text values are read. The atoms are walked in the raw moov atom,
+  as atom_write.c rewrites them, see atom_movie_save_metadata.
+*/
+
+#define META_TYPE(c, d, e) FOURCC(0xA9, c, d, e)
+
+const struct AtomMetadataField atom_metadata_fields[] = {
+  { "title",       META_TYPE('n','a','m'), "com.apple.quicktime.title" },
+  { "artist",      META_TYPE('A','R','T'), "com.apple.quicktime.artist" },
+  { "album",       META_TYPE('a','l','b'), "com.apple.quicktime.album" },
+  { "author",      META_TYPE('a','u','t'), "com.apple.quicktime.author" },
+  { "comment",     META_TYPE('c','m','t'), "com.apple.quicktime.comment" },
+  { "composer",    META_TYPE('w','r','t'), "com.apple.quicktime.composer" },
+  { "copyright",   META_TYPE('c','p','y'), "com.apple.quicktime.copyright" },
+  { "date",        META_TYPE('d','a','y'), "com.apple.quicktime.creationdate" },
+  { "description", META_TYPE('d','e','s'), "com.apple.quicktime.description" },
+  { "director",    META_TYPE('d','i','r'), "com.apple.quicktime.director" },
+  { "encoder",     META_TYPE('t','o','o'), "com.apple.quicktime.encoder" },
+  { "genre",       META_TYPE('g','e','n'), "com.apple.quicktime.genre" },
+  { "keywords",    META_TYPE('k','e','y'), "com.apple.quicktime.keywords" },
+  { "producer",    META_TYPE('p','r','d'), "com.apple.quicktime.producer" },
+  { "software",    META_TYPE('s','w','r'), "com.apple.quicktime.software" },
+  { NULL, 0, NULL }
+};
+
+/*
+  Returns the known field with the given name, or NULL.
+*/
+const struct AtomMetadataField *atom_metadata_field(const char *name)
+{
+  const struct AtomMetadataField *field;
+
+  for (field = atom_metadata_fields; field->name; field++) {
+    if (strcmp(field->name, name) == 0) return field;
+  }
+  return NULL;
+}
+
+static uint32_t atom_meta_u32(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/*
+  Reads the header of the atom at p, which has to end by end. Sets its
+  type, payload and the length of the payload and returns the atom after
+  it, or NULL if there is no whole atom at p.
+*/
+const unsigned char *atom_meta_child(const unsigned char *p, const unsigned char *end, uint32_t *type, const unsigned char **payload, uint64_t *length)
+{
+  uint64_t size, header = 8;
+
+  if (end - p < 8) return NULL;
+  size = atom_meta_u32(p);
+  *type = atom_meta_u32(p + 4);
+  if (size == 1) {
+    if (end - p < 16) return NULL;
+    size = ((uint64_t)atom_meta_u32(p + 8) << 32) | atom_meta_u32(p + 12);
+    header = 16;
+  } else if (size == 0) {
+    size = end - p;
+  }
+  if (size < header || size > (uint64_t)(end - p)) return NULL;
+  *payload = p + header;
+  *length = size - header;
+  return p + size;
+}
+
+/*
+  Returns where the child atoms of a 'meta' atom start in its payload. The
+  MP4 one is a full atom with a version and flags, the QuickTime one isn't.
+*/
+uint64_t atom_meta_body(const unsigned char *payload, uint64_t length)
+{
+  return (length >= 8 && atom_meta_u32(payload + 4) == FOURCC('h','d','l','r')) ? 0 : 4;
+}
+
+/*  helper function, sets the field to the value, adding it if needed.
+    Returns 0 if out of memory.
+*/
+static int atom_metadata_set(struct AtomMetadata *metadata, const char *name, char *value, size_t length, int store)
+{
+  struct AtomMetadataEntry *entries, *entry;
+  uint32_t i;
+
+  for (i = 0; i < metadata->count && strcmp(metadata->entries[i].name, name) != 0; i++);
+  if (i == metadata->count) {
+    if (!(entries = (struct AtomMetadataEntry*)realloc(metadata->entries, (metadata->count + 1) * sizeof(struct AtomMetadataEntry)))) {
+      free(value);
+      return 0;
+    }
+    metadata->entries = entries;
+    entry = &entries[metadata->count];
+    memset(entry, 0, sizeof(struct AtomMetadataEntry));
+    if (!(entry->name = strdup(name))) {
+      free(value);
+      return 0;
+    }
+    metadata->count++;
+  }
+  entry = &metadata->entries[i];
+  free(entry->value);
+  entry->value = value;
+  entry->length = length;
+  entry->stores |= store;
+  return 1;
+}
+
+/*  helper function, reads the text of a 'data' atom among the children
+    of an item, NULL if it has no UTF-8 text.
+*/
+static char *atom_meta_data_text(const unsigned char *p, uint64_t length, size_t *text_length)
+{
+  const unsigned char *end = p + length, *payload, *next;
+  uint64_t size;
+  uint32_t type;
+
+  for (; (next = atom_meta_child(p, end, &type, &payload, &size)); p = next) {
+    // well-known type 1 is UTF-8 text
+    if (type == FOURCC('d','a','t','a') && size >= 8 && (atom_meta_u32(payload) & 0xFFFFFF) == 1)
+      return atom_text_string(payload + 8, size - 8, text_length);
+  }
+  return NULL;
+}
+
+/*  helper function, returns the field with the given type.
+*/
+static const struct AtomMetadataField *atom_metadata_field_of_type(uint32_t type)
+{
+  const struct AtomMetadataField *field;
+
+  for (field = atom_metadata_fields; field->name; field++) {
+    if (field->type == type) return field;
+  }
+  return NULL;
+}
+
+/*  helper function, reads the items of an iTunes list.
+*/
+static int atom_meta_read_ilst(struct AtomMetadata *metadata, const unsigned char *p, uint64_t length)
+{
+  const unsigned char *end = p + length, *payload, *next;
+  const struct AtomMetadataField *field;
+  uint64_t size;
+  uint32_t type;
+  size_t text_length;
+  char *text;
+
+  for (; (next = atom_meta_child(p, end, &type, &payload, &size)); p = next) {
+    if (!(field = atom_metadata_field_of_type(type)) || !(text = atom_meta_data_text(payload, size, &text_length))) continue;
+    if (!atom_metadata_set(metadata, field->name, text, text_length, ATOM_METADATA_ILST)) return 0;
+  }
+  return 1;
+}
+
+/*  helper function, reads the user data atoms and the iTunes list in it.
+*/
+static int atom_meta_read_udta(struct AtomMetadata *metadata, const unsigned char *p, uint64_t length)
+{
+  const unsigned char *end = p + length, *payload, *next, *child, *child_payload;
+  const struct AtomMetadataField *field;
+  uint64_t size, child_size, body;
+  uint32_t type, child_type;
+  size_t count, text_length;
+  char *text;
+
+  for (; (next = atom_meta_child(p, end, &type, &payload, &size)); p = next) {
+    if (type == FOURCC('m','e','t','a')) {
+      body = atom_meta_body(payload, size);
+      for (child = payload + body; body <= size && (next = atom_meta_child(child, payload + size, &child_type, &child_payload, &child_size)); child = next) {
+        if (child_type == FOURCC('i','l','s','t')) {
+          metadata->stores |= ATOM_METADATA_ILST;
+          if (!atom_meta_read_ilst(metadata, child_payload, child_size)) return 0;
+        }
+      }
+      next = payload + size;
+      continue;
+    }
+    if (!(field = atom_metadata_field_of_type(type))) continue;
+    if (size >= 8 && atom_meta_u32(payload + 4) == FOURCC('d','a','t','a')) {
+      // some writers put iTunes style items in the user data
+      text = atom_meta_data_text(payload, size, &text_length);
+    } else if (size >= 4) {
+      // the first of the texts, a length and language code before each
+      count = (size_t)((payload[0] << 8) | payload[1]);
+      if (count > size - 4) count = (size_t)(size - 4);
+      text = atom_text_string(payload + 4, count, &text_length);
+    } else {
+      continue;
+    }
+    if (text && !atom_metadata_set(metadata, field->name, text, text_length, ATOM_METADATA_UDTA)) return 0;
+  }
+  return 1;
+}
+
+/*  helper function, reads QuickTime metadata. Items of keys which aren't
+    known fields are named by their key.
+*/
+static int atom_meta_read_mdta(struct AtomMetadata *metadata, const unsigned char *p, uint64_t length)
+{
+  const unsigned char *end = p + length, *payload, *next, *keys = NULL, *ilst = NULL, *key;
+  const struct AtomMetadataField *field;
+  uint64_t size, keys_size = 0, ilst_size = 0, offset;
+  uint32_t type, index, count, i;
+  size_t text_length;
+  char *text, *name;
+  int handler = 0, ok = 1;
+
+  for (; (next = atom_meta_child(p, end, &type, &payload, &size)); p = next) {
+    if (type == FOURCC('h','d','l','r') && size >= 12 && atom_meta_u32(payload + 8) == FOURCC('m','d','t','a')) handler = 1;
+    if (type == FOURCC('k','e','y','s')) {
+      keys = payload;
+      keys_size = size;
+    }
+    if (type == FOURCC('i','l','s','t')) {
+      ilst = payload;
+      ilst_size = size;
+    }
+  }
+  if (!handler || !keys || keys_size < 8) return 1;
+  metadata->stores |= ATOM_METADATA_MDTA;
+
+  count = atom_meta_u32(keys + 4);
+  for (p = ilst, end = ilst + ilst_size; ilst && ok && (next = atom_meta_child(p, end, &index, &payload, &size)); p = next) {
+    // items are numbered after the keys, starting at 1
+    for (i = 1, offset = 8; i < index && i <= count && offset + 8 <= keys_size; i++) {
+      offset += atom_meta_u32(keys + offset) < 8 ? keys_size : atom_meta_u32(keys + offset);
+    }
+    if (index == 0 || i > count || offset + 8 > keys_size || atom_meta_u32(keys + offset) < 8 || offset + atom_meta_u32(keys + offset) > keys_size) continue;
+    key = keys + offset;
+    if (!(text = atom_meta_data_text(payload, size, &text_length))) continue;
+    if (!(name = (char*)malloc(atom_meta_u32(key) - 8 + 1))) {
+      free(text);
+      return 0;
+    }
+    memcpy(name, key + 8, atom_meta_u32(key) - 8);
+    name[atom_meta_u32(key) - 8] = '\0';
+    for (field = atom_metadata_fields; field->name && strcmp(field->key, name) != 0; field++);
+    ok = atom_metadata_set(metadata, field->name ? field->name : name, text, text_length, ATOM_METADATA_MDTA);
+    free(name);
+  }
+  return ok;
+}
+
+/*
+  Fills in the metadata of the movie, each field once with the value of
+  the last place it's found in: user data, the iTunes list then QuickTime
+  metadata. Returns 0 if the movie header can't be read or memory runs
+  out. The metadata must be freed with atom_metadata_free.
+*/
+int atom_movie_metadata(struct AtomMovie *movie, struct AtomMetadata *metadata)
+{
+  const unsigned char *moov, *p, *end, *payload, *next;
+  uint64_t size;
+  uint32_t type;
+  int ok = 1;
+
+  memset(metadata, 0, sizeof(struct AtomMetadata));
+  if (!movie->moov || !(moov = atom_data(movie, movie->moov))) return 0;
+  end = moov + ATOM_DATA_SIZE(movie->moov);
+  for (p = moov; ok && (next = atom_meta_child(p, end, &type, &payload, &size)); p = next) {
+    if (type == FOURCC('u','d','t','a')) ok = atom_meta_read_udta(metadata, payload, size);
+  }
+  for (p = moov; ok && (next = atom_meta_child(p, end, &type, &payload, &size)); p = next) {
+    if (type == FOURCC('m','e','t','a')) ok = atom_meta_read_mdta(metadata, payload + atom_meta_body(payload, size), size - atom_meta_body(payload, size));
+  }
+  if (!ok) atom_metadata_free(metadata);
+  return ok;
+}
+
+void atom_metadata_free(struct AtomMetadata *metadata)
+{
+  uint32_t i;
+
+  for (i = 0; i < metadata->count; i++) {
+    free(metadata->entries[i].name);
+    free(metadata->entries[i].value);
+  }
+  free(metadata->entries);
+  memset(metadata, 0, sizeof(struct AtomMetadata));
+}
@@ -0,0 +1,367 @@
+#include "rmov_ext.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+  Scans a directory tree for movie files, see QuickTime.scan. A walker
+  thread lists the directories and queues the files whose name matches
+  the pattern. Worker threads open the queued files ahead of time, hinting
+  the kernel to read their first and last bytes where the moov atom is
+  usually found, and probe the files opened earlier in the meantime. The
+  probed movies are handed back in the order they complete.
+
+  Only a bounded number of files are queued, opened or waiting to be taken
+  at any time, the walker waits for the caller to catch up.
+*/
+
+/*  helper function, appends job to the end of queue.
+*/
+static void atom_scan_push(struct AtomScanQueue *queue, struct AtomScanJob *job)
+{
+  job->next = NULL;
+  if (queue->head) {
+    queue->tail->next = job;
+  } else {
+    queue->head = job;
+  }
+  queue->tail = job;
+  queue->count++;
+}
+
+/*  helper function, removes the first job of queue, NULL if it's empty.
+*/
+static struct AtomScanJob *atom_scan_shift(struct AtomScanQueue *queue)
+{
+  struct AtomScanJob *job = queue->head;
+  if (job) {
+    queue->head = job->next;
+    queue->count--;
+  }
+  return job;
+}
+
+/*
+  Frees a job taken from atom_scan_next along with its movie, if it's
+  still held by the job.
+*/
+void atom_scan_job_free(struct AtomScanJob *job)
+{
+  if (job->fd >= 0) close(job->fd);
+  if (job->movie) atom_movie_free(job->movie);
+  free(job->filepath);
+  free(job);
+}
+
+static void atom_scan_free_queue(struct AtomScanQueue *queue)
+{
+  struct AtomScanJob *job;
+  while ((job = atom_scan_shift(queue))) {
+    atom_scan_job_free(job);
+  }
+}
+
+/*  helper function, queues the file (or the directory which could not be
+    read when error is set) at path for the workers. Takes over path. Waits
+    while too many files are pending, returns 0 if the scan was cancelled.
+*/
+static int atom_scan_found(struct AtomScan *scan, char *path, int error)
+{
+  struct AtomScanJob *job = (struct AtomScanJob*)calloc(1, sizeof(struct AtomScanJob));
+
+  if (job == NULL) {
+    free(path);
+    return 1;
+  }
+  job->filepath = path;
+  job->fd = -1;
+  if (error)
+    snprintf(job->error, sizeof(job->error), "Error %d occurred while reading directory at %s", error, path);
+
+  pthread_mutex_lock(&scan->lock);
+  while (!scan->cancelled && scan->pending >= ATOM_SCAN_PENDING(scan)) {
+    pthread_cond_wait(&scan->changed, &scan->lock);
+  }
+  if (scan->cancelled) {
+    pthread_mutex_unlock(&scan->lock);
+    atom_scan_job_free(job);
+    return 0;
+  }
+  atom_scan_push(&scan->found, job);
+  scan->pending++;
+  pthread_cond_broadcast(&scan->changed);
+  pthread_mutex_unlock(&scan->lock);
+  return 1;
+}
+
+/*  helper function, returns whether path (named name within its directory)
+    is a directory to descend into, a file to match or neither. Symbolic
+    links to files are followed, those to directories are not.
+*/
+enum { ATOM_SCAN_SKIP, ATOM_SCAN_FILE, ATOM_SCAN_DIRECTORY };
+
+static int atom_scan_type(struct dirent *entry, const char *path)
+{
+  struct stat st;
+
+#ifdef DT_DIR
+  if (entry->d_type == DT_DIR) return ATOM_SCAN_DIRECTORY;
+  if (entry->d_type == DT_REG) return ATOM_SCAN_FILE;
+  if (entry->d_type == DT_LNK) return (stat(path, &st) == 0 && S_ISREG(st.st_mode)) ? ATOM_SCAN_FILE : ATOM_SCAN_SKIP;
+  if (entry->d_type != DT_UNKNOWN) return ATOM_SCAN_SKIP;
+#endif
+  if (lstat(path, &st) != 0) return ATOM_SCAN_SKIP;
+  if (S_ISDIR(st.st_mode)) return ATOM_SCAN_DIRECTORY;
+  if (S_ISLNK(st.st_mode) && stat(path, &st) != 0) return ATOM_SCAN_SKIP;
+  return S_ISREG(st.st_mode) ? ATOM_SCAN_FILE : ATOM_SCAN_SKIP;
+}
+
+/*  helper function, walker thread. Lists the directories depth first from
+    a stack of paths, hidden files and directories are skipped.
+*/
+static void *atom_scan_walk(void *arg)
+{
+  struct AtomScan *scan = (struct AtomScan*)arg;
+  struct dirent *entry;
+  char **stack, **grown, *directory, *path;
+  size_t depth = 0, capacity = 64, length;
+  int running = 1;
+  DIR *dir;
+
+  stack = (char**)malloc(capacity * sizeof(char*));
+  if (stack && (stack[0] = strdup(scan->root))) depth = 1;
+
+  while (running && depth) {
+    directory = stack[--depth];
+    dir = opendir(directory);
+    if (dir == NULL) {
+      running = atom_scan_found(scan, directory, errno);
+      continue;
+    }
+    length = strlen(directory);
+    while (running && (entry = readdir(dir))) {
+      if (entry->d_name[0] == '.') continue;
+      path = (char*)malloc(length + strlen(entry->d_name) + 2);
+      if (path == NULL) break;
+      sprintf(path, (length && directory[length - 1] == '/') ? "%s%s" : "%s/%s", directory, entry->d_name);
+
+      switch (atom_scan_type(entry, path)) {
+        case ATOM_SCAN_DIRECTORY:
+          if (depth == capacity) {
+            grown = (char**)realloc(stack, capacity * 2 * sizeof(char*));
+            if (grown == NULL) {
+              free(path);
+              break;
+            }
+            stack = grown;
+            capacity *= 2;
+          }
+          stack[depth++] = path;
+          break;
+        case ATOM_SCAN_FILE:
+          if (fnmatch(scan->pattern, entry->d_name, 0) == 0) {
+            running = atom_scan_found(scan, path, 0);
+          } else {
+            free(path);
+          }
+          break;
+        default:
+          free(path);
+      }
+    }
+    closedir(dir);
+    free(directory);
+  }
+
+  while (depth) {
+    free(stack[--depth]);
+  }
+  free(stack);
+
+  pthread_mutex_lock(&scan->lock);
+  scan->walking = 0;
+  pthread_cond_broadcast(&scan->changed);
+  pthread_mutex_unlock(&scan->lock);
+  return NULL;
+}
+
+/*  helper function, opens the file of job and asks the kernel to start
+    reading its first and last bytes, where the probe will look first.
+*/
+static void atom_scan_read_ahead(struct AtomScanJob *job)
+{
+#ifdef HAVE_POSIX_FADVISE
+  struct stat st;
+#endif
+
+  job->fd = open(job->filepath, O_RDONLY);
+  if (job->fd < 0) {
+    snprintf(job->error, sizeof(job->error), "Error %d occurred while reading file at %s", errno, job->filepath);
+    return;
+  }
+#ifdef HAVE_POSIX_FADVISE
+  if (fstat(job->fd, &st) == 0) {
+    posix_fadvise(job->fd, 0, ATOM_SCAN_HINT_SIZE, POSIX_FADV_WILLNEED);
+    if (st.st_size > ATOM_SCAN_HINT_SIZE)
+      posix_fadvise(job->fd, st.st_size - ATOM_SCAN_HINT_SIZE, ATOM_SCAN_HINT_SIZE, POSIX_FADV_WILLNEED);
+  }
+#endif
+}
+
+/*  helper function, worker thread. Opens queued files while fewer than
+    ATOM_SCAN_READ_AHEAD per thread are waiting to be probed, otherwise
+    probes the file opened first.
+*/
+static void *atom_scan_work(void *arg)
+{
+  struct AtomScan *scan = (struct AtomScan*)arg;
+  struct AtomScanJob *job;
+  int opening = 0;
+  uint32_t i;
+
+  for (;;) {
+    pthread_mutex_lock(&scan->lock);
+    for (job = NULL; !scan->cancelled; pthread_cond_wait(&scan->changed, &scan->lock)) {
+      opening = scan->found.head && scan->opened.count < scan->thread_count * ATOM_SCAN_READ_AHEAD;
+      job = atom_scan_shift(opening ? &scan->found : &scan->opened);
+      if (job || !scan->walking) break;
+    }
+    pthread_mutex_unlock(&scan->lock);
+    if (job == NULL) break;
+
+    if (opening) {
+      if (!job->error[0]) atom_scan_read_ahead(job);
+    } else if (job->fd >= 0) {
+      job->movie = atom_movie_probe_fd(job->fd, job->filepath, job->error, sizeof(job->error));
+      job->fd = -1;
+      // parse every track here rather than on first use by the caller
+      for (i = 0; job->movie && i < job->movie->track_count; i++) {
+        atom_movie_track(job->movie, i);
+      }
+    }
+
+    pthread_mutex_lock(&scan->lock);
+    atom_scan_push(opening ? &scan->opened : &scan->done, job);
+    pthread_cond_broadcast(&scan->changed);
+    pthread_mutex_unlock(&scan->lock);
+  }
+  return NULL;
+}
+
+/*
+  Starts scanning the directory tree at root for files whose name matches
+  pattern (see fnmatch) on thread_count worker threads. Returns NULL and
+  fills in error if root is not a directory or no threads could be started.
+*/
+struct AtomScan *atom_scan_start(const char *root, const char *pattern, uint32_t thread_count, char *error, size_t error_size)
+{
+  struct AtomScan *scan;
+  struct stat st;
+
+  if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    snprintf(error, error_size, "Unable to find directory at %s", root);
+    return NULL;
+  }
+  scan = (struct AtomScan*)calloc(1, sizeof(struct AtomScan));
+  if (scan == NULL || !(scan->root = strdup(root)) || !(scan->pattern = strdup(pattern)) ||
+      !(scan->workers = (pthread_t*)malloc((thread_count ? thread_count : 1) * sizeof(pthread_t)))) {
+    if (scan) {
+      free(scan->root);
+      free(scan->pattern);
+      free(scan);
+    }
+    snprintf(error, error_size, "Unable to allocate scan");
+    return NULL;
+  }
+  scan->thread_count = thread_count ? thread_count : 1;
+  scan->walking = 1;
+  pthread_mutex_init(&scan->lock, NULL);
+  pthread_cond_init(&scan->changed, NULL);
+
+  if (pthread_create(&scan->walker, NULL, atom_scan_walk, scan) != 0) {
+    scan->walking = 0;
+    atom_scan_free(scan);
+    snprintf(error, error_size, "Unable to start scanning %s", root);
+    return NULL;
+  }
+  scan->walker_started = 1;
+  while (scan->started < scan->thread_count) {
+    if (pthread_create(&scan->workers[scan->started], NULL, atom_scan_work, scan) != 0) break;
+    scan->started++;
+  }
+  if (scan->started == 0) {
+    atom_scan_free(scan);
+    snprintf(error, error_size, "Unable to start scanning %s", root);
+    return NULL;
+  }
+  return scan;
+}
+
+/*
+  Returns the next probed file, waiting for one to complete. The job holds
+  either a movie or an error and must be freed with atom_scan_job_free.
+  Returns NULL once every file has been returned, or when interrupted by
+  atom_scan_interrupt (scan->interrupted is set then).
+*/
+struct AtomScanJob *atom_scan_next(struct AtomScan *scan)
+{
+  struct AtomScanJob *job;
+
+  pthread_mutex_lock(&scan->lock);
+  while (!scan->done.head && (scan->walking || scan->pending) && !scan->interrupted) {
+    pthread_cond_wait(&scan->changed, &scan->lock);
+  }
+  job = atom_scan_shift(&scan->done);
+  // only the walker waits for files to be taken
+  if (job && scan->pending-- == ATOM_SCAN_PENDING(scan))
+    pthread_cond_broadcast(&scan->changed);
+  pthread_mutex_unlock(&scan->lock);
+  return job;
+}
+
+/*
+  Wakes up atom_scan_next, which returns NULL with scan->interrupted set.
+*/
+void atom_scan_interrupt(void *arg)
+{
+  struct AtomScan *scan = (struct AtomScan*)arg;
+  pthread_mutex_lock(&scan->lock);
+  scan->interrupted = 1;
+  pthread_cond_broadcast(&scan->changed);
+  pthread_mutex_unlock(&scan->lock);
+}
+
+/*
+  Stops the scan, waiting for the files being probed to finish, and frees
+  it along with every file not yet returned.
+*/
+void atom_scan_free(struct AtomScan *scan)
+{
+  uint32_t i;
+
+  pthread_mutex_lock(&scan->lock);
+  scan->cancelled = 1;
+  pthread_cond_broadcast(&scan->changed);
+  pthread_mutex_unlock(&scan->lock);
+
+  if (scan->walker_started) pthread_join(scan->walker, NULL);
+  for (i = 0; i < scan->started; i++) {
+    pthread_join(scan->workers[i], NULL);
+  }
+  atom_scan_free_queue(&scan->found);
+  atom_scan_free_queue(&scan->opened);
+  atom_scan_free_queue(&scan->done);
+  pthread_cond_destroy(&scan->changed);
+  pthread_mutex_destroy(&scan->lock);
+  free(scan->workers);
+  free(scan->pattern);
+  free(scan->root);
+  free(scan);
+}
@@ -0,0 +1,460 @@
+#include "rmov_ext.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+  Image sequences, both ways.
+
+  The image files of a sequence are inspected before they are made into a
+  movie. Each file gets a single stat and a few small reads to find its
+  format and dimensions: the IHDR chunk of a PNG, or the frame header of
+  a JPEG found by skipping from marker to marker. Files are claimed in
+  order by a pool of threads since on network storage the latency of
+  each stat dominates.
+
+  The samples of a track are exported to image files by a pool of threads
+  as well, each turning a run of samples into images (see atom_image.c)
+  and writing them. Nothing is decoded.
+*/
+
+static uint32_t atom_sequence_u16(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 8) | p[1];
+}
+
+static uint32_t atom_sequence_u32(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/*
+  Returns a new sequence with room for count frames playing frame_duration
+  each, NULL if out of memory. The caller fills in the filepath of each
+  frame.
+*/
+struct AtomSequence *atom_sequence_new(uint32_t count, uint32_t time_scale, uint32_t frame_duration)
+{
+  struct AtomSequence *sequence = (struct AtomSequence*)calloc(1, sizeof(struct AtomSequence));
+  if (sequence == NULL) return NULL;
+  sequence->frames = (struct AtomSequenceFrame*)calloc(count ? count : 1, sizeof(struct AtomSequenceFrame));
+  if (sequence->frames == NULL) {
+    free(sequence);
+    return NULL;
+  }
+  sequence->count = count;
+  sequence->time_scale = time_scale;
+  sequence->frame_duration = frame_duration;
+  pthread_mutex_init(&sequence->lock, NULL);
+  return sequence;
+}
+
+/*
+  Frees the sequence along with the filepaths of its frames.
+*/
+void atom_sequence_free(struct AtomSequence *sequence)
+{
+  uint32_t i;
+
+  for (i = 0; i < sequence->count; i++) {
+    free(sequence->frames[i].filepath);
+  }
+  free(sequence->frames);
+  pthread_mutex_destroy(&sequence->lock);
+  free(sequence);
+}
+
+/*  helper function, reads the width and height from the frame header of
+    a JPEG file. Application segments (such as Exif thumbnails) are
+    skipped without reading them. Returns 0 if there is no frame header
+    before the scan.
+*/
+static int atom_sequence_jpeg(int fd, struct AtomSequenceFrame *frame)
+{
+  unsigned char p[10];
+  uint64_t offset = 2;
+  ssize_t length;
+  int marker;
+
+  while (offset + 4 <= frame->size) {
+    length = pread(fd, p, sizeof(p), offset);
+    if (length < 4 || p[0] != 0xFF) return 0;
+    marker = p[1];
+    if (marker == 0xFF) {
+      offset++;  // fill byte
+      continue;
+    }
+    if (marker == 0xD9 || marker == 0xDA) return 0;
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+      offset += 2;
+      continue;
+    }
+    // SOF0 to SOF15, other than DHT, JPG and DAC
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      if (length < 10) return 0;
+      frame->height = atom_sequence_u16(p + 5);
+      frame->width = atom_sequence_u16(p + 7);
+      frame->depth = p[9] == 1 ? 40 : 24;
+      return frame->width && frame->height;
+    }
+    offset += 2 + atom_sequence_u16(p + 2);
+  }
+  return 0;
+}
+
+/*  helper function, reads the width, height and color type from the IHDR
+    chunk, which comes first in every PNG file.
+*/
+static int atom_sequence_png(int fd, struct AtomSequenceFrame *frame)
+{
+  unsigned char p[26];
+
+  if (pread(fd, p, sizeof(p), 0) != sizeof(p) || atom_sequence_u32(p + 12) != FOURCC('I','H','D','R'))
+    return 0;
+  frame->width = atom_sequence_u32(p + 16);
+  frame->height = atom_sequence_u32(p + 20);
+  // gray, gray with alpha and color with alpha
+  frame->depth = p[25] == 0 ? 40 : (p[25] == 4 || p[25] == 6) ? 32 : 24;
+  return frame->width && frame->height && frame->width <= 0xFFFF && frame->height <= 0xFFFF;
+}
+
+/*  helper function, finds the size, format and dimensions of the image
+    file of a frame. Returns 0 and fills in error on failure.
+*/
+static int atom_sequence_inspect_frame(struct AtomSequenceFrame *frame, char *error, size_t error_size)
+{
+  static const unsigned char png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  unsigned char p[8];
+  struct stat info;
+  int fd, ok = 0;
+
+  fd = open(frame->filepath, O_RDONLY);
+  if (fd < 0) {
+    snprintf(error, error_size, "Unable to open image file at %s", frame->filepath);
+    return 0;
+  }
+  if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+    snprintf(error, error_size, "Unable to read image file at %s", frame->filepath);
+    close(fd);
+    return 0;
+  }
+  frame->size = info.st_size;
+  if (frame->size > 0xFFFFFFFFULL) {
+    snprintf(error, error_size, "Image file at %s is too large to be a frame", frame->filepath);
+    close(fd);
+    return 0;
+  }
+
+  if (pread(fd, p, sizeof(p), 0) == sizeof(p)) {
+    if (p[0] == 0xFF && p[1] == 0xD8) {
+      frame->format = ATOM_IMAGE_JPEG;
+      ok = atom_sequence_jpeg(fd, frame);
+    } else if (memcmp(p, png_signature, sizeof(png_signature)) == 0) {
+      frame->format = ATOM_IMAGE_PNG;
+      ok = atom_sequence_png(fd, frame);
+    }
+  }
+  close(fd);
+  if (!ok)
+    snprintf(error, error_size, "Unable to find the size of the image at %s, only JPEG and PNG files are supported", frame->filepath);
+  return ok;
+}
+
+/*  helper function, worker thread of atom_sequence_inspect. Takes the
+    next unclaimed frame until none are left, the sequence is cancelled or
+    a frame can't be read.
+*/
+static void *atom_sequence_worker(void *arg)
+{
+  struct AtomSequence *sequence = (struct AtomSequence*)arg;
+  struct AtomSequenceFrame *frame;
+  char error[1024];
+
+  for (;;) {
+    pthread_mutex_lock(&sequence->lock);
+    frame = (sequence->next < sequence->count && !sequence->cancelled && !sequence->failed) ? &sequence->frames[sequence->next++] : NULL;
+    pthread_mutex_unlock(&sequence->lock);
+    if (frame == NULL) break;
+
+    if (!atom_sequence_inspect_frame(frame, error, sizeof(error))) {
+      pthread_mutex_lock(&sequence->lock);
+      if (!sequence->failed) {
+        sequence->failed = 1;
+        memcpy(sequence->error, error, sizeof(error));
+      }
+      pthread_mutex_unlock(&sequence->lock);
+    }
+  }
+  return NULL;
+}
+
+/*
+  Inspects every frame of the sequence using up to thread_count threads
+  and checks they all have the format and dimensions of the first.
+  Returns 0 and fills in the error of the sequence if a file can't be
+  read or differs, or the sequence was cancelled.
+*/
+int atom_sequence_inspect(struct AtomSequence *sequence, uint32_t thread_count)
+{
+  struct AtomSequenceFrame *first = sequence->frames, *frame;
+  pthread_t *threads;
+  uint32_t i, started = 0;
+
+  if (thread_count > sequence->count) thread_count = sequence->count;
+  if (thread_count < 1) thread_count = 1;
+
+  threads = (pthread_t*)malloc(thread_count * sizeof(pthread_t));
+  for (i = 0; threads && i < thread_count; i++) {
+    if (pthread_create(&threads[i], NULL, atom_sequence_worker, sequence) != 0) break;
+    started++;
+  }
+  // fall back to inspecting in this thread if none could be started
+  if (started == 0) atom_sequence_worker(sequence);
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  if (sequence->cancelled) {
+    snprintf(sequence->error, sizeof(sequence->error), "Inspecting the image sequence was interrupted.");
+    return 0;
+  }
+  if (sequence->failed) return 0;
+  for (i = 1; i < sequence->count; i++) {
+    frame = &sequence->frames[i];
+    if (frame->format != first->format || frame->width != first->width || frame->height != first->height) {
+      snprintf(sequence->error, sizeof(sequence->error), "Image at %s is a %ux%u %s, unlike the %ux%u %s at %s",
+        frame->filepath, frame->width, frame->height, frame->format == ATOM_IMAGE_PNG ? "PNG" : "JPEG",
+        first->width, first->height, first->format == ATOM_IMAGE_PNG ? "PNG" : "JPEG", first->filepath);
+      sequence->failed = 1;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+  Stops the sequence from inspecting or writing any more frames.
+*/
+void atom_sequence_cancel(void *arg)
+{
+  struct AtomSequence *sequence = (struct AtomSequence*)arg;
+  pthread_mutex_lock(&sequence->lock);
+  sequence->cancelled = 1;
+  pthread_mutex_unlock(&sequence->lock);
+}
+
+
+/*** EXPORT ***/
+
+/*
+  Returns a new export of count samples of the track starting with first
+  (starting at 0), NULL if out of memory or the sample tables can't be
+  read. The caller fills in the filepath of each sample. The movie holding
+  the media of the track is retained until the export is freed.
+*/
+struct AtomSequenceExport *atom_sequence_export_new(struct AtomTrack *track, uint32_t first, uint32_t count)
+{
+  struct AtomSequenceExport *export;
+  struct AtomSampleIndex *index = atom_track_sample_index(track);
+
+  if (!index || first > index->count || count > index->count - first) return NULL;
+  export = (struct AtomSequenceExport*)calloc(1, sizeof(struct AtomSequenceExport));
+  if (export == NULL) return NULL;
+  export->filepaths = (char**)calloc(count ? count : 1, sizeof(char*));
+  if (export->filepaths == NULL) {
+    free(export);
+    return NULL;
+  }
+  export->media = ATOM_TRACK_MEDIA(track);
+  export->index = index;
+  export->first = first;
+  export->count = count;
+  atom_movie_retain(export->media->movie);
+  pthread_mutex_init(&export->lock, NULL);
+  return export;
+}
+
+/*
+  Frees the export along with its filepaths and releases the movie.
+*/
+void atom_sequence_export_free(struct AtomSequenceExport *export)
+{
+  uint32_t i;
+
+  for (i = 0; i < export->count; i++) {
+    free(export->filepaths[i]);
+  }
+  free(export->filepaths);
+  atom_movie_free(export->media->movie);
+  pthread_mutex_destroy(&export->lock);
+  free(export);
+}
+
+/*  helper function, stops the export with the error of the first failure.
+*/
+static void atom_sequence_export_fail(struct AtomSequenceExport *export, const char *error)
+{
+  pthread_mutex_lock(&export->lock);
+  if (!export->failed) {
+    export->failed = 1;
+    snprintf(export->error, sizeof(export->error), "%s", error);
+  }
+  pthread_mutex_unlock(&export->lock);
+}
+
+/*  helper function, writes all of the image to a new file at filepath,
+    replacing any file there. Returns 0 on failure.
+*/
+static int atom_sequence_write_image(const char *filepath, const unsigned char *image, size_t length)
+{
+  ssize_t written;
+  int fd, ok = 1;
+
+  fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) return 0;
+  while (ok && length > 0) {
+    written = write(fd, image, length);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) ok = 0;
+    else {
+      image += written;
+      length -= written;
+    }
+  }
+  if (close(fd) != 0) ok = 0;
+  return ok;
+}
+
+/*  helper function, worker thread of atom_sequence_export. Takes the next
+    run of samples until none are left, the export is cancelled or a
+    sample can't be written.
+*/
+static void *atom_sequence_export_worker(void *arg)
+{
+  struct AtomSequenceExport *export = (struct AtomSequenceExport*)arg;
+  struct AtomSampleIndex *index = export->index;
+  struct AtomMovie *movie = export->media->movie;
+  const struct AtomSampleDescription *description;
+  const unsigned char *bytes;
+  unsigned char *buffer = NULL, *grown, *image;
+  size_t buffer_size = 0, length;
+  uint32_t start, end, i, sample, d;
+  char error[1024];
+
+  for (;;) {
+    pthread_mutex_lock(&export->lock);
+    start = export->next;
+    end = (export->cancelled || export->failed) ? start : (start + ATOM_SEQUENCE_EXPORT_RUN < export->count ? start + ATOM_SEQUENCE_EXPORT_RUN : export->count);
+    export->next = end;
+    pthread_mutex_unlock(&export->lock);
+    if (start == end) break;
+
+    for (i = start; i < end; i++) {
+      sample = export->first + i;
+      d = index->descriptions ? index->descriptions[sample] : 1;
+      if (d < 1 || d > export->media->sample_description_count) {
+        snprintf(error, sizeof(error), "Sample %u of track %u has no sample description", sample + 1, export->media->id);
+        atom_sequence_export_fail(export, error);
+        break;
+      }
+      description = &export->media->sample_descriptions[d - 1];
+      if (atom_image_description_format(description) == ATOM_IMAGE_NONE) {
+        snprintf(error, sizeof(error), "Unable to write sample %u of track %u without decoding its '%.4s' codec", sample + 1, export->media->id,
+          (char[4]){ description->format >> 24, description->format >> 16, description->format >> 8, description->format });
+        atom_sequence_export_fail(export, error);
+        break;
+      }
+
+      if (!(bytes = atom_movie_bytes(movie, index->offsets[sample], index->sizes[sample])) && !movie->map && movie->fd >= 0) {
+        if (index->sizes[sample] > buffer_size) {
+          if (!(grown = (unsigned char*)realloc(buffer, index->sizes[sample]))) {
+            snprintf(error, sizeof(error), "Unable to allocate %u bytes for sample %u of track %u", index->sizes[sample], sample + 1, export->media->id);
+            atom_sequence_export_fail(export, error);
+            break;
+          }
+          buffer = grown;
+          buffer_size = index->sizes[sample];
+        }
+        if (pread(movie->fd, buffer, index->sizes[sample], index->offsets[sample]) == (ssize_t)index->sizes[sample])
+          bytes = buffer;
+      }
+      if (!bytes) {
+        snprintf(error, sizeof(error), "Unable to read sample %u of track %u", sample + 1, export->media->id);
+        atom_sequence_export_fail(export, error);
+        break;
+      }
+      if (!(image = atom_image_sample(description, bytes, index->sizes[sample], &length))) {
+        snprintf(error, sizeof(error), "Sample %u of track %u is not a valid image", sample + 1, export->media->id);
+        atom_sequence_export_fail(export, error);
+        break;
+      }
+      if (!atom_sequence_write_image(export->filepaths[i], image, length)) {
+        snprintf(error, sizeof(error), "Error %d occurred while writing image to %s", errno, export->filepaths[i]);
+        free(image);
+        atom_sequence_export_fail(export, error);
+        break;
+      }
+      free(image);
+    }
+  }
+  free(buffer);
+  return NULL;
+}
+
+/*
+  Writes every sample of the export to its file using up to thread_count
+  threads. Returns 0 and fills in the error of the export if a sample
+  can't be written or the export was cancelled, files written until then
+  are left.
+*/
+int atom_sequence_export(struct AtomSequenceExport *export, uint32_t thread_count)
+{
+  struct AtomSampleIndex *index = export->index;
+  pthread_t *threads;
+  uint64_t start = UINT64_MAX, end = 0;
+  uint32_t i, started = 0;
+
+  for (i = export->first; i < export->first + export->count; i++) {
+    if (index->offsets[i] < start) start = index->offsets[i];
+    if (index->offsets[i] + index->sizes[i] > end) end = index->offsets[i] + index->sizes[i];
+  }
+  atom_movie_advise_sequential(export->media->movie, start, end);
+
+  if (thread_count > (export->count + ATOM_SEQUENCE_EXPORT_RUN - 1) / ATOM_SEQUENCE_EXPORT_RUN)
+    thread_count = (export->count + ATOM_SEQUENCE_EXPORT_RUN - 1) / ATOM_SEQUENCE_EXPORT_RUN;
+  if (thread_count < 1) thread_count = 1;
+
+  threads = (pthread_t*)malloc(thread_count * sizeof(pthread_t));
+  for (i = 0; threads && i < thread_count; i++) {
+    if (pthread_create(&threads[i], NULL, atom_sequence_export_worker, export) != 0) break;
+    started++;
+  }
+  // fall back to writing in this thread if none could be started
+  if (started == 0) atom_sequence_export_worker(export);
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  if (export->cancelled && !export->failed) {
+    snprintf(export->error, sizeof(export->error), "Exporting the image sequence was interrupted.");
+    return 0;
+  }
+  return !export->failed;
+}
+
+/*
+  Stops the export from starting any more samples.
+*/
+void atom_sequence_export_cancel(void *arg)
+{
+  struct AtomSequenceExport *export = (struct AtomSequenceExport*)arg;
+  pthread_mutex_lock(&export->lock);
+  export->cancelled = 1;
+  pthread_mutex_unlock(&export->lock);
+}
@@ -0,0 +1,194 @@
+#include "rmov_ext.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  Reads a movie from a stream, such as a pipe, which is read once from
+  start to end and can't seek. The bytes are fed in as they arrive and
+  the top level atoms are walked from their headers. The moov atom is
+  read into memory, the payloads of all other atoms, the media above all,
+  are skipped a chunk at a time without being held. Once the moov atom is
+  complete the movie is probed from memory, the rest of the stream is
+  left unread. The movie reports like a probed one but can't read the
+  data of its samples.
+*/
+
+static uint32_t atom_u32(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t atom_u64(const unsigned char *p)
+{
+  return ((uint64_t)atom_u32(p) << 32) | atom_u32(p + 4);
+}
+
+/*
+  Starts reading a stream, holding a moov atom of at most buffer_limit
+  bytes (ATOM_STREAM_BUFFER_LIMIT for 0).
+*/
+void atom_stream_init(struct AtomStream *stream, uint64_t buffer_limit)
+{
+  memset(stream, 0, sizeof(struct AtomStream));
+  stream->buffer_limit = buffer_limit ? buffer_limit : ATOM_STREAM_BUFFER_LIMIT;
+  stream->tail = &stream->atoms;
+}
+
+/*
+  Returns how many bytes to read from the stream next, never more than
+  the rest of the current atom or ATOM_STREAM_CHUNK_SIZE. Feeding more
+  than that isn't allowed.
+*/
+size_t atom_stream_wanted(struct AtomStream *stream)
+{
+  if (stream->remaining == 0) {
+    // a size of 1 is followed by the 64 bit size
+    if (stream->header_length >= 8 && atom_u32(stream->header) == 1) return 16 - stream->header_length;
+    return 8 - stream->header_length;
+  }
+  return stream->remaining < ATOM_STREAM_CHUNK_SIZE ? (size_t)stream->remaining : ATOM_STREAM_CHUNK_SIZE;
+}
+
+/*  helper function, adds the top level atom whose header was just read.
+    Returns 0 and fills in error if the stream can't be read on.
+*/
+static int atom_stream_add(struct AtomStream *stream, char *error, size_t error_size)
+{
+  struct Atom *atom;
+  uint32_t header_size = stream->header_length;
+  uint64_t size = atom_u32(stream->header);
+  uint32_t type = atom_u32(stream->header + 4);
+
+  if (size == 1) size = atom_u64(stream->header + 8);
+  if (size == 0) {
+    // an atom lasting until the end of the stream is the last one
+    snprintf(error, error_size, "Unable to find movie data in stream, its '%.4s' atom at %llu lasts until the end", (const char*)stream->header + 4, (unsigned long long)(stream->offset - header_size));
+    return 0;
+  }
+  if (size < header_size) {
+    snprintf(error, error_size, "Unable to read stream, invalid atom size at %llu", (unsigned long long)(stream->offset - header_size));
+    return 0;
+  }
+
+  atom = (struct Atom*)calloc(1, sizeof(struct Atom));
+  if (atom == NULL) {
+    snprintf(error, error_size, "Unable to read stream, out of memory");
+    return 0;
+  }
+  atom->type = type;
+  atom->offset = stream->offset - header_size;
+  atom->size = size;
+  atom->header_size = header_size;
+  *stream->tail = atom;
+  stream->tail = &atom->next;
+  stream->remaining = size - header_size;
+  stream->header_length = 0;
+
+  if (type == FOURCC('m','o','o','v') && !stream->moov) {
+    if (size > stream->buffer_limit) {
+      snprintf(error, error_size, "Unable to read movie data of %llu bytes from stream, larger than the buffer limit of %llu bytes", (unsigned long long)size, (unsigned long long)stream->buffer_limit);
+      return 0;
+    }
+    if (size > SIZE_MAX || !(stream->buffer = (unsigned char*)malloc((size_t)size))) {
+      snprintf(error, error_size, "Unable to read movie data of %llu bytes from stream, out of memory", (unsigned long long)size);
+      return 0;
+    }
+    memcpy(stream->buffer, stream->header, header_size);
+    stream->buffer_length = header_size;
+    stream->moov = atom;
+  }
+  return 1;
+}
+
+/*
+  Feeds the next length bytes of the stream, at most atom_stream_wanted
+  of them, and a length of 0 at its end. Returns 1 once the moov atom is
+  read, 0 while more is needed and -1 with error filled in if the stream
+  isn't a movie or its moov atom can't be held.
+*/
+int atom_stream_feed(struct AtomStream *stream, const unsigned char *bytes, size_t length, char *error, size_t error_size)
+{
+  size_t count;
+
+  if (length == 0) {
+    if (stream->moov)
+      snprintf(error, error_size, "Unable to read movie data, the stream ended %llu bytes short of it", (unsigned long long)stream->remaining);
+    else if (stream->atoms || stream->header_length)
+      snprintf(error, error_size, "Unable to find movie data in stream");
+    else
+      snprintf(error, error_size, "Unable to read movie from empty stream");
+    return -1;
+  }
+
+  while (length > 0) {
+    if (stream->remaining == 0) {
+      count = atom_stream_wanted(stream);
+      if (count > length) count = length;
+      memcpy(stream->header + stream->header_length, bytes, count);
+      stream->header_length += count;
+      stream->offset += count;
+      bytes += count;
+      length -= count;
+      if (atom_stream_wanted(stream) > 0) continue;
+      if (!atom_stream_add(stream, error, error_size)) return -1;
+    } else {
+      count = length < stream->remaining ? length : (size_t)stream->remaining;
+      // the moov atom is the only one being kept
+      if (stream->moov) {
+        memcpy(stream->buffer + stream->buffer_length, bytes, count);
+        stream->buffer_length += count;
+      }
+      stream->remaining -= count;
+      stream->offset += count;
+      bytes += count;
+      length -= count;
+    }
+    if (stream->moov && stream->buffer_length == stream->moov->size) return 1;
+  }
+  return stream->moov && stream->buffer_length == stream->moov->size;
+}
+
+/*
+  Returns the movie of a stream whose moov atom was read, probed from
+  memory, and takes over the atoms read so far. The name of the stream is
+  used in error messages. Returns NULL and fills in error if its movie
+  data can't be parsed.
+*/
+struct AtomMovie *atom_stream_movie(struct AtomStream *stream, const char *name, char *error, size_t error_size)
+{
+  struct AtomMovie *movie = atom_movie_empty();
+
+  if (movie == NULL) {
+    snprintf(error, error_size, "Unable to read stream, out of memory");
+    return NULL;
+  }
+  movie->atoms = stream->atoms;
+  movie->file_size = stream->offset;
+  movie->moov_buffer = stream->buffer;
+  movie->moov_buffer_offset = stream->moov->offset;
+  movie->moov_buffer_size = stream->moov->size;
+  stream->atoms = NULL;
+  stream->tail = &stream->atoms;
+  stream->buffer = NULL;
+  stream->moov = NULL;
+  return atom_movie_load(movie, name, error, error_size);
+}
+
+/*
+  Frees what a stream holds unless atom_stream_movie took it over.
+*/
+void atom_stream_free(struct AtomStream *stream)
+{
+  struct Atom *next;
+
+  while (stream->atoms) {
+    next = stream->atoms->next;
+    free(stream->atoms);
+    stream->atoms = next;
+  }
+  free(stream->buffer);
+  stream->buffer = NULL;
+  stream->moov = NULL;
+}
@@ -0,0 +1,220 @@
+#include "rmov_ext.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  Reads text tracks, the QuickTime 'text' and the 3GPP 'tx3g' formats,
+  and the chapters of a movie. Both formats start each sample with the
+  length of the text and the text itself, followed by style and other
+  modifier atoms which are ignored. The text is UTF-8, or UTF-16 when it
+  starts with a byte order mark, older files may use Mac OS Roman.
+  Chapters are the samples of a text track other tracks refer to with a
+  'chap' track reference.
+*/
+
+/*  the characters 0x80 to 0xFF of Mac OS Roman, the encoding of older
+    QuickTime text samples which aren't UTF-8.
+*/
+static const uint16_t atom_text_mac_roman[128] = {
+  0x00C4, 0x00C5, 0x00C7, 0x00C9, 0x00D1, 0x00D6, 0x00DC, 0x00E1, 0x00E0, 0x00E2, 0x00E4, 0x00E3, 0x00E5, 0x00E7, 0x00E9, 0x00E8,
+  0x00EA, 0x00EB, 0x00ED, 0x00EC, 0x00EE, 0x00EF, 0x00F1, 0x00F3, 0x00F2, 0x00F4, 0x00F6, 0x00F5, 0x00FA, 0x00F9, 0x00FB, 0x00FC,
+  0x2020, 0x00B0, 0x00A2, 0x00A3, 0x00A7, 0x2022, 0x00B6, 0x00DF, 0x00AE, 0x00A9, 0x2122, 0x00B4, 0x00A8, 0x2260, 0x00C6, 0x00D8,
+  0x221E, 0x00B1, 0x2264, 0x2265, 0x00A5, 0x00B5, 0x2202, 0x2211, 0x220F, 0x03C0, 0x222B, 0x00AA, 0x00BA, 0x03A9, 0x00E6, 0x00F8,
+  0x00BF, 0x00A1, 0x00AC, 0x221A, 0x0192, 0x2248, 0x2206, 0x00AB, 0x00BB, 0x2026, 0x00A0, 0x00C0, 0x00C3, 0x00D5, 0x0152, 0x0153,
+  0x2013, 0x2014, 0x201C, 0x201D, 0x2018, 0x2019, 0x00F7, 0x25CA, 0x00FF, 0x0178, 0x2044, 0x20AC, 0x2039, 0x203A, 0xFB01, 0xFB02,
+  0x2021, 0x00B7, 0x201A, 0x201E, 0x2030, 0x00C2, 0x00CA, 0x00C1, 0x00CB, 0x00C8, 0x00CD, 0x00CE, 0x00CF, 0x00CC, 0x00D3, 0x00D4,
+  0xF8FF, 0x00D2, 0x00DA, 0x00DB, 0x00D9, 0x0131, 0x02C6, 0x02DC, 0x00AF, 0x02D8, 0x02D9, 0x02DA, 0x00B8, 0x02DD, 0x02DB, 0x02C7
+};
+
+/*
+  Returns true if the sample description is of a text format read by
+  atom_text_decode.
+*/
+int atom_text_description(const struct AtomSampleDescription *description)
+{
+  return description && (description->format == FOURCC('t','e','x','t') || description->format == FOURCC('t','x','3','g'));
+}
+
+/*  helper function, appends a code point as UTF-8.
+*/
+static void atom_text_utf8(char *text, size_t *length, uint32_t c)
+{
+  if (c < 0x80) {
+    text[(*length)++] = (char)c;
+  } else if (c < 0x800) {
+    text[(*length)++] = (char)(0xC0 | (c >> 6));
+    text[(*length)++] = (char)(0x80 | (c & 0x3F));
+  } else if (c < 0x10000) {
+    text[(*length)++] = (char)(0xE0 | (c >> 12));
+    text[(*length)++] = (char)(0x80 | ((c >> 6) & 0x3F));
+    text[(*length)++] = (char)(0x80 | (c & 0x3F));
+  } else {
+    text[(*length)++] = (char)(0xF0 | (c >> 18));
+    text[(*length)++] = (char)(0x80 | ((c >> 12) & 0x3F));
+    text[(*length)++] = (char)(0x80 | ((c >> 6) & 0x3F));
+    text[(*length)++] = (char)(0x80 | (c & 0x3F));
+  }
+}
+
+/*  helper function, true if the bytes are well formed UTF-8.
+*/
+static int atom_text_is_utf8(const unsigned char *p, size_t count)
+{
+  size_t i = 0, follow;
+
+  while (i < count) {
+    if (p[i] < 0x80) {
+      i++;
+      continue;
+    }
+    if (p[i] >= 0xC2 && p[i] <= 0xDF) follow = 1;
+    else if (p[i] >= 0xE0 && p[i] <= 0xEF) follow = 2;
+    else if (p[i] >= 0xF0 && p[i] <= 0xF4) follow = 3;
+    else return 0;
+    for (i++; follow > 0; follow--, i++) {
+      if (i >= count || (p[i] & 0xC0) != 0x80) return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+  Returns count bytes of text as a NUL terminated UTF-8 string, with the
+  carriage returns QuickTime ends lines with turned into newlines, and its
+  length in bytes. Text which is neither UTF-16 with a byte order mark nor
+  UTF-8 is read as Mac OS Roman. Returns NULL if memory runs out, the
+  string must be freed with free.
+*/
+char *atom_text_string(const unsigned char *p, size_t count, size_t *length)
+{
+  uint32_t c, low;
+  int big_endian, utf8;
+  size_t i;
+  char *text;
+
+  // a byte of Mac OS Roman takes at most 3 bytes of UTF-8
+  if (!(text = (char*)malloc(count * 3 + 1))) return NULL;
+  *length = 0;
+
+  if (count >= 2 && ((p[0] == 0xFE && p[1] == 0xFF) || (p[0] == 0xFF && p[1] == 0xFE))) {
+    big_endian = p[0] == 0xFE;
+    for (i = 2; i + 1 < count; i += 2) {
+      c = big_endian ? (uint32_t)((p[i] << 8) | p[i + 1]) : (uint32_t)((p[i + 1] << 8) | p[i]);
+      if (c >= 0xD800 && c < 0xDC00 && i + 3 < count) {
+        low = big_endian ? (uint32_t)((p[i + 2] << 8) | p[i + 3]) : (uint32_t)((p[i + 3] << 8) | p[i + 2]);
+        if (low >= 0xDC00 && low < 0xE000) {
+          c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+          i += 2;
+        }
+      }
+      if (c == '\r' && !(i + 3 < count && (big_endian ? p[i + 2] == 0 && p[i + 3] == '\n' : p[i + 3] == 0 && p[i + 2] == '\n'))) c = '\n';
+      if (c != '\r') atom_text_utf8(text, length, c);
+    }
+  } else {
+    utf8 = atom_text_is_utf8(p, count);
+    for (i = 0; i < count; i++) {
+      if (p[i] == '\r') {
+        if (i + 1 < count && p[i + 1] == '\n') continue;
+        text[(*length)++] = '\n';
+      } else if (p[i] >= 0x80 && !utf8) {
+        atom_text_utf8(text, length, atom_text_mac_roman[p[i] - 0x80]);
+      } else {
+        text[(*length)++] = (char)p[i];
+      }
+    }
+  }
+  text[*length] = '\0';
+  return text;
+}
+
+/*
+  Returns the text of a text sample as atom_text_string does.
+*/
+char *atom_text_decode(const unsigned char *p, size_t size, size_t *length)
+{
+  size_t count = size >= 2 ? (size_t)((p[0] << 8) | p[1]) : 0;
+
+  if (count > size - 2) count = size >= 2 ? size - 2 : 0;
+  return atom_text_string(p + 2, count, length);
+}
+
+/*
+  Returns the time in the movie time scale at which the media time of the
+  track is first shown through its edit list, or -1 if it isn't shown.
+*/
+int64_t atom_track_movie_time(struct AtomTrack *track, int64_t media_time)
+{
+  struct AtomTrack *media = ATOM_TRACK_MEDIA(track);
+  struct AtomEdit *edit;
+  int64_t position = 0, length;
+  double scale;
+  uint32_t i;
+
+  if (!media->media_time_scale || !track->movie->time_scale) return -1;
+  for (i = 0; i < track->edit_count; position += track->edits[i++].segment_duration) {
+    edit = &track->edits[i];
+    if (edit->media_time < 0 || edit->media_rate <= 0 || (edit->media && ATOM_TRACK_MEDIA(edit->media) != media)) continue;
+    scale = (double)media->media_time_scale / track->movie->time_scale * edit->media_rate / 65536.0;
+    length = (int64_t)(edit->segment_duration * scale + 0.5);
+    if (media_time >= edit->media_time && media_time < edit->media_time + length)
+      return position + (int64_t)((media_time - edit->media_time) / scale + 0.5);
+  }
+  return -1;
+}
+
+/*
+  Returns true if the track refers to the track with the given id with a
+  track reference of the given type, such as 'chap'.
+*/
+int atom_track_refers(struct AtomTrack *track, uint32_t type, uint32_t id)
+{
+  struct AtomTrack *media = ATOM_TRACK_MEDIA(track);
+  struct Atom *reference;
+  const unsigned char *p;
+  uint64_t i;
+
+  // references of media pasted from another movie are to its tracks
+  if (media->movie != track->movie) return 0;
+  reference = atom_find(media->trak, FOURCC('t','r','e','f'));
+  for (reference = reference ? reference->children : NULL; reference; reference = reference->next) {
+    if (reference->type != type || !(p = atom_data(media->movie, reference))) continue;
+    for (i = 0; i + 4 <= ATOM_DATA_SIZE(reference); i += 4) {
+      if ((uint32_t)((p[i] << 24) | (p[i + 1] << 16) | (p[i + 2] << 8) | p[i + 3]) == id) return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+  Returns true if the track is a text track holding chapters, one another
+  track of the movie refers to with a 'chap' reference. Tracks of chapter
+  images are not.
+*/
+int atom_track_is_chapters(struct AtomTrack *track)
+{
+  struct AtomMovie *movie = track->movie;
+  struct AtomTrack *media = ATOM_TRACK_MEDIA(track);
+  uint32_t i;
+
+  if (media->sample_description_count == 0 || !atom_text_description(&media->sample_descriptions[0])) return 0;
+  for (i = 0; i < movie->track_count; i++) {
+    if (movie->tracks[i] != track && atom_track_refers(movie->tracks[i], FOURCC('c','h','a','p'), track->id)) return 1;
+  }
+  return 0;
+}
+
+/*
+  Returns the first text track of the movie holding chapters, or NULL if
+  it has none.
+*/
+struct AtomTrack *atom_movie_chapter_track(struct AtomMovie *movie)
+{
+  uint32_t i;
+
+  if (!atom_movie_load_tracks(movie)) return NULL;
+  for (i = 0; i < movie->track_count; i++) {
+    if (atom_track_is_chapters(movie->tracks[i])) return movie->tracks[i];
+  }
+  return NULL;
+}
@@ -0,0 +1,2638 @@
+#include "rmov_ext.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+/*
+  Native movie writer. Flattening gathers the samples played by the edits
+  of each track, lays them out in chunks and writes a new moov atom with
+  rebuilt sample tables. The sample data is copied from the source files
+  in large runs with copy_file_range (or sendfile), so it's never read
+  into this process when the kernel can avoid it. Image sequences are
+  written the same way, each image file becoming a sample.
+*/
+
+/*** BUFFER ***/
+
+static uint16_t atom_u16(const unsigned char *p)
+{
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t atom_u32(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t atom_u64(const unsigned char *p)
+{
+  return ((uint64_t)atom_u32(p) << 32) | atom_u32(p + 4);
+}
+
+static void buf_reserve(struct AtomBuffer *b, size_t length)
+{
+  unsigned char *data;
+  size_t capacity;
+
+  if (b->failed || b->size + length <= b->capacity) return;
+  capacity = b->capacity ? b->capacity : 4096;
+  while (capacity < b->size + length) capacity *= 2;
+  data = (unsigned char*)realloc(b->data, capacity);
+  if (data == NULL) {
+    b->failed = 1;
+    return;
+  }
+  b->data = data;
+  b->capacity = capacity;
+}
+
+static void buf_bytes(struct AtomBuffer *b, const void *bytes, size_t length)
+{
+  buf_reserve(b, length);
+  if (b->failed) return;
+  memcpy(b->data + b->size, bytes, length);
+  b->size += length;
+}
+
+static void buf_u16(struct AtomBuffer *b, uint16_t value)
+{
+  unsigned char p[2] = { value >> 8, value };
+  buf_bytes(b, p, 2);
+}
+
+static void buf_u32(struct AtomBuffer *b, uint32_t value)
+{
+  unsigned char p[4] = { value >> 24, value >> 16, value >> 8, value };
+  buf_bytes(b, p, 4);
+}
+
+static void buf_u64(struct AtomBuffer *b, uint64_t value)
+{
+  buf_u32(b, (uint32_t)(value >> 32));
+  buf_u32(b, (uint32_t)value);
+}
+
+/*
+  Starts an atom of the given type, returning its position for buf_end.
+*/
+static size_t buf_begin(struct AtomBuffer *b, uint32_t type)
+{
+  size_t start = b->size;
+  buf_u32(b, 0);
+  buf_u32(b, type);
+  return start;
+}
+
+/*
+  Starts a full atom, which has a version and flags after its header.
+*/
+static size_t buf_begin_full(struct AtomBuffer *b, uint32_t type, uint8_t version, uint32_t flags)
+{
+  size_t start = buf_begin(b, type);
+  buf_u32(b, ((uint32_t)version << 24) | (flags & 0x00FFFFFF));
+  return start;
+}
+
+/*
+  Ends the atom started at start by filling in its size.
+*/
+static void buf_end(struct AtomBuffer *b, size_t start)
+{
+  uint32_t size = (uint32_t)(b->size - start);
+
+  if (b->failed) return;
+  b->data[start] = size >> 24;
+  b->data[start + 1] = size >> 16;
+  b->data[start + 2] = size >> 8;
+  b->data[start + 3] = size;
+}
+
+static void buf_free(struct AtomBuffer *b)
+{
+  free(b->data);
+  memset(b, 0, sizeof(struct AtomBuffer));
+}
+
+/*
+  Appends the atom as it is in the movie file, header included.
+*/
+static void buf_atom(struct AtomBuffer *b, struct AtomMovie *movie, struct Atom *atom)
+{
+  buf_reserve(b, atom->size);
+  if (b->failed) return;
+  if (pread(movie->fd, b->data + b->size, atom->size, atom->offset) != (ssize_t)atom->size) {
+    b->failed = 1;
+    return;
+  }
+  b->size += atom->size;
+}
+
+
+/*** PLANNING ***/
+
+/*  A sample to be written, and where to copy it from.
+*/
+struct AtomWriteSample {
+  struct AtomMovie *source;
+  uint64_t offset;          /* in the source file */
+  uint32_t size;
+  uint32_t duration;
+  int32_t cts_offset;
+  uint32_t description;     /* 1 based, in the written stsd */
+  int sync;
+};
+
+struct AtomWriteChunk {
+  uint32_t track;           /* index into the written tracks */
+  uint32_t first;           /* first sample of the track in this chunk */
+  uint32_t count;
+  uint64_t size;            /* bytes of samples */
+  double time;              /* movie time in seconds the chunk starts playing */
+  uint64_t offset;          /* in the written mdat payload */
+};
+
+struct AtomWriteTrack {
+  struct AtomTrack *track;
+  struct AtomTrack *media;  /* track providing the media headers */
+  uint32_t media_time_scale;
+  uint64_t media_duration;
+  struct AtomEdit *edits;
+  uint32_t edit_count;
+  struct AtomWriteSample *samples;
+  uint32_t sample_count;
+  uint32_t sample_capacity;
+  struct AtomTrack **description_sources;  /* media whose descriptions are written */
+  uint32_t *description_bases;             /* first written index of each */
+  uint32_t description_source_count;
+  uint32_t description_count;
+  uint32_t chunk_first;
+  uint32_t chunk_count;
+};
+
+struct AtomWritePlan {
+  struct AtomMovie *movie;
+  struct AtomWriteTrack *tracks;
+  uint32_t track_count;
+  struct AtomWriteChunk *chunks;
+  uint32_t chunk_count;
+  uint32_t *layout;          /* chunks in the order they are written */
+  uint64_t mdat_size;
+  char *error;
+  size_t error_size;
+};
+
+static void atom_write_track_free(struct AtomWriteTrack *wt)
+{
+  free(wt->edits);
+  free(wt->samples);
+  free(wt->description_sources);
+  free(wt->description_bases);
+}
+
+static void atom_write_plan_free(struct AtomWritePlan *plan)
+{
+  uint32_t i;
+
+  for (i = 0; i < plan->track_count; i++) {
+    atom_write_track_free(&plan->tracks[i]);
+  }
+  free(plan->tracks);
+  free(plan->chunks);
+  free(plan->layout);
+}
+
+/*  helper function, finds the sample description table of a media track.
+*/
+static struct Atom *atom_track_stsd(struct AtomTrack *media)
+{
+  return atom_find(atom_find(atom_find(atom_find(media->trak, FOURCC('m','d','i','a')), FOURCC('m','i','n','f')), FOURCC('s','t','b','l')), FOURCC('s','t','s','d'));
+}
+
+/*  helper function, returns the written index of the first description
+    of media, adding its descriptions to the track if they aren't yet.
+    Returns 0 on failure.
+*/
+static uint32_t atom_write_description_base(struct AtomWriteTrack *wt, struct AtomTrack *media)
+{
+  struct AtomTrack **sources;
+  uint32_t *bases, i;
+
+  for (i = 0; i < wt->description_source_count; i++) {
+    if (wt->description_sources[i] == media) return wt->description_bases[i];
+  }
+  sources = (struct AtomTrack**)realloc(wt->description_sources, (i + 1) * sizeof(struct AtomTrack*));
+  if (sources == NULL) return 0;
+  wt->description_sources = sources;
+  bases = (uint32_t*)realloc(wt->description_bases, (i + 1) * sizeof(uint32_t));
+  if (bases == NULL) return 0;
+  wt->description_bases = bases;
+
+  sources[i] = media;
+  bases[i] = wt->description_count + 1;
+  wt->description_count += media->sample_description_count;
+  wt->description_source_count++;
+  return bases[i];
+}
+
+static int atom_write_push_sample(struct AtomWriteTrack *wt, struct AtomWriteSample *sample)
+{
+  struct AtomWriteSample *samples;
+
+  if (wt->sample_count == wt->sample_capacity) {
+    wt->sample_capacity = wt->sample_capacity ? wt->sample_capacity * 2 : 256;
+    samples = (struct AtomWriteSample*)realloc(wt->samples, wt->sample_capacity * sizeof(struct AtomWriteSample));
+    if (samples == NULL) return 0;
+    wt->samples = samples;
+  }
+  wt->samples[wt->sample_count++] = *sample;
+  return 1;
+}
+
+/*  helper function, gathers the samples played by each edit of the track
+    and rewrites the edits to play them from their new media times. An
+    edit starting within a group of pictures takes the samples from the
+    key frame before it, so it can still be decoded.
+*/
+static int atom_write_plan_track(struct AtomWritePlan *plan, struct AtomWriteTrack *wt)
+{
+  struct AtomTrack *track = wt->track, *media;
+  struct AtomSampleIndex *index;
+  struct AtomWriteSample sample;
+  struct AtomEdit *edit;
+  int64_t first, last, media_length, time = 0;
+  uint32_t i, base, s;
+
+  wt->edits = (struct AtomEdit*)calloc(track->edit_count ? track->edit_count : 1, sizeof(struct AtomEdit));
+  if (wt->edits == NULL) return 0;
+  wt->edit_count = track->edit_count;
+
+  for (i = 0; i < track->edit_count; i++) {
+    edit = &wt->edits[i];
+    *edit = track->edits[i];
+    if (edit->media_time == -1) continue;
+
+    media = ATOM_TRACK_MEDIA(edit->media);
+    if (!wt->media) {
+      wt->media = media;
+      wt->media_time_scale = media->media_time_scale;
+    }
+    if (media->media_time_scale != wt->media_time_scale || media->handler_type != wt->media->handler_type) {
+      snprintf(plan->error, plan->error_size, "Unable to flatten track %u which plays different kinds of media", track->id);
+      return 0;
+    }
+    if (!(index = atom_track_sample_index(media)) || index->count == 0 || !(base = atom_write_description_base(wt, media))) {
+      snprintf(plan->error, plan->error_size, "Unable to read sample tables of track %u", media->id);
+      return 0;
+    }
+
+    media_length = (int64_t)((double)edit->segment_duration * media->media_time_scale / plan->movie->time_scale * edit->media_rate / 65536.0 + 0.5);
+    first = atom_sample_at_time(index, edit->media_time);
+    if ((last = atom_sync_sample_before(index, first)) >= 0) first = last;
+    last = atom_sample_at_time(index, edit->media_time + (media_length > 0 ? media_length - 1 : 0));
+
+    edit->media_time = time + (edit->media_time - index->dts[first]);
+    edit->media = NULL;
+    for (s = first; s <= last; s++) {
+      sample.source = media->movie;
+      sample.offset = index->offsets[s];
+      sample.size = index->sizes[s];
+      sample.duration = (uint32_t)(((s + 1 < index->count) ? index->dts[s + 1] : index->end_time) - index->dts[s]);
+      sample.cts_offset = index->cts_offsets ? index->cts_offsets[s] : 0;
+      sample.description = base + (index->descriptions ? index->descriptions[s] : 1) - 1;
+      sample.sync = atom_sample_is_sync(index, s);
+      if (!atom_write_push_sample(wt, &sample)) return 0;
+      time += sample.duration;
+    }
+  }
+  wt->media_duration = time;
+  return 1;
+}
+
+/*  helper function, splits the samples of each track into chunks of
+    samples which are stored one after another in the same source file.
+    Chunks don't cross multiples of the chunk duration, so the same media
+    is chunked the same way whatever its layout. With a maximum
+    distance chunks are also kept small enough that one chunk of every
+    track fits in it, so the media of tracks playing together stays that
+    close once interleaved.
+*/
+static int atom_write_plan_chunks(struct AtomWritePlan *plan, const struct AtomFlattenOptions *options)
+{
+  struct AtomWriteTrack *wt;
+  struct AtomWriteSample *sample, *previous;
+  struct AtomWriteChunk *chunks, *chunk = NULL;
+  uint32_t capacity = 0, t, s;
+  uint64_t time, chunk_start = 0, max_size = 0;
+  double duration = options->chunk_duration > 0 ? options->chunk_duration : ATOM_CHUNK_DURATION;
+
+  if (options->max_distance && plan->track_count)
+    max_size = options->max_distance / plan->track_count;
+
+  for (t = 0; t < plan->track_count; t++) {
+    wt = &plan->tracks[t];
+    wt->chunk_first = plan->chunk_count;
+    time = 0;
+    for (s = 0; s < wt->sample_count; s++) {
+      sample = &wt->samples[s];
+      previous = s ? &wt->samples[s - 1] : NULL;
+      if (!previous || previous->source != sample->source || previous->offset + previous->size != sample->offset ||
+          previous->description != sample->description ||
+          floor(time / (duration * wt->media_time_scale)) != floor(chunk_start / (duration * wt->media_time_scale)) ||
+          (max_size && chunk->size + sample->size > max_size)) {
+        if (plan->chunk_count == capacity) {
+          capacity = capacity ? capacity * 2 : 256;
+          if (!(chunks = (struct AtomWriteChunk*)realloc(plan->chunks, capacity * sizeof(struct AtomWriteChunk)))) return 0;
+          plan->chunks = chunks;
+        }
+        chunk = &plan->chunks[plan->chunk_count++];
+        chunk->track = t;
+        chunk->first = s;
+        chunk->count = 0;
+        chunk->size = 0;
+        chunk->time = (double)atom_track_offset(wt->track) / plan->movie->time_scale + (double)time / wt->media_time_scale;
+        chunk_start = time;
+      }
+      chunk->count++;
+      chunk->size += sample->size;
+      time += sample->duration;
+    }
+    wt->chunk_count = plan->chunk_count - wt->chunk_first;
+  }
+  return 1;
+}
+
+/*  helper function, orders chunks by the time they start playing, and by
+    track for the same time. The keys carry what is compared, so sorting
+    needs no shared state.
+*/
+struct AtomChunkOrder {
+  double time;
+  uint32_t track;
+  uint32_t first;
+  uint32_t chunk;
+};
+
+static int atom_compare_chunks(const void *a, const void *b)
+{
+  const struct AtomChunkOrder *x = (const struct AtomChunkOrder*)a;
+  const struct AtomChunkOrder *y = (const struct AtomChunkOrder*)b;
+
+  if (x->time != y->time) return x->time < y->time ? -1 : 1;
+  if (x->track != y->track) return x->track < y->track ? -1 : 1;
+  return x->first < y->first ? -1 : (x->first > y->first);
+}
+
+/*  helper function, returns the chunk indices ordered by the time the
+    chunks start playing. Returns NULL if out of memory.
+*/
+static uint32_t *atom_write_play_order(struct AtomWritePlan *plan)
+{
+  struct AtomChunkOrder *keys;
+  uint32_t *order, i;
+
+  order = (uint32_t*)malloc((plan->chunk_count ? plan->chunk_count : 1) * sizeof(uint32_t));
+  keys = (struct AtomChunkOrder*)malloc((plan->chunk_count ? plan->chunk_count : 1) * sizeof(struct AtomChunkOrder));
+  if (order == NULL || keys == NULL) {
+    free(order);
+    free(keys);
+    return NULL;
+  }
+  for (i = 0; i < plan->chunk_count; i++) {
+    keys[i].time = plan->chunks[i].time;
+    keys[i].track = plan->chunks[i].track;
+    keys[i].first = plan->chunks[i].first;
+    keys[i].chunk = i;
+  }
+  qsort(keys, plan->chunk_count, sizeof(struct AtomChunkOrder), atom_compare_chunks);
+  for (i = 0; i < plan->chunk_count; i++) {
+    order[i] = keys[i].chunk;
+  }
+  free(keys);
+  return order;
+}
+
+/*  helper function, decides the order chunks are written in and their
+    offset in the mdat payload. Without interleaving each track is written
+    in one run after the other.
+*/
+static int atom_write_plan_layout(struct AtomWritePlan *plan, int interleave)
+{
+  struct AtomWriteChunk *chunk;
+  uint32_t i;
+
+  if (interleave) {
+    plan->layout = atom_write_play_order(plan);
+    if (plan->layout == NULL) return 0;
+  } else {
+    plan->layout = (uint32_t*)malloc((plan->chunk_count ? plan->chunk_count : 1) * sizeof(uint32_t));
+    if (plan->layout == NULL) return 0;
+    for (i = 0; i < plan->chunk_count; i++) {
+      plan->layout[i] = i;
+    }
+  }
+
+  plan->mdat_size = 0;
+  for (i = 0; i < plan->chunk_count; i++) {
+    chunk = &plan->chunks[plan->layout[i]];
+    chunk->offset = plan->mdat_size;
+    plan->mdat_size += chunk->size;
+  }
+  return 1;
+}
+
+/*  helper function, plans the tracks, chunks and layout of the movie.
+*/
+static int atom_write_plan(struct AtomWritePlan *plan, struct AtomMovie *movie, const struct AtomFlattenOptions *options)
+{
+  struct AtomWriteTrack *wt;
+  uint32_t i, j;
+
+  plan->movie = movie;
+  if (!atom_movie_load_tracks(movie)) {
+    snprintf(plan->error, plan->error_size, "Unable to read tracks of movie");
+    return 0;
+  }
+  plan->tracks = (struct AtomWriteTrack*)calloc(movie->track_count ? movie->track_count : 1, sizeof(struct AtomWriteTrack));
+  if (plan->tracks == NULL) return 0;
+
+  for (i = 0; i < movie->track_count; i++) {
+    wt = &plan->tracks[plan->track_count++];
+    wt->track = movie->tracks[i];
+    if (!atom_write_plan_track(plan, wt)) return 0;
+    // tracks without any media are left out
+    for (j = 0; j < wt->edit_count && wt->edits[j].media_time == -1; j++);
+    if (j == wt->edit_count || !wt->sample_count) {
+      atom_write_track_free(wt);
+      memset(wt, 0, sizeof(struct AtomWriteTrack));
+      plan->track_count--;
+    }
+  }
+  return atom_write_plan_chunks(plan, options) && atom_write_plan_layout(plan, options->interleave);
+}
+
+
+/*  helper function, measures the seeks needed to read the chunks in the
+    order they play, from the source files or from the planned layout.
+*/
+static void atom_write_seek_report(struct AtomWritePlan *plan, uint32_t *order, int planned, struct AtomSeekReport *report)
+{
+  struct AtomWriteChunk *chunk, *previous = NULL;
+  struct AtomMovie *source, *previous_source = NULL;
+  uint64_t start, previous_start = 0, distance;
+  uint32_t i;
+
+  memset(report, 0, sizeof(struct AtomSeekReport));
+  report->chunks = plan->chunk_count;
+  for (i = 0; i < plan->chunk_count; i++) {
+    chunk = &plan->chunks[order[i]];
+    source = planned ? NULL : plan->tracks[chunk->track].samples[chunk->first].source;
+    start = planned ? chunk->offset : plan->tracks[chunk->track].samples[chunk->first].offset;
+    if (previous && source != previous_source) {
+      report->seeks++;
+    } else if (previous && start != previous_start + previous->size) {
+      distance = start > previous_start + previous->size ? start - previous_start - previous->size : previous_start + previous->size - start;
+      report->seeks++;
+      report->seek_bytes += distance;
+      if (distance > report->max_seek) report->max_seek = distance;
+    }
+    if (previous && source == previous_source && chunk->track != previous->track) {
+      distance = start > previous_start ? start - previous_start : previous_start - start;
+      if (distance > report->max_distance) report->max_distance = distance;
+    }
+    previous = chunk;
+    previous_source = source;
+    previous_start = start;
+  }
+}
+
+/*
+  Measures how far a player has to seek to read the media of the movie in
+  the order it plays, both as it's stored now and as atom_movie_flatten
+  would lay it out with the options. Nothing is written. Returns 0 and
+  fills in error on failure.
+*/
+int atom_movie_seek_report(struct AtomMovie *movie, const struct AtomFlattenOptions *options, struct AtomSeekReport *current, struct AtomSeekReport *planned, char *error, size_t error_size)
+{
+  struct AtomWritePlan plan;
+  uint32_t *order;
+  int ok;
+
+  memset(&plan, 0, sizeof(plan));
+  plan.error = error;
+  plan.error_size = error_size;
+  snprintf(error, error_size, "Unable to plan the layout of the movie");
+
+  ok = atom_write_plan(&plan, movie, options) && (order = atom_write_play_order(&plan)) != NULL;
+  if (ok) {
+    atom_write_seek_report(&plan, order, 0, current);
+    atom_write_seek_report(&plan, order, 1, planned);
+    free(order);
+  }
+  atom_write_plan_free(&plan);
+  return ok;
+}
+
+
+/*** MOOV ***/
+
+/*  helper function, the payload of the first child of the given type of
+    container, or NULL if there's none or it's shorter than length bytes
+    (extra more for version 1).
+*/
+static const unsigned char *atom_write_header_source(struct AtomMovie *movie, struct Atom *container, uint32_t type, uint64_t length, uint64_t extra)
+{
+  struct Atom *atom = atom_find(container, type);
+  const unsigned char *p = atom ? atom_data(movie, atom) : NULL;
+
+  if (!p || ATOM_DATA_SIZE(atom) < length || (p[0] == 1 && ATOM_DATA_SIZE(atom) < length + extra)) return NULL;
+  return p;
+}
+
+/*  helper function, appends the mvhd atom of the movie. The fields which
+    aren't kept in the movie record, such as the creation time and the
+    selection, are copied from its mvhd atom.
+*/
+static void atom_write_mvhd(struct AtomBuffer *b, struct AtomMovie *movie, uint32_t next_track_id)
+{
+  const unsigned char *source = atom_write_header_source(movie, movie->moov, FOURCC('m','v','h','d'), 100, 12);
+  const unsigned char *rest = NULL;  // the fields following the duration
+  uint64_t created = 0, modified = 0;
+  int version;
+  size_t start;
+  uint32_t i;
+
+  if (source && source[0] == 1) {
+    created = atom_u64(source + 4);
+    modified = atom_u64(source + 12);
+    rest = source + 32;
+  } else if (source) {
+    created = atom_u32(source + 4);
+    modified = atom_u32(source + 8);
+    rest = source + 20;
+  }
+  version = movie->duration > 0xFFFFFFFFULL || created > 0xFFFFFFFFULL || modified > 0xFFFFFFFFULL;
+  start = buf_begin_full(b, FOURCC('m','v','h','d'), version, 0);
+
+  if (version) {
+    buf_u64(b, created);
+    buf_u64(b, modified);
+    buf_u32(b, movie->time_scale);
+    buf_u64(b, movie->duration);
+  } else {
+    buf_u32(b, (uint32_t)created);
+    buf_u32(b, (uint32_t)modified);
+    buf_u32(b, movie->time_scale);
+    buf_u32(b, (uint32_t)movie->duration);
+  }
+  if (rest) {
+    buf_bytes(b, rest, 16);  // rate, volume and reserved
+  } else {
+    buf_u32(b, 0x00010000);  // rate
+    buf_u16(b, 0x0100);      // volume
+    buf_bytes(b, "\0\0\0\0\0\0\0\0\0\0", 10);
+  }
+  for (i = 0; i < 9; i++) buf_u32(b, movie->matrix[i]);
+  if (rest) {
+    buf_bytes(b, rest + 52, 8);  // preview time and duration
+  } else {
+    buf_u32(b, 0);
+    buf_u32(b, 0);
+  }
+  buf_u32(b, movie->poster_time);
+  if (rest) {
+    buf_bytes(b, rest + 64, 12);  // selection time and duration, current time
+  } else {
+    buf_bytes(b, "\0\0\0\0\0\0\0\0\0\0\0\0", 12);
+  }
+  buf_u32(b, next_track_id);
+  buf_end(b, start);
+}
+
+/*  helper function, appends the tkhd atom of the track. The creation
+    time, layer and alternate group are copied from the tkhd atom of the
+    track it shares its media with.
+*/
+static void atom_write_tkhd(struct AtomBuffer *b, struct AtomTrack *track)
+{
+  struct AtomTrack *media = ATOM_TRACK_MEDIA(track);
+  const unsigned char *source = atom_write_header_source(media->movie, media->trak, FOURCC('t','k','h','d'), 84, 12);
+  const unsigned char *rest = NULL;  // the fields following the duration
+  uint64_t created = 0, modified = 0;
+  int version;
+  size_t start;
+  uint32_t i;
+
+  if (source && source[0] == 1) {
+    created = atom_u64(source + 4);
+    modified = atom_u64(source + 12);
+    rest = source + 36;
+  } else if (source) {
+    created = atom_u32(source + 4);
+    modified = atom_u32(source + 8);
+    rest = source + 24;
+  }
+  version = track->duration > 0xFFFFFFFFULL || created > 0xFFFFFFFFULL || modified > 0xFFFFFFFFULL;
+  start = buf_begin_full(b, FOURCC('t','k','h','d'), version, track->flags);
+
+  if (version) {
+    buf_u64(b, created);
+    buf_u64(b, modified);
+    buf_u32(b, track->id);
+    buf_u32(b, 0);
+    buf_u64(b, track->duration);
+  } else {
+    buf_u32(b, (uint32_t)created);
+    buf_u32(b, (uint32_t)modified);
+    buf_u32(b, track->id);
+    buf_u32(b, 0);
+    buf_u32(b, (uint32_t)track->duration);
+  }
+  if (rest) {
+    buf_bytes(b, rest, 12);  // reserved, layer and alternate group
+  } else {
+    buf_bytes(b, "\0\0\0\0\0\0\0\0", 8);
+    buf_u16(b, 0);           // layer
+    buf_u16(b, 0);           // alternate group
+  }
+  buf_u16(b, (uint16_t)track->volume);
+  buf_u16(b, 0);
+  for (i = 0; i < 9; i++) buf_u32(b, track->matrix[i]);
+  buf_u32(b, track->width);
+  buf_u32(b, track->height);
+  buf_end(b, start);
+}
+
+/*
+  Appends an edts atom holding the given edit list.
+*/
+static void atom_write_edts(struct AtomBuffer *b, struct AtomEdit *edits, uint32_t count)
+{
+  size_t edts = buf_begin(b, FOURCC('e','d','t','s'));
+  size_t elst;
+  int version = 0;
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    if (edits[i].segment_duration > 0xFFFFFFFFLL || edits[i].media_time > 0x7FFFFFFFLL) version = 1;
+  }
+  elst = buf_begin_full(b, FOURCC('e','l','s','t'), version, 0);
+  buf_u32(b, count);
+  for (i = 0; i < count; i++) {
+    if (version) {
+      buf_u64(b, edits[i].segment_duration);
+      buf_u64(b, edits[i].media_time);
+    } else {
+      buf_u32(b, (uint32_t)edits[i].segment_duration);
+      buf_u32(b, (uint32_t)edits[i].media_time);
+    }
+    buf_u32(b, edits[i].media_rate);
+  }
+  buf_end(b, elst);
+  buf_end(b, edts);
+}
+
+static void atom_write_mdhd(struct AtomBuffer *b, struct AtomWriteTrack *wt)
+{
+  struct Atom *source = atom_find(atom_find(wt->media->trak, FOURCC('m','d','i','a')), FOURCC('m','d','h','d'));
+  const unsigned char *p = source ? atom_data(wt->media->movie, source) : NULL;
+  int version = wt->media_duration > 0xFFFFFFFFULL;
+  uint16_t language = 0, quality = 0;
+  size_t start;
+
+  // keep the language and quality of the source media
+  if (p && ATOM_DATA_SIZE(source) >= (p[0] == 1 ? 36 : 24)) {
+    language = atom_u16(p + (p[0] == 1 ? 32 : 20));
+    quality = atom_u16(p + (p[0] == 1 ? 34 : 22));
+  }
+  start = buf_begin_full(b, FOURCC('m','d','h','d'), version, 0);
+  if (version) {
+    buf_u64(b, 0);
+    buf_u64(b, 0);
+    buf_u32(b, wt->media_time_scale);
+    buf_u64(b, wt->media_duration);
+  } else {
+    buf_u32(b, 0);
+    buf_u32(b, 0);
+    buf_u32(b, wt->media_time_scale);
+    buf_u32(b, (uint32_t)wt->media_duration);
+  }
+  buf_u16(b, language);
+  buf_u16(b, quality);
+  buf_end(b, start);
+}
+
+static void atom_write_stsd(struct AtomBuffer *b, struct AtomWriteTrack *wt)
+{
+  size_t start = buf_begin_full(b, FOURCC('s','t','s','d'), 0, 0);
+  struct Atom *stsd;
+  const unsigned char *p;
+  uint32_t i;
+
+  buf_u32(b, wt->description_count);
+  for (i = 0; i < wt->description_source_count; i++) {
+    stsd = atom_track_stsd(wt->description_sources[i]);
+    if (!stsd || ATOM_DATA_SIZE(stsd) < 8 || !(p = atom_data(wt->description_sources[i]->movie, stsd))) {
+      b->failed = 1;
+      return;
+    }
+    buf_bytes(b, p + 8, ATOM_DATA_SIZE(stsd) - 8);
+  }
+  buf_end(b, start);
+}
+
+/*  helper function, appends the sample tables of the track, with chunk
+    offsets starting at base.
+*/
+static void atom_write_stbl(struct AtomBuffer *b, struct AtomWritePlan *plan, struct AtomWriteTrack *wt, uint64_t base, int co64)
+{
+  size_t stbl = buf_begin(b, FOURCC('s','t','b','l')), start, count_at;
+  struct AtomWriteSample *samples = wt->samples;
+  struct AtomWriteChunk *chunk;
+  uint32_t i, run, entries, size;
+  int has_cts = 0, all_sync = 1;
+
+  atom_write_stsd(b, wt);
+
+  // time to sample, run length encoded
+  start = buf_begin_full(b, FOURCC('s','t','t','s'), 0, 0);
+  count_at = b->size;
+  buf_u32(b, 0);
+  for (i = 0, entries = 0; i < wt->sample_count; i += run, entries++) {
+    for (run = 1; i + run < wt->sample_count && samples[i + run].duration == samples[i].duration; run++);
+    buf_u32(b, run);
+    buf_u32(b, samples[i].duration);
+  }
+  if (!b->failed) memcpy(b->data + count_at, (unsigned char[4]){ entries >> 24, entries >> 16, entries >> 8, entries }, 4);
+  buf_end(b, start);
+
+  for (i = 0; i < wt->sample_count; i++) {
+    if (samples[i].cts_offset) has_cts = 1;
+    if (!samples[i].sync) all_sync = 0;
+  }
+  if (has_cts) {
+    start = buf_begin_full(b, FOURCC('c','t','t','s'), 0, 0);
+    count_at = b->size;
+    buf_u32(b, 0);
+    for (i = 0, entries = 0; i < wt->sample_count; i += run, entries++) {
+      for (run = 1; i + run < wt->sample_count && samples[i + run].cts_offset == samples[i].cts_offset; run++);
+      buf_u32(b, run);
+      buf_u32(b, (uint32_t)samples[i].cts_offset);
+    }
+    if (!b->failed) memcpy(b->data + count_at, (unsigned char[4]){ entries >> 24, entries >> 16, entries >> 8, entries }, 4);
+    buf_end(b, start);
+  }
+  if (!all_sync) {
+    start = buf_begin_full(b, FOURCC('s','t','s','s'), 0, 0);
+    count_at = b->size;
+    buf_u32(b, 0);
+    for (i = 0, entries = 0; i < wt->sample_count; i++) {
+      if (samples[i].sync) {
+        buf_u32(b, i + 1);
+        entries++;
+      }
+    }
+    if (!b->failed) memcpy(b->data + count_at, (unsigned char[4]){ entries >> 24, entries >> 16, entries >> 8, entries }, 4);
+    buf_end(b, start);
+  }
+
+  // sample to chunk, only listing changes
+  start = buf_begin_full(b, FOURCC('s','t','s','c'), 0, 0);
+  count_at = b->size;
+  buf_u32(b, 0);
+  for (i = 0, entries = 0; i < wt->chunk_count; i++) {
+    chunk = &plan->chunks[wt->chunk_first + i];
+    if (i && chunk->count == chunk[-1].count && samples[chunk->first].description == samples[chunk[-1].first].description) continue;
+    buf_u32(b, i + 1);
+    buf_u32(b, chunk->count);
+    buf_u32(b, samples[chunk->first].description);
+    entries++;
+  }
+  if (!b->failed) memcpy(b->data + count_at, (unsigned char[4]){ entries >> 24, entries >> 16, entries >> 8, entries }, 4);
+  buf_end(b, start);
+
+  start = buf_begin_full(b, FOURCC('s','t','s','z'), 0, 0);
+  for (i = 1, size = samples[0].size; i < wt->sample_count && samples[i].size == size; i++);
+  if (i == wt->sample_count) {
+    // older sound tracks keep a size of 1 for each frame
+    buf_u32(b, wt->media->sample_index && wt->media->sample_index->frame_sized ? 1 : size);
+    buf_u32(b, wt->sample_count);
+  } else {
+    buf_u32(b, 0);
+    buf_u32(b, wt->sample_count);
+    for (i = 0; i < wt->sample_count; i++) buf_u32(b, samples[i].size);
+  }
+  buf_end(b, start);
+
+  start = buf_begin_full(b, co64 ? FOURCC('c','o','6','4') : FOURCC('s','t','c','o'), 0, 0);
+  buf_u32(b, wt->chunk_count);
+  for (i = 0; i < wt->chunk_count; i++) {
+    chunk = &plan->chunks[wt->chunk_first + i];
+    if (co64)
+      buf_u64(b, base + chunk->offset);
+    else
+      buf_u32(b, (uint32_t)(base + chunk->offset));
+  }
+  buf_end(b, start);
+
+  buf_end(b, stbl);
+}
+
+/*
+  Appends a dinf atom saying the media is in this file.
+*/
+static void atom_write_dinf(struct AtomBuffer *b)
+{
+  size_t dinf = buf_begin(b, FOURCC('d','i','n','f'));
+  size_t dref = buf_begin_full(b, FOURCC('d','r','e','f'), 0, 0);
+  size_t alis;
+
+  buf_u32(b, 1);
+  alis = buf_begin_full(b, FOURCC('a','l','i','s'), 0, 1);
+  buf_end(b, alis);
+  buf_end(b, dref);
+  buf_end(b, dinf);
+}
+
+/*
+  Appends a hdlr atom for a media or data handler.
+*/
+static void atom_write_hdlr(struct AtomBuffer *b, uint32_t type, uint32_t subtype, const char *name)
+{
+  size_t start = buf_begin_full(b, FOURCC('h','d','l','r'), 0, 0);
+  unsigned char length = (unsigned char)strlen(name);
+
+  buf_u32(b, type);
+  buf_u32(b, subtype);
+  buf_u32(b, 0);           // manufacturer
+  buf_u32(b, 0);           // flags
+  buf_u32(b, 0);           // flags mask
+  buf_bytes(b, &length, 1);
+  buf_bytes(b, name, length);
+  buf_end(b, start);
+}
+
+static void atom_write_trak(struct AtomBuffer *b, struct AtomWritePlan *plan, struct AtomWriteTrack *wt, uint64_t base, int co64)
+{
+  struct Atom *mdia = atom_find(wt->media->trak, FOURCC('m','d','i','a'));
+  struct Atom *minf_source = atom_find(mdia, FOURCC('m','i','n','f')), *atom;
+  size_t trak = buf_begin(b, FOURCC('t','r','a','k')), mdia_start, minf;
+
+  atom_write_tkhd(b, wt->track);
+  atom_write_edts(b, wt->edits, wt->edit_count);
+  // track ids are kept, so references such as chapters still hold
+  if (wt->media->movie == plan->movie && (atom = atom_find(wt->media->trak, FOURCC('t','r','e','f'))))
+    buf_atom(b, wt->media->movie, atom);
+  // user data, aperture dimensions and the like are kept as they are
+  for (atom = wt->media->trak->children; atom; atom = atom->next) {
+    if (atom->type != FOURCC('t','k','h','d') && atom->type != FOURCC('e','d','t','s') && atom->type != FOURCC('t','r','e','f') && atom->type != FOURCC('m','d','i','a'))
+      buf_atom(b, wt->media->movie, atom);
+  }
+
+  mdia_start = buf_begin(b, FOURCC('m','d','i','a'));
+  atom_write_mdhd(b, wt);
+  if ((atom = atom_find(mdia, FOURCC('h','d','l','r'))))
+    buf_atom(b, wt->media->movie, atom);
+
+  minf = buf_begin(b, FOURCC('m','i','n','f'));
+  // the media header and data handler are kept, data references are not
+  for (atom = minf_source ? minf_source->children : NULL; atom; atom = atom->next) {
+    if (atom->type != FOURCC('d','i','n','f') && atom->type != FOURCC('s','t','b','l'))
+      buf_atom(b, wt->media->movie, atom);
+  }
+  atom_write_dinf(b);
+  atom_write_stbl(b, plan, wt, base, co64);
+  buf_end(b, minf);
+
+  buf_end(b, mdia_start);
+  buf_end(b, trak);
+}
+
+static void atom_write_moov(struct AtomBuffer *b, struct AtomWritePlan *plan, uint64_t base, int co64)
+{
+  size_t moov = buf_begin(b, FOURCC('m','o','o','v'));
+  struct Atom *atom;
+  uint32_t i, next_track_id = 0;
+
+  for (i = 0; i < plan->track_count; i++) {
+    if (plan->tracks[i].track->id > next_track_id) next_track_id = plan->tracks[i].track->id;
+  }
+  atom_write_mvhd(b, plan->movie, next_track_id + 1);
+  for (i = 0; i < plan->track_count; i++) {
+    atom_write_trak(b, plan, &plan->tracks[i], base, co64);
+  }
+  // metadata and user data are kept, the samples of fragments are in the sample tables now
+  for (atom = plan->movie->moov ? plan->movie->moov->children : NULL; atom; atom = atom->next) {
+    if (atom->type != FOURCC('m','v','h','d') && atom->type != FOURCC('t','r','a','k') && atom->type != FOURCC('m','v','e','x'))
+      buf_atom(b, plan->movie, atom);
+  }
+  buf_end(b, moov);
+}
+
+
+/*** OUTPUT ***/
+
+/*
+  Writes all of the buffer to fd. Returns 0 on failure.
+*/
+static int atom_write_all(int fd, const unsigned char *data, size_t length)
+{
+  ssize_t written;
+
+  while (length > 0) {
+    written = write(fd, data, length);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return 0;
+    data += written;
+    length -= written;
+  }
+  return 1;
+}
+
+/*
+  Copies length bytes at offset of in_fd to the current position of
+  out_fd. The kernel copies them directly when it can, otherwise they go
+  through a buffer. Returns 0 on failure.
+*/
+static int atom_copy_range(int out_fd, int in_fd, uint64_t offset, uint64_t length)
+{
+  unsigned char buffer[1 << 16];
+  ssize_t copied;
+  off_t position = offset;
+  int direct = 1;
+
+  while (length > 0) {
+    copied = -1;
+#ifdef HAVE_COPY_FILE_RANGE
+    if (direct) {
+      copied = copy_file_range(in_fd, &position, out_fd, NULL, length, 0);
+      if (copied > 0) {
+        length -= copied;
+        continue;
+      }
+    }
+#endif
+#ifdef HAVE_SENDFILE
+    if (direct) {
+      copied = sendfile(out_fd, in_fd, &position, length > 0x7FFFF000 ? 0x7FFFF000 : length);
+      if (copied > 0) {
+        length -= copied;
+        continue;
+      }
+    }
+#endif
+    if (copied < 0 && errno == EINTR) continue;
+    // copy_file_range and sendfile don't work across all file systems
+    direct = 0;
+    copied = pread(in_fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer), position);
+    if (copied < 0 && errno == EINTR) continue;
+    if (copied <= 0 || !atom_write_all(out_fd, buffer, copied)) return 0;
+    position += copied;
+    length -= copied;
+  }
+  return 1;
+}
+
+/*  helper function, copies the samples of the chunks in layout order,
+    joining chunks which follow each other in the same source file into
+    one copy.
+*/
+static int atom_write_mdat_payload(int fd, struct AtomWritePlan *plan)
+{
+  struct AtomWriteChunk *chunk;
+  struct AtomWriteSample *first, *last;
+  struct AtomMovie *source = NULL;
+  uint64_t start = 0, end = 0;
+  uint32_t i;
+
+  for (i = 0; i < plan->chunk_count; i++) {
+    chunk = &plan->chunks[plan->layout[i]];
+    first = &plan->tracks[chunk->track].samples[chunk->first];
+    last = first + chunk->count - 1;
+    if (source == first->source && end == first->offset) {
+      end = last->offset + last->size;
+      continue;
+    }
+    if (source && !atom_copy_range(fd, source->fd, start, end - start)) return 0;
+    source = first->source;
+    start = first->offset;
+    end = last->offset + last->size;
+  }
+  if (source && !atom_copy_range(fd, source->fd, start, end - start)) return 0;
+  return 1;
+}
+
+static const unsigned char ftyp[20] = { 0, 0, 0, 20, 'f', 't', 'y', 'p', 'q', 't', ' ', ' ', 0x20, 0x05, 0x03, 0x00, 'q', 't', ' ', ' ' };
+
+/*
+  Writes the movie with all of its media to a new file at filepath,
+  which must not exist yet, laid out as the options say. Returns 0 and
+  fills in error on failure.
+*/
+int atom_movie_flatten(struct AtomMovie *movie, const char *filepath, const struct AtomFlattenOptions *options, char *error, size_t error_size)
+{
+  struct AtomWritePlan plan;
+  struct AtomBuffer moov, header;
+  uint64_t mdat_header_size, base;
+  int fd, co64 = 0, ok;
+
+  memset(&plan, 0, sizeof(plan));
+  memset(&moov, 0, sizeof(moov));
+  memset(&header, 0, sizeof(header));
+  plan.error = error;
+  plan.error_size = error_size;
+  snprintf(error, error_size, "Unable to flatten movie to %s", filepath);
+
+  if (!atom_write_plan(&plan, movie, options)) {
+    atom_write_plan_free(&plan);
+    return 0;
+  }
+
+  // the size of moov doesn't depend on the offsets, only on their width
+  mdat_header_size = plan.mdat_size + 8 > 0xFFFFFFFFULL ? 16 : 8;
+  atom_write_moov(&moov, &plan, 0, 0);
+  if (sizeof(ftyp) + moov.size + mdat_header_size + plan.mdat_size > 0xFFFFFFFFULL) co64 = 1;
+  base = sizeof(ftyp) + mdat_header_size + (options->moov_first ? moov.size + (co64 ? 4 * plan.chunk_count : 0) : 0);
+  moov.size = 0;
+  atom_write_moov(&moov, &plan, base, co64);
+
+  if (mdat_header_size == 16) {
+    buf_u32(&header, 1);
+    buf_u32(&header, FOURCC('m','d','a','t'));
+    buf_u64(&header, plan.mdat_size + 16);
+  } else {
+    buf_u32(&header, (uint32_t)(plan.mdat_size + 8));
+    buf_u32(&header, FOURCC('m','d','a','t'));
+  }
+
+  fd = open(filepath, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if (fd < 0) {
+    snprintf(error, error_size, "Error %d occurred while opening file for export at %s", errno, filepath);
+    ok = 0;
+  } else {
+    ok = !moov.failed && !header.failed && atom_write_all(fd, ftyp, sizeof(ftyp));
+    if (ok && options->moov_first)
+      ok = atom_write_all(fd, moov.data, moov.size);
+    ok = ok && atom_write_all(fd, header.data, header.size) && atom_write_mdat_payload(fd, &plan);
+    if (ok && !options->moov_first)
+      ok = atom_write_all(fd, moov.data, moov.size);
+    if (close(fd) != 0) ok = 0;
+    if (!ok) {
+      snprintf(error, error_size, "Error %d occurred while writing movie to %s", errno, filepath);
+      unlink(filepath);
+    }
+  }
+
+  buf_free(&moov);
+  buf_free(&header);
+  atom_write_plan_free(&plan);
+  return ok;
+}
+
+
+/*** FAST START ***/
+
+/*  A top level atom of a file, see atom_read_top_level.
+*/
+struct AtomExtent {
+  uint32_t type;
+  uint64_t offset;
+  uint64_t size;
+};
+
+/*  How chunk offsets move when the media between start and end is 
+    shifted forward to make room for the moov atom.
+*/
+struct AtomRelocation {
+  uint64_t start;        /* first byte of media which moves */
+  uint64_t end;          /* the old moov atom, media up to here moves by moov_size */
+  uint64_t old_size;     /* size of the old moov atom */
+  uint64_t moov_size;    /* size of the rewritten moov atom */
+  int external;          /* the current track's media is in another file */
+  int failed;
+};
+
+static int atom_is_padding(uint32_t type)
+{
+  return type == FOURCC('f','r','e','e') || type == FOURCC('s','k','i','p') || type == FOURCC('w','i','d','e');
+}
+
+/*  helper function, reads the headers of the top level atoms of the file.
+    Only their headers are read, the media is never touched.
+*/
+static struct AtomExtent *atom_read_top_level(int fd, uint64_t file_size, uint32_t *count)
+{
+  struct AtomExtent *extents = NULL, *grown;
+  unsigned char header[16];
+  uint64_t offset = 0, size;
+  uint32_t capacity = 0;
+
+  *count = 0;
+  while (offset + 8 <= file_size) {
+    if (pread(fd, header, 16, offset) < 8) break;
+    size = atom_u32(header);
+    if (size == 1) {
+      if (offset + 16 > file_size) break;
+      size = atom_u64(header + 8);
+    } else if (size == 0) {
+      size = file_size - offset;
+    }
+    if (size < 8 || size > file_size - offset) break;
+    if (*count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      if (!(grown = (struct AtomExtent*)realloc(extents, capacity * sizeof(struct AtomExtent)))) break;
+      extents = grown;
+    }
+    extents[*count].type = atom_u32(header + 4);
+    extents[*count].offset = offset;
+    extents[*count].size = size;
+    (*count)++;
+    offset += size;
+  }
+  if (offset != file_size) {
+    free(extents);
+    return NULL;
+  }
+  return extents;
+}
+
+static uint64_t atom_relocate_offset(struct AtomRelocation *r, uint64_t offset)
+{
+  if (r->external) return offset;
+  if (offset >= r->start && offset < r->end) return offset + r->moov_size;
+  if (offset >= r->end + r->old_size) return offset + r->moov_size - r->old_size;
+  return offset;
+}
+
+/*  helper function, true when the data references of the minf payload 
+    all point into the movie file itself.
+*/
+static int atom_minf_self_contained(const unsigned char *p, uint64_t length)
+{
+  uint64_t size, offset = 0, dref_offset, i;
+  uint32_t count;
+
+  while (offset + 8 <= length) {
+    size = atom_u32(p + offset);
+    if (size < 8 || size > length - offset) return 1;
+    if (atom_u32(p + offset + 4) == FOURCC('d','i','n','f') && size >= 24 &&
+        atom_u32(p + offset + 12) == FOURCC('d','r','e','f')) {
+      count = atom_u32(p + offset + 20);
+      dref_offset = offset + 24;
+      for (i = 0; i < count && dref_offset + 12 <= offset + size; i++) {
+        if (!(atom_u32(p + dref_offset + 8) & 1)) return 0;
+        if (atom_u32(p + dref_offset) < 12) return 0;
+        dref_offset += atom_u32(p + dref_offset);
+      }
+    }
+    offset += size;
+  }
+  return 1;
+}
+
+/*  helper function, copies the atoms of p into the buffer, shifting chunk
+    offsets of the sample tables. An stco table whose offsets no longer fit
+    in 32 bits is written as a co64 table.
+*/
+static void atom_relocate_atoms(struct AtomBuffer *b, const unsigned char *p, uint64_t length, struct AtomRelocation *r)
+{
+  uint64_t offset = 0, size, header_size, value, i, count;
+  uint32_t type;
+  size_t start;
+  int wide;
+
+  while (offset + 8 <= length) {
+    size = atom_u32(p + offset);
+    header_size = 8;
+    if (size == 1 && offset + 16 <= length) {
+      size = atom_u64(p + offset + 8);
+      header_size = 16;
+    } else if (size == 0) {
+      size = length - offset;
+    }
+    if (size < header_size || size > length - offset) {
+      r->failed = 1;
+      return;
+    }
+    type = atom_u32(p + offset + 4);
+
+    if (type == FOURCC('m','o','o','v') || type == FOURCC('t','r','a','k') || type == FOURCC('m','d','i','a') ||
+        type == FOURCC('m','i','n','f') || type == FOURCC('s','t','b','l')) {
+      if (type == FOURCC('m','i','n','f'))
+        r->external = !atom_minf_self_contained(p + offset + header_size, size - header_size);
+      start = buf_begin(b, type);
+      atom_relocate_atoms(b, p + offset + header_size, size - header_size, r);
+      buf_end(b, start);
+    } else if ((type == FOURCC('s','t','c','o') || type == FOURCC('c','o','6','4')) && size >= header_size + 8) {
+      count = atom_u32(p + offset + header_size + 4);
+      wide = type == FOURCC('c','o','6','4');
+      if (count > (size - header_size - 8) / (wide ? 8 : 4)) {
+        r->failed = 1;
+        return;
+      }
+      for (i = 0; i < count && !wide; i++) {
+        if (atom_relocate_offset(r, atom_u32(p + offset + header_size + 8 + i*4)) > 0xFFFFFFFFULL) wide = 1;
+      }
+      start = buf_begin(b, wide ? FOURCC('c','o','6','4') : FOURCC('s','t','c','o'));
+      buf_bytes(b, p + offset + header_size, 8);
+      for (i = 0; i < count; i++) {
+        if (type == FOURCC('c','o','6','4'))
+          value = atom_u64(p + offset + header_size + 8 + i*8);
+        else
+          value = atom_u32(p + offset + header_size + 8 + i*4);
+        value = atom_relocate_offset(r, value);
+        if (wide)
+          buf_u64(b, value);
+        else
+          buf_u32(b, (uint32_t)value);
+      }
+      buf_end(b, start);
+    } else {
+      buf_bytes(b, p + offset, size);
+    }
+    offset += size;
+  }
+}
+
+/*  helper function, moves length bytes at offset + delta of the file back
+    to offset, working forward from the start so nothing is overwritten
+    before it is moved.
+*/
+static int atom_shift_back(int fd, uint64_t offset, uint64_t length, uint64_t delta, unsigned char *block, size_t block_size)
+{
+  uint64_t position = offset;
+  size_t n;
+
+  while (position < offset + length) {
+    n = offset + length - position < block_size ? offset + length - position : block_size;
+    if (pread(fd, block, n, position + delta) != (ssize_t)n) return 0;
+    if (pwrite(fd, block, n, position) != (ssize_t)n) return 0;
+    position += n;
+  }
+  return 1;
+}
+
+/*  helper function, moves length bytes at offset of the file forward by 
+    delta, working back from the end so nothing is overwritten before it 
+    is moved. Each block is read and written with one sequential call.
+    Once cancelled is set the blocks moved so far are moved back and -1 
+    is returned, the bytes up to delta past the end of the range are left 
+    overwritten. Returns 0 on I/O errors.
+*/
+static int atom_shift_forward(int fd, uint64_t offset, uint64_t length, uint64_t delta, unsigned char *block, size_t block_size, volatile int *cancelled)
+{
+  uint64_t position = offset + length;
+  size_t n;
+
+  while (position > offset) {
+    if (cancelled && *cancelled)
+      return atom_shift_back(fd, position, offset + length - position, delta, block, block_size) ? -1 : 0;
+    n = position - offset < block_size ? position - offset : block_size;
+    position -= n;
+    if (pread(fd, block, n, position) != (ssize_t)n) return 0;
+    if (pwrite(fd, block, n, position + delta) != (ssize_t)n) return 0;
+  }
+  return 1;
+}
+
+/*
+  Moves the moov atom of the movie file at filepath in front of its media,
+  so it can be played while it downloads. When there is enough free space
+  in front of the media the moov atom is written there and the old one is
+  cut off the end of the file, otherwise the media is shifted forward once and the chunk offsets are patched. Only the
+  moov atom is read into memory and samples are never parsed. Sets moved
+  to 0 when the file already starts with its moov atom. Returns 0 and
+  fills in error on failure.
+
+  Setting cancelled while the media is shifted stops it between blocks, 
+  the media moved so far is moved back and the old moov atom written 
+  again, so the file is left as it was and 0 is returned. The moov atom 
+  itself is written in one go and can't be cancelled.
+*/
+int atom_file_faststart(const char *filepath, int *moved, volatile int *cancelled, char *error, size_t error_size)
+{
+  struct AtomExtent *extents;
+  struct AtomExtent *moov = NULL, *mdat = NULL, *padding;
+  struct AtomRelocation relocation;
+  struct AtomBuffer buffer;
+  unsigned char *data, *block, header[8];
+  uint64_t file_size, run, grow;
+  uint32_t count, i, j, attempts;
+  off_t end;
+  int fd, ok = 0, shifted;
+
+  *moved = 0;
+  fd = open(filepath, O_RDWR);
+  if (fd < 0) {
+    snprintf(error, error_size, "Error %d occurred while opening movie at %s", errno, filepath);
+    return 0;
+  }
+  end = lseek(fd, 0, SEEK_END);
+  file_size = end < 0 ? 0 : (uint64_t)end;
+  extents = atom_read_top_level(fd, file_size, &count);
+  if (!extents) {
+    snprintf(error, error_size, "Unable to read atoms of movie at %s", filepath);
+    close(fd);
+    return 0;
+  }
+  for (i = 0; i < count; i++) {
+    if (extents[i].type == FOURCC('m','o','o','v') && !moov) moov = &extents[i];
+    if (extents[i].type == FOURCC('m','d','a','t') && !mdat) mdat = &extents[i];
+    if (extents[i].type == FOURCC('m','o','o','f')) {
+      // fragments follow their own moov, and may address data absolutely
+      snprintf(error, error_size, "Unable to relocate fragmented movie at %s", filepath);
+      free(extents);
+      close(fd);
+      return 0;
+    }
+  }
+  if (!moov) {
+    snprintf(error, error_size, "Unable to find movie header in %s", filepath);
+    free(extents);
+    close(fd);
+    return 0;
+  }
+  if (!mdat || moov->offset < mdat->offset) {
+    free(extents);
+    close(fd);
+    return 1;
+  }
+  if (moov->size > SIZE_MAX || !(data = (unsigned char*)malloc(moov->size)) || pread(fd, data, moov->size, moov->offset) != (ssize_t)moov->size) {
+    snprintf(error, error_size, "Unable to read movie header in %s", filepath);
+    free(data);
+    free(extents);
+    close(fd);
+    return 0;
+  }
+
+  // a run of padding in front of the media can take the moov atom as it is
+  for (i = 0; &extents[i] < mdat; i = j + 1) {
+    for (j = i, run = 0; &extents[j] < mdat && atom_is_padding(extents[j].type); j++) {
+      run += extents[j].size;
+    }
+    if (run == moov->size || run >= moov->size + 8) {
+      padding = &extents[i];
+      ok = pwrite(fd, data, moov->size, padding->offset) == (ssize_t)moov->size;
+      if (ok && run > moov->size) {
+        memcpy(header, (unsigned char[8]){ (run - moov->size) >> 24, (run - moov->size) >> 16, (run - moov->size) >> 8, run - moov->size, 'f', 'r', 'e', 'e' }, 8);
+        ok = pwrite(fd, header, 8, padding->offset + moov->size) == 8;
+      }
+      if (moov == &extents[count - 1]) {
+        // the old moov atom ends the file, it's cut off along with the
+        // free space between it and the media
+        for (j = count - 1; &extents[j - 1] > mdat && atom_is_padding(extents[j - 1].type); j--);
+        ok = ok && ftruncate(fd, (off_t)extents[j].offset) == 0;
+      } else {
+        // the old moov atom stays behind as free space
+        ok = ok && pwrite(fd, "free", 4, moov->offset + 4) == 4;
+      }
+      if (!ok) snprintf(error, error_size, "Error %d occurred while writing movie at %s", errno, filepath);
+      *moved = ok;
+      free(data);
+      free(extents);
+      close(fd);
+      return ok;
+    }
+  }
+
+  // otherwise the media moves forward by the size of the rewritten moov,
+  // which only grows when chunk offsets need 64 bits
+  memset(&relocation, 0, sizeof(relocation));
+  memset(&buffer, 0, sizeof(buffer));
+  relocation.start = mdat->offset;
+  relocation.end = moov->offset;
+  relocation.old_size = moov->size;
+  relocation.moov_size = moov->size;
+  for (attempts = 0; attempts < 8; attempts++) {
+    buffer.size = 0;
+    relocation.failed = 0;
+    atom_relocate_atoms(&buffer, data, moov->size, &relocation);
+    run = buffer.size > moov->size ? buffer.size : moov->size;
+    if (buffer.failed || relocation.failed || run == relocation.moov_size) break;
+    relocation.moov_size = run;
+  }
+  // 64 bit atom headers are written with 32 bits, their space is left free
+  if (buffer.size < relocation.moov_size) {
+    run = relocation.moov_size - buffer.size;
+    buf_u32(&buffer, (uint32_t)run);
+    buf_u32(&buffer, FOURCC('f','r','e','e'));
+    buf_reserve(&buffer, run - 8);
+    if (!buffer.failed) {
+      memset(buffer.data + buffer.size, 0, run - 8);
+      buffer.size += run - 8;
+    }
+  }
+  if (buffer.failed || relocation.failed || buffer.size != relocation.moov_size) {
+    snprintf(error, error_size, "Unable to relocate movie header in %s", filepath);
+    buf_free(&buffer);
+    free(data);
+    free(extents);
+    close(fd);
+    return 0;
+  }
+
+  block = (unsigned char*)malloc(ATOM_SHIFT_BLOCK_SIZE);
+  ok = block != NULL;
+  grow = relocation.moov_size - relocation.old_size;
+  shifted = 0;
+  if (ok && grow > 0) {
+    ok = atom_shift_forward(fd, moov->offset + moov->size, file_size - moov->offset - moov->size, grow, block, ATOM_SHIFT_BLOCK_SIZE, cancelled);
+    shifted = ok == 1;
+  }
+  if (ok == 1)
+    ok = atom_shift_forward(fd, mdat->offset, moov->offset - mdat->offset, relocation.moov_size, block, ATOM_SHIFT_BLOCK_SIZE, cancelled);
+  if (ok == -1) {
+    // put the old moov atom and what follows it back where they were
+    ok = pwrite(fd, data, moov->size, moov->offset) == (ssize_t)moov->size;
+    if (ok && shifted) ok = atom_shift_back(fd, moov->offset + moov->size, file_size - moov->offset - moov->size, grow, block, ATOM_SHIFT_BLOCK_SIZE);
+    if (ok && grow > 0) ok = ftruncate(fd, (off_t)file_size) == 0;
+    if (ok)
+      snprintf(error, error_size, "Relocating movie header in %s was interrupted", filepath);
+    else
+      snprintf(error, error_size, "Error %d occurred while restoring movie at %s, it is left inconsistent", errno, filepath);
+    ok = 0;
+  } else {
+    ok = ok && pwrite(fd, buffer.data, buffer.size, mdat->offset) == (ssize_t)buffer.size;
+    if (!ok) snprintf(error, error_size, "Error %d occurred while writing movie at %s", errno, filepath);
+  }
+  if (close(fd) != 0 && ok) {
+    snprintf(error, error_size, "Error %d occurred while writing movie at %s", errno, filepath);
+    ok = 0;
+  }
+  *moved = ok;
+  free(block);
+  free(data);
+  buf_free(&buffer);
+  free(extents);
+  return ok;
+}
+
+
+/*** SAVING ***/
+
+/*
+  The text track of chapters written along with the moov atom by
+  atom_movie_save_chapters. Text tracks holding the old chapters are left
+  out and the 'chap' references to them dropped.
+*/
+struct AtomChapterTrack {
+  const struct AtomChapter *chapters;
+  uint32_t count;
+  uint32_t id;               /* of the new track */
+  uint32_t referrer;         /* id of the track the chapters are of */
+  uint64_t offset;           /* of the first sample in the file */
+  int co64;
+};
+
+/* the extension atom marking the text of a sample as UTF-8 */
+static const unsigned char atom_chapter_encd[12] = { 0, 0, 0, 12, 'e', 'n', 'c', 'd', 0, 0, 1, 0 };
+
+/*  helper function, the duration of a chapter in the movie time scale.
+*/
+static int64_t atom_chapter_duration(struct AtomMovie *movie, struct AtomChapterTrack *ct, uint32_t i)
+{
+  return (i + 1 < ct->count ? ct->chapters[i + 1].time : (int64_t)movie->duration) - ct->chapters[i].time;
+}
+
+/*  helper function, appends the tref atom of a saved track, keeping its
+    'chap' references only to tracks which stay in the movie and adding
+    one to the new chapters if they are of this track. The atom is left 
+    out when nothing is left to refer to.
+*/
+static void atom_write_saved_tref(struct AtomBuffer *b, struct AtomTrack *track, struct AtomChapterTrack *ct)
+{
+  struct AtomTrack *media = ATOM_TRACK_MEDIA(track);
+  struct AtomMovie *movie = track->movie;
+  struct Atom *tref = atom_find(media->trak, FOURCC('t','r','e','f')), *atom;
+  size_t start = buf_begin(b, FOURCC('t','r','e','f')), chap = 0;
+  const unsigned char *p;
+  uint64_t i;
+  uint32_t id, j;
+
+  for (atom = tref ? tref->children : NULL; atom; atom = atom->next) {
+    if (atom->type != FOURCC('c','h','a','p'))
+      buf_atom(b, media->movie, atom);
+  }
+  // references of media pasted from another movie are to its tracks
+  for (atom = tref && media->movie == movie ? tref->children : NULL; atom; atom = atom->next) {
+    if (atom->type != FOURCC('c','h','a','p')) continue;
+    if (!(p = atom_data(movie, atom))) {
+      b->failed = 1;
+      break;
+    }
+    for (i = 0; i + 4 <= ATOM_DATA_SIZE(atom); i += 4) {
+      id = atom_u32(p + i);
+      for (j = 0; j < movie->track_count && movie->tracks[j]->id != id; j++);
+      if (j == movie->track_count || atom_track_is_chapters(movie->tracks[j])) continue;
+      if (!chap) chap = buf_begin(b, FOURCC('c','h','a','p'));
+      buf_u32(b, id);
+    }
+  }
+  if (ct->count > 0 && track->id == ct->referrer) {
+    if (!chap) chap = buf_begin(b, FOURCC('c','h','a','p'));
+    buf_u32(b, ct->id);
+  }
+  if (chap) buf_end(b, chap);
+
+  if (b->size == start + 8)
+    b->size = start;
+  else
+    buf_end(b, start);
+}
+
+/*  helper function, appends a trak atom for a track whose media is in the
+    movie file itself. The headers and edits are written from the track,
+    everything else is kept as it is in the file, except for the track
+    references when chapters are written.
+*/
+static void atom_write_saved_trak(struct AtomBuffer *b, struct AtomTrack *track, struct AtomChapterTrack *ct)
+{
+  struct AtomTrack *media = ATOM_TRACK_MEDIA(track);
+  struct Atom *atom;
+  size_t trak = buf_begin(b, FOURCC('t','r','a','k'));
+
+  atom_write_tkhd(b, track);
+  atom_write_edts(b, track->edits, track->edit_count);
+  if (ct) atom_write_saved_tref(b, track, ct);
+  for (atom = media->trak->children; atom; atom = atom->next) {
+    if (atom->type != FOURCC('t','k','h','d') && atom->type != FOURCC('e','d','t','s') && !(ct && atom->type == FOURCC('t','r','e','f')))
+      buf_atom(b, track->movie, atom);
+  }
+  buf_end(b, trak);
+}
+
+/*  helper function, appends the sample description of the chapter text,
+    black on white in the default font.
+*/
+static void atom_write_chapter_stsd(struct AtomBuffer *b)
+{
+  size_t stsd = buf_begin_full(b, FOURCC('s','t','s','d'), 0, 0), entry;
+
+  buf_u32(b, 1);
+  entry = buf_begin(b, FOURCC('t','e','x','t'));
+  buf_bytes(b, "\0\0\0\0\0\0", 6);
+  buf_u16(b, 1);           // data reference index
+  buf_u32(b, 0);           // display flags
+  buf_u32(b, 0);           // text justification, left
+  buf_u16(b, 0xFFFF);      // background color
+  buf_u16(b, 0xFFFF);
+  buf_u16(b, 0xFFFF);
+  buf_bytes(b, "\0\0\0\0\0\0\0\0", 8);  // default text box
+  buf_bytes(b, "\0\0\0\0\0\0\0\0", 8);  // reserved
+  buf_u16(b, 0);           // font number
+  buf_u16(b, 0);           // font face
+  buf_bytes(b, "\0\0\0", 3);            // reserved
+  buf_u16(b, 0);           // foreground color
+  buf_u16(b, 0);
+  buf_u16(b, 0);
+  buf_bytes(b, "\0", 1);   // font name
+  buf_end(b, entry);
+  buf_end(b, stsd);
+}
+
+/*  helper function, appends the sample tables of the chapters, a sample
+    for each stored one after another in a single chunk.
+*/
+static void atom_write_chapter_stbl(struct AtomBuffer *b, struct AtomMovie *movie, struct AtomChapterTrack *ct)
+{
+  size_t stbl = buf_begin(b, FOURCC('s','t','b','l')), start;
+  uint32_t runs = 0, run, i;
+
+  atom_write_chapter_stsd(b);
+
+  for (i = 0; i < ct->count; i++) {
+    if (i == 0 || atom_chapter_duration(movie, ct, i) != atom_chapter_duration(movie, ct, i - 1)) runs++;
+  }
+  start = buf_begin_full(b, FOURCC('s','t','t','s'), 0, 0);
+  buf_u32(b, runs);
+  for (i = 0; i < ct->count; i += run) {
+    for (run = 1; i + run < ct->count && atom_chapter_duration(movie, ct, i + run) == atom_chapter_duration(movie, ct, i); run++);
+    buf_u32(b, run);
+    buf_u32(b, (uint32_t)atom_chapter_duration(movie, ct, i));
+  }
+  buf_end(b, start);
+
+  start = buf_begin_full(b, FOURCC('s','t','s','c'), 0, 0);
+  buf_u32(b, 1);
+  buf_u32(b, 1);
+  buf_u32(b, ct->count);
+  buf_u32(b, 1);
+  buf_end(b, start);
+
+  start = buf_begin_full(b, FOURCC('s','t','s','z'), 0, 0);
+  buf_u32(b, 0);
+  buf_u32(b, ct->count);
+  for (i = 0; i < ct->count; i++) buf_u32(b, (uint32_t)(2 + ct->chapters[i].length + sizeof(atom_chapter_encd)));
+  buf_end(b, start);
+
+  start = buf_begin_full(b, ct->co64 ? FOURCC('c','o','6','4') : FOURCC('s','t','c','o'), 0, 0);
+  buf_u32(b, 1);
+  if (ct->co64)
+    buf_u64(b, ct->offset);
+  else
+    buf_u32(b, (uint32_t)ct->offset);
+  buf_end(b, start);
+
+  buf_end(b, stbl);
+}
+
+/*  helper function, appends the trak atom of the chapters. The track
+    lasts as long as the movie, starting with an empty edit until the
+    first chapter. It's in the movie but not enabled, so players list the
+    chapters without drawing their titles over the video.
+*/
+static void atom_write_chapter_trak(struct AtomBuffer *b, struct AtomMovie *movie, struct AtomChapterTrack *ct)
+{
+  static const int32_t identity[9] = { 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000 };
+  int64_t start = ct->chapters[0].time;
+  struct AtomEdit edits[2] = { { start, -1, 0x10000, NULL }, { (int64_t)movie->duration - start, 0, 0x10000, NULL } };
+  struct AtomTrack track;
+  struct AtomWriteTrack wt;
+  size_t trak, mdia, minf, gmhd, atom;
+  uint32_t i;
+
+  memset(&track, 0, sizeof(track));
+  track.id = ct->id;
+  track.flags = 2;         // in movie
+  track.duration = movie->duration;
+  memcpy(track.matrix, identity, sizeof(identity));
+
+  memset(&wt, 0, sizeof(wt));
+  wt.track = wt.media = &track;
+  wt.media_time_scale = movie->time_scale;
+  wt.media_duration = movie->duration - start;
+
+  trak = buf_begin(b, FOURCC('t','r','a','k'));
+  atom_write_tkhd(b, &track);
+  atom_write_edts(b, start > 0 ? edits : edits + 1, start > 0 ? 2 : 1);
+  mdia = buf_begin(b, FOURCC('m','d','i','a'));
+  atom_write_mdhd(b, &wt);
+  atom_write_hdlr(b, FOURCC('m','h','l','r'), FOURCC('t','e','x','t'), "Text Media Handler");
+  minf = buf_begin(b, FOURCC('m','i','n','f'));
+  gmhd = buf_begin(b, FOURCC('g','m','h','d'));
+  atom = buf_begin_full(b, FOURCC('g','m','i','n'), 0, 0);
+  buf_u16(b, 0x40);        // graphics mode, dither copy
+  buf_u16(b, 0x8000);      // opcolor
+  buf_u16(b, 0x8000);
+  buf_u16(b, 0x8000);
+  buf_u16(b, 0);           // balance
+  buf_u16(b, 0);           // reserved
+  buf_end(b, atom);
+  atom = buf_begin(b, FOURCC('t','e','x','t'));
+  for (i = 0; i < 9; i++) buf_u32(b, (uint32_t)identity[i]);
+  buf_end(b, atom);
+  buf_end(b, gmhd);
+  atom_write_hdlr(b, FOURCC('d','h','l','r'), FOURCC('a','l','i','s'), "Data Handler");
+  atom_write_dinf(b);
+  atom_write_chapter_stbl(b, movie, ct);
+  buf_end(b, minf);
+  buf_end(b, mdia);
+  buf_end(b, trak);
+}
+
+/*  helper function, appends the moov atom of an edited movie, see 
+    atom_movie_save. With chapters the old chapter tracks are replaced.
+*/
+static void atom_write_saved_moov(struct AtomBuffer *b, struct AtomMovie *movie, struct AtomChapterTrack *ct)
+{
+  size_t moov = buf_begin(b, FOURCC('m','o','o','v'));
+  struct Atom *atom;
+  uint32_t i, next_track_id = 0;
+
+  for (i = 0; i < movie->track_count; i++) {
+    if (movie->tracks[i]->id > next_track_id) next_track_id = movie->tracks[i]->id;
+  }
+  if (ct && ct->id > next_track_id) next_track_id = ct->id;
+  atom_write_mvhd(b, movie, next_track_id + 1);
+  for (i = 0; i < movie->track_count; i++) {
+    if (!ct || !atom_track_is_chapters(movie->tracks[i]))
+      atom_write_saved_trak(b, movie->tracks[i], ct);
+  }
+  if (ct && ct->count > 0)
+    atom_write_chapter_trak(b, movie, ct);
+  for (atom = movie->moov->children; atom; atom = atom->next) {
+    if (atom->type != FOURCC('m','v','h','d') && atom->type != FOURCC('t','r','a','k'))
+      buf_atom(b, movie, atom);
+  }
+  buf_end(b, moov);
+}
+
+/*  helper function, writes the moov atom at offset followed by a free 
+    atom filling up to end. When resize is set the file ends there. The
+    first unchanged bytes of its payload are already in the file and
+    aren't written again.
+*/
+static int atom_write_moov_at(int fd, struct AtomBuffer *moov, uint64_t offset, uint64_t end, int resize, size_t unchanged)
+{
+  unsigned char header[8];
+  uint64_t rest = end - offset - moov->size;
+  size_t tail = 8 + unchanged;
+
+  if (pwrite(fd, moov->data, 8, offset) != 8) return 0;
+  if (tail < moov->size && pwrite(fd, moov->data + tail, moov->size - tail, offset + tail) != (ssize_t)(moov->size - tail)) return 0;
+  if (rest >= 8) {
+    memcpy(header, (unsigned char[8]){ rest >> 24, rest >> 16, rest >> 8, rest, 'f', 'r', 'e', 'e' }, 8);
+    if (pwrite(fd, header, 8, offset + moov->size) != 8) return 0;
+  }
+  // a grown file is filled with zeros without writing them
+  if (resize && ftruncate(fd, end) != 0) return 0;
+  return 1;
+}
+
+/*  helper function, opens the file of the movie for saving and reads its
+    top level atoms. Sets the index of its moov atom, which must be the
+    one the movie was read from. Returns -1 and fills in error on failure.
+*/
+static int atom_open_saved(struct AtomMovie *movie, const char *filepath, struct AtomExtent **extents, uint32_t *count, uint32_t *index, uint64_t *file_size, char *error, size_t error_size)
+{
+  off_t end;
+  int fd;
+
+  fd = open(filepath, O_RDWR);
+  if (fd < 0) {
+    snprintf(error, error_size, "Error %d occurred while opening movie at %s", errno, filepath);
+    return -1;
+  }
+  end = lseek(fd, 0, SEEK_END);
+  *file_size = end < 0 ? 0 : (uint64_t)end;
+  *extents = atom_read_top_level(fd, *file_size, count);
+  for (*index = 0; *extents && *index < *count; (*index)++) {
+    if ((*extents)[*index].type == FOURCC('m','o','o','v') && (*extents)[*index].offset == movie->moov->offset && (*extents)[*index].size == movie->moov->size)
+      return fd;
+  }
+  snprintf(error, error_size, "Unable to save movie because %s changed since it was opened", filepath);
+  free(*extents);
+  close(fd);
+  return -1;
+}
+
+/*  helper function, writes the moov atom where the top level atom i of
+    the file is when it fits in it and the free space after it, or when
+    it's at the end of the file. Otherwise it's added to the end of the 
+    file followed by padding and the old one is marked free.
+*/
+static int atom_place_moov(int fd, struct AtomExtent *extents, uint32_t count, uint32_t i, uint64_t file_size, struct AtomBuffer *buffer, size_t unchanged, uint64_t padding)
+{
+  struct AtomExtent *moov = &extents[i];
+  uint64_t available;
+  uint32_t j;
+
+  for (available = moov->size, j = i + 1; j < count && atom_is_padding(extents[j].type); j++) {
+    available += extents[j].size;
+  }
+  if (buffer->size == available || buffer->size + 8 <= available)
+    return atom_write_moov_at(fd, buffer, moov->offset, moov->offset + available, 0, unchanged);
+  if (moov->offset + available == file_size)
+    return atom_write_moov_at(fd, buffer, moov->offset, moov->offset + buffer->size + padding, 1, unchanged);
+  return atom_write_moov_at(fd, buffer, file_size, file_size + buffer->size + padding, 1, 0) &&
+         pwrite(fd, "free", 4, moov->offset + 4) == 4;
+}
+
+/*  helper function, returns the top level mdat atom holding the samples
+    of the chapter tracks and nothing else, as atom_movie_save_chapters
+    writes it, or NULL if there is none.
+*/
+static struct AtomExtent *atom_find_chapter_mdat(struct AtomMovie *movie, struct AtomExtent *extents, uint32_t count)
+{
+  struct AtomExtent *mdat = NULL;
+  struct AtomSampleIndex *index;
+  uint32_t i, j, s;
+  int chapters;
+
+  // the mdat atom is found from the first chapter sample
+  for (i = 0; i < movie->track_count && !mdat; i++) {
+    if (!atom_track_is_chapters(movie->tracks[i]) || !(index = atom_track_sample_index(movie->tracks[i])) || index->count == 0) continue;
+    for (j = 0; j < count; j++) {
+      if (extents[j].type == FOURCC('m','d','a','t') && index->offsets[0] >= extents[j].offset + 8 &&
+          index->offsets[0] < extents[j].offset + extents[j].size) mdat = &extents[j];
+    }
+  }
+  if (!mdat) return NULL;
+  // all chapter samples have to be in it and no other samples
+  for (i = 0; i < movie->track_count; i++) {
+    if (!(index = atom_track_sample_index(movie->tracks[i]))) return NULL;
+    chapters = atom_track_is_chapters(movie->tracks[i]);
+    for (s = 0; s < index->count; s++) {
+      if (index->offsets[s] >= mdat->offset + 8 && index->offsets[s] + index->sizes[s] <= mdat->offset + mdat->size) {
+        if (!chapters) return NULL;
+      } else if (chapters || (index->offsets[s] < mdat->offset + mdat->size && index->offsets[s] + index->sizes[s] > mdat->offset)) {
+        return NULL;
+      }
+    }
+  }
+  return mdat;
+}
+
+/*  helper function, saves the movie as atom_movie_save does. Chapters
+    are written in a new mdat atom, which is removed again if the moov
+    atom can't be written. The mdat atom of the old chapters is reused
+    when it ends the file or the new chapters fit in it and the free space
+    after it, otherwise it's marked free once the moov atom is written.
+*/
+static int atom_movie_write_saved(struct AtomMovie *movie, const char *filepath, uint64_t padding, struct AtomChapterTrack *ct, char *error, size_t error_size)
+{
+  struct AtomExtent *extents, *old;
+  struct AtomBuffer buffer, mdat;
+  unsigned char *old_data = NULL, header[8];
+  uint64_t file_size, original_size, at, available = 0;
+  uint32_t count, i, j;
+  size_t start;
+  int fd, ok, reuse = 0;
+
+  if (!movie->moov || !atom_movie_load_tracks(movie)) {
+    snprintf(error, error_size, "Unable to read tracks of movie");
+    return 0;
+  }
+  for (i = 0; i < movie->track_count; i++) {
+    if (ATOM_TRACK_MEDIA(movie->tracks[i])->movie != movie) break;
+    for (j = 0; j < movie->tracks[i]->edit_count; j++) {
+      if (movie->tracks[i]->edits[j].media && ATOM_TRACK_MEDIA(movie->tracks[i]->edits[j].media) != ATOM_TRACK_MEDIA(movie->tracks[i])) break;
+    }
+    if (j < movie->tracks[i]->edit_count) break;
+  }
+  if (i < movie->track_count) {
+    snprintf(error, error_size, "Unable to save movie which plays media of other movies or tracks, flatten it instead.");
+    return 0;
+  }
+  if (padding > 0 && padding < 8) padding = 8;
+
+  memset(&buffer, 0, sizeof(buffer));
+  memset(&mdat, 0, sizeof(mdat));
+  if (ct && ct->count > 0) {
+    start = buf_begin(&mdat, FOURCC('m','d','a','t'));
+    for (i = 0; i < ct->count; i++) {
+      buf_u16(&mdat, (uint16_t)ct->chapters[i].length);
+      buf_bytes(&mdat, ct->chapters[i].title, ct->chapters[i].length);
+      buf_bytes(&mdat, atom_chapter_encd, sizeof(atom_chapter_encd));
+    }
+    buf_end(&mdat, start);
+  }
+  // the size of moov doesn't depend on the offsets of the chapters, only on their width
+  atom_write_saved_moov(&buffer, movie, ct);
+  if (buffer.failed || mdat.failed) {
+    snprintf(error, error_size, "Unable to write movie header of %s", filepath);
+    buf_free(&buffer);
+    buf_free(&mdat);
+    return 0;
+  }
+
+  fd = atom_open_saved(movie, filepath, &extents, &count, &i, &file_size, error, error_size);
+  if (fd < 0) {
+    buf_free(&buffer);
+    buf_free(&mdat);
+    return 0;
+  }
+  original_size = file_size;
+
+  // the old chapters are kept in memory until the moov atom is written
+  old = ct ? atom_find_chapter_mdat(movie, extents, count) : NULL;
+  at = file_size;
+  if (old) {
+    // along with the free space after it
+    for (available = old->size, j = (uint32_t)(old - extents) + 1; j < count && atom_is_padding(extents[j].type); j++) {
+      available += extents[j].size;
+    }
+    if (j == count || (mdat.size > 0 && (mdat.size == available || mdat.size + 8 <= available))) {
+      if (old->size <= SIZE_MAX && (old_data = (unsigned char*)malloc(old->size)) &&
+          pread(fd, old_data, old->size, old->offset) == (ssize_t)old->size) {
+        at = old->offset;
+        reuse = j == count ? 2 : 1;
+      } else {
+        free(old_data);
+        old_data = NULL;
+      }
+    }
+  }
+
+  ok = 1;
+  if (reuse == 2) {
+    // the old chapters end the file, the new ones replace them there
+    ok = ftruncate(fd, (off_t)at) == 0;
+    file_size = at;
+  }
+  if (mdat.size > 0) {
+    ct->offset = at + 8;
+    ct->co64 = at + mdat.size > 0xFFFFFFFFULL;
+    buffer.size = 0;
+    atom_write_saved_moov(&buffer, movie, ct);
+    ok = ok && !buffer.failed && pwrite(fd, mdat.data, mdat.size, at) == (ssize_t)mdat.size;
+    if (reuse == 1 && mdat.size < available) {
+      memcpy(header, (unsigned char[8]){ (available - mdat.size) >> 24, (available - mdat.size) >> 16, (available - mdat.size) >> 8, available - mdat.size, 'f', 'r', 'e', 'e' }, 8);
+      ok = ok && pwrite(fd, header, 8, at + mdat.size) == 8;
+    }
+    if (reuse != 1) file_size += mdat.size;
+  }
+
+  ok = ok && atom_place_moov(fd, extents, count, i, file_size, &buffer, 0, padding);
+  if (ok && old && !reuse)
+    ok = pwrite(fd, "free", 4, old->offset + 4) == 4;
+  if (!ok) {
+    snprintf(error, error_size, "Error %d occurred while saving movie at %s", errno, filepath);
+    // the chapters written for the moov atom which wasn't written go again
+    if ((file_size != original_size && ftruncate(fd, original_size) != 0) ||
+        (old_data && pwrite(fd, old_data, old->size, old->offset) != (ssize_t)old->size))
+      snprintf(error, error_size, "Error %d occurred while saving movie at %s, its chapters may be lost", errno, filepath);
+  }
+  free(old_data);
+  if (close(fd) != 0 && ok) {
+    snprintf(error, error_size, "Error %d occurred while saving movie at %s", errno, filepath);
+    ok = 0;
+  }
+  free(extents);
+  buf_free(&buffer);
+  buf_free(&mdat);
+  return ok;
+}
+
+/*
+  Saves the edited movie to its file at filepath by rewriting only its
+  moov atom. The new moov atom goes where the old one was when it fits in
+  the old one and the free space after it, or when it's at the end of the
+  file. Otherwise it's added to the end of the file and the old one is
+  marked free. A new moov atom is followed by padding bytes of free space
+  so later saves fit in place. Every track must play media from this file.
+  Returns 0 and fills in error on failure.
+*/
+int atom_movie_save(struct AtomMovie *movie, const char *filepath, uint64_t padding, char *error, size_t error_size)
+{
+  return atom_movie_write_saved(movie, filepath, padding, NULL, error, error_size);
+}
+
+/*
+  Saves the movie as atom_movie_save does, replacing its chapters by the
+  given ones, sorted by time. The titles are written as the samples of a
+  new text track in a single mdat atom, in place of the one holding the
+  old chapters when it ends the file or they fit in it and appended to
+  the file otherwise. The moov atom is then written once with the sample 
+  tables of that track and a 'chap' reference to it from the first 
+  enabled video track (or the first other track). No chapters removes 
+  them. Returns 0 and fills in error on failure.
+*/
+int atom_movie_save_chapters(struct AtomMovie *movie, const char *filepath, const struct AtomChapter *chapters, uint32_t count, uint64_t padding, char *error, size_t error_size)
+{
+  struct AtomChapterTrack ct;
+  struct AtomTrack *track, *referrer = NULL;
+  uint32_t i;
+
+  if (!movie->moov || !atom_movie_load_tracks(movie)) {
+    snprintf(error, error_size, "Unable to read tracks of movie");
+    return 0;
+  }
+  memset(&ct, 0, sizeof(ct));
+  ct.chapters = chapters;
+  ct.count = count;
+  for (i = 0; i < movie->track_count; i++) {
+    track = movie->tracks[i];
+    if (track->id >= ct.id) ct.id = track->id + 1;
+    if (atom_track_is_chapters(track)) continue;
+    if (!referrer || (track->handler_type == VideoMediaType && (track->flags & 1) && !(referrer->handler_type == VideoMediaType && (referrer->flags & 1))))
+      referrer = track;
+  }
+  if (count > 0 && !referrer) {
+    snprintf(error, error_size, "Unable to add chapters to a movie without tracks");
+    return 0;
+  }
+  ct.referrer = referrer ? referrer->id : 0;
+
+  for (i = 0; i < count; i++) {
+    if (chapters[i].time < 0 || (uint64_t)chapters[i].time >= movie->duration) {
+      snprintf(error, error_size, "Chapter %u starts outside of the movie", i + 1);
+      return 0;
+    }
+    if (i > 0 && chapters[i].time <= chapters[i - 1].time) {
+      snprintf(error, error_size, "Chapter %u doesn't start after the one before it", i + 1);
+      return 0;
+    }
+    if (chapters[i].length > 0xFFFF) {
+      snprintf(error, error_size, "Title of chapter %u is too long", i + 1);
+      return 0;
+    }
+  }
+  return atom_movie_write_saved(movie, filepath, padding, &ct, error, error_size);
+}
+
+
+/*** METADATA ***/
+
+/*
+  A field written by atom_movie_save_metadata. It's replaced where the
+  movie has it and added to a single place otherwise.
+*/
+struct AtomMetadataChange {
+  const struct AtomMetadataEntry *entry;
+  const struct AtomMetadataField *field;   /* NULL for a custom key */
+  int present;               /* ATOM_METADATA_* holding the field now */
+  int stores;                /* ATOM_METADATA_* to write it to, none removes it */
+};
+
+/*  helper function, sets the big endian value at position of the buffer.
+*/
+static void buf_set_u32(struct AtomBuffer *b, size_t position, uint32_t value)
+{
+  if (b->failed) return;
+  b->data[position] = value >> 24;
+  b->data[position + 1] = value >> 16;
+  b->data[position + 2] = value >> 8;
+  b->data[position + 3] = value;
+}
+
+static struct AtomMetadataChange *atom_metadata_change_of_type(struct AtomMetadataChange *changes, uint32_t count, uint32_t type)
+{
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    if (changes[i].field && changes[i].field->type == type) return &changes[i];
+  }
+  return NULL;
+}
+
+static struct AtomMetadataChange *atom_metadata_change_of_key(struct AtomMetadataChange *changes, uint32_t count, const unsigned char *key, uint64_t length)
+{
+  const char *name;
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    name = changes[i].field ? changes[i].field->key : changes[i].entry->name;
+    if (strlen(name) == length && memcmp(name, key, length) == 0) return &changes[i];
+  }
+  return NULL;
+}
+
+/*  helper function, true if the payload of a 'meta' atom has an 'mdta'
+    handler, making it QuickTime metadata.
+*/
+static int atom_meta_is_mdta(const unsigned char *payload, uint64_t length)
+{
+  const unsigned char *p = payload + atom_meta_body(payload, length), *end = payload + length, *child, *next;
+  uint64_t size;
+  uint32_t type;
+
+  for (; (next = atom_meta_child(p, end, &type, &child, &size)); p = next) {
+    if (type == FOURCC('h','d','l','r')) return size >= 12 && atom_u32(child + 8) == FOURCC('m','d','t','a');
+  }
+  return 0;
+}
+
+/*  helper function, writes an item of an iTunes list or QuickTime
+    metadata, a 'data' atom of UTF-8 text.
+*/
+static void atom_write_metadata_item(struct AtomBuffer *b, uint32_t type, struct AtomMetadataChange *change)
+{
+  size_t item = buf_begin(b, type);
+  size_t data = buf_begin_full(b, FOURCC('d','a','t','a'), 0, 1);
+
+  buf_u32(b, 0);        // locale
+  buf_bytes(b, change->entry->value, change->entry->length);
+  buf_end(b, data);
+  buf_end(b, item);
+}
+
+/*  helper function, rewrites the iTunes list of the user data.
+*/
+static void atom_write_metadata_ilst(struct AtomBuffer *b, const unsigned char *p, uint64_t length, struct AtomMetadataChange *changes, uint32_t count)
+{
+  const unsigned char *end = p + length, *payload, *next;
+  struct AtomMetadataChange *change;
+  size_t ilst = buf_begin(b, FOURCC('i','l','s','t'));
+  uint64_t size;
+  uint32_t type, i;
+
+  for (; (next = atom_meta_child(p, end, &type, &payload, &size)); p = next) {
+    if (!(change = atom_metadata_change_of_type(changes, count, type)))
+      buf_bytes(b, p, next - p);
+    else if (change->stores & ATOM_METADATA_ILST)
+      atom_write_metadata_item(b, type, change);
+  }
+  for (i = 0; i < count; i++) {
+    if ((changes[i].stores & ATOM_METADATA_ILST) && !(changes[i].present & ATOM_METADATA_ILST))
+      atom_write_metadata_item(b, changes[i].field->type, &changes[i]);
+  }
+  buf_end(b, ilst);
+}
+
+/*  helper function, rewrites the user data, which is left out when 
+    nothing remains in it. The fields are written as a single text of
+    undetermined language.
+*/
+static void atom_write_metadata_udta(struct AtomBuffer *b, const unsigned char *p, uint64_t length, struct AtomMetadataChange *changes, uint32_t count)
+{
+  const unsigned char *end = p + length, *payload, *next, *child, *child_payload;
+  struct AtomMetadataChange *change;
+  size_t udta = buf_begin(b, FOURCC('u','d','t','a')), meta, item;
+  uint64_t size, child_size, body;
+  uint32_t type, child_type, i;
+
+  for (; p && (next = atom_meta_child(p, end, &type, &payload, &size)); p = next) {
+    if (type == FOURCC('m','e','t','a')) {
+      meta = buf_begin(b, type);
+      body = atom_meta_body(payload, size);
+      buf_bytes(b, payload, body);
+      for (child = payload + body; body <= size && (next = atom_meta_child(child, payload + size, &child_type, &child_payload, &child_size)); child = next) {
+        if (child_type == FOURCC('i','l','s','t'))
+          atom_write_metadata_ilst(b, child_payload, child_size, changes, count);
+        else
+          buf_bytes(b, child, next - child);
+      }
+      buf_end(b, meta);
+      next = payload + size;
+    } else if (!(change = atom_metadata_change_of_type(changes, count, type))) {
+      buf_bytes(b, p, next - p);
+    } else if (change->stores & ATOM_METADATA_UDTA) {
+      item = buf_begin(b, type);
+      buf_u16(b, (uint16_t)change->entry->length);
+      buf_u16(b, 0x55C4);   // 'und' packed in 5 bit letters
+      buf_bytes(b, change->entry->value, change->entry->length);
+      buf_end(b, item);
+    }
+  }
+  for (i = 0; i < count; i++) {
+    if ((changes[i].stores & ATOM_METADATA_UDTA) && !(changes[i].present & ATOM_METADATA_UDTA)) {
+      item = buf_begin(b, changes[i].field->type);
+      buf_u16(b, (uint16_t)changes[i].entry->length);
+      buf_u16(b, 0x55C4);
+      buf_bytes(b, changes[i].entry->value, changes[i].entry->length);
+      buf_end(b, item);
+    }
+  }
+  if (b->size - udta == 8)
+    b->size = udta;
+  else
+    buf_end(b, udta);
+}
+
+/*  helper function, rewrites the keys and items of QuickTime metadata.
+    The keys of removed fields go and the items are numbered again, new
+    fields get keys after the others.
+*/
+static void atom_write_metadata_keys(struct AtomBuffer *b, const unsigned char *keys, uint64_t keys_size, const unsigned char *ilst, uint64_t ilst_size, struct AtomMetadataChange *changes, uint32_t count)
+{
+  struct AtomMetadataChange **key_changes = NULL, *change;
+  const unsigned char *p, *end, *payload, *next;
+  uint32_t key_count = 0, *numbers = NULL, number = 0, kept, index, i;
+  uint64_t offset, size;
+  size_t start, count_at;
+
+  if (keys && keys_size >= 8) key_count = atom_u32(keys + 4);
+  if (key_count > (keys_size - 8) / 8) key_count = (uint32_t)((keys_size - 8) / 8);
+  numbers = (uint32_t*)calloc(key_count + 1, sizeof(uint32_t));
+  key_changes = (struct AtomMetadataChange**)calloc(key_count + 1, sizeof(struct AtomMetadataChange*));
+  if (!numbers || !key_changes) {
+    b->failed = 1;
+    free(numbers);
+    free(key_changes);
+    return;
+  }
+
+  start = buf_begin_full(b, FOURCC('k','e','y','s'), 0, 0);
+  count_at = b->size;
+  buf_u32(b, 0);
+  for (i = 1, offset = 8; i <= key_count; i++, offset += size) {
+    size = offset + 8 <= keys_size ? atom_u32(keys + offset) : 0;
+    if (size < 8 || size > keys_size - offset) break;
+    change = atom_metadata_change_of_key(changes, count, keys + offset + 8, size - 8);
+    if (change && !(change->stores & ATOM_METADATA_MDTA)) continue;
+    key_changes[i] = change;
+    numbers[i] = ++number;
+    buf_bytes(b, keys + offset, size);
+  }
+  kept = number;
+  for (i = 0; i < count; i++) {
+    if ((changes[i].stores & ATOM_METADATA_MDTA) && !(changes[i].present & ATOM_METADATA_MDTA)) {
+      p = (const unsigned char*)(changes[i].field ? changes[i].field->key : changes[i].entry->name);
+      buf_u32(b, (uint32_t)(8 + strlen((const char*)p)));
+      buf_u32(b, FOURCC('m','d','t','a'));
+      buf_bytes(b, p, strlen((const char*)p));
+      number++;
+    }
+  }
+  buf_set_u32(b, count_at, number);
+  buf_end(b, start);
+
+  start = buf_begin(b, FOURCC('i','l','s','t'));
+  for (p = ilst, end = ilst + ilst_size; ilst && (next = atom_meta_child(p, end, &index, &payload, &size)); p = next) {
+    if (index == 0 || index > key_count || numbers[index] == 0) continue;
+    if (key_changes[index]) {
+      atom_write_metadata_item(b, numbers[index], key_changes[index]);
+    } else {
+      count_at = buf_begin(b, numbers[index]);
+      buf_bytes(b, payload, size);
+      buf_end(b, count_at);
+    }
+  }
+  for (i = 0; i < count; i++) {
+    if ((changes[i].stores & ATOM_METADATA_MDTA) && !(changes[i].present & ATOM_METADATA_MDTA))
+      atom_write_metadata_item(b, ++kept, &changes[i]);
+  }
+  buf_end(b, start);
+  free(numbers);
+  free(key_changes);
+}
+
+/*  helper function, rewrites QuickTime metadata, or writes new metadata
+    when p is NULL.
+*/
+static void atom_write_metadata_mdta(struct AtomBuffer *b, const unsigned char *p, uint64_t length, struct AtomMetadataChange *changes, uint32_t count)
+{
+  const unsigned char *end = p + length, *child, *payload, *next, *ilst = NULL;
+  size_t meta = buf_begin(b, FOURCC('m','e','t','a')), hdlr;
+  uint64_t size, body = p ? atom_meta_body(p, length) : 0, ilst_size = 0;
+  uint32_t type;
+  int keys = 0;
+
+  if (!p) {
+    hdlr = buf_begin_full(b, FOURCC('h','d','l','r'), 0, 0);
+    buf_u32(b, 0);
+    buf_u32(b, FOURCC('m','d','t','a'));
+    buf_u32(b, 0);
+    buf_u32(b, 0);
+    buf_u32(b, 0);
+    buf_bytes(b, "", 1);
+    buf_end(b, hdlr);
+    atom_write_metadata_keys(b, NULL, 0, NULL, 0, changes, count);
+    buf_end(b, meta);
+    return;
+  }
+  for (child = p + body; (next = atom_meta_child(child, end, &type, &payload, &size)); child = next) {
+    if (type == FOURCC('i','l','s','t')) {
+      ilst = payload;
+      ilst_size = size;
+    }
+  }
+  buf_bytes(b, p, body);
+  for (p += body; (next = atom_meta_child(p, end, &type, &payload, &size)); p = next) {
+    if (type == FOURCC('k','e','y','s') && !keys) {
+      atom_write_metadata_keys(b, payload, size, ilst, ilst_size, changes, count);
+      keys = 1;
+    } else if (type != FOURCC('i','l','s','t')) {
+      buf_bytes(b, p, next - p);
+    }
+  }
+  // items without keys can't be read
+  if (!keys) atom_write_metadata_keys(b, NULL, 0, NULL, 0, changes, count);
+  buf_end(b, meta);
+}
+
+/*  helper function, writes the moov atom with the metadata changed, all
+    else is copied as it is.
+*/
+static void atom_write_metadata_moov(struct AtomBuffer *b, const unsigned char *p, uint64_t length, struct AtomMetadataChange *changes, uint32_t count)
+{
+  const unsigned char *end = p + length, *payload, *next;
+  size_t moov = buf_begin(b, FOURCC('m','o','o','v'));
+  int udta = 0, mdta = 0, stores = 0;
+  uint64_t size;
+  uint32_t type, i;
+
+  for (; (next = atom_meta_child(p, end, &type, &payload, &size)); p = next) {
+    if (type == FOURCC('u','d','t','a') && !udta) {
+      atom_write_metadata_udta(b, payload, size, changes, count);
+      udta = 1;
+    } else if (type == FOURCC('m','e','t','a') && !mdta && atom_meta_is_mdta(payload, size)) {
+      atom_write_metadata_mdta(b, payload, size, changes, count);
+      mdta = 1;
+    } else {
+      buf_bytes(b, p, next - p);
+    }
+  }
+  for (i = 0; i < count; i++) {
+    stores |= changes[i].stores;
+  }
+  if (!udta && (stores & (ATOM_METADATA_UDTA | ATOM_METADATA_ILST)))
+    atom_write_metadata_udta(b, NULL, 0, changes, count);
+  if (!mdta && (stores & ATOM_METADATA_MDTA))
+    atom_write_metadata_mdta(b, NULL, 0, changes, count);
+  buf_end(b, moov);
+}
+
+/*
+  Saves the given metadata fields to the movie file at filepath, the 
+  other fields are kept. A field with a NULL value is removed. A field is
+  replaced wherever the movie holds it (user data, the iTunes list or 
+  QuickTime metadata, see atom_meta.c). A new field goes to the QuickTime
+  metadata when the movie has some or it's named by a reverse DNS key, 
+  to the iTunes list when the movie has one and to the user data 
+  otherwise. Only the moov atom is rewritten, in place when it fits in 
+  the free space after it, and then only from the first byte which 
+  changed. The movie must have been saved. Returns 0 and fills in error 
+  on failure.
+*/
+int atom_movie_save_metadata(struct AtomMovie *movie, const char *filepath, const struct AtomMetadataEntry *entries, uint32_t count, uint64_t padding, char *error, size_t error_size)
+{
+  struct AtomMetadata metadata;
+  struct AtomMetadataChange *changes;
+  struct AtomExtent *extents;
+  struct AtomBuffer buffer;
+  const unsigned char *old;
+  uint64_t file_size;
+  uint32_t extent_count, i, j;
+  size_t unchanged = 0;
+  int fd, ok;
+
+  for (i = 0; i < count; i++) {
+    if (!atom_metadata_field(entries[i].name) && !strchr(entries[i].name, '.')) {
+      snprintf(error, error_size, "Unknown metadata field %s, custom fields are named by a reverse DNS key such as com.example.rating", entries[i].name);
+      return 0;
+    }
+    if (entries[i].value && entries[i].length > 0xFFFF) {
+      snprintf(error, error_size, "Value of metadata field %s is too long", entries[i].name);
+      return 0;
+    }
+  }
+  if (!movie->moov || !(old = atom_data(movie, movie->moov)) || !atom_movie_metadata(movie, &metadata)) {
+    snprintf(error, error_size, "Unable to read metadata of movie");
+    return 0;
+  }
+  if (padding > 0 && padding < 8) padding = 8;
+
+  if (!(changes = (struct AtomMetadataChange*)calloc(count ? count : 1, sizeof(struct AtomMetadataChange)))) {
+    snprintf(error, error_size, "Unable to write metadata of %s", filepath);
+    atom_metadata_free(&metadata);
+    return 0;
+  }
+  for (i = 0; i < count; i++) {
+    changes[i].entry = &entries[i];
+    if (!(changes[i].field = atom_metadata_field(entries[i].name))) {
+      for (changes[i].field = atom_metadata_fields; changes[i].field->name && strcmp(changes[i].field->key, entries[i].name) != 0; changes[i].field++);
+      if (!changes[i].field->name) changes[i].field = NULL;
+    }
+    for (j = 0; j < metadata.count; j++) {
+      if (strcmp(metadata.entries[j].name, changes[i].field ? changes[i].field->name : entries[i].name) == 0)
+        changes[i].present = metadata.entries[j].stores;
+    }
+    if (!entries[i].value)
+      changes[i].stores = 0;
+    else if (changes[i].present)
+      changes[i].stores = changes[i].present;
+    else if (!changes[i].field || (metadata.stores & ATOM_METADATA_MDTA))
+      changes[i].stores = ATOM_METADATA_MDTA;
+    else
+      changes[i].stores = (metadata.stores & ATOM_METADATA_ILST) ? ATOM_METADATA_ILST : ATOM_METADATA_UDTA;
+  }
+  atom_metadata_free(&metadata);
+
+  memset(&buffer, 0, sizeof(buffer));
+  atom_write_metadata_moov(&buffer, old, ATOM_DATA_SIZE(movie->moov), changes, count);
+  free(changes);
+  if (buffer.failed) {
+    snprintf(error, error_size, "Unable to write movie header of %s", filepath);
+    buf_free(&buffer);
+    return 0;
+  }
+  // the tracks before the metadata usually stay as they are
+  if (movie->moov->header_size == 8) {
+    while (unchanged < ATOM_DATA_SIZE(movie->moov) && 8 + unchanged < buffer.size && old[unchanged] == buffer.data[8 + unchanged]) unchanged++;
+  }
+
+  fd = atom_open_saved(movie, filepath, &extents, &extent_count, &i, &file_size, error, error_size);
+  if (fd < 0) {
+    buf_free(&buffer);
+    return 0;
+  }
+  ok = atom_place_moov(fd, extents, extent_count, i, file_size, &buffer, unchanged, padding);
+  if (!ok)
+    snprintf(error, error_size, "Error %d occurred while saving movie at %s", errno, filepath);
+  if (close(fd) != 0 && ok) {
+    snprintf(error, error_size, "Error %d occurred while saving movie at %s", errno, filepath);
+    ok = 0;
+  }
+  free(extents);
+  buf_free(&buffer);
+  return ok;
+}
+
+
+/*** IMAGE SEQUENCES ***/
+
+/*  helper function, appends the image description shared by all frames.
+*/
+static void atom_write_sequence_stsd(struct AtomBuffer *b, struct AtomSequenceFrame *frame)
+{
+  const char *name = frame->format == ATOM_IMAGE_PNG ? "PNG" : "Photo - JPEG";
+  unsigned char compressor[32];
+  size_t stsd, entry;
+
+  memset(compressor, 0, sizeof(compressor));
+  compressor[0] = (unsigned char)strlen(name);
+  memcpy(compressor + 1, name, compressor[0]);
+
+  stsd = buf_begin_full(b, FOURCC('s','t','s','d'), 0, 0);
+  buf_u32(b, 1);
+  entry = buf_begin(b, frame->format == ATOM_IMAGE_PNG ? FOURCC('p','n','g',' ') : FOURCC('j','p','e','g'));
+  buf_bytes(b, "\0\0\0\0\0\0", 6);
+  buf_u16(b, 1);           // data reference index
+  buf_u16(b, 0);           // version
+  buf_u16(b, 0);           // revision level
+  buf_u32(b, FOURCC('a','p','p','l'));
+  buf_u32(b, 0);           // temporal quality
+  buf_u32(b, 0x200);       // spatial quality, normal
+  buf_u16(b, (uint16_t)frame->width);
+  buf_u16(b, (uint16_t)frame->height);
+  buf_u32(b, 72 << 16);    // horizontal resolution
+  buf_u32(b, 72 << 16);    // vertical resolution
+  buf_u32(b, 0);           // data size
+  buf_u16(b, 1);           // frames per sample
+  buf_bytes(b, compressor, sizeof(compressor));
+  buf_u16(b, frame->depth);
+  buf_u16(b, 0xFFFF);      // no color table
+  buf_end(b, entry);
+  buf_end(b, stsd);
+}
+
+/*  helper function, appends the sample tables of the frames, stored one
+    after another from base in chunks of chunk_samples frames. Every frame
+    is a key frame so there is no stss.
+*/
+static void atom_write_sequence_stbl(struct AtomBuffer *b, struct AtomSequence *sequence, uint32_t chunk_samples, uint64_t base, int co64)
+{
+  size_t stbl = buf_begin(b, FOURCC('s','t','b','l')), start;
+  uint32_t chunk_count = (sequence->count + chunk_samples - 1) / chunk_samples;
+  uint32_t last = sequence->count - (chunk_count - 1) * chunk_samples, i;
+  uint64_t offset = base;
+
+  atom_write_sequence_stsd(b, &sequence->frames[0]);
+
+  start = buf_begin_full(b, FOURCC('s','t','t','s'), 0, 0);
+  buf_u32(b, 1);
+  buf_u32(b, sequence->count);
+  buf_u32(b, sequence->frame_duration);
+  buf_end(b, start);
+
+  start = buf_begin_full(b, FOURCC('s','t','s','c'), 0, 0);
+  if (chunk_count > 1 && last != chunk_samples) {
+    buf_u32(b, 2);
+    buf_u32(b, 1);
+    buf_u32(b, chunk_samples);
+    buf_u32(b, 1);
+    buf_u32(b, chunk_count);
+    buf_u32(b, last);
+    buf_u32(b, 1);
+  } else {
+    buf_u32(b, 1);
+    buf_u32(b, 1);
+    buf_u32(b, chunk_count > 1 ? chunk_samples : last);
+    buf_u32(b, 1);
+  }
+  buf_end(b, start);
+
+  start = buf_begin_full(b, FOURCC('s','t','s','z'), 0, 0);
+  buf_u32(b, 0);
+  buf_u32(b, sequence->count);
+  for (i = 0; i < sequence->count; i++) buf_u32(b, (uint32_t)sequence->frames[i].size);
+  buf_end(b, start);
+
+  start = buf_begin_full(b, co64 ? FOURCC('c','o','6','4') : FOURCC('s','t','c','o'), 0, 0);
+  buf_u32(b, chunk_count);
+  for (i = 0; i < sequence->count; i++) {
+    if (i % chunk_samples == 0) {
+      if (co64)
+        buf_u64(b, offset);
+      else
+        buf_u32(b, (uint32_t)offset);
+    }
+    offset += sequence->frames[i].size;
+  }
+  buf_end(b, start);
+
+  buf_end(b, stbl);
+}
+
+/*  helper function, appends the moov atom of a movie with a single video
+    track playing the frames, see atom_write_sequence_stbl.
+*/
+static void atom_write_sequence_moov(struct AtomBuffer *b, struct AtomSequence *sequence, uint32_t chunk_samples, uint64_t base, int co64)
+{
+  static const int32_t identity[9] = { 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000 };
+  uint64_t duration = (uint64_t)sequence->count * sequence->frame_duration;
+  struct AtomMovie movie;
+  struct AtomTrack track;
+  struct AtomWriteTrack wt;
+  struct AtomEdit edit = { (int64_t)duration, 0, 0x10000, NULL };
+  size_t moov = buf_begin(b, FOURCC('m','o','o','v')), trak, mdia, minf, vmhd;
+
+  memset(&movie, 0, sizeof(movie));
+  movie.time_scale = sequence->time_scale;
+  movie.duration = duration;
+  memcpy(movie.matrix, identity, sizeof(identity));
+
+  memset(&track, 0, sizeof(track));
+  track.id = 1;
+  track.flags = 0xF;       // enabled, in movie, preview and poster
+  track.duration = duration;
+  memcpy(track.matrix, identity, sizeof(identity));
+  track.width = sequence->frames[0].width << 16;
+  track.height = sequence->frames[0].height << 16;
+
+  memset(&wt, 0, sizeof(wt));
+  wt.track = wt.media = &track;
+  wt.media_time_scale = sequence->time_scale;
+  wt.media_duration = duration;
+
+  atom_write_mvhd(b, &movie, 2);
+  trak = buf_begin(b, FOURCC('t','r','a','k'));
+  atom_write_tkhd(b, &track);
+  atom_write_edts(b, &edit, 1);
+  mdia = buf_begin(b, FOURCC('m','d','i','a'));
+  atom_write_mdhd(b, &wt);
+  atom_write_hdlr(b, FOURCC('m','h','l','r'), FOURCC('v','i','d','e'), "Video Media Handler");
+  minf = buf_begin(b, FOURCC('m','i','n','f'));
+  vmhd = buf_begin_full(b, FOURCC('v','m','h','d'), 0, 1);
+  buf_u16(b, 0x40);        // graphics mode, dither copy
+  buf_u16(b, 0x8000);      // opcolor
+  buf_u16(b, 0x8000);
+  buf_u16(b, 0x8000);
+  buf_end(b, vmhd);
+  atom_write_hdlr(b, FOURCC('d','h','l','r'), FOURCC('a','l','i','s'), "Data Handler");
+  atom_write_dinf(b);
+  atom_write_sequence_stbl(b, sequence, chunk_samples, base, co64);
+  buf_end(b, minf);
+  buf_end(b, mdia);
+  buf_end(b, trak);
+  buf_end(b, moov);
+}
+
+/*
+  Writes a movie playing the frames of the inspected sequence to a new
+  file at filepath, which must not exist yet. The image files are copied
+  into the media one after another as they are, by the kernel where it
+  can, behind the moov atom. Returns 0 and fills in error on failure.
+*/
+int atom_sequence_write(struct AtomSequence *sequence, const char *filepath, char *error, size_t error_size)
+{
+  struct AtomSequenceFrame *frame;
+  struct AtomBuffer moov, header;
+  struct stat info;
+  uint64_t mdat_size = 0, mdat_header_size, base;
+  uint32_t chunk_samples, chunk_count, i;
+  int fd, image_fd, co64 = 0, ok;
+
+  if (sequence->count == 0) {
+    snprintf(error, error_size, "Unable to write a movie without frames to %s", filepath);
+    return 0;
+  }
+  for (i = 0; i < sequence->count; i++) {
+    mdat_size += sequence->frames[i].size;
+  }
+  chunk_samples = (uint32_t)(ATOM_CHUNK_DURATION * sequence->time_scale / sequence->frame_duration);
+  if (chunk_samples < 1) chunk_samples = 1;
+  chunk_count = (sequence->count + chunk_samples - 1) / chunk_samples;
+
+  memset(&moov, 0, sizeof(moov));
+  memset(&header, 0, sizeof(header));
+  mdat_header_size = mdat_size + 8 > 0xFFFFFFFFULL ? 16 : 8;
+  atom_write_sequence_moov(&moov, sequence, chunk_samples, 0, 0);
+  if (sizeof(ftyp) + moov.size + mdat_header_size + mdat_size > 0xFFFFFFFFULL) co64 = 1;
+  base = sizeof(ftyp) + moov.size + (co64 ? 4 * chunk_count : 0) + mdat_header_size;
+  moov.size = 0;
+  atom_write_sequence_moov(&moov, sequence, chunk_samples, base, co64);
+
+  if (mdat_header_size == 16) {
+    buf_u32(&header, 1);
+    buf_u32(&header, FOURCC('m','d','a','t'));
+    buf_u64(&header, mdat_size + 16);
+  } else {
+    buf_u32(&header, (uint32_t)(mdat_size + 8));
+    buf_u32(&header, FOURCC('m','d','a','t'));
+  }
+
+  fd = open(filepath, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if (fd < 0) {
+    snprintf(error, error_size, "Error %d occurred while opening file for export at %s", errno, filepath);
+    ok = 0;
+  } else {
+    ok = !moov.failed && !header.failed && atom_write_all(fd, ftyp, sizeof(ftyp)) &&
+         atom_write_all(fd, moov.data, moov.size) && atom_write_all(fd, header.data, header.size);
+    if (!ok) snprintf(error, error_size, "Error %d occurred while writing movie to %s", errno, filepath);
+    for (i = 0; ok && i < sequence->count; i++) {
+      frame = &sequence->frames[i];
+      if (sequence->cancelled) {
+        snprintf(error, error_size, "Writing the image sequence was interrupted.");
+        ok = 0;
+        break;
+      }
+      image_fd = open(frame->filepath, O_RDONLY);
+      // the size of every frame is already in the moov atom
+      ok = image_fd >= 0 && fstat(image_fd, &info) == 0 && (uint64_t)info.st_size == frame->size;
+      if (!ok)
+        snprintf(error, error_size, "Image file at %s changed while the movie was written", frame->filepath);
+      else if (!(ok = atom_copy_range(fd, image_fd, 0, frame->size)))
+        snprintf(error, error_size, "Error %d occurred while copying %s into the movie", errno, frame->filepath);
+      if (image_fd >= 0) close(image_fd);
+    }
+    if (close(fd) != 0 && ok) {
+      snprintf(error, error_size, "Error %d occurred while writing movie to %s", errno, filepath);
+      ok = 0;
+    }
+    if (!ok) unlink(filepath);
+  }
+
+  buf_free(&moov);
+  buf_free(&header);
+  return ok;
+}
@@ -2,6 +2,8 @@
 
 VALUE cExporter;
 
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+
 static void exporter_free(struct RExporter *rExporter)
 {
   if (rExporter->settings) {
@@ -193,3 +195,4 @@ void Init_quicktime_exporter()
   rb_define_method(cExporter, "load_settings", exporter_load_settings, 1);
   rb_define_method(cExporter, "save_settings", exporter_save_settings, 1);
 }
+#endif
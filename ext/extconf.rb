@@ -1,12 +1,36 @@
 require 'mkmf'
 
-unless RUBY_PLATFORM =~ /darwin/ || have_header('QuickTime/QuickTime.h')
-  abort("The rmov gem is not compatible with this platform : #{RUBY_PLATFORM}")
+if have_header('QuickTime/QuickTime.h')
+  $CFLAGS = CONFIG["CFLAGS"].sub!("x86_64", "i386")
+  $LDSHARED = CONFIG["LDSHARED"].sub!("x86_64", "i386")
+  $LIBRUBY_LDSHARED = CONFIG["LIBRUBY_LDSHARED"].sub!("x86_64", "i386")
+  CONFIG["LDFLAGS"] = $LDFLAGS = CONFIG["LDFLAGS"].sub("x86_64", "i386") + " -framework QuickTime"
+else
+  # Without QuickTime movies are read by the native atom parser (see atom.c)
+  unless have_func('mmap', 'sys/mman.h')
+    abort("The rmov gem is not compatible with this platform : #{RUBY_PLATFORM}")
+  end
 end
 
-$CFLAGS = CONFIG["CFLAGS"].sub!("x86_64", "i386")
-$LDSHARED = CONFIG["LDSHARED"].sub!("x86_64", "i386")
-$LIBRUBY_LDSHARED = CONFIG["LIBRUBY_LDSHARED"].sub!("x86_64", "i386")
-CONFIG["LDFLAGS"] = $LDFLAGS = CONFIG["LDFLAGS"].sub("x86_64", "i386") + " -framework QuickTime"
+# Movie.probe_many parses files on native threads outside the interpreter lock
+have_library('pthread')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+
+# Track#each_sample yields strings pointing into the mapped movie file
+have_func('rb_str_new_static', 'ruby.h')
+
+# ProbeCache keys reports by the modification time of files in nanoseconds
+have_struct_member('struct stat', 'st_mtim', 'sys/stat.h')
+have_struct_member('struct stat', 'st_mtimespec', 'sys/stat.h')
+
+# QuickTime.scan asks the kernel to read the headers of upcoming files ahead
+have_func('posix_fadvise', 'fcntl.h')
+
+# uncompressed video frames are written as PNG images
+have_library('z', 'compress2', 'zlib.h')
+
+# Movie#flatten lets the kernel copy sample data between files when it can
+have_func('copy_file_range', 'unistd.h')
+have_func('sendfile', 'sys/sendfile.h')
 
 create_makefile('rmov_ext')
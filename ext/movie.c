@@ -1,18 +1,37 @@
 #include "rmov_ext.h"
 
+#include <math.h>
+#include <string.h>
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#endif
+#ifdef HAVE_RUBY_ENCODING_H
+#include <ruby/encoding.h>
+#endif
+
 VALUE cMovie;
 
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
 OSErr movie_progress_proc(Movie movie, short message, short operation, Fixed percent, VALUE proc)
 {
   rb_funcall(proc, rb_intern("call"), 1, rb_float_new(FixedToFloat(percent)));
   return 0;
 }
+#endif
 
 static void movie_free(struct RMovie *rMovie)
 {
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
   if (rMovie->movie) {
     DisposeMovie(rMovie->movie);
   }
+#endif
+  if (rMovie->atoms) {
+    atom_movie_free(rMovie->atoms);
+  }
+  if (rMovie->filepath) {
+    free(rMovie->filepath);
+  }
 }
 
 static void movie_mark(struct RMovie *rMovie)
@@ -33,6 +52,35 @@ static VALUE movie_new(VALUE klass)
   return Data_Make_Struct(klass, struct RMovie, movie_mark, movie_free, rMovie);
 }
 
+/*  helper function, true if a movie has been loaded through either backend
+*/
+static int movie_loaded(VALUE obj)
+{
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj)) return 1;
+#endif
+  return RMOVIE(obj)->atoms != NULL;
+}
+
+/*
+  Returns the parsed atoms of the movie, raising an error if the movie 
+  has not been loaded. A movie loaded through QuickTime is parsed from 
+  its file the first time this is needed.
+*/
+struct AtomMovie *movie_atoms(VALUE obj)
+{
+  char error[1024];
+  
+  if (!RMOVIE(obj)->atoms) {
+    if (!movie_loaded(obj) || !RMOVIE(obj)->filepath)
+      rb_raise(eQuickTime, "Movie has not been loaded.");
+    RMOVIE(obj)->atoms = atom_movie_open(RMOVIE(obj)->filepath, error, sizeof(error));
+    if (!RMOVIE(obj)->atoms)
+      rb_raise(eQuickTime, "%s", error);
+  }
+  return RMOVIE(obj)->atoms;
+}
+
 /*
   call-seq: dispose()
   
@@ -43,10 +91,16 @@ static VALUE movie_new(VALUE klass)
 */
 static VALUE movie_dispose(VALUE obj)
 {
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
   if (MOVIE(obj)) {
     DisposeMovie(MOVIE(obj));
     RMOVIE(obj)->movie = NULL;
   }
+#endif
+  if (RMOVIE(obj)->atoms) {
+    atom_movie_free(RMOVIE(obj)->atoms);
+    RMOVIE(obj)->atoms = NULL;
+  }
   return obj;
 }
 
@@ -56,12 +110,16 @@ static VALUE movie_dispose(VALUE obj)
   Loads a new, empty QuickTime movie at given filepath. Should only be 
   called if no movie has been loaded (or it has been disposed). Usually 
   you go through Movie.open.
+  
+  Without the QuickTime framework the movie is read by the native atom 
+  parser, which supports reporting but not editing or exporting.
 */
 static VALUE movie_load_from_file(VALUE obj, VALUE filepath)
 {
-  if (MOVIE(obj)) {
+  if (movie_loaded(obj)) {
     rb_raise(eQuickTime, "Movie has already been loaded.");
   } else {
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
     OSErr err;
     FSSpec fs;
     short resRefNum = -1;
@@ -85,13 +143,250 @@ static VALUE movie_load_from_file(VALUE obj, VALUE filepath)
       rb_raise(eQuickTime, "Error %d occurred while closing movie file at %s", err, RSTRING(filepath)->ptr);
     
     RMOVIE(obj)->movie = *movie;
-    RMOVIE(obj)->filepath = RSTRING(filepath)->ptr;
     RMOVIE(obj)->resId = resId;
+#else
+    char error[1024];
+    
+    RMOVIE(obj)->atoms = atom_movie_open(StringValueCStr(filepath), error, sizeof(error));
+    if (!RMOVIE(obj)->atoms)
+      rb_raise(eQuickTime, "%s", error);
+#endif
+    RMOVIE(obj)->filepath = strdup(StringValueCStr(filepath));
     
     return obj;
   }
 }
 
+/*
+  call-seq: load_headers_from_file(filepath)
+  
+  Loads the movie at filepath reading only its atom headers. The media 
+  data and sample tables are not read, and each track is parsed the first 
+  time it is fetched. The movie can only be used for reporting. Usually 
+  you go through Movie.probe.
+*/
+static VALUE movie_load_headers_from_file(VALUE obj, VALUE filepath)
+{
+  char error[1024];
+  
+  if (movie_loaded(obj))
+    rb_raise(eQuickTime, "Movie has already been loaded.");
+  
+  RMOVIE(obj)->atoms = atom_movie_probe(StringValueCStr(filepath), error, sizeof(error));
+  if (!RMOVIE(obj)->atoms)
+    rb_raise(eQuickTime, "%s", error);
+  RMOVIE(obj)->filepath = strdup(StringValueCStr(filepath));
+  
+  return obj;
+}
+
+/*  helper function, reads the stream from the IO until its moov atom.
+*/
+struct StreamArgs {
+  VALUE obj;
+  VALUE io;
+  struct AtomStream stream;
+};
+
+static VALUE movie_load_from_io_read(VALUE arg)
+{
+  struct StreamArgs *args = (struct StreamArgs*)arg;
+  VALUE buffer = rb_str_buf_new(ATOM_STREAM_CHUNK_SIZE);
+  VALUE bytes, name;
+  char error[1024];
+  int done;
+  
+  do {
+    bytes = rb_funcall(args->io, rb_intern("read"), 2, SIZET2NUM(atom_stream_wanted(&args->stream)), buffer);
+    if (NIL_P(bytes))
+      done = atom_stream_feed(&args->stream, NULL, 0, error, sizeof(error));
+    else
+      done = atom_stream_feed(&args->stream, (const unsigned char*)RSTRING_PTR(bytes), RSTRING_LEN(bytes), error, sizeof(error));
+    if (done < 0)
+      rb_raise(eQuickTime, "%s", error);
+  } while (!done);
+  
+  name = rb_inspect(args->io);
+  RMOVIE(args->obj)->atoms = atom_stream_movie(&args->stream, StringValueCStr(name), error, sizeof(error));
+  if (!RMOVIE(args->obj)->atoms)
+    rb_raise(eQuickTime, "%s", error);
+  return args->obj;
+}
+
+static VALUE movie_load_from_io_free(VALUE arg)
+{
+  atom_stream_free(&((struct StreamArgs*)arg)->stream);
+  return Qnil;
+}
+
+/*
+  call-seq: load_from_io(io, buffer_limit)
+  
+  Loads the movie from an IO such as a pipe, reading it once from the 
+  start until the end of its movie header. The media data is read and 
+  dropped a chunk at a time, only the movie header is held, and not if 
+  it's larger than buffer_limit bytes (64 MB for nil). The rest of the 
+  stream is left unread. The movie can only be used for reporting. 
+  Usually you go through Movie.from_io.
+*/
+static VALUE movie_load_from_io(VALUE obj, VALUE io, VALUE buffer_limit)
+{
+  struct StreamArgs args;
+  
+  if (movie_loaded(obj))
+    rb_raise(eQuickTime, "Movie has already been loaded.");
+  if (!NIL_P(buffer_limit) && NUM2LL(buffer_limit) <= 0)
+    rb_raise(rb_eArgError, "Buffer limit must be positive");
+  
+  args.obj = obj;
+  args.io = io;
+  atom_stream_init(&args.stream, NIL_P(buffer_limit) ? 0 : NUM2ULL(buffer_limit));
+  return rb_ensure(movie_load_from_io_read, (VALUE)&args, movie_load_from_io_free, (VALUE)&args);
+}
+
+/*  helper function, runs the probe batch with the given number of threads.
+*/
+struct ProbeArgs {
+  struct AtomProbeBatch *batch;
+  uint32_t thread_count;
+};
+
+static void *movie_probe_files_run(void *arg)
+{
+  struct ProbeArgs *args = (struct ProbeArgs*)arg;
+  atom_probe_many(args->batch, args->thread_count);
+  return NULL;
+}
+
+/*
+  call-seq: probe_files(filepaths, thread_count) -> array
+  
+  Probes each of the filepaths using a pool of native threads. The files 
+  are parsed without holding the Ruby interpreter lock. Returns an array 
+  with a probed movie for each file, or the QuickTime::Error which 
+  occurred reading it. Usually you go through Movie.probe_many.
+*/
+static VALUE movie_probe_files(VALUE klass, VALUE filepaths, VALUE thread_count)
+{
+  struct AtomProbeBatch *batch;
+  struct ProbeArgs args;
+  VALUE results, movie_obj;
+  long i;
+  
+  Check_Type(filepaths, T_ARRAY);
+  for (i = 0; i < RARRAY_LEN(filepaths); i++) {
+    StringValueCStr(RARRAY_PTR(filepaths)[i]);
+  }
+  args.thread_count = NUM2UINT(thread_count);
+  
+  batch = atom_probe_batch_new(RARRAY_LEN(filepaths));
+  if (!batch)
+    rb_raise(rb_eNoMemError, "Unable to allocate probe batch");
+  for (i = 0; i < RARRAY_LEN(filepaths); i++) {
+    batch->jobs[i].filepath = strdup(RSTRING_PTR(RARRAY_PTR(filepaths)[i]));
+  }
+  
+  args.batch = batch;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(movie_probe_files_run, &args, atom_probe_cancel, batch);
+#else
+  movie_probe_files_run(&args);
+#endif
+  
+  if (batch->cancelled) {
+    atom_probe_batch_free(batch);
+    rb_thread_check_ints();
+    rb_raise(eQuickTime, "Probing was interrupted.");
+  }
+  
+  results = rb_ary_new2(batch->count);
+  for (i = 0; i < (long)batch->count; i++) {
+    if (batch->jobs[i].movie) {
+      movie_obj = rb_obj_alloc(klass);
+      RMOVIE(movie_obj)->atoms = batch->jobs[i].movie;
+      RMOVIE(movie_obj)->filepath = batch->jobs[i].filepath;
+      batch->jobs[i].movie = NULL;
+      batch->jobs[i].filepath = NULL;
+      rb_ary_push(results, movie_obj);
+    } else {
+      rb_ary_push(results, rb_exc_new2(eQuickTime, batch->jobs[i].error));
+    }
+  }
+  atom_probe_batch_free(batch);
+  
+  return results;
+}
+
+/*  helper function, inspects the image files of a sequence and writes the
+    movie.
+*/
+struct SequenceArgs {
+  struct AtomSequence *sequence;
+  uint32_t thread_count;
+  const char *filepath;
+  int ok;
+  char error[1024];
+};
+
+static void *movie_write_image_sequence_run(void *arg)
+{
+  struct SequenceArgs *args = (struct SequenceArgs*)arg;
+  if (!atom_sequence_inspect(args->sequence, args->thread_count)) {
+    snprintf(args->error, sizeof(args->error), "%s", args->sequence->error);
+    args->ok = 0;
+  } else {
+    args->ok = atom_sequence_write(args->sequence, args->filepath, args->error, sizeof(args->error));
+  }
+  return NULL;
+}
+
+/*
+  call-seq: write_image_sequence(image_filepaths, filepath, time_scale, frame_duration, thread_count)
+  
+  Writes a movie to filepath with a frame for each of the JPEG or PNG 
+  image files, lasting frame_duration in time_scale each. The image files 
+  are inspected on a pool of native threads and copied into the movie as 
+  they are, without holding the Ruby interpreter lock. Usually you go 
+  through Movie.from_image_sequence.
+*/
+static VALUE movie_write_image_sequence(VALUE klass, VALUE image_filepaths, VALUE filepath, VALUE time_scale, VALUE frame_duration, VALUE thread_count)
+{
+  struct SequenceArgs args;
+  long i;
+  
+  Check_Type(image_filepaths, T_ARRAY);
+  for (i = 0; i < RARRAY_LEN(image_filepaths); i++) {
+    StringValueCStr(RARRAY_PTR(image_filepaths)[i]);
+  }
+  if (NUM2UINT(time_scale) == 0 || NUM2UINT(frame_duration) == 0)
+    rb_raise(rb_eArgError, "Time scale and frame duration must be positive");
+  args.filepath = StringValueCStr(filepath);
+  args.thread_count = NUM2UINT(thread_count);
+  
+  args.sequence = atom_sequence_new(RARRAY_LEN(image_filepaths), NUM2UINT(time_scale), NUM2UINT(frame_duration));
+  if (!args.sequence)
+    rb_raise(rb_eNoMemError, "Unable to allocate image sequence");
+  for (i = 0; i < RARRAY_LEN(image_filepaths); i++) {
+    args.sequence->frames[i].filepath = strdup(RSTRING_PTR(RARRAY_PTR(image_filepaths)[i]));
+  }
+  
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(movie_write_image_sequence_run, &args, atom_sequence_cancel, args.sequence);
+#else
+  movie_write_image_sequence_run(&args);
+#endif
+  
+  if (args.sequence->cancelled) {
+    atom_sequence_free(args.sequence);
+    rb_thread_check_ints();
+    rb_raise(eQuickTime, "Writing the image sequence was interrupted.");
+  }
+  atom_sequence_free(args.sequence);
+  if (!args.ok)
+    rb_raise(eQuickTime, "%s", args.error);
+  return Qnil;
+}
+
 /*
   call-seq: load_empty()
   
@@ -101,10 +396,14 @@ static VALUE movie_load_from_file(VALUE obj, VALUE filepath)
 */
 static VALUE movie_load_empty(VALUE obj)
 {
-  if (MOVIE(obj)) {
+  if (movie_loaded(obj)) {
     rb_raise(eQuickTime, "Movie has already been loaded.");
   } else {
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
     RMOVIE(obj)->movie = NewMovie(0);
+#else
+    RMOVIE(obj)->atoms = atom_movie_empty();
+#endif
     return obj; 
   }
 }
@@ -117,7 +416,11 @@ static VALUE movie_load_empty(VALUE obj)
 */
 static VALUE movie_raw_duration(VALUE obj)
 {
-  return INT2NUM(GetMovieDuration(MOVIE(obj)));
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj))
+    return INT2NUM(GetMovieDuration(MOVIE(obj)));
+#endif
+  return ULL2NUM(MOVIE_ATOMS(obj)->duration);
 }
 
 /*
@@ -128,7 +431,39 @@ static VALUE movie_raw_duration(VALUE obj)
 */
 static VALUE movie_time_scale(VALUE obj)
 {
-  return INT2NUM(GetMovieTimeScale(MOVIE(obj)));
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj))
+    return INT2NUM(GetMovieTimeScale(MOVIE(obj)));
+#endif
+  return UINT2NUM(MOVIE_ATOMS(obj)->time_scale);
+}
+
+/*  helper function, reads the bounds of the movie in pixels.
+*/
+static void movie_get_bounds(VALUE obj, int *bounds)
+{
+  double left, top, right, bottom;
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj)) {
+    Rect box;
+    GetMovieBox(MOVIE(obj), &box);
+    left = box.left; top = box.top; right = box.right; bottom = box.bottom;
+  } else
+#endif
+  atom_movie_bounds(MOVIE_ATOMS(obj), &left, &top, &right, &bottom);
+  bounds[0] = (int)left; bounds[1] = (int)top; bounds[2] = (int)right; bounds[3] = (int)bottom;
+}
+
+/*  helper function, writes bounds (left, top, right, bottom) as a hash at key.
+*/
+static void movie_write_bounds(struct ReportWriter *writer, int key, int *bounds)
+{
+  report_begin_hash(writer, key);
+  report_value(writer, REPORT_LEFT, INT2NUM(bounds[0]));
+  report_value(writer, REPORT_TOP, INT2NUM(bounds[1]));
+  report_value(writer, REPORT_RIGHT, INT2NUM(bounds[2]));
+  report_value(writer, REPORT_BOTTOM, INT2NUM(bounds[3]));
+  report_end(writer);
 }
 
 /*
@@ -139,14 +474,12 @@ static VALUE movie_time_scale(VALUE obj)
 */
 static VALUE movie_bounds(VALUE obj)
 {
-  VALUE bounds_hash = rb_hash_new();
-  Rect bounds;
-  GetMovieBox(MOVIE(obj), &bounds);
-  rb_hash_aset(bounds_hash, ID2SYM(rb_intern("left")), INT2NUM(bounds.left));
-  rb_hash_aset(bounds_hash, ID2SYM(rb_intern("top")), INT2NUM(bounds.top));
-  rb_hash_aset(bounds_hash, ID2SYM(rb_intern("right")), INT2NUM(bounds.right));
-  rb_hash_aset(bounds_hash, ID2SYM(rb_intern("bottom")), INT2NUM(bounds.bottom));
-  return bounds_hash;
+  struct ReportWriter writer;
+  int bounds[4];
+  movie_get_bounds(obj, bounds);
+  report_writer_init(&writer, 0);
+  movie_write_bounds(&writer, REPORT_ELEMENT, bounds);
+  return report_writer_result(&writer);
 }
 
 /*
@@ -156,7 +489,34 @@ static VALUE movie_bounds(VALUE obj)
 */
 static VALUE movie_track_count(VALUE obj)
 {
-  return INT2NUM(GetMovieTrackCount(MOVIE(obj)));
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj))
+    return INT2NUM(GetMovieTrackCount(MOVIE(obj)));
+#endif
+  return UINT2NUM(MOVIE_ATOMS(obj)->track_count);
+}
+
+/*  helper function, raises an error unless both movies are loaded by the 
+    same backend, QuickTime or the native atom parser.
+*/
+static void movie_check_backend(VALUE obj, VALUE src)
+{
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (!MOVIE(obj) != !MOVIE(src))
+    rb_raise(eQuickTime, "Unable to combine a movie loaded through QuickTime with a probed one.");
+#endif
+}
+
+/*  helper function, records a native edit of the movie. The edits only 
+    fail when running out of memory or reading a broken movie file.
+*/
+static void movie_edited(VALUE obj, int ok)
+{
+  if (!ok)
+    rb_raise(eQuickTime, "Unable to edit movie, its sample tables could not be read.");
+  RMOVIE(obj)->edit_count++;
+  if (rb_block_given_p())
+    rb_yield(rb_float_new(1.0));
 }
 
 /*
@@ -167,7 +527,14 @@ static VALUE movie_track_count(VALUE obj)
 */
 static VALUE movie_select(VALUE obj, VALUE position, VALUE duration)
 {
-  SetMovieSelection(MOVIE(obj), MOVIE_TIME(obj, position), MOVIE_TIME(obj, duration));
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj)) {
+    SetMovieSelection(MOVIE(obj), MOVIE_TIME(obj, position), MOVIE_TIME(obj, duration));
+    return obj;
+  }
+#endif
+  RMOVIE(obj)->selection_start = floor(NUM2DBL(position)*MOVIE_ATOMS(obj)->time_scale);
+  RMOVIE(obj)->selection_duration = floor(NUM2DBL(duration)*MOVIE_ATOMS(obj)->time_scale);
   return obj;
 }
 
@@ -179,17 +546,28 @@ static VALUE movie_select(VALUE obj, VALUE position, VALUE duration)
   You can track the progress of this operation by passing a block to this 
   method. It will be called regularly during the process and pass the 
   percentage complete (0.0 to 1.0) as an argument to the block.
+  
+  Without QuickTime this only adds edits referring to the media of the 
+  given movie, which is never copied.
 */
 static VALUE movie_add_into_selection(VALUE obj, VALUE src)
 {
-  if (rb_block_given_p())
-    SetMovieProgressProc(MOVIE(obj), (MovieProgressUPP)movie_progress_proc, rb_block_proc());
-  
-  AddMovieSelection(MOVIE(obj), MOVIE(src));
-  
-  if (rb_block_given_p())
-    SetMovieProgressProc(MOVIE(obj), 0, 0);
-  
+  movie_check_backend(obj, src);
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj)) {
+    if (rb_block_given_p())
+      SetMovieProgressProc(MOVIE(obj), (MovieProgressUPP)movie_progress_proc, rb_block_proc());
+    
+    AddMovieSelection(MOVIE(obj), MOVIE(src));
+    RMOVIE(obj)->edit_count++;
+    
+    if (rb_block_given_p())
+      SetMovieProgressProc(MOVIE(obj), 0, 0);
+    
+    return obj;
+  }
+#endif
+  movie_edited(obj, atom_movie_add(MOVIE_ATOMS(obj), RMOVIE(obj)->selection_start, RMOVIE(obj)->selection_duration, MOVIE_ATOMS(src)));
   return obj;
 }
 
@@ -201,17 +579,28 @@ static VALUE movie_add_into_selection(VALUE obj, VALUE src)
   You can track the progress of this operation by passing a block to this 
   method. It will be called regularly during the process and pass the 
   percentage complete (0.0 to 1.0) as an argument to the block.
+  
+  Without QuickTime this only rewrites the edit lists of the tracks.
 */
 static VALUE movie_insert_into_selection(VALUE obj, VALUE src)
 {
-  if (rb_block_given_p())
-    SetMovieProgressProc(MOVIE(obj), (MovieProgressUPP)movie_progress_proc, rb_block_proc());
-  
-  PasteMovieSelection(MOVIE(obj), MOVIE(src));
-  
-  if (rb_block_given_p())
-    SetMovieProgressProc(MOVIE(obj), 0, 0);
-  
+  movie_check_backend(obj, src);
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj)) {
+    if (rb_block_given_p())
+      SetMovieProgressProc(MOVIE(obj), (MovieProgressUPP)movie_progress_proc, rb_block_proc());
+    
+    PasteMovieSelection(MOVIE(obj), MOVIE(src));
+    RMOVIE(obj)->edit_count++;
+    
+    if (rb_block_given_p())
+      SetMovieProgressProc(MOVIE(obj), 0, 0);
+    
+    return obj;
+  }
+#endif
+  movie_edited(obj, atom_movie_delete(MOVIE_ATOMS(obj), RMOVIE(obj)->selection_start, RMOVIE(obj)->selection_duration) &&
+                    atom_movie_insert(MOVIE_ATOMS(obj), RMOVIE(obj)->selection_start, MOVIE_ATOMS(src)));
   return obj;
 }
 
@@ -229,13 +618,24 @@ static VALUE movie_clone_selection(VALUE obj)
 {
   VALUE new_movie_obj = rb_obj_alloc(cMovie);
   
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj)) {
+    if (rb_block_given_p())
+      SetMovieProgressProc(MOVIE(obj), (MovieProgressUPP)movie_progress_proc, rb_block_proc());
+    
+    RMOVIE(new_movie_obj)->movie = CopyMovieSelection(MOVIE(obj));
+    
+    if (rb_block_given_p())
+      SetMovieProgressProc(MOVIE(obj), 0, 0);
+    
+    return new_movie_obj;
+  }
+#endif
+  RMOVIE(new_movie_obj)->atoms = atom_movie_copy(MOVIE_ATOMS(obj), RMOVIE(obj)->selection_start, RMOVIE(obj)->selection_duration);
+  if (!RMOVIE(new_movie_obj)->atoms)
+    rb_raise(eQuickTime, "Unable to edit movie, its sample tables could not be read.");
   if (rb_block_given_p())
-    SetMovieProgressProc(MOVIE(obj), (MovieProgressUPP)movie_progress_proc, rb_block_proc());
-  
-  RMOVIE(new_movie_obj)->movie = CopyMovieSelection(MOVIE(obj));
-  
-  if (rb_block_given_p())
-    SetMovieProgressProc(MOVIE(obj), 0, 0);
+    rb_yield(rb_float_new(1.0));
   
   return new_movie_obj;
 }
@@ -252,16 +652,29 @@ static VALUE movie_clone_selection(VALUE obj)
 */
 static VALUE movie_clip_selection(VALUE obj)
 {
-  VALUE new_movie_obj = rb_obj_alloc(cMovie);
-  
-  if (rb_block_given_p())
-    SetMovieProgressProc(MOVIE(obj), (MovieProgressUPP)movie_progress_proc, rb_block_proc());
-  
-  RMOVIE(new_movie_obj)->movie = CutMovieSelection(MOVIE(obj));
-  
-  if (rb_block_given_p())
-    SetMovieProgressProc(MOVIE(obj), 0, 0);
+  VALUE new_movie_obj;
   
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj)) {
+    new_movie_obj = rb_obj_alloc(cMovie);
+    
+    if (rb_block_given_p())
+      SetMovieProgressProc(MOVIE(obj), (MovieProgressUPP)movie_progress_proc, rb_block_proc());
+    
+    RMOVIE(new_movie_obj)->movie = CutMovieSelection(MOVIE(obj));
+    RMOVIE(obj)->edit_count++;
+    
+    if (rb_block_given_p())
+      SetMovieProgressProc(MOVIE(obj), 0, 0);
+    
+    return new_movie_obj;
+  }
+#endif
+  new_movie_obj = rb_obj_alloc(cMovie);
+  RMOVIE(new_movie_obj)->atoms = atom_movie_copy(MOVIE_ATOMS(obj), RMOVIE(obj)->selection_start, RMOVIE(obj)->selection_duration);
+  if (!RMOVIE(new_movie_obj)->atoms)
+    rb_raise(eQuickTime, "Unable to edit movie, its sample tables could not be read.");
+  movie_edited(obj, atom_movie_delete(MOVIE_ATOMS(obj), RMOVIE(obj)->selection_start, RMOVIE(obj)->selection_duration));
   return new_movie_obj;
 }
 
@@ -272,7 +685,14 @@ static VALUE movie_clip_selection(VALUE obj)
 */
 static VALUE movie_delete_selection(VALUE obj)
 {
-  ClearMovieSelection(MOVIE(obj));
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj)) {
+    ClearMovieSelection(MOVIE(obj));
+    RMOVIE(obj)->edit_count++;
+    return obj;
+  }
+#endif
+  movie_edited(obj, atom_movie_delete(MOVIE_ATOMS(obj), RMOVIE(obj)->selection_start, RMOVIE(obj)->selection_duration));
   return obj;
 }
 
@@ -284,11 +704,11 @@ static VALUE movie_delete_selection(VALUE obj)
 */
 static VALUE movie_changed(VALUE obj)
 {
-  if (HasMovieChanged(MOVIE(obj))) {
-    return Qtrue;
-  } else {
-    return Qfalse;
-  }
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj))
+    return HasMovieChanged(MOVIE(obj)) ? Qtrue : Qfalse;
+#endif
+  return RMOVIE(obj)->edit_count != RMOVIE(obj)->saved_edit_count ? Qtrue : Qfalse;
 }
 
 /*
@@ -298,51 +718,397 @@ static VALUE movie_changed(VALUE obj)
 */
 static VALUE movie_clear_changed_status(VALUE obj)
 {
-  ClearMovieChanged(MOVIE(obj));
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj)) {
+    ClearMovieChanged(MOVIE(obj));
+    return Qnil;
+  }
+#endif
+  RMOVIE(obj)->saved_edit_count = RMOVIE(obj)->edit_count;
   return Qnil;
 }
 
+/*  helper function, loads the movie again after its file was rewritten. 
+    Tracks fetched before are no longer part of it.
+*/
+static void movie_reload(VALUE obj)
+{
+  VALUE filepath = rb_str_new2(RMOVIE(obj)->filepath);
+  
+  movie_dispose(obj);
+  free(RMOVIE(obj)->filepath);
+  RMOVIE(obj)->filepath = NULL;
+  movie_load_from_file(obj, filepath);
+}
 
 /*
-  call-seq: flatten(filepath)
+  call-seq: fragmented?() -> bool
   
-  Saves the movie to the given filepath by flattening it.
+  Returns true if the samples of the movie are described by movie 
+  fragments following its header, as live recorders write them. 
 */
-static VALUE movie_flatten(VALUE obj, VALUE filepath)
+static VALUE movie_fragmented(VALUE obj)
 {
-  OSErr err;
-  FSSpec fs;
-  VALUE new_movie_obj = rb_obj_alloc(cMovie);
+  return MOVIE_ATOMS(obj)->fragmented ? Qtrue : Qfalse;
+}
+
+/*
+  call-seq: refresh!() -> fragment_count
   
-  err = NativePathNameToFSSpec(RSTRING(filepath)->ptr, &fs, 0);
-  if (err != fnfErr)
-    rb_raise(eQuickTime, "Error %d occurred while opening file for export at %s", err, RSTRING(filepath)->ptr);
-  
-  // TODO make these flags settable through an options hash
-  RMOVIE(new_movie_obj)->movie = FlattenMovieData(MOVIE(obj),
-                                  flattenDontInterleaveFlatten
-                                  | flattenCompressMovieResource
-                                  | flattenAddMovieToDataFork
-                                  | flattenForceMovieResourceBeforeMovieData,
-                                  &fs, 'TVOD', smSystemScript, createMovieFileDontCreateResFile);
+  Reads what was added to the movie file since it was opened or last 
+  refreshed, for watching a recording in progress. Only the atoms past 
+  the last fragment read are parsed and only the new fragments are added 
+  to the tracks, so duration, frame_count and the sample index grow 
+  with the file. A fragment is added once all of its media is in the 
+  file. Returns the number of fragments added. Tracks fetched before 
+  stay part of the movie.
+*/
+static VALUE movie_refresh(VALUE obj)
+{
+  char error[1024];
+  uint32_t count;
+  
+  if (RTEST(movie_changed(obj)))
+    rb_raise(eQuickTime, "Unable to refresh movie because it has unsaved changes.");
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  // QuickTime has to load the movie again
+  if (MOVIE(obj)) {
+    movie_reload(obj);
+    return Qnil;
+  }
+#endif
+  if (!atom_movie_refresh(MOVIE_ATOMS(obj), &count, error, sizeof(error)))
+    rb_raise(eQuickTime, "%s", error);
+  return UINT2NUM(count);
+}
+
+/*  helper function, relocates the moov atom of a file.
+*/
+struct FaststartArgs {
+  const char *filepath;
+  int moved;
+  int ok;
+  volatile int cancelled;
+  char error[1024];
+};
+
+static void *movie_faststart_run(void *arg)
+{
+  struct FaststartArgs *args = (struct FaststartArgs*)arg;
+  args->ok = atom_file_faststart(args->filepath, &args->moved, &args->cancelled, args->error, sizeof(args->error));
+  return NULL;
+}
+
+/*  helper function, stops moving the media when the thread is interrupted.
+*/
+static void movie_faststart_cancel(void *arg)
+{
+  ((struct FaststartArgs*)arg)->cancelled = 1;
+}
+
+/*
+  call-seq: faststart!(filepath) -> bool
+  
+  Moves the movie header of the file at filepath in front of its media so 
+  the movie can be played while it downloads. Free space in front of the 
+  media is used when there is enough of it, otherwise the media is moved 
+  once and its offsets in the header are updated. Only the movie header is 
+  read into memory. Returns false if the file already starts with its 
+  header.
+  
+  When the thread is interrupted while the media is moved, the part moved 
+  so far is moved back before raising, so the file is left as it was.
+*/
+static VALUE movie_faststart_file(VALUE klass, VALUE filepath)
+{
+  struct FaststartArgs args;
+  
+  args.filepath = StringValueCStr(filepath);
+  args.cancelled = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(movie_faststart_run, &args, movie_faststart_cancel, &args);
+#else
+  movie_faststart_run(&args);
+#endif
+  if (!args.ok) {
+    if (args.cancelled) rb_thread_check_ints();
+    rb_raise(eQuickTime, "%s", args.error);
+  }
+  return args.moved ? Qtrue : Qfalse;
+}
+
+/*
+  call-seq: faststart!() -> bool
+  
+  Moves the movie header of this movie's file in front of its media, see 
+  Movie.faststart!. The movie is loaded again afterwards, so tracks must 
+  be fetched again. Returns false if the file already starts with its 
+  header.
+*/
+static VALUE movie_faststart(VALUE obj)
+{
+  if (!RMOVIE(obj)->filepath)
+    rb_raise(eQuickTime, "Unable to relocate movie because it does not have an associated file.");
+  if (RTEST(movie_changed(obj)))
+    rb_raise(eQuickTime, "Unable to relocate movie because it has unsaved changes.");
+  
+  if (!RTEST(movie_faststart_file(cMovie, rb_str_new2(RMOVIE(obj)->filepath))))
+    return Qfalse;
+  
+  movie_reload(obj);
+  return Qtrue;
+}
+
+/*  helper function, reads the flatten options hash, see flatten.
+*/
+static void movie_flatten_options(VALUE options, struct AtomFlattenOptions *flatten)
+{
+  VALUE value;
+  
+  memset(flatten, 0, sizeof(struct AtomFlattenOptions));
+  flatten->moov_first = 1;
+  flatten->chunk_duration = ATOM_CHUNK_DURATION;
+  if (NIL_P(options)) return;
+  
+  Check_Type(options, T_HASH);
+  if (RTEST(rb_funcall(options, rb_intern("has_key?"), 1, ID2SYM(rb_intern("interleave")))))
+    flatten->interleave = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("interleave"))));
+  if (RTEST(rb_funcall(options, rb_intern("has_key?"), 1, ID2SYM(rb_intern("moov_first")))))
+    flatten->moov_first = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("moov_first"))));
+  if (!NIL_P(value = rb_hash_aref(options, ID2SYM(rb_intern("chunk_duration"))))) {
+    flatten->chunk_duration = NUM2DBL(value);
+    if (flatten->chunk_duration <= 0)
+      rb_raise(rb_eArgError, "chunk_duration must be positive");
+  }
+  if (!NIL_P(value = rb_hash_aref(options, ID2SYM(rb_intern("max_distance")))))
+    flatten->max_distance = NUM2ULL(value);
+}
+
+/*
+  call-seq: flatten(filepath, options = {}) -> movie
+  
+  Saves the movie to the given filepath by flattening it, so all of its 
+  media is copied into the new file. Returns the new movie. These options 
+  are supported.
+  
+  :interleave     - write the chunks of all tracks in the order they play, 
+                    defaults to false
+  
+  :moov_first     - write the movie header before the media so the file 
+                    can be played while it downloads, defaults to true
+  
+  :chunk_duration - seconds of media in each chunk, defaults to 0.5
+  
+  :max_distance   - bytes the media of tracks playing together may be 
+                    apart when interleaved, chunks are made smaller to 
+                    keep it, defaults to no limit
+  
+  Without QuickTime only the samples which are played are copied, and the 
+  kernel copies them between files when it can. See seek_report to compare 
+  layouts before flattening.
+*/
+static VALUE movie_flatten(int argc, VALUE *argv, VALUE obj)
+{
+  VALUE filepath, options, new_movie_obj = rb_obj_alloc(cMovie);
+  struct AtomFlattenOptions flatten;
+  
+  rb_scan_args(argc, argv, "11", &filepath, &options);
+  StringValueCStr(filepath);
+  movie_flatten_options(options, &flatten);
+  
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj)) {
+    OSErr err;
+    FSSpec fs;
+    
+    err = NativePathNameToFSSpec(RSTRING(filepath)->ptr, &fs, 0);
+    if (err != fnfErr)
+      rb_raise(eQuickTime, "Error %d occurred while opening file for export at %s", err, RSTRING(filepath)->ptr);
+    
+    RMOVIE(new_movie_obj)->movie = FlattenMovieData(MOVIE(obj),
+                                    (flatten.interleave ? 0 : flattenDontInterleaveFlatten)
+                                    | flattenCompressMovieResource
+                                    | flattenAddMovieToDataFork
+                                    | (flatten.moov_first ? flattenForceMovieResourceBeforeMovieData : 0),
+                                    &fs, 'TVOD', smSystemScript, createMovieFileDontCreateResFile);
+    return new_movie_obj;
+  }
+#endif
+  {
+    char error[1024];
+    
+    if (!atom_movie_flatten(MOVIE_ATOMS(obj), RSTRING_PTR(filepath), &flatten, error, sizeof(error)))
+      rb_raise(eQuickTime, "%s", error);
+    RMOVIE(new_movie_obj)->atoms = atom_movie_open(RSTRING_PTR(filepath), error, sizeof(error));
+    if (!RMOVIE(new_movie_obj)->atoms)
+      rb_raise(eQuickTime, "%s", error);
+    RMOVIE(new_movie_obj)->filepath = strdup(RSTRING_PTR(filepath));
+  }
   return new_movie_obj;
 }
 
+/*  helper function, converts a seek report to a hash.
+*/
+static VALUE movie_seek_report_hash(struct AtomSeekReport *report)
+{
+  VALUE report_hash = rb_hash_new();
+  rb_hash_aset(report_hash, ID2SYM(rb_intern("chunks")), UINT2NUM(report->chunks));
+  rb_hash_aset(report_hash, ID2SYM(rb_intern("seeks")), UINT2NUM(report->seeks));
+  rb_hash_aset(report_hash, ID2SYM(rb_intern("seek_bytes")), ULL2NUM(report->seek_bytes));
+  rb_hash_aset(report_hash, ID2SYM(rb_intern("max_seek")), ULL2NUM(report->max_seek));
+  rb_hash_aset(report_hash, ID2SYM(rb_intern("max_distance")), ULL2NUM(report->max_distance));
+  return report_hash;
+}
 
 /*
-  call-seq: save()
+  call-seq: seek_report(options = {}) -> {:before => report_hash, :after => report_hash}
+  
+  Measures how far a player has to seek to read the media of the movie in 
+  the order it plays, in chunks of chunk_duration. The :before report is 
+  for the media as it is stored now and the :after report for the layout 
+  flatten would write with the same options. Nothing is written. Each 
+  report has these keys.
   
-  Saves the movie to the current file.
+  :chunks       - number of chunks read
+  :seeks        - reads which don't continue where the last one ended
+  :seek_bytes   - total distance of those seeks
+  :max_seek     - the longest seek
+  :max_distance - the largest distance between chunks of different tracks 
+                  which are read one after the other
 */
-static VALUE movie_save(VALUE obj)
+static VALUE movie_seek_report(int argc, VALUE *argv, VALUE obj)
 {
-  OSErr err;
-  FSSpec fs;
-  short resRefNum = -1;
+  VALUE options, report_hash = rb_hash_new();
+  struct AtomFlattenOptions flatten;
+  struct AtomSeekReport before, after;
+  char error[1024];
   
-  if (!RMOVIE(obj)->filepath || !RMOVIE(obj)->resId) {
-    rb_raise(eQuickTime, "Unable to save movie because it does not have an associated file.");
-  } else {
+  rb_scan_args(argc, argv, "01", &options);
+  movie_flatten_options(options, &flatten);
+  if (!atom_movie_seek_report(MOVIE_ATOMS(obj), &flatten, &before, &after, error, sizeof(error)))
+    rb_raise(eQuickTime, "%s", error);
+  
+  rb_hash_aset(report_hash, ID2SYM(rb_intern("before")), movie_seek_report_hash(&before));
+  rb_hash_aset(report_hash, ID2SYM(rb_intern("after")), movie_seek_report_hash(&after));
+  return report_hash;
+}
+
+/*
+  call-seq: fingerprints(options = {}) -> {track_id => digest}
+  
+  Returns the fingerprint of the sample data of each track, keyed by track 
+  id. The shards of all tracks are hashed by one pool of threads. Takes the 
+  same options as Track#fingerprint.
+*/
+static VALUE movie_fingerprints(int argc, VALUE *argv, VALUE obj)
+{
+  struct AtomMovie *movie = MOVIE_ATOMS(obj);
+  struct AtomTrack **tracks;
+  VALUE options, digests, fingerprints = rb_hash_new();
+  uint32_t i, count = movie->track_count;
+  
+  rb_scan_args(argc, argv, "01", &options);
+  tracks = ALLOCA_N(struct AtomTrack*, count ? count : 1);
+  for (i = 0; i < count; i++) {
+    if (!(tracks[i] = atom_movie_track(movie, i)))
+      rb_raise(eQuickTime, "Unable to fetch track for movie at index %d", i + 1);
+  }
+  digests = track_fingerprints(tracks, count, options);
+  for (i = 0; i < count; i++) {
+    rb_hash_aset(fingerprints, UINT2NUM(tracks[i]->id), rb_ary_entry(digests, i));
+  }
+  return fingerprints;
+}
+
+/*
+  Collects the report of the movie and all its tracks, as hashes or as 
+  JSON when json is set.
+*/
+VALUE movie_write_report(VALUE obj, int json)
+{
+  struct ReportWriter writer;
+  VALUE time_scale = movie_time_scale(obj);
+  int bounds[4];
+  
+  movie_get_bounds(obj, bounds);
+  report_writer_init(&writer, json);
+  report_begin_hash(&writer, REPORT_ELEMENT);
+  report_value(&writer, REPORT_DURATION, rb_float_new(NUM2DBL(movie_raw_duration(obj)) / NUM2DBL(time_scale)));
+  report_value(&writer, REPORT_TIME_SCALE, time_scale);
+  report_value(&writer, REPORT_WIDTH, INT2NUM(bounds[2] - bounds[0]));
+  report_value(&writer, REPORT_HEIGHT, INT2NUM(bounds[3] - bounds[1]));
+  movie_write_bounds(&writer, REPORT_BOUNDS, bounds);
+  report_begin_array(&writer, REPORT_TRACKS);
+  track_write_reports(obj, NUM2INT(movie_track_count(obj)), &writer);
+  report_end(&writer);
+  report_end(&writer);
+  return report_writer_result(&writer);
+}
+
+/*
+  call-seq: report() -> report_hash
+  
+  Returns a hash describing this movie: :duration, :time_scale, :width, 
+  :height, :bounds and :tracks, an array with the report of each track 
+  (see Track#report). Everything is collected in one call. With a current 
+  ProbeCache the report of an unchanged file comes from the cache.
+*/
+static VALUE movie_report(VALUE obj)
+{
+  VALUE cache = probe_cache_current();
+  if (!NIL_P(cache))
+    return probe_cache_movie_report(cache, obj);
+  return movie_write_report(obj, 0);
+}
+
+/*
+  call-seq: report_json() -> json_string
+  
+  Returns the report of this movie as a JSON string, written directly 
+  without building the hashes. Symbols become strings, and durations which 
+  aren't finite (a zero time scale) become null.
+*/
+static VALUE movie_report_json(VALUE obj)
+{
+  return movie_write_report(obj, 1);
+}
+
+/*
+  call-seq: save(options = {})
+  
+  Saves the movie to the current file. These options are supported.
+  
+  :padding - bytes of free space to reserve after the movie header when 
+             it has to be moved, so later saves can be written in place, 
+             defaults to 4096
+  
+  Without QuickTime only the movie header is written, over the old one 
+  when it fits, and the movie is loaded again afterwards. Movies which play 
+  media of other movies must be flattened instead.
+*/
+static VALUE movie_save(int argc, VALUE *argv, VALUE obj)
+{
+  VALUE options, padding_obj;
+  uint64_t padding = ATOM_SAVE_PADDING;
+  char error[1024];
+  
+  rb_scan_args(argc, argv, "01", &options);
+  if (!NIL_P(options)) {
+    Check_Type(options, T_HASH);
+    padding_obj = rb_hash_aref(options, ID2SYM(rb_intern("padding")));
+    if (!NIL_P(padding_obj))
+      padding = NUM2ULL(padding_obj);
+  }
+  
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj)) {
+    OSErr err;
+    FSSpec fs;
+    short resRefNum = -1;
+    
+    if (!RMOVIE(obj)->filepath || !RMOVIE(obj)->resId)
+      rb_raise(eQuickTime, "Unable to save movie because it does not have an associated file.");
+    
     err = NativePathNameToFSSpec(RMOVIE(obj)->filepath, &fs, 0);
     if (err != 0)
       rb_raise(eQuickTime, "Error %d occurred while reading file at %s", err, RMOVIE(obj)->filepath);
@@ -361,8 +1127,340 @@ static VALUE movie_save(VALUE obj)
     
     return Qnil;
   }
+#endif
+  if (!RMOVIE(obj)->filepath)
+    rb_raise(eQuickTime, "Unable to save movie because it does not have an associated file.");
+  if (!atom_movie_save(MOVIE_ATOMS(obj), RMOVIE(obj)->filepath, padding, error, sizeof(error)))
+    rb_raise(eQuickTime, "%s", error);
+  
+  movie_reload(obj);
+  RMOVIE(obj)->saved_edit_count = RMOVIE(obj)->edit_count;
+  return Qnil;
+}
+
+/*
+  call-seq: chapter_track() -> track
+  
+  Returns the text track holding the chapters of this movie, which other 
+  tracks refer to for their chapters, or nil if the movie has none.
+*/
+static VALUE movie_chapter_track(VALUE obj)
+{
+  struct AtomMovie *movie = MOVIE_ATOMS(obj);
+  struct AtomTrack *track = atom_movie_chapter_track(movie);
+  uint32_t i;
+  
+  for (i = 0; track && i < movie->track_count; i++) {
+    if (movie->tracks[i] == track)
+      return rb_funcall(rb_obj_alloc(cTrack), rb_intern("load_from_movie"), 2, obj, UINT2NUM(i + 1));
+  }
+  return Qnil;
+}
+
+/*
+  call-seq: write_chapters(chapters)
+  
+  Replaces the chapters of the movie by the given array of [seconds, title] 
+  pairs, sorted by time, with UTF-8 titles. The titles are appended to the 
+  movie file and the movie is saved along with them (see save) in one 
+  pass, then loaded again. This is generally called through chapters=.
+*/
+static VALUE movie_write_chapters(VALUE obj, VALUE chapters_obj)
+{
+  struct AtomChapter *chapters;
+  struct AtomMovie *movie;
+  VALUE chapter, title;
+  long count, i;
+  char error[1024];
+  int ok;
+  
+  Check_Type(chapters_obj, T_ARRAY);
+  if (!RMOVIE(obj)->filepath)
+    rb_raise(eQuickTime, "Unable to save movie because it does not have an associated file.");
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  // the chapters are written with the edits QuickTime made
+  if (MOVIE(obj)) {
+    movie_save(0, NULL, obj);
+    movie_reload(obj);
+  }
+#endif
+  movie = MOVIE_ATOMS(obj);
+  count = RARRAY_LEN(chapters_obj);
+  for (i = 0; i < count; i++) {
+    chapter = rb_ary_entry(chapters_obj, i);
+    Check_Type(chapter, T_ARRAY);
+    if (RARRAY_LEN(chapter) != 2)
+      rb_raise(rb_eArgError, "Chapters must be [seconds, title] pairs");
+    NUM2DBL(RARRAY_PTR(chapter)[0]);
+    StringValue(RARRAY_PTR(chapter)[1]);
+  }
+  
+  chapters = ALLOC_N(struct AtomChapter, count > 0 ? count : 1);
+  for (i = 0; i < count; i++) {
+    chapter = rb_ary_entry(chapters_obj, i);
+    title = rb_ary_entry(chapter, 1);
+    chapters[i].time = (int64_t)floor(NUM2DBL(rb_ary_entry(chapter, 0)) * movie->time_scale + 1e-6);
+    chapters[i].title = RSTRING_PTR(title);
+    chapters[i].length = RSTRING_LEN(title);
+  }
+  ok = atom_movie_save_chapters(movie, RMOVIE(obj)->filepath, chapters, (uint32_t)count, ATOM_SAVE_PADDING, error, sizeof(error));
+  xfree(chapters);
+  RB_GC_GUARD(chapters_obj);
+  if (!ok)
+    rb_raise(eQuickTime, "%s", error);
+  
+  movie_reload(obj);
+  RMOVIE(obj)->saved_edit_count = RMOVIE(obj)->edit_count;
+  return Qnil;
+}
+
+/*
+  call-seq: metadata() -> hash
+  
+  Returns the metadata of the movie, such as its title and artist, as a 
+  hash of UTF-8 strings. Known fields have symbol keys (:title, :artist, 
+  :album, :author, :comment, :composer, :copyright, :date, :description, 
+  :director, :encoder, :genre, :keywords, :producer and :software), other 
+  QuickTime metadata is keyed by its reverse DNS string such as 
+  "com.apple.quicktime.location.ISO6709". The user data, the iTunes item 
+  list and QuickTime metadata are read, only text values are returned.
+*/
+static VALUE movie_metadata(VALUE obj)
+{
+  struct AtomMetadata metadata;
+  VALUE hash, key, value;
+  uint32_t i;
+  
+  if (!atom_movie_metadata(MOVIE_ATOMS(obj), &metadata))
+    rb_raise(eQuickTime, "Unable to read metadata of movie");
+  hash = rb_hash_new();
+  for (i = 0; i < metadata.count; i++) {
+    key = atom_metadata_field(metadata.entries[i].name) ? ID2SYM(rb_intern(metadata.entries[i].name)) : rb_str_new2(metadata.entries[i].name);
+    value = rb_str_new(metadata.entries[i].value, metadata.entries[i].length);
+#ifdef HAVE_RUBY_ENCODING_H
+    rb_enc_associate(value, rb_utf8_encoding());
+#endif
+    rb_hash_aset(hash, key, value);
+  }
+  atom_metadata_free(&metadata);
+  return hash;
+}
+
+/*
+  call-seq: write_metadata(changes)
+  
+  Writes the given array of [name, value] pairs to the metadata of the 
+  movie file, keeping its other fields. A nil value removes the field. 
+  Unsaved edits are saved first (see save). Only the movie header is 
+  rewritten, in place when it fits, and only from the first byte which 
+  changed, then the movie is loaded again. This is generally called 
+  through metadata=.
+*/
+static VALUE movie_write_metadata(VALUE obj, VALUE changes_obj)
+{
+  struct AtomMetadataEntry *entries;
+  VALUE change, name, value;
+  long count, i;
+  char error[1024];
+  int ok;
+  
+  Check_Type(changes_obj, T_ARRAY);
+  if (!RMOVIE(obj)->filepath)
+    rb_raise(eQuickTime, "Unable to save movie because it does not have an associated file.");
+  count = RARRAY_LEN(changes_obj);
+  for (i = 0; i < count; i++) {
+    change = rb_ary_entry(changes_obj, i);
+    Check_Type(change, T_ARRAY);
+    if (RARRAY_LEN(change) != 2)
+      rb_raise(rb_eArgError, "Metadata must be [name, value] pairs");
+    name = StringValue(RARRAY_PTR(change)[0]);
+    if (!atom_metadata_field(StringValueCStr(name)) && !strchr(RSTRING_PTR(name), '.'))
+      rb_raise(rb_eArgError, "Unknown metadata field %s, custom fields are named by a reverse DNS key such as com.example.rating", RSTRING_PTR(name));
+    if (!NIL_P(RARRAY_PTR(change)[1]))
+      StringValue(RARRAY_PTR(change)[1]);
+  }
+  
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj)) {
+    movie_save(0, NULL, obj);
+    movie_reload(obj);
+  }
+#endif
+  // the header is copied as it is in the file
+  if (RMOVIE(obj)->edit_count != RMOVIE(obj)->saved_edit_count)
+    movie_save(0, NULL, obj);
+  
+  entries = ALLOC_N(struct AtomMetadataEntry, count > 0 ? count : 1);
+  for (i = 0; i < count; i++) {
+    change = rb_ary_entry(changes_obj, i);
+    value = rb_ary_entry(change, 1);
+    entries[i].name = RSTRING_PTR(rb_ary_entry(change, 0));
+    entries[i].value = NIL_P(value) ? NULL : RSTRING_PTR(value);
+    entries[i].length = NIL_P(value) ? 0 : RSTRING_LEN(value);
+    entries[i].stores = 0;
+  }
+  ok = atom_movie_save_metadata(MOVIE_ATOMS(obj), RMOVIE(obj)->filepath, entries, (uint32_t)count, ATOM_SAVE_PADDING, error, sizeof(error));
+  xfree(entries);
+  RB_GC_GUARD(changes_obj);
+  if (!ok)
+    rb_raise(eQuickTime, "%s", error);
+  
+  movie_reload(obj);
+  RMOVIE(obj)->saved_edit_count = RMOVIE(obj)->edit_count;
+  return Qnil;
+}
+
+/*
+  Returns the symbol of an image format.
+*/
+VALUE movie_image_format_symbol(int format)
+{
+  return ID2SYM(rb_intern(format == ATOM_IMAGE_PNG ? "png" : "jpeg"));
+}
+
+/*
+  call-seq: image_format(seconds) -> :jpeg, :png or nil
+  
+  Returns the format the video frame shown at the given time is already 
+  stored in, when it can be written as an image file without decoding it 
+  (see contact_sheet). Returns nil if it can't or no frame is shown.
+*/
+static VALUE movie_image_format(VALUE obj, VALUE seconds)
+{
+  struct AtomImageFrame frame;
+  struct AtomMovie *atoms;
+  
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj) && RMOVIE(obj)->edit_count != RMOVIE(obj)->saved_edit_count)
+    return Qnil;
+#endif
+  if (!RMOVIE(obj)->atoms && !RMOVIE(obj)->filepath)
+    return Qnil;
+  atoms = MOVIE_ATOMS(obj);
+  memset(&frame, 0, sizeof(frame));
+  frame.time = (int64_t)floor(NUM2DBL(seconds)*atoms->time_scale + 1e-6);
+  if (!atom_movie_image_locate(atoms, &frame) || frame.format == ATOM_IMAGE_NONE)
+    return Qnil;
+  return movie_image_format_symbol(frame.format);
+}
+
+/*  helper function, reads the frames without holding the interpreter lock.
+*/
+struct ImageFramesArgs {
+  struct AtomMovie *movie;
+  struct AtomImageFrame *frames;
+  uint32_t count;
+  volatile int cancelled;
+  char error[1024];
+  int ok;
+};
+
+static void *movie_image_frames_run(void *arg)
+{
+  struct ImageFramesArgs *args = (struct ImageFramesArgs*)arg;
+  args->ok = atom_movie_image_frames(args->movie, args->frames, args->count, &args->cancelled, args->error, sizeof(args->error));
+  return NULL;
+}
+
+static void movie_image_frames_cancel(void *arg)
+{
+  ((struct ImageFramesArgs*)arg)->cancelled = 1;
+}
+
+/*
+  call-seq: contact_sheet(times) -> array
+  
+  Returns the video frames shown at each of the times (in seconds) as 
+  image files, without decoding them. This works for Photo-JPEG, 
+  Motion-JPEG (A and B) and PNG video, such as slideshows and camera 
+  footage. The samples of all the frames are read in a single pass in 
+  file order, a sample shown at several of the times is read once. Each 
+  frame is a hash with its :time, the image :format (:jpeg or :png) and 
+  the image :data, in the order of the times.
+  
+    movie.contact_sheet([0, 10, 20]).each_with_index do |frame, i|
+      File.open("thumb#{i}.#{frame[:format]}", "wb") { |f| f.write(frame[:data]) }
+    end
+  
+  Raises QuickTime::Error if no video frame is shown at one of the times 
+  or it would have to be decoded.
+*/
+static VALUE movie_contact_sheet(VALUE obj, VALUE times)
+{
+  struct ImageFramesArgs args;
+  struct AtomImageFrame *frame;
+  VALUE results, frame_hash, data;
+  char codec[5];
+  long i;
+  
+  Check_Type(times, T_ARRAY);
+  for (i = 0; i < RARRAY_LEN(times); i++) {
+    NUM2DBL(RARRAY_PTR(times)[i]);
+  }
+  args.movie = MOVIE_ATOMS(obj);
+  args.count = (uint32_t)RARRAY_LEN(times);
+  args.cancelled = 0;
+  if (!(args.frames = (struct AtomImageFrame*)calloc(args.count ? args.count : 1, sizeof(struct AtomImageFrame))))
+    rb_raise(rb_eNoMemError, "Unable to allocate frames");
+  for (i = 0; i < (long)args.count; i++) {
+    args.frames[i].time = (int64_t)floor(NUM2DBL(RARRAY_PTR(times)[i])*args.movie->time_scale + 1e-6);
+  }
+  
+  // another thread may dispose of the movie while the frames are read
+  atom_movie_retain(args.movie);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(movie_image_frames_run, &args, movie_image_frames_cancel, &args);
+#else
+  movie_image_frames_run(&args);
+#endif
+  atom_movie_free(args.movie);
+  if (!args.ok && args.cancelled) {
+    atom_image_frames_free(args.frames, args.count);
+    rb_thread_check_ints();
+    rb_raise(eQuickTime, "Reading the frames was interrupted.");
+  }
+  
+  for (i = 0; args.ok && i < (long)args.count; i++) {
+    frame = &args.frames[i];
+    if (!frame->media) {
+      snprintf(args.error, sizeof(args.error), "No video frame is shown at %g seconds", NUM2DBL(RARRAY_PTR(times)[i]));
+      args.ok = 0;
+    } else if (frame->format == ATOM_IMAGE_NONE) {
+      codec[0] = (char)(frame->codec >> 24);
+      codec[1] = (char)(frame->codec >> 16);
+      codec[2] = (char)(frame->codec >> 8);
+      codec[3] = (char)frame->codec;
+      codec[4] = '\0';
+      snprintf(args.error, sizeof(args.error), "Unable to extract the frame at %g seconds without decoding its '%s' codec", NUM2DBL(RARRAY_PTR(times)[i]), codec);
+      args.ok = 0;
+    }
+  }
+  if (!args.ok) {
+    atom_image_frames_free(args.frames, args.count);
+    rb_raise(eQuickTime, "%s", args.error);
+  }
+  
+  results = rb_ary_new2(args.count);
+  for (i = 0; i < (long)args.count; i++) {
+    frame = &args.frames[i];
+    if (frame->original == (uint32_t)i) {
+      data = rb_str_new((const char*)frame->data, frame->length);
+      OBJ_FREEZE(data);
+    } else {
+      data = rb_hash_aref(rb_ary_entry(results, frame->original), ID2SYM(rb_intern("data")));
+    }
+    frame_hash = rb_hash_new();
+    rb_hash_aset(frame_hash, ID2SYM(rb_intern("time")), RARRAY_PTR(times)[i]);
+    rb_hash_aset(frame_hash, ID2SYM(rb_intern("format")), movie_image_format_symbol(frame->format));
+    rb_hash_aset(frame_hash, ID2SYM(rb_intern("data")), data);
+    rb_ary_push(results, frame_hash);
+  }
+  atom_image_frames_free(args.frames, args.count);
+  return results;
 }
 
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+
 /*
   call-seq: export_image_type(filepath, time, ostype)
   
@@ -408,6 +1506,7 @@ static VALUE movie_export_image_type(VALUE obj, VALUE filepath, VALUE frame_time
   
   return Qnil;
 }
+#endif
 
 /*
   call-seq: poster_time() -> seconds
@@ -416,7 +1515,13 @@ static VALUE movie_export_image_type(VALUE obj, VALUE filepath, VALUE frame_time
 */
 static VALUE movie_get_poster_time(VALUE obj)
 {
-  return rb_float_new((double)GetMoviePosterTime(MOVIE(obj))/GetMovieTimeScale(MOVIE(obj)));
+  struct AtomMovie *atoms;
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj))
+    return rb_float_new((double)GetMoviePosterTime(MOVIE(obj))/GetMovieTimeScale(MOVIE(obj)));
+#endif
+  atoms = MOVIE_ATOMS(obj);
+  return rb_float_new(atoms->time_scale ? (double)atoms->poster_time/atoms->time_scale : 0.0);
 }
 
 /*
@@ -426,10 +1531,21 @@ static VALUE movie_get_poster_time(VALUE obj)
 */
 static VALUE movie_set_poster_time(VALUE obj, VALUE seconds)
 {
-  SetMoviePosterTime(MOVIE(obj), MOVIE_TIME(obj, seconds));
+  struct AtomMovie *atoms;
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(obj)) {
+    SetMoviePosterTime(MOVIE(obj), MOVIE_TIME(obj, seconds));
+    return Qnil;
+  }
+#endif
+  atoms = MOVIE_ATOMS(obj);
+  atoms->poster_time = (uint32_t)floor(NUM2DBL(seconds)*atoms->time_scale);
+  RMOVIE(obj)->edit_count++;
   return Qnil;
 }
 
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+
 /*
   call-seq: new_track(width, height) -> track
   
@@ -443,8 +1559,11 @@ static VALUE movie_new_track(VALUE obj, VALUE width, VALUE height)
 {
   VALUE track_obj = rb_obj_alloc(cTrack);
   RTRACK(track_obj)->track = NewMovieTrack(MOVIE(obj), NUM2INT(width), NUM2INT(height), kFullVolume);
+  RTRACK(track_obj)->movie = obj;
+  RMOVIE(obj)->edit_count++;
   return track_obj;
 }
+#endif
 
 void Init_quicktime_movie()
 {
@@ -452,12 +1571,21 @@ void Init_quicktime_movie()
   mQuickTime = rb_define_module("QuickTime");
   cMovie = rb_define_class_under(mQuickTime, "Movie", rb_cObject);
   rb_define_alloc_func(cMovie, movie_new);
+  rb_define_singleton_method(cMovie, "probe_files", movie_probe_files, 2);
+  rb_define_singleton_method(cMovie, "write_image_sequence", movie_write_image_sequence, 5);
   rb_define_method(cMovie, "load_from_file", movie_load_from_file, 1);
+  rb_define_method(cMovie, "load_headers_from_file", movie_load_headers_from_file, 1);
+  rb_define_method(cMovie, "load_from_io", movie_load_from_io, 2);
   rb_define_method(cMovie, "load_empty", movie_load_empty, 0);
   rb_define_method(cMovie, "raw_duration", movie_raw_duration, 0);
   rb_define_method(cMovie, "time_scale", movie_time_scale, 0);
   rb_define_method(cMovie, "bounds", movie_bounds, 0);
   rb_define_method(cMovie, "track_count", movie_track_count, 0);
+  rb_define_method(cMovie, "fragmented?", movie_fragmented, 0);
+  rb_define_method(cMovie, "refresh!", movie_refresh, 0);
+  rb_define_method(cMovie, "dispose", movie_dispose, 0);
+  rb_define_method(cMovie, "poster_time", movie_get_poster_time, 0);
+  rb_define_method(cMovie, "poster_time=", movie_set_poster_time, 1);
   rb_define_method(cMovie, "select", movie_select, 2);
   rb_define_method(cMovie, "add_into_selection", movie_add_into_selection, 1);
   rb_define_method(cMovie, "insert_into_selection", movie_insert_into_selection, 1);
@@ -466,11 +1594,22 @@ void Init_quicktime_movie()
   rb_define_method(cMovie, "delete_selection", movie_delete_selection, 0);
   rb_define_method(cMovie, "changed?", movie_changed, 0);
   rb_define_method(cMovie, "clear_changed_status", movie_clear_changed_status, 0);
-  rb_define_method(cMovie, "flatten", movie_flatten, 1);
+  rb_define_method(cMovie, "flatten", movie_flatten, -1);
+  rb_define_method(cMovie, "seek_report", movie_seek_report, -1);
+  rb_define_method(cMovie, "fingerprints", movie_fingerprints, -1);
+  rb_define_method(cMovie, "report", movie_report, 0);
+  rb_define_method(cMovie, "report_json", movie_report_json, 0);
+  rb_define_method(cMovie, "image_format", movie_image_format, 1);
+  rb_define_method(cMovie, "contact_sheet", movie_contact_sheet, 1);
+  rb_define_method(cMovie, "save", movie_save, -1);
+  rb_define_method(cMovie, "chapter_track", movie_chapter_track, 0);
+  rb_define_method(cMovie, "write_chapters", movie_write_chapters, 1);
+  rb_define_method(cMovie, "metadata", movie_metadata, 0);
+  rb_define_method(cMovie, "write_metadata", movie_write_metadata, 1);
+  rb_define_singleton_method(cMovie, "faststart!", movie_faststart_file, 1);
+  rb_define_method(cMovie, "faststart!", movie_faststart, 0);
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
   rb_define_method(cMovie, "export_image_type", movie_export_image_type, 3);
-  rb_define_method(cMovie, "dispose", movie_dispose, 0);
-  rb_define_method(cMovie, "poster_time", movie_get_poster_time, 0);
-  rb_define_method(cMovie, "poster_time=", movie_set_poster_time, 1);
   rb_define_method(cMovie, "new_track", movie_new_track, 2);
-  rb_define_method(cMovie, "save", movie_save, 0);
+#endif
 }
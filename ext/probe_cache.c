@@ -0,0 +1,314 @@
+#include "rmov_ext.h"
+
+#include <string.h>
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#endif
+
+VALUE cProbeCache;
+
+static VALUE probe_cache_current_cache = Qnil;
+
+static void probe_cache_free(struct RProbeCache *rProbeCache)
+{
+  if (rProbeCache->cache) {
+    atom_probe_cache_close(rProbeCache->cache);
+  }
+  if (rProbeCache->closing) {
+    atom_probe_cache_close(rProbeCache->closing);
+  }
+}
+
+static void probe_cache_mark(struct RProbeCache *rProbeCache)
+{
+}
+
+/*
+  call-seq: new() -> probe_cache
+
+  Creates a new probe cache instance. Usually you go through
+  ProbeCache.open.
+*/
+static VALUE probe_cache_new(VALUE klass)
+{
+  struct RProbeCache *rProbeCache;
+  return Data_Make_Struct(klass, struct RProbeCache, probe_cache_mark, probe_cache_free, rProbeCache);
+}
+
+/*  helper function, returns the open cache, raising an error once it has
+    been closed.
+*/
+static struct AtomProbeCache *probe_cache_atoms(VALUE obj)
+{
+  if (!RPROBE_CACHE(obj)->cache)
+    rb_raise(eQuickTime, "Probe cache has been closed.");
+  return RPROBE_CACHE(obj)->cache;
+}
+
+/*
+  call-seq: load_from_file(path)
+
+  Opens the probe cache file at path, creating it if there is none.
+  Usually you go through ProbeCache.open.
+*/
+static VALUE probe_cache_load_from_file(VALUE obj, VALUE path)
+{
+  char error[1024];
+
+  if (RPROBE_CACHE(obj)->cache)
+    rb_raise(eQuickTime, "Probe cache has already been loaded.");
+  RPROBE_CACHE(obj)->cache = atom_probe_cache_open(StringValueCStr(path), error, sizeof(error));
+  if (!RPROBE_CACHE(obj)->cache)
+    rb_raise(eQuickTime, "%s", error);
+  return obj;
+}
+
+static void *probe_cache_close_run(void *cache)
+{
+  atom_probe_cache_close((struct AtomProbeCache*)cache);
+  return NULL;
+}
+
+/*
+  call-seq: close()
+
+  Closes the cache, waiting for a compaction in progress to finish. It's
+  no longer the current cache.
+*/
+static VALUE probe_cache_close(VALUE obj)
+{
+  struct AtomProbeCache *cache = RPROBE_CACHE(obj)->cache;
+
+  if (probe_cache_current_cache == obj)
+    probe_cache_current_cache = Qnil;
+  if (cache) {
+    RPROBE_CACHE(obj)->cache = NULL;
+    // a thread waiting in compact closes it once it's done
+    if (RPROBE_CACHE(obj)->waiting) {
+      RPROBE_CACHE(obj)->closing = cache;
+      return Qnil;
+    }
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(probe_cache_close_run, cache, NULL, NULL);
+#else
+    probe_cache_close_run(cache);
+#endif
+  }
+  return Qnil;
+}
+
+/*
+  call-seq: closed?() -> bool
+
+  Returns true once the cache has been closed.
+*/
+static VALUE probe_cache_closed(VALUE obj)
+{
+  return RPROBE_CACHE(obj)->cache ? Qfalse : Qtrue;
+}
+
+/*  helper function, returns the report stored for key, nil if there is none.
+*/
+static VALUE probe_cache_find(VALUE obj, const struct AtomCacheKey *key)
+{
+  const unsigned char *value;
+  uint32_t length;
+  char error[1024];
+
+  switch (atom_probe_cache_find(probe_cache_atoms(obj), key, &value, &length, error, sizeof(error))) {
+    case 1:
+      return rb_marshal_load(rb_str_new((const char*)value, length));
+    case 0:
+      return Qnil;
+    default:
+      rb_raise(eQuickTime, "%s", error);
+  }
+  return Qnil;
+}
+
+/*  helper function, stores report for the file at path identified by key.
+*/
+static void probe_cache_store_key(VALUE obj, const struct AtomCacheKey *key, const char *path, VALUE report)
+{
+  VALUE value = rb_marshal_dump(report, Qnil);
+  char error[1024];
+
+  if (!atom_probe_cache_store(probe_cache_atoms(obj), key, path, (const unsigned char*)RSTRING_PTR(value), (uint32_t)RSTRING_LEN(value), error, sizeof(error)))
+    rb_raise(eQuickTime, "%s", error);
+}
+
+/*
+  call-seq: fetch(path) -> report_hash or nil
+
+  Returns the report stored for the file at path if the file hasn't
+  changed since, nil otherwise. Takes a single stat of the file.
+*/
+static VALUE probe_cache_fetch(VALUE obj, VALUE path)
+{
+  struct AtomCacheKey key;
+  struct stat info;
+
+  if (stat(StringValueCStr(path), &info) != 0)
+    return Qnil;
+  atom_cache_key_from_stat(&info, &key);
+  return probe_cache_find(obj, &key);
+}
+
+/*
+  call-seq: store(path, report_hash) -> report_hash
+
+  Stores the report of the file at path as it is now, replacing what was
+  stored for it before.
+*/
+static VALUE probe_cache_store(VALUE obj, VALUE path, VALUE report)
+{
+  struct AtomCacheKey key;
+  struct stat info;
+
+  if (stat(StringValueCStr(path), &info) != 0)
+    rb_raise(eQuickTime, "Unable to find file at %s", RSTRING_PTR(path));
+  atom_cache_key_from_stat(&info, &key);
+  probe_cache_store_key(obj, &key, RSTRING_PTR(path), report);
+  return report;
+}
+
+/*
+  Returns the report of a movie (see Movie#report) from the cache when its
+  file hasn't changed, otherwise collects and stores it. Movies which have
+  been edited and not saved, or don't have a file, are never cached.
+*/
+VALUE probe_cache_movie_report(VALUE obj, VALUE movie_obj)
+{
+  struct RMovie *rMovie = RMOVIE(movie_obj);
+  struct AtomCacheKey key;
+  struct stat info;
+  VALUE report;
+
+  if (!rMovie->filepath || rMovie->edit_count != rMovie->saved_edit_count)
+    return movie_write_report(movie_obj, 0);
+  if (MOVIE_ATOMS(movie_obj)->fd < 0 || fstat(MOVIE_ATOMS(movie_obj)->fd, &info) != 0)
+    return movie_write_report(movie_obj, 0);
+  atom_cache_key_from_stat(&info, &key);
+
+  report = probe_cache_find(obj, &key);
+  if (NIL_P(report)) {
+    report = movie_write_report(movie_obj, 0);
+    probe_cache_store_key(obj, &key, rMovie->filepath, report);
+  }
+  return report;
+}
+
+/*
+  call-seq: report(movie) -> report_hash
+
+  Returns the report of the movie from the cache if its file hasn't
+  changed since it was stored, otherwise collects and stores it.
+*/
+static VALUE probe_cache_report(VALUE obj, VALUE movie_obj)
+{
+  return probe_cache_movie_report(obj, movie_obj);
+}
+
+/*
+  call-seq: size() -> count
+
+  Returns the number of files with a stored report.
+*/
+static VALUE probe_cache_size(VALUE obj)
+{
+  return UINT2NUM(atom_probe_cache_size(probe_cache_atoms(obj)));
+}
+
+static void *probe_cache_wait_run(void *cache)
+{
+  atom_probe_cache_wait((struct AtomProbeCache*)cache);
+  return NULL;
+}
+
+/*
+  call-seq: compact()
+
+  Compacts the cache file right away and waits for it to finish. Reports
+  of files which changed or are gone are dropped. This happens on its own
+  in the background once most of the file is replaced reports. Other
+  threads keep running and may use the cache while it waits.
+*/
+static VALUE probe_cache_compact(VALUE obj)
+{
+  struct RProbeCache *rProbeCache = RPROBE_CACHE(obj);
+  struct AtomProbeCache *cache = probe_cache_atoms(obj);
+
+  if (!atom_probe_cache_compact(cache))
+    return obj;
+  rProbeCache->waiting++;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(probe_cache_wait_run, cache, NULL, NULL);
+#else
+  probe_cache_wait_run(cache);
+#endif
+  if (--rProbeCache->waiting == 0 && rProbeCache->closing) {
+    cache = rProbeCache->closing;
+    rProbeCache->closing = NULL;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(probe_cache_close_run, cache, NULL, NULL);
+#else
+    probe_cache_close_run(cache);
+#endif
+  }
+  return obj;
+}
+
+/*
+  Returns the cache consulted by Movie#report, nil if there is none.
+*/
+VALUE probe_cache_current(void)
+{
+  return probe_cache_current_cache;
+}
+
+/*
+  call-seq: current() -> probe_cache or nil
+
+  Returns the cache Movie#report and Movie.probe_many consult, nil if
+  there is none.
+*/
+static VALUE probe_cache_get_current(VALUE klass)
+{
+  return probe_cache_current_cache;
+}
+
+/*
+  call-seq: current=(probe_cache)
+
+  Sets the cache Movie#report and Movie.probe_many consult, nil to stop
+  using one.
+*/
+static VALUE probe_cache_set_current(VALUE klass, VALUE cache)
+{
+  if (!NIL_P(cache)) {
+    if (!rb_obj_is_kind_of(cache, cProbeCache))
+      rb_raise(rb_eArgError, "Expected a QuickTime::ProbeCache");
+    probe_cache_atoms(cache);
+  }
+  probe_cache_current_cache = cache;
+  return cache;
+}
+
+void Init_quicktime_probe_cache()
+{
+  VALUE mQuickTime;
+  mQuickTime = rb_define_module("QuickTime");
+  cProbeCache = rb_define_class_under(mQuickTime, "ProbeCache", rb_cObject);
+  rb_global_variable(&probe_cache_current_cache);
+  rb_define_alloc_func(cProbeCache, probe_cache_new);
+  rb_define_singleton_method(cProbeCache, "current", probe_cache_get_current, 0);
+  rb_define_singleton_method(cProbeCache, "current=", probe_cache_set_current, 1);
+  rb_define_method(cProbeCache, "load_from_file", probe_cache_load_from_file, 1);
+  rb_define_method(cProbeCache, "close", probe_cache_close, 0);
+  rb_define_method(cProbeCache, "closed?", probe_cache_closed, 0);
+  rb_define_method(cProbeCache, "fetch", probe_cache_fetch, 1);
+  rb_define_method(cProbeCache, "store", probe_cache_store, 2);
+  rb_define_method(cProbeCache, "report", probe_cache_report, 1);
+  rb_define_method(cProbeCache, "size", probe_cache_size, 0);
+  rb_define_method(cProbeCache, "compact", probe_cache_compact, 0);
+}
@@ -0,0 +1,259 @@
+#include "rmov_ext.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+  Writes the hashes returned by Movie#report and Track#report. The same
+  writer builds either the nested Ruby hashes or their JSON, appended to a
+  single string, so a report is collected in one pass in both cases. Hash
+  keys are symbols interned once by Init_quicktime_report.
+*/
+
+static const char *report_key_names[REPORT_KEY_COUNT] = {
+  "duration", "time_scale", "width", "height", "bounds", "left", "top",
+  "right", "bottom", "tracks", "id", "media_type", "codec", "frame_count",
+  "enabled", "offset", "frame_rate", "encoded_pixel_dimensions",
+  "display_pixel_dimensions", "pixel_aspect_ratio", "volume", "channel_map",
+  "assignment", "message"
+};
+
+static VALUE report_keys[REPORT_KEY_COUNT];
+static ID id_to_s;
+static char report_json_keys[REPORT_KEY_COUNT][32];  /* "key": */
+static long report_json_key_lengths[REPORT_KEY_COUNT];
+
+/*  helper function, appends a string to the JSON.
+*/
+static void report_cat(struct ReportWriter *writer, const char *str, long length)
+{
+  rb_str_buf_cat(writer->json, str, length);
+}
+
+/*  helper function, appends a quoted JSON string. Bytes outside of ASCII
+    are escaped as latin 1 characters so the JSON is always valid.
+*/
+static void report_cat_string(struct ReportWriter *writer, const char *str, long length)
+{
+  static const char hex[] = "0123456789abcdef";
+  char escape[6] = { '\\', 'u', '0', '0', 0, 0 };
+  long i, start = 0;
+  unsigned char c;
+
+  report_cat(writer, "\"", 1);
+  for (i = 0; i < length; i++) {
+    c = (unsigned char)str[i];
+    if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') continue;
+    report_cat(writer, str + start, i - start);
+    start = i + 1;
+    if (c == '"') {
+      report_cat(writer, "\\\"", 2);
+    } else if (c == '\\') {
+      report_cat(writer, "\\\\", 2);
+    } else {
+      escape[4] = hex[c >> 4];
+      escape[5] = hex[c & 0xf];
+      report_cat(writer, escape, 6);
+    }
+  }
+  report_cat(writer, str + start, length - start);
+  report_cat(writer, "\"", 1);
+}
+
+/*  helper function, appends the decimal digits of a whole number, 
+    without going through snprintf.
+*/
+static void report_cat_digits(struct ReportWriter *writer, unsigned long long whole, int negative, const char *suffix)
+{
+  char digits[32], *p = digits + sizeof(digits);
+  size_t length = strlen(suffix);
+
+  p -= length;
+  memcpy(p, suffix, length);
+  do {
+    *--p = '0' + (char)(whole % 10);
+    whole /= 10;
+  } while (whole);
+  if (negative)
+    *--p = '-';
+  report_cat(writer, p, digits + sizeof(digits) - p);
+}
+
+/*  helper function, appends a Float. Whole numbers are written directly, 
+    others take the shortest digits which read back as the same double 
+    from Float#to_s. JSON has no infinity or NaN, these are written as null.
+*/
+static void report_cat_float(struct ReportWriter *writer, VALUE value)
+{
+  double number = NUM2DBL(value);
+
+  if (!isfinite(number)) {
+    report_cat(writer, "null", 4);
+  } else if (number == floor(number) && fabs(number) < 1e15) {
+    report_cat_digits(writer, (unsigned long long)fabs(number), signbit(number), ".0");
+  } else {
+    value = rb_funcall(value, id_to_s, 0);
+    report_cat(writer, RSTRING_PTR(value), RSTRING_LEN(value));
+  }
+}
+
+/*  helper function, starts a value at key of the enclosing hash (or the
+    next element of the enclosing array) in the JSON.
+*/
+static void report_json_key(struct ReportWriter *writer, int key)
+{
+  if (writer->depth == 0) return;
+  if (writer->counts[writer->depth - 1]++)
+    report_cat(writer, ",", 1);
+  if (key != REPORT_ELEMENT)
+    report_cat(writer, report_json_keys[key], report_json_key_lengths[key]);
+}
+
+/*  helper function, stores value at key of the enclosing hash (or appends
+    it to the enclosing array). At the top level it becomes the result.
+*/
+static void report_store(struct ReportWriter *writer, int key, VALUE value)
+{
+  VALUE container;
+
+  if (writer->depth == 0) {
+    writer->result = value;
+    return;
+  }
+  container = writer->containers[writer->depth - 1];
+  if (key == REPORT_ELEMENT) {
+    rb_ary_push(container, value);
+  } else {
+    rb_hash_aset(container, report_keys[key], value);
+  }
+}
+
+/*  helper function, opens a hash or array.
+*/
+static void report_begin(struct ReportWriter *writer, int key, int array)
+{
+  VALUE container;
+
+  if (writer->depth == REPORT_MAX_DEPTH)
+    rb_raise(eQuickTime, "Report is nested too deeply");
+  if (RTEST(writer->json)) {
+    report_json_key(writer, key);
+    report_cat(writer, array ? "[" : "{", 1);
+    container = Qnil;
+  } else {
+    container = array ? rb_ary_new() : rb_hash_new();
+    report_store(writer, key, container);
+  }
+  writer->containers[writer->depth] = container;
+  writer->arrays[writer->depth] = array;
+  writer->counts[writer->depth] = 0;
+  writer->depth++;
+}
+
+/*
+  Prepares writer for a new report, as JSON when json is true and as
+  Ruby hashes otherwise.
+*/
+void report_writer_init(struct ReportWriter *writer, int json)
+{
+  writer->json = json ? rb_str_buf_new(4096) : Qnil;
+  writer->result = Qnil;
+  writer->depth = 0;
+}
+
+/*
+  Returns the report written, the top level hash (or array) or the JSON
+  string.
+*/
+VALUE report_writer_result(struct ReportWriter *writer)
+{
+  return RTEST(writer->json) ? writer->json : writer->result;
+}
+
+/*
+  Opens a hash at key, later values are written into it until report_end.
+*/
+void report_begin_hash(struct ReportWriter *writer, int key)
+{
+  report_begin(writer, key, 0);
+}
+
+/*
+  Opens an array at key, later values are appended to it until report_end.
+  Pass REPORT_ELEMENT as their key.
+*/
+void report_begin_array(struct ReportWriter *writer, int key)
+{
+  report_begin(writer, key, 1);
+}
+
+/*
+  Closes the hash or array opened last.
+*/
+void report_end(struct ReportWriter *writer)
+{
+  writer->depth--;
+  if (RTEST(writer->json))
+    report_cat(writer, writer->arrays[writer->depth] ? "]" : "}", 1);
+}
+
+/*
+  Writes a value at key. It may be nil, true, false, an Integer, a Float,
+  a Symbol (written as a string in JSON) or a String.
+*/
+void report_value(struct ReportWriter *writer, int key, VALUE value)
+{
+  const char *name;
+  long number;
+
+  if (!RTEST(writer->json)) {
+    report_store(writer, key, value);
+    return;
+  }
+  report_json_key(writer, key);
+  if (NIL_P(value)) {
+    report_cat(writer, "null", 4);
+  } else if (value == Qtrue) {
+    report_cat(writer, "true", 4);
+  } else if (value == Qfalse) {
+    report_cat(writer, "false", 5);
+  } else if (FIXNUM_P(value)) {
+    number = FIX2LONG(value);
+    report_cat_digits(writer, number < 0 ? -(unsigned long long)number : (unsigned long long)number, number < 0, "");
+  } else if (TYPE(value) == T_BIGNUM) {
+    value = rb_big2str(value, 10);
+    report_cat(writer, RSTRING_PTR(value), RSTRING_LEN(value));
+  } else if (TYPE(value) == T_FLOAT) {
+    report_cat_float(writer, value);
+  } else if (SYMBOL_P(value)) {
+    name = rb_id2name(SYM2ID(value));
+    report_cat_string(writer, name, strlen(name));
+  } else {
+    value = rb_String(value);
+    report_cat_string(writer, RSTRING_PTR(value), RSTRING_LEN(value));
+  }
+}
+
+/*
+  Writes a string at key, without creating a Ruby string for JSON.
+*/
+void report_string(struct ReportWriter *writer, int key, const char *str)
+{
+  if (!RTEST(writer->json)) {
+    report_store(writer, key, rb_str_new2(str));
+    return;
+  }
+  report_json_key(writer, key);
+  report_cat_string(writer, str, strlen(str));
+}
+
+void Init_quicktime_report()
+{
+  int i;
+  id_to_s = rb_intern("to_s");
+  for (i = 0; i < REPORT_KEY_COUNT; i++) {
+    report_keys[i] = ID2SYM(rb_intern(report_key_names[i]));
+    report_json_key_lengths[i] = snprintf(report_json_keys[i], sizeof(report_json_keys[i]), "\"%s\":", report_key_names[i]);
+  }
+}
@@ -6,11 +6,18 @@ void Init_rmov_ext()
 {
   VALUE mQuickTime;
   
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
   EnterMovies(); // Enables the QuickTime framework
+#endif
   
   mQuickTime = rb_define_module("QuickTime");
   eQuickTime = rb_define_class_under(mQuickTime, "Error", rb_eStandardError);
+  Init_quicktime_report();
   Init_quicktime_movie();
   Init_quicktime_track();
+  Init_quicktime_probe_cache();
+  Init_quicktime_scanner();
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
   Init_quicktime_exporter();
+#endif
 }
@@ -1,43 +1,899 @@
 #include <ruby.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
 #include <QuickTime/QuickTime.h>
+#endif
 
-extern VALUE eQuickTime, cMovie, cTrack, cExporter;
+extern VALUE eQuickTime, cMovie, cTrack, cExporter, cProbeCache, cScanner;
 
 
 #define OSTYPE(str) ((str[0] << 24) | (str[1] << 16) | (str[2] << 8) | str[3])
+#define FOURCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+#ifndef HAVE_QUICKTIME_QUICKTIME_H
+/*
+  Without the QuickTime framework the atom parser provides all movie and
+  track data. These are the few Mac types and CoreAudio channel layout
+  definitions (see CoreAudioTypes.h) the shared track code relies on.
+*/
+typedef uint8_t UInt8;
+typedef uint32_t UInt32;
+typedef int32_t SInt32;
+typedef int16_t OSErr;
+typedef uint32_t OSType;
+
+#define noErr 0
+#define VideoMediaType FOURCC('v','i','d','e')
+#define SoundMediaType FOURCC('s','o','u','n')
+#define TextMediaType FOURCC('t','e','x','t')
+
+typedef UInt32 AudioChannelLabel;
+typedef UInt32 AudioChannelLayoutTag;
+
+enum {
+  kAudioChannelLabel_Left = 1,
+  kAudioChannelLabel_Right = 2,
+  kAudioChannelLabel_Center = 3,
+  kAudioChannelLabel_LFEScreen = 4,
+  kAudioChannelLabel_LeftSurround = 5,
+  kAudioChannelLabel_RightSurround = 6,
+  kAudioChannelLabel_LeftCenter = 7,
+  kAudioChannelLabel_RightCenter = 8,
+  kAudioChannelLabel_CenterSurround = 9,
+  kAudioChannelLabel_LeftSurroundDirect = 10,
+  kAudioChannelLabel_RightSurroundDirect = 11,
+  kAudioChannelLabel_TopCenterSurround = 12,
+  kAudioChannelLabel_VerticalHeightLeft = 13,
+  kAudioChannelLabel_VerticalHeightCenter = 14,
+  kAudioChannelLabel_VerticalHeightRight = 15,
+  kAudioChannelLabel_TopBackLeft = 16,
+  kAudioChannelLabel_TopBackCenter = 17,
+  kAudioChannelLabel_TopBackRight = 18,
+  kAudioChannelLabel_RearSurroundLeft = 33,
+  kAudioChannelLabel_RearSurroundRight = 34,
+  kAudioChannelLabel_LeftWide = 35,
+  kAudioChannelLabel_RightWide = 36,
+  kAudioChannelLabel_LFE2 = 37,
+  kAudioChannelLabel_LeftTotal = 38,
+  kAudioChannelLabel_RightTotal = 39,
+  kAudioChannelLabel_HearingImpaired = 40,
+  kAudioChannelLabel_Narration = 41,
+  kAudioChannelLabel_Mono = 42,
+  kAudioChannelLabel_DialogCentricMix = 43,
+  kAudioChannelLabel_CenterSurroundDirect = 44
+};
+
+#define kAudioChannelLayoutTag_UseChannelDescriptions ((0U << 16) | 0)
+#define kAudioChannelLayoutTag_UseChannelBitmap ((1U << 16) | 0)
+#define kAudioChannelLayoutTag_Mono ((100U << 16) | 1)
+#define kAudioChannelLayoutTag_Stereo ((101U << 16) | 2)
+#define kAudioChannelLayoutTag_MatrixStereo ((103U << 16) | 2)
+#define kAudioChannelLayoutTag_SMPTE_DTV ((130U << 16) | 8)
+#define kAudioChannelLayoutTag_Unknown 0xFFFF0000U
+#define AudioChannelLayoutTag_GetNumberOfChannels(tag) ((UInt32)((tag) & 0x0000FFFF))
+
+typedef struct AudioChannelDescription {
+  AudioChannelLabel mChannelLabel;
+  UInt32 mChannelFlags;
+  float mCoordinates[3];
+} AudioChannelDescription;
+
+typedef struct AudioChannelLayout {
+  AudioChannelLayoutTag mChannelLayoutTag;
+  UInt32 mChannelBitmap;
+  UInt32 mNumberChannelDescriptions;
+  AudioChannelDescription mChannelDescriptions[1];
+} AudioChannelLayout;
+#endif
+
+
+/*** ATOM ***/
+
+/*
+  A node in the parsed atom tree. The payload points straight into the
+  memory mapped file, nothing is copied. For a probed movie the payload
+  is read into buffer when needed and is NULL until then.
+*/
+struct Atom {
+  uint32_t type;
+  uint64_t offset;       /* file offset of the atom header */
+  uint64_t size;         /* total size including the header */
+  uint32_t header_size;  /* 8, or 16 for 64 bit sizes */
+  const unsigned char *data;
+  unsigned char *buffer;
+  struct Atom *parent;
+  struct Atom *children;
+  struct Atom *next;
+};
+
+#define ATOM_DATA_SIZE(atom) ((atom)->size - (atom)->header_size)
+#define ATOM_TRACK_MEDIA(track) ((track)->media_source ? (track)->media_source : (track))
+
+/*
+  A parsed sample description entry. QuickTime tracks cache the same
+  record built from their media, see track_descriptions.
+*/
+struct AtomSampleDescription {
+  uint32_t format;
+  uint16_t data_reference_index;
+
+  /* video */
+  uint16_t width;
+  uint16_t height;
+  uint16_t depth;
+  char compressor_name[32];
+  uint32_t pasp_h_spacing;
+  uint32_t pasp_v_spacing;
+  uint32_t clap_width;
+  uint32_t clap_height;
+  uint32_t display_width;
+  uint32_t display_height;
+
+  /* audio */
+  uint16_t sound_version;
+  uint32_t channels;
+  uint32_t sample_size;
+  double sample_rate;
+  uint32_t bytes_per_frame;   /* from version 1 and 2 descriptions, 0 if unknown */
+  uint32_t format_flags;      /* of version 2 'lpcm' descriptions */
+  int little_endian;          /* set by an 'enda' extension */
+  int has_channel_layout;     /* set if a 'chan' extension was found */
+  uint32_t channel_layout_tag;
+  uint32_t channel_bitmap;
+  uint32_t channel_description_count;
+  uint32_t *channel_labels;
+};
+
+struct AtomEdit {
+  int64_t segment_duration;  /* in movie time scale */
+  int64_t media_time;        /* in media time scale, -1 for an empty edit */
+  int32_t media_rate;        /* 16.16 */
+  struct AtomTrack *media;   /* track whose media plays, NULL for an empty edit */
+};
+
+/*
+  Flat per sample arrays built from the sample tables of a track, see 
+  atom_track_sample_index. Times are in the media time scale.
+*/
+struct AtomSampleIndex {
+  uint32_t count;
+  uint64_t *offsets;         /* file offset of each sample */
+  uint32_t *sizes;
+  int64_t *dts;              /* decode time of each sample */
+  int32_t *cts_offsets;      /* composition offsets, NULL without ctts */
+  uint32_t *descriptions;    /* sample description (1 based), NULL if all use the first */
+  uint32_t sync_count;
+  uint32_t *sync_samples;    /* sorted, NULL if every sample is a sync sample */
+  int frame_sized;           /* set if stsz gave each sound frame a size of 1 */
+  int64_t end_time;          /* decode time past the last sample */
+  uint32_t capacity;         /* of the per sample arrays, fragments are appended to them */
+  uint32_t sync_capacity;
+};
+
+/*
+  Sample duration statistics of a track, see atom_track_frame_timing.
+  Durations are in the media time scale.
+*/
+struct AtomDurationCount {
+  uint32_t duration;
+  uint64_t count;
+};
+
+struct AtomFrameTiming {
+  uint64_t sample_count;
+  uint64_t total_duration;
+  uint32_t min_duration;
+  uint32_t max_duration;
+  uint32_t histogram_size;
+  struct AtomDurationCount *histogram;  /* sorted by duration */
+};
+
+/*
+  Where the samples of a track run of a movie fragment start in the sample
+  index, so the entries of a 'tfra' atom can be found. The numbers are 1
+  based as in 'tfra'.
+*/
+struct AtomFragmentRun {
+  uint64_t moof;             /* offset of the moof atom */
+  uint32_t traf;
+  uint32_t trun;
+  uint32_t first;            /* first sample, 0 based */
+};
+
+struct AtomTrack {
+  struct AtomMovie *movie;         /* movie holding the track */
+  struct AtomTrack *media_source;  /* for tracks made by editing, the track whose media this one shares */
+  uint32_t id;
+  uint32_t flags;
+  uint64_t duration;         /* in movie time scale */
+  int16_t volume;            /* 8.8 */
+  int32_t matrix[9];
+  uint32_t width;            /* 16.16 */
+  uint32_t height;           /* 16.16 */
+
+  uint32_t edit_count;
+  struct AtomEdit *edits;
+
+  uint32_t handler_type;
+  uint32_t media_time_scale;
+  uint64_t media_duration;
+
+  uint32_t sample_description_count;
+  struct AtomSampleDescription *sample_descriptions;
+
+  struct Atom *trak;
+  struct Atom *stts, *ctts, *stss, *stsc, *stsz, *stco;
+  struct AtomSampleIndex *sample_index;
+
+  /* fragmented movies, see atom_fragment.c */
+  uint32_t trex_description; /* defaults of the samples from the 'trex' atom */
+  uint32_t trex_duration;
+  uint32_t trex_size;
+  uint32_t trex_flags;
+  uint32_t open_edit;        /* edit (1 based) growing with the fragments, 0 for none */
+  struct AtomFragmentRun *runs;
+  uint32_t run_count;
+  uint32_t run_capacity;
+};
+
+/*
+  A mapping of a movie file replaced by a larger one. Strings and threads
+  may still point into it, so it's kept until the movie is freed.
+*/
+struct AtomRetiredMap {
+  const unsigned char *map;
+  uint64_t size;
+  struct AtomRetiredMap *next;
+};
+
+struct AtomMovie {
+  int refs;                  /* see atom_movie_retain */
+  int fd;
+  const unsigned char *map;  /* NULL for a probed movie */
+  uint64_t file_size;
+
+  struct Atom *atoms;        /* top level atoms */
+  struct Atom *moov;
+
+  uint32_t time_scale;
+  uint64_t duration;
+  int32_t matrix[9];
+  uint32_t poster_time;
+
+  uint32_t track_count;
+  struct AtomTrack **tracks; /* parsed on demand, see atom_movie_track */
+  uint32_t deleted_count;    /* deleted tracks kept after track_count, see atom_movie_delete_track */
+
+  uint64_t map_size;         /* mapped length, past the end of a file growing since, see atom_movie_refresh */
+  struct AtomRetiredMap *retired_maps; /* replaced by atom_movie_refresh, unmapped with the movie */
+  int fragmented;            /* the moov atom has an 'mvex' atom, see atom_fragment.c */
+  struct Atom *fragment_atom; /* last top level atom read for fragments, NULL before the first */
+  uint32_t fragment_count;   /* moof atoms read */
+
+  unsigned char *moov_buffer; /* the moov atom of a streamed movie, which has no file, see atom_stream.c */
+  uint64_t moov_buffer_offset;
+  uint64_t moov_buffer_size;
+};
+
+/*
+  A growing buffer atoms are serialized into, see atom_write.c. Once an
+  allocation fails the buffer stays failed and ignores further writes.
+*/
+struct AtomBuffer {
+  unsigned char *data;
+  size_t size;
+  size_t capacity;
+  int failed;
+};
+
+/*
+  How atom_movie_flatten lays out the media.
+*/
+struct AtomFlattenOptions {
+  int interleave;            /* write chunks of all tracks in the order they play */
+  int moov_first;            /* write the moov atom before the media */
+  double chunk_duration;     /* seconds of media per chunk, 0 for ATOM_CHUNK_DURATION */
+  uint64_t max_distance;     /* bytes between chunks of tracks playing together, 0 for no limit */
+};
+
+#define ATOM_CHUNK_DURATION 0.5
+
+/*
+  Seeks needed to read the media of a movie in the order it plays, see
+  atom_movie_seek_report.
+*/
+struct AtomSeekReport {
+  uint32_t chunks;
+  uint32_t seeks;            /* reads not continuing where the last one ended */
+  uint64_t seek_bytes;       /* total distance of those seeks */
+  uint64_t max_seek;
+  uint64_t max_distance;     /* largest distance between chunks of different tracks read in a row */
+};
+
+#define ATOM_SHIFT_BLOCK_SIZE (8 << 20)  /* media is moved in blocks this large */
+#define ATOM_SAVE_PADDING 4096            /* free space reserved after a saved moov atom */
+
+/*
+  Levels of a PCM audio track measured by atom_track_audio_levels. The
+  arrays hold a value per channel, blocks holds the K weighted mean square
+  of each channel for every 100 ms (block_count rows of channels values).
+*/
+struct AtomAudioLevels {
+  uint32_t channels;
+  double sample_rate;
+  uint64_t frames;
+  double *peaks;             /* largest absolute sample, 1.0 is full scale */
+  double *squares;           /* sum of squared samples */
+  double *blocks;
+  uint32_t block_count;
+  volatile int cancelled;
+};
+
+/*
+  Waveform pyramid of a PCM audio track, see atom_track_waveform. Level 0
+  has the minimum and maximum of every ATOM_WAVEFORM_BUCKET_FRAMES frames
+  of each channel, each level above merges pairs of buckets of the one
+  below until a single bucket is left. Values are scaled to +-32767 and
+  stored (min, max) for each channel in each bucket.
+*/
+#define ATOM_WAVEFORM_BUCKET_FRAMES 512
+#define ATOM_WAVEFORM_MAX_LEVELS 40
+#define ATOM_WAVEFORM_VERSION 1
+#define ATOM_WAVEFORM_HEADER_SIZE 68
+
+struct AtomWaveform {
+  uint32_t channels;
+  uint32_t bucket_frames;
+  uint64_t frames;
+  uint32_t level_count;
+  uint32_t counts[ATOM_WAVEFORM_MAX_LEVELS];
+  int16_t *levels[ATOM_WAVEFORM_MAX_LEVELS];
+  int cached;                /* read from the sidecar */
+  int save_failed;           /* the sidecar could not be written */
+  volatile int cancelled;
+};
+
+struct AtomWaveformSource {
+  uint32_t track_id;
+  uint32_t sample_count;
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  int64_t mtime;
+};
+
+/*
+  A batch of tracks for atom_fingerprint_many. The sample data of each
+  track is split into shards which are claimed in order by the worker
+  threads, see atom_hash.c.
+*/
+#define ATOM_FINGERPRINT_CRC32C 1
+#define ATOM_FINGERPRINT_XXH64 2
+#define ATOM_FINGERPRINT_SHARD_SIZE (4 << 20)  /* shards end at the first sample reaching this many bytes */
+
+struct AtomFingerprintShard {
+  uint32_t track;            /* index into the tracks of the batch */
+  uint32_t first;            /* 0 based sample */
+  uint32_t count;
+  uint64_t bytes;
+  uint64_t digest;
+};
+
+struct AtomFingerprintBatch {
+  int algorithm;
+  uint32_t count;
+  struct AtomSampleIndex **indexes;
+  struct AtomMovie **movies;  /* holding the media of each track, retained */
+  uint64_t *digests;          /* fingerprint of each track */
+  struct AtomFingerprintShard *shards;
+  uint32_t shard_count;
+  uint32_t next;
+  int cancelled;
+  int failed;
+  char error[1024];
+  pthread_mutex_t lock;
+};
+
+/*
+  A batch of files for atom_probe_many. Jobs are claimed in order by the
+  worker threads.
+*/
+struct AtomProbeJob {
+  char *filepath;
+  struct AtomMovie *movie;
+  char error[1024];
+};
+
+struct AtomProbeBatch {
+  struct AtomProbeJob *jobs;
+  uint32_t count;
+  uint32_t next;
+  int cancelled;
+  pthread_mutex_t lock;
+};
+
+/*
+  A video frame extracted without decoding, see atom_image.c. Times are
+  in the movie time scale.
+*/
+#define ATOM_IMAGE_NONE 0
+#define ATOM_IMAGE_JPEG 1
+#define ATOM_IMAGE_PNG 2
+
+struct AtomImageFrame {
+  int64_t time;
+  struct AtomTrack *media;   /* track holding the sample shown, NULL if there is none */
+  uint32_t sample;           /* starting at 0 */
+  uint64_t offset;
+  uint32_t size;
+  uint32_t codec;
+  const struct AtomSampleDescription *description;
+  int format;                /* ATOM_IMAGE_NONE if the sample needs decoding */
+  uint32_t original;         /* frame with the same sample, holding the data */
+  unsigned char *data;       /* the image file */
+  size_t length;
+};
+
+/*
+  Image files made into the frames of a movie, see atom_sequence.c. The
+  files are inspected by a pool of threads claiming them in order, then
+  copied as they are into the media of the movie by atom_sequence_write.
+*/
+struct AtomSequenceFrame {
+  char *filepath;
+  uint64_t size;
+  int format;                /* ATOM_IMAGE_JPEG or ATOM_IMAGE_PNG */
+  uint32_t width;
+  uint32_t height;
+  uint16_t depth;            /* of the image description, 40 for grayscale */
+};
+
+struct AtomSequence {
+  struct AtomSequenceFrame *frames;
+  uint32_t count;
+  uint32_t time_scale;
+  uint32_t frame_duration;   /* in time_scale */
+  uint32_t next;
+  int cancelled;
+  int failed;
+  char error[1024];
+  pthread_mutex_t lock;
+};
+
+/*
+  Samples of a track written to image files, see atom_sequence_export.
+  Threads claim runs of ATOM_SEQUENCE_EXPORT_RUN consecutive samples in
+  order, so the samples are read close to the order they are stored.
+*/
+#define ATOM_SEQUENCE_EXPORT_RUN 16
+
+struct AtomSequenceExport {
+  struct AtomTrack *media;   /* the movie of which is retained */
+  struct AtomSampleIndex *index;
+  uint32_t first;            /* sample written to the first file, starting at 0 */
+  char **filepaths;
+  uint32_t count;
+  uint32_t next;
+  int cancelled;
+  int failed;
+  char error[1024];
+  pthread_mutex_t lock;
+};
+
+/*
+  A chapter written by atom_movie_save_chapters, the time is in the movie
+  time scale and the title UTF-8.
+*/
+struct AtomChapter {
+  int64_t time;
+  const char *title;
+  size_t length;
+};
+
+/*
+  Metadata of a movie, see atom_meta.c. Known fields have a name such as
+  "title", the others are named by their reverse DNS key.
+*/
+#define ATOM_METADATA_UDTA 1  /* a user data atom, such as 0xA9 'nam' for the title */
+#define ATOM_METADATA_ILST 2  /* an item of the iTunes list in the user data */
+#define ATOM_METADATA_MDTA 4  /* an item of the QuickTime metadata, named by a key */
+
+struct AtomMetadataField {
+  const char *name;
+  uint32_t type;             /* of the user data atom and iTunes item */
+  const char *key;           /* of the QuickTime metadata */
+};
+
+struct AtomMetadataEntry {
+  char *name;
+  char *value;               /* UTF-8, NULL to remove the field when writing */
+  size_t length;
+  int stores;                /* ATOM_METADATA_* holding the field */
+};
+
+struct AtomMetadata {
+  struct AtomMetadataEntry *entries;
+  uint32_t count;
+  int stores;                /* ATOM_METADATA_ILST and ATOM_METADATA_MDTA if the movie has those lists */
+};
+
+/*
+  A scan of a directory tree for movie files, see atom_scan.c. Files move
+  from the found queue (filled by the walker) to the opened queue (read
+  ahead) to the done queue (probed), from which they are taken in the 
+  order they complete.
+*/
+#define ATOM_SCAN_READ_AHEAD 4          /* files opened ahead of the probes, per thread */
+#define ATOM_SCAN_HINT_SIZE (256 << 10) /* bytes read ahead at the start and end of a file */
+#define ATOM_SCAN_PENDING(scan) ((scan)->thread_count * ATOM_SCAN_READ_AHEAD * 2)  /* files found and not yet taken */
+
+struct AtomScanJob {
+  char *filepath;
+  int fd;                     /* once opened, until handed to the movie */
+  struct AtomMovie *movie;
+  char error[1024];
+  struct AtomScanJob *next;
+};
+
+struct AtomScanQueue {
+  struct AtomScanJob *head;
+  struct AtomScanJob *tail;
+  uint32_t count;
+};
+
+struct AtomScan {
+  char *root;
+  char *pattern;
+  uint32_t thread_count;
+  struct AtomScanQueue found;
+  struct AtomScanQueue opened;
+  struct AtomScanQueue done;
+  uint32_t pending;           /* found and not yet taken */
+  int walking;
+  int cancelled;
+  int interrupted;
+  pthread_t walker;
+  int walker_started;
+  pthread_t *workers;
+  uint32_t started;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
+
+/*
+  A movie read from a stream, such as a pipe, see atom_stream.c. Only the
+  moov atom is held in memory, the other top level atoms are skipped.
+*/
+#define ATOM_STREAM_CHUNK_SIZE (256 << 10)  /* most bytes asked for at a time */
+#define ATOM_STREAM_BUFFER_LIMIT (64 << 20) /* largest moov atom read unless told otherwise */
+
+struct AtomStream {
+  uint64_t offset;            /* bytes of the stream read so far */
+  uint64_t buffer_limit;
+  unsigned char header[16];   /* of the atom being read */
+  uint32_t header_length;
+  uint64_t remaining;         /* bytes of the atom's payload not read yet */
+  struct Atom *atoms;         /* top level atoms, without their payloads */
+  struct Atom **tail;
+  struct Atom *moov;
+  unsigned char *buffer;      /* of the moov atom, header included */
+  uint64_t buffer_length;
+};
+
+/*
+  A persistent cache of probe reports keyed by the identity of the file 
+  they are of, see atom_cache.c. Only the owner (the thread holding the 
+  interpreter lock) maps and unmaps the cache file, the background 
+  compaction retires the map it replaces.
+*/
+#define ATOM_CACHE_VERSION 1
+#define ATOM_CACHE_HEADER_SIZE 16
+#define ATOM_CACHE_RECORD_HEADER_SIZE 48
+#define ATOM_CACHE_COMPACT_SIZE (1 << 20)  /* superseded bytes before the cache is compacted */
+
+struct AtomCacheKey {
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  int64_t mtime;             /* nanoseconds */
+};
+
+struct AtomCacheEntry {
+  struct AtomCacheKey key;
+  uint64_t offset;           /* of the record, 0 when the slot is empty */
+  uint32_t size;
+};
+
+struct AtomCacheIndex {
+  struct AtomCacheEntry *entries;  /* open addressing by device and inode */
+  uint32_t capacity;
+  uint32_t count;
+  uint64_t live_bytes;
+};
+
+struct AtomProbeCache {
+  char *path;
+  int fd;
+  unsigned char *map;
+  size_t map_size;
+  unsigned char *retired_map;      /* replaced by a compaction, unmapped by the owner */
+  size_t retired_size;
+  uint64_t end;                    /* of the valid records */
+  struct AtomCacheIndex index;
+  pthread_mutex_t lock;
+  pthread_t compactor;
+  pthread_cond_t finished;         /* signalled when a compaction is done */
+  int compacting;
+  int compacted;                   /* -1 while running, then whether the file was replaced */
+  struct AtomCacheEntry *snapshot; /* live records when the compaction started */
+  uint32_t snapshot_count;
+  uint64_t snapshot_end;
+  int snapshot_fd;
+  uint64_t snapshot_inode;
+};
+
+struct AtomMovie *atom_movie_open(const char *filepath, char *error, size_t error_size);
+struct AtomMovie *atom_movie_probe(const char *filepath, char *error, size_t error_size);
+struct AtomMovie *atom_movie_probe_fd(int fd, const char *filepath, char *error, size_t error_size);
+struct AtomMovie *atom_movie_empty(void);
+struct AtomMovie *atom_movie_load(struct AtomMovie *movie, const char *filepath, char *error, size_t error_size);
+int atom_movie_refresh(struct AtomMovie *movie, uint32_t *count, char *error, size_t error_size);
+void atom_movie_retain(struct AtomMovie *movie);
+void atom_movie_free(struct AtomMovie *movie);
+void atom_track_free(struct AtomTrack *track);
+struct AtomTrack *atom_movie_track(struct AtomMovie *movie, uint32_t index);
+uint32_t atom_track_sample_count(struct AtomTrack *track);
+struct AtomSampleIndex *atom_track_sample_index(struct AtomTrack *track);
+void atom_sample_index_free(struct AtomSampleIndex *index);
+int64_t atom_sample_at_time(struct AtomSampleIndex *index, int64_t time);
+int64_t atom_sync_sample_before(struct AtomSampleIndex *index, uint32_t sample);
+int atom_sample_is_sync(struct AtomSampleIndex *index, uint32_t sample);
+int atom_track_frame_timing(struct AtomTrack *track, struct AtomFrameTiming *timing);
+const unsigned char *atom_movie_bytes(struct AtomMovie *movie, uint64_t offset, uint64_t length);
+void atom_movie_advise_sequential(struct AtomMovie *movie, uint64_t start, uint64_t end);
+struct Atom *atom_find(struct Atom *atom, uint32_t type);
+int atom_load_children(struct AtomMovie *movie, struct Atom *atom);
+const unsigned char *atom_data(struct AtomMovie *movie, struct Atom *atom);
+void atom_track_bounds(struct AtomTrack *track, double *left, double *top, double *right, double *bottom);
+void atom_movie_bounds(struct AtomMovie *movie, double *left, double *top, double *right, double *bottom);
+int64_t atom_track_offset(struct AtomTrack *track);
+
+/* editing, see atom_edit.c */
+void atom_edits_release(struct AtomTrack *track, struct AtomEdit *edits, uint32_t count);
+int atom_movie_load_tracks(struct AtomMovie *movie);
+int atom_movie_insert(struct AtomMovie *movie, int64_t time, struct AtomMovie *src);
+int atom_movie_add(struct AtomMovie *movie, int64_t time, int64_t duration, struct AtomMovie *src);
+int atom_movie_delete(struct AtomMovie *movie, int64_t start, int64_t duration);
+struct AtomMovie *atom_movie_copy(struct AtomMovie *movie, int64_t start, int64_t duration);
+int atom_track_set_offset(struct AtomTrack *track, int64_t offset);
+int atom_movie_delete_track(struct AtomMovie *movie, struct AtomTrack *track);
+
+/* writing, see atom_write.c */
+int atom_movie_flatten(struct AtomMovie *movie, const char *filepath, const struct AtomFlattenOptions *options, char *error, size_t error_size);
+int atom_movie_seek_report(struct AtomMovie *movie, const struct AtomFlattenOptions *options, struct AtomSeekReport *current, struct AtomSeekReport *planned, char *error, size_t error_size);
+int atom_file_faststart(const char *filepath, int *moved, volatile int *cancelled, char *error, size_t error_size);
+int atom_movie_save(struct AtomMovie *movie, const char *filepath, uint64_t padding, char *error, size_t error_size);
+int atom_sequence_write(struct AtomSequence *sequence, const char *filepath, char *error, size_t error_size);
+int atom_movie_save_metadata(struct AtomMovie *movie, const char *filepath, const struct AtomMetadataEntry *changes, uint32_t count, uint64_t padding, char *error, size_t error_size);
+int atom_movie_save_chapters(struct AtomMovie *movie, const char *filepath, const struct AtomChapter *chapters, uint32_t count, uint64_t padding, char *error, size_t error_size);
+
+struct AtomProbeBatch *atom_probe_batch_new(uint32_t count);
+void atom_probe_batch_free(struct AtomProbeBatch *batch);
+void atom_probe_many(struct AtomProbeBatch *batch, uint32_t thread_count);
+void atom_probe_cancel(void *batch);
+
+/* audio levels, see atom_audio.c */
+int atom_track_audio_levels(struct AtomTrack *track, struct AtomAudioLevels *levels, char *error, size_t error_size);
+void atom_audio_levels_free(struct AtomAudioLevels *levels);
+double atom_audio_loudness(const struct AtomAudioLevels *levels, const double *weights);
+int atom_track_waveform(struct AtomTrack *track, const char *sidecar, struct AtomWaveform *waveform, char *error, size_t error_size);
+void atom_waveform_free(struct AtomWaveform *waveform);
+void atom_waveform_buckets(const struct AtomWaveform *waveform, uint32_t channel, uint32_t count, double *mins, double *maxs);
+
+/* fingerprinting, see atom_hash.c */
+struct AtomFingerprintBatch *atom_fingerprint_batch_new(struct AtomTrack **tracks, uint32_t count, int algorithm, char *error, size_t error_size);
+void atom_fingerprint_batch_free(struct AtomFingerprintBatch *batch);
+int atom_fingerprint_many(struct AtomFingerprintBatch *batch, uint32_t thread_count);
+void atom_fingerprint_cancel(void *batch);
+uint32_t atom_crc32c(uint32_t crc, const unsigned char *p, size_t length);
+
+/* still images, see atom_image.c */
+int atom_image_format(uint32_t codec);
+int atom_image_description_format(const struct AtomSampleDescription *description);
+unsigned char *atom_image_sample(const struct AtomSampleDescription *description, const unsigned char *p, size_t size, size_t *length);
+int atom_movie_image_locate(struct AtomMovie *movie, struct AtomImageFrame *frame);
+int atom_movie_image_frames(struct AtomMovie *movie, struct AtomImageFrame *frames, uint32_t count, volatile int *cancelled, char *error, size_t error_size);
+void atom_image_frames_free(struct AtomImageFrame *frames, uint32_t count);
+
+/* image sequences, see atom_sequence.c */
+struct AtomSequence *atom_sequence_new(uint32_t count, uint32_t time_scale, uint32_t frame_duration);
+void atom_sequence_free(struct AtomSequence *sequence);
+int atom_sequence_inspect(struct AtomSequence *sequence, uint32_t thread_count);
+void atom_sequence_cancel(void *sequence);
+struct AtomSequenceExport *atom_sequence_export_new(struct AtomTrack *track, uint32_t first, uint32_t count);
+void atom_sequence_export_free(struct AtomSequenceExport *export);
+int atom_sequence_export(struct AtomSequenceExport *export, uint32_t thread_count);
+void atom_sequence_export_cancel(void *export);
+
+/* text and chapters, see atom_text.c */
+int atom_text_description(const struct AtomSampleDescription *description);
+char *atom_text_string(const unsigned char *p, size_t count, size_t *length);
+char *atom_text_decode(const unsigned char *p, size_t size, size_t *length);
+int64_t atom_track_movie_time(struct AtomTrack *track, int64_t media_time);
+int atom_track_refers(struct AtomTrack *track, uint32_t type, uint32_t id);
+int atom_track_is_chapters(struct AtomTrack *track);
+struct AtomTrack *atom_movie_chapter_track(struct AtomMovie *movie);
+
+/* fragmented movies, see atom_fragment.c */
+int atom_movie_init_fragments(struct AtomMovie *movie);
+int atom_movie_read_fragments(struct AtomMovie *movie, uint32_t *count);
+
+/* streams, see atom_stream.c */
+void atom_stream_init(struct AtomStream *stream, uint64_t buffer_limit);
+size_t atom_stream_wanted(struct AtomStream *stream);
+int atom_stream_feed(struct AtomStream *stream, const unsigned char *bytes, size_t length, char *error, size_t error_size);
+struct AtomMovie *atom_stream_movie(struct AtomStream *stream, const char *name, char *error, size_t error_size);
+void atom_stream_free(struct AtomStream *stream);
+
+/* metadata, see atom_meta.c */
+extern const struct AtomMetadataField atom_metadata_fields[];
+const struct AtomMetadataField *atom_metadata_field(const char *name);
+const unsigned char *atom_meta_child(const unsigned char *p, const unsigned char *end, uint32_t *type, const unsigned char **payload, uint64_t *length);
+uint64_t atom_meta_body(const unsigned char *payload, uint64_t length);
+int atom_movie_metadata(struct AtomMovie *movie, struct AtomMetadata *metadata);
+void atom_metadata_free(struct AtomMetadata *metadata);
+
+/* scanning, see atom_scan.c */
+struct AtomScan *atom_scan_start(const char *root, const char *pattern, uint32_t thread_count, char *error, size_t error_size);
+struct AtomScanJob *atom_scan_next(struct AtomScan *scan);
+void atom_scan_interrupt(void *scan);
+void atom_scan_job_free(struct AtomScanJob *job);
+void atom_scan_free(struct AtomScan *scan);
+
+/* probe cache, see atom_cache.c */
+void atom_cache_key_from_stat(const struct stat *info, struct AtomCacheKey *key);
+struct AtomProbeCache *atom_probe_cache_open(const char *path, char *error, size_t error_size);
+void atom_probe_cache_close(struct AtomProbeCache *cache);
+int atom_probe_cache_find(struct AtomProbeCache *cache, const struct AtomCacheKey *key, const unsigned char **value, uint32_t *length, char *error, size_t error_size);
+int atom_probe_cache_store(struct AtomProbeCache *cache, const struct AtomCacheKey *key, const char *path, const unsigned char *value, uint32_t length, char *error, size_t error_size);
+int atom_probe_cache_compact(struct AtomProbeCache *cache);
+int atom_probe_cache_wait(struct AtomProbeCache *cache);
+uint32_t atom_probe_cache_size(struct AtomProbeCache *cache);
+
+
+/*** REPORT ***/
+
+/*
+  Keys of the report hashes, see report.c. REPORT_ELEMENT appends to the 
+  enclosing array instead.
+*/
+enum ReportKey {
+  REPORT_ELEMENT = -1,
+  REPORT_DURATION, REPORT_TIME_SCALE, REPORT_WIDTH, REPORT_HEIGHT, REPORT_BOUNDS,
+  REPORT_LEFT, REPORT_TOP, REPORT_RIGHT, REPORT_BOTTOM, REPORT_TRACKS, REPORT_ID,
+  REPORT_MEDIA_TYPE, REPORT_CODEC, REPORT_FRAME_COUNT, REPORT_ENABLED, REPORT_OFFSET,
+  REPORT_FRAME_RATE, REPORT_ENCODED_PIXEL_DIMENSIONS, REPORT_DISPLAY_PIXEL_DIMENSIONS,
+  REPORT_PIXEL_ASPECT_RATIO, REPORT_VOLUME, REPORT_CHANNEL_MAP, REPORT_ASSIGNMENT,
+  REPORT_MESSAGE,
+  REPORT_KEY_COUNT
+};
+
+#define REPORT_MAX_DEPTH 8
+
+/*
+  Writes a report as Ruby hashes, or as JSON into one string when json 
+  is set. Lives on the stack while the report is written.
+*/
+struct ReportWriter {
+  VALUE json;                          /* Qnil when writing hashes */
+  VALUE result;
+  VALUE containers[REPORT_MAX_DEPTH];  /* open hashes and arrays */
+  int arrays[REPORT_MAX_DEPTH];        /* whether each open container is an array */
+  int counts[REPORT_MAX_DEPTH];        /* values written into each, for JSON commas */
+  int depth;
+};
+
+void Init_quicktime_report();
+void report_writer_init(struct ReportWriter *writer, int json);
+VALUE report_writer_result(struct ReportWriter *writer);
+void report_begin_hash(struct ReportWriter *writer, int key);
+void report_begin_array(struct ReportWriter *writer, int key);
+void report_end(struct ReportWriter *writer);
+void report_value(struct ReportWriter *writer, int key, VALUE value);
+void report_string(struct ReportWriter *writer, int key, const char *str);
+
 
 /*** MOVIE ***/
 
 void Init_quicktime_movie();
-OSErr movie_progress_proc(Movie movie, short message, short operation, Fixed percent, VALUE proc);
+struct AtomMovie *movie_atoms(VALUE obj);
+VALUE movie_write_report(VALUE obj, int json);
+VALUE movie_image_format_symbol(int format);
 
 #define RMOVIE(obj) (Check_Type(obj, T_DATA), (struct RMovie*)DATA_PTR(obj))
+#define MOVIE_ATOMS(obj) (movie_atoms(obj))
+
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+OSErr movie_progress_proc(Movie movie, short message, short operation, Fixed percent, VALUE proc);
+
 #define MOVIE(obj) (RMOVIE(obj)->movie)
 #define MOVIE_TIME(obj, seconds) (floor(NUM2DBL(seconds)*GetMovieTimeScale(MOVIE(obj))))
+#endif
 
 struct RMovie {
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
   Movie movie;
   short resId;
+#endif
   char *filepath;
+  struct AtomMovie *atoms;
+  unsigned long edit_count;  /* bumped by every edit, see track_descriptions */
+  unsigned long saved_edit_count;
+  int64_t selection_start;    /* native selection in movie time scale */
+  int64_t selection_duration;
 };
 
 
 /*** TRACK ***/
 
 void Init_quicktime_track();
+struct AtomTrack *track_atoms(VALUE obj);
+VALUE track_fingerprints(struct AtomTrack **tracks, uint32_t count, VALUE options);
+void track_write_reports(VALUE movie_obj, int count, struct ReportWriter *writer);
 
 #define RTRACK(obj) (Check_Type(obj, T_DATA), (struct RTrack*)DATA_PTR(obj))
+#define TRACK_ATOMS(obj) (track_atoms(obj))
+
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
 #define TRACK(obj) (RTRACK(obj)->track)
 #define TRACK_MEDIA(obj) (GetTrackMedia(TRACK(obj)))
 #define TRACK_TIME(obj, seconds) (floor(NUM2DBL(seconds)*GetMediaTimeScale(TRACK_MEDIA(obj))))
+#endif
 
 struct RTrack {
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
   Track track;
+  struct AtomSampleDescription *descriptions;
+  uint32_t description_count;
+  unsigned long edit_count;  /* of the movie when descriptions were cached */
+#endif
+  VALUE movie;
+  struct AtomTrack *atoms;
+};
+
+
+/*** PROBE CACHE ***/
+
+void Init_quicktime_probe_cache();
+VALUE probe_cache_current(void);
+VALUE probe_cache_movie_report(VALUE obj, VALUE movie_obj);
+
+#define RPROBE_CACHE(obj) (Check_Type(obj, T_DATA), (struct RProbeCache*)DATA_PTR(obj))
+
+struct RProbeCache {
+  struct AtomProbeCache *cache;
+  struct AtomProbeCache *closing;  /* closed while compact waits, freed by the last waiter */
+  int waiting;
+};
+
+
+/*** SCANNER ***/
+
+void Init_quicktime_scanner();
+
+#define RSCANNER(obj) (Check_Type(obj, T_DATA), (struct RScanner*)DATA_PTR(obj))
+
+struct RScanner {
+  struct AtomScan *scan;
 };
 
 
 /*** EXPORTER ***/
 
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
 void Init_quicktime_exporter();
 
 #define REXPORTER(obj) (Check_Type(obj, T_DATA), (struct RExporter*)DATA_PTR(obj))
@@ -45,3 +901,4 @@ void Init_quicktime_exporter();
 struct RExporter {
   QTAtomContainer settings;
 };
+#endif
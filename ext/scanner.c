@@ -0,0 +1,134 @@
+#include "rmov_ext.h"
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#endif
+
+VALUE cScanner;
+
+static void scanner_free(struct RScanner *rScanner)
+{
+  if (rScanner->scan) {
+    atom_scan_free(rScanner->scan);
+  }
+}
+
+static void scanner_mark(struct RScanner *rScanner)
+{
+}
+
+/*
+  call-seq: new() -> scanner
+
+  Creates a new scanner instance. Usually you go through QuickTime.scan.
+*/
+static VALUE scanner_new(VALUE klass)
+{
+  struct RScanner *rScanner;
+  return Data_Make_Struct(klass, struct RScanner, scanner_mark, scanner_free, rScanner);
+}
+
+/*
+  call-seq: start(directory, pattern, thread_count) -> scanner
+
+  Starts scanning the directory tree for files whose name matches the
+  pattern (as in File.fnmatch) on thread_count native threads. Usually
+  you go through QuickTime.scan.
+*/
+static VALUE scanner_start(VALUE obj, VALUE directory, VALUE pattern, VALUE thread_count)
+{
+  char error[1024];
+
+  if (RSCANNER(obj)->scan)
+    rb_raise(eQuickTime, "Scan has already been started.");
+  RSCANNER(obj)->scan = atom_scan_start(StringValueCStr(directory), StringValueCStr(pattern), NUM2UINT(thread_count), error, sizeof(error));
+  if (!RSCANNER(obj)->scan)
+    rb_raise(eQuickTime, "%s", error);
+  return obj;
+}
+
+static void *scanner_next_run(void *scan)
+{
+  return atom_scan_next((struct AtomScan*)scan);
+}
+
+/*
+  call-seq: next_movie() -> [filepath, movie or error] or nil
+
+  Waits for the next file to be probed and returns its path along with
+  the probed movie, or the QuickTime::Error which occurred reading it.
+  Files are returned in the order they complete. Returns nil once all
+  files have been returned.
+*/
+static VALUE scanner_next_movie(VALUE obj)
+{
+  struct AtomScan *scan = RSCANNER(obj)->scan;
+  struct AtomScanJob *job;
+  VALUE filepath, movie_obj;
+
+  if (!scan)
+    rb_raise(eQuickTime, "Scan has not been started or was closed.");
+  for (;;) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    job = (struct AtomScanJob*)rb_thread_call_without_gvl(scanner_next_run, scan, atom_scan_interrupt, scan);
+#else
+    job = atom_scan_next(scan);
+#endif
+    if (job || !scan->interrupted) break;
+    scan->interrupted = 0;
+    rb_thread_check_ints();
+  }
+  if (!job)
+    return Qnil;
+
+  filepath = rb_str_new2(job->filepath);
+  if (job->movie) {
+    movie_obj = rb_obj_alloc(cMovie);
+    RMOVIE(movie_obj)->atoms = job->movie;
+    RMOVIE(movie_obj)->filepath = job->filepath;
+    job->movie = NULL;
+    job->filepath = NULL;
+  } else {
+    movie_obj = rb_exc_new2(eQuickTime, job->error);
+  }
+  atom_scan_job_free(job);
+
+  return rb_ary_new3(2, filepath, movie_obj);
+}
+
+static void *scanner_close_run(void *scan)
+{
+  atom_scan_free((struct AtomScan*)scan);
+  return NULL;
+}
+
+/*
+  call-seq: close()
+
+  Stops the scan, waiting for the files being probed to finish.
+*/
+static VALUE scanner_close(VALUE obj)
+{
+  struct AtomScan *scan = RSCANNER(obj)->scan;
+
+  if (scan) {
+    RSCANNER(obj)->scan = NULL;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(scanner_close_run, scan, NULL, NULL);
+#else
+    scanner_close_run(scan);
+#endif
+  }
+  return Qnil;
+}
+
+void Init_quicktime_scanner()
+{
+  VALUE mQuickTime;
+  mQuickTime = rb_define_module("QuickTime");
+  cScanner = rb_define_class_under(mQuickTime, "Scanner", rb_cObject);
+  rb_define_alloc_func(cScanner, scanner_new);
+  rb_define_method(cScanner, "start", scanner_start, 3);
+  rb_define_method(cScanner, "next_movie", scanner_next_movie, 0);
+  rb_define_method(cScanner, "close", scanner_close, 0);
+}
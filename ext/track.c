@@ -1,13 +1,29 @@
 #include "rmov_ext.h"
 
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#endif
+#ifdef HAVE_RUBY_ENCODING_H
+#include <ruby/encoding.h>
+#endif
+
 VALUE cTrack;
 
+static VALUE sym_audio, sym_video, sym_text, sym_unsupported;
+
 static void track_free(struct RTrack *rTrack)
 {
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  free(rTrack->descriptions);
+#endif
 }
 
 static void track_mark(struct RTrack *rTrack)
 {
+  rb_gc_mark(rTrack->movie);
 }
 
 /*
@@ -30,13 +46,56 @@ static VALUE track_new(VALUE klass)
 */
 static VALUE track_load(VALUE obj, VALUE movie_obj, VALUE index_obj)
 {
-  RTRACK(obj)->track = GetMovieIndTrack(MOVIE(movie_obj), NUM2INT(index_obj));
-  if (!RTRACK(obj)->track)
-    rb_raise(eQuickTime, "Unable to fetch track for movie at index %d", NUM2INT(index_obj));
+  int index = NUM2INT(index_obj);
+  
+  RTRACK(obj)->movie = movie_obj;
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (MOVIE(movie_obj)) {
+    RTRACK(obj)->track = GetMovieIndTrack(MOVIE(movie_obj), index);
+    if (!RTRACK(obj)->track)
+      rb_raise(eQuickTime, "Unable to fetch track for movie at index %d", index);
+    return obj;
+  }
+#endif
+  if (index < 1 || !(RTRACK(obj)->atoms = atom_movie_track(MOVIE_ATOMS(movie_obj), index-1)))
+    rb_raise(eQuickTime, "Unable to fetch track for movie at index %d", index);
   
   return obj;
 }
 
+/*
+  Returns the parsed atoms of the track, raising an error if the track 
+  has not been loaded. For a track loaded through QuickTime the atoms 
+  are looked up by track id in the parsed movie file.
+*/
+struct AtomTrack *track_atoms(VALUE obj)
+{
+  struct AtomMovie *movie;
+  uint32_t i;
+  
+  if (RTRACK(obj)->atoms) {
+    // the movie may have been disposed since this track was loaded
+    movie = RMOVIE(RTRACK(obj)->movie)->atoms;
+    for (i = 0; movie && i < movie->track_count; i++) {
+      if (movie->tracks[i] == RTRACK(obj)->atoms) return RTRACK(obj)->atoms;
+    }
+    rb_raise(eQuickTime, "Track is no longer part of a loaded movie.");
+  } else {
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+    if (TRACK(obj) && RTRACK(obj)->movie) {
+      movie = MOVIE_ATOMS(RTRACK(obj)->movie);
+      for (i = 0; i < movie->track_count; i++) {
+        if (atom_movie_track(movie, i) && movie->tracks[i]->id == (uint32_t)GetTrackID(TRACK(obj)))
+          RTRACK(obj)->atoms = movie->tracks[i];
+      }
+    }
+#endif
+    if (!RTRACK(obj)->atoms)
+      rb_raise(eQuickTime, "Track has not been loaded.");
+  }
+  return RTRACK(obj)->atoms;
+}
+
 /*
   call-seq: raw_duration() -> duration_int
   
@@ -45,7 +104,11 @@ static VALUE track_load(VALUE obj, VALUE movie_obj, VALUE index_obj)
 */
 static VALUE track_raw_duration(VALUE obj)
 {
-  return INT2NUM(GetMediaDuration(TRACK_MEDIA(obj)));
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj))
+    return INT2NUM(GetMediaDuration(TRACK_MEDIA(obj)));
+#endif
+  return ULL2NUM(TRACK_ATOMS(obj)->media_duration);
 }
 
 /*
@@ -56,7 +119,11 @@ static VALUE track_raw_duration(VALUE obj)
 */
 static VALUE track_time_scale(VALUE obj)
 {
-  return INT2NUM(GetMediaTimeScale(TRACK_MEDIA(obj)));
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj))
+    return INT2NUM(GetMediaTimeScale(TRACK_MEDIA(obj)));
+#endif
+  return UINT2NUM(TRACK_ATOMS(obj)->media_time_scale);
 }
 
 /*
@@ -66,7 +133,512 @@ static VALUE track_time_scale(VALUE obj)
 */
 static VALUE track_frame_count(VALUE obj)
 {
-  return INT2NUM(GetMediaSampleCount(TRACK_MEDIA(obj)));
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj))
+    return INT2NUM(GetMediaSampleCount(TRACK_MEDIA(obj)));
+#endif
+  return UINT2NUM(atom_track_sample_count(TRACK_ATOMS(obj)));
+}
+
+/*  helper function, returns the sample index of the track. It's built 
+    from the sample tables in the movie file the first time it's needed.
+*/
+static struct AtomSampleIndex *track_sample_index(VALUE obj)
+{
+  struct AtomTrack *atoms = TRACK_ATOMS(obj);
+  struct AtomSampleIndex *index = atom_track_sample_index(atoms);
+  
+  if (!index || !atoms->media_time_scale)
+    rb_raise(eQuickTime, "Unable to read sample tables of track %d", atoms->id);
+  return index;
+}
+
+/*  helper function, converts seconds to the time scale of the track media.
+*/
+static int64_t track_media_time(VALUE obj, VALUE seconds)
+{
+  // the tolerance keeps times such as 2.3 * 10 from flooring one unit short
+  return (int64_t)floor(NUM2DBL(seconds) * TRACK_ATOMS(obj)->media_time_scale + 1e-6);
+}
+
+/*  helper function, greatest common divisor for reducing frame rates.
+*/
+static uint64_t track_gcd(uint64_t a, uint64_t b)
+{
+  uint64_t t;
+  while (b) {
+    t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/*
+  call-seq: frame_timing() -> timing_hash
+  
+  Returns exact statistics of the frame (sample) durations of the track, 
+  read in one pass over its time to sample table:
+  
+  :frame_rate      [numerator, denominator] of the average frame rate, 
+                   such as [30000, 1001]
+  :constant        true if every frame has the same duration
+  :min_duration    shortest frame duration in seconds
+  :max_duration    longest frame duration in seconds
+  :mean_duration   average frame duration in seconds
+  :histogram       hash of frame durations in the track time_scale 
+                   to the number of frames with that duration
+*/
+static VALUE track_frame_timing(VALUE obj)
+{
+  struct AtomTrack *atoms = TRACK_ATOMS(obj);
+  struct AtomFrameTiming timing;
+  double time_scale = atoms->media_time_scale;
+  uint64_t numerator, denominator, divisor;
+  VALUE timing_hash, histogram;
+  uint32_t i;
+  
+  if (!atoms->media_time_scale || !atom_track_frame_timing(atoms, &timing))
+    rb_raise(eQuickTime, "Unable to read sample tables of track %d", atoms->id);
+  
+  histogram = rb_hash_new();
+  for (i = 0; i < timing.histogram_size; i++) {
+    rb_hash_aset(histogram, UINT2NUM(timing.histogram[i].duration), ULL2NUM(timing.histogram[i].count));
+  }
+  free(timing.histogram);
+  
+  timing_hash = rb_hash_new();
+  if (timing.sample_count && timing.total_duration) {
+    numerator = timing.sample_count * atoms->media_time_scale;
+    denominator = timing.total_duration;
+    divisor = track_gcd(numerator, denominator);
+    rb_hash_aset(timing_hash, ID2SYM(rb_intern("frame_rate")), rb_ary_new3(2, ULL2NUM(numerator / divisor), ULL2NUM(denominator / divisor)));
+  } else {
+    rb_hash_aset(timing_hash, ID2SYM(rb_intern("frame_rate")), Qnil);
+  }
+  rb_hash_aset(timing_hash, ID2SYM(rb_intern("constant")), timing.histogram_size == 1 ? Qtrue : Qfalse);
+  rb_hash_aset(timing_hash, ID2SYM(rb_intern("min_duration")), rb_float_new(timing.min_duration / time_scale));
+  rb_hash_aset(timing_hash, ID2SYM(rb_intern("max_duration")), rb_float_new(timing.max_duration / time_scale));
+  rb_hash_aset(timing_hash, ID2SYM(rb_intern("mean_duration")), rb_float_new(timing.sample_count ? timing.total_duration / time_scale / timing.sample_count : 0.0));
+  rb_hash_aset(timing_hash, ID2SYM(rb_intern("histogram")), histogram);
+  
+  return timing_hash;
+}
+
+/*
+  call-seq: sample_at(seconds) -> sample_number
+  
+  Returns the number (starting at 1) of the sample being decoded at the 
+  given time in the track media. Returns nil if the track has no samples.
+*/
+static VALUE track_sample_at(VALUE obj, VALUE seconds)
+{
+  struct AtomSampleIndex *index = track_sample_index(obj);
+  int64_t sample = atom_sample_at_time(index, track_media_time(obj, seconds));
+  
+  if (sample < 0)
+    return Qnil;
+  return ULL2NUM(sample + 1);
+}
+
+/*
+  call-seq: keyframe_before(seconds) -> sample_number
+  
+  Returns the number of the last key frame at or before the sample being 
+  decoded at the given time. Decoding has to start there to show that 
+  time. Returns nil if there is no such key frame.
+*/
+static VALUE track_keyframe_before(VALUE obj, VALUE seconds)
+{
+  struct AtomSampleIndex *index = track_sample_index(obj);
+  int64_t sample = atom_sample_at_time(index, track_media_time(obj, seconds));
+  
+  if (sample < 0 || (sample = atom_sync_sample_before(index, sample)) < 0)
+    return Qnil;
+  return ULL2NUM(sample + 1);
+}
+
+/*  helper function, describes a sample (starting at 0) of the index, see 
+    sample_info.
+*/
+static VALUE track_sample_info_hash(struct AtomSampleIndex *index, uint32_t sample, double time_scale)
+{
+  int64_t pts = index->dts[sample] + (index->cts_offsets ? index->cts_offsets[sample] : 0);
+  int64_t end = (sample + 1 < index->count) ? index->dts[sample + 1] : index->end_time;
+  VALUE info_hash = rb_hash_new();
+  
+  rb_hash_aset(info_hash, ID2SYM(rb_intern("offset")), ULL2NUM(index->offsets[sample]));
+  rb_hash_aset(info_hash, ID2SYM(rb_intern("size")), UINT2NUM(index->sizes[sample]));
+  rb_hash_aset(info_hash, ID2SYM(rb_intern("dts")), rb_float_new(index->dts[sample] / time_scale));
+  rb_hash_aset(info_hash, ID2SYM(rb_intern("pts")), rb_float_new(pts / time_scale));
+  rb_hash_aset(info_hash, ID2SYM(rb_intern("duration")), rb_float_new((end - index->dts[sample]) / time_scale));
+  rb_hash_aset(info_hash, ID2SYM(rb_intern("sync")), atom_sample_is_sync(index, sample) ? Qtrue : Qfalse);
+  return info_hash;
+}
+
+/*
+  call-seq: sample_info(sample_number) -> info_hash
+  
+  Returns a hash describing the given sample (starting at 1) with its 
+  :offset and :size in the movie file, its decode (:dts) and presentation 
+  (:pts) time and :duration in seconds, and whether it's a :sync sample 
+  which can be decoded on its own.
+*/
+static VALUE track_sample_info(VALUE obj, VALUE sample_number)
+{
+  struct AtomSampleIndex *index = track_sample_index(obj);
+  long number = NUM2LONG(sample_number);
+  
+  if (number < 1 || (unsigned long)number > index->count)
+    rb_raise(eQuickTime, "Sample %ld is out of range, the track has %u samples", number, index->count);
+  return track_sample_info_hash(index, number - 1, TRACK_ATOMS(obj)->media_time_scale);
+}
+
+/*  helper function, keeps a movie's mapping alive while strings pointing 
+    into it are around, see each_sample.
+*/
+static void track_mapping_free(void *movie)
+{
+  atom_movie_free((struct AtomMovie*)movie);
+}
+
+/*  helper function, reads a sample range from the range given to 
+    each_sample, clamped to the samples of the track.
+*/
+static void track_sample_range(VALUE range, uint32_t count, uint32_t *first, uint32_t *last)
+{
+  long from, to;
+  
+  *first = 1;
+  *last = count;
+  if (NIL_P(range)) return;
+  from = NUM2LONG(rb_funcall(range, rb_intern("begin"), 0));
+  to = NIL_P(rb_funcall(range, rb_intern("end"), 0)) ? (long)count : NUM2LONG(rb_funcall(range, rb_intern("end"), 0));
+  if (!NIL_P(rb_funcall(range, rb_intern("end"), 0)) && RTEST(rb_funcall(range, rb_intern("exclude_end?"), 0)))
+    to--;
+  if (from > 1) *first = from > (long)count ? count + 1 : (uint32_t)from;
+  if (to < (long)count) *last = to < 0 ? 0 : (uint32_t)to;
+}
+
+/*
+  call-seq: each_sample(range = nil) { |info_hash, data| ... }
+  
+  Yields each sample of the track, or those numbered in range (starting at 
+  1), with its sample_info hash (which also has the sample :number) and 
+  its data as a frozen string. The data is not copied, the strings point 
+  straight into the memory mapped movie file, which stays mapped as long 
+  as any of them are around. The kernel is told the samples are read in 
+  order so it reads ahead. For a probed movie the data is read instead.
+*/
+static VALUE track_each_sample(int argc, VALUE *argv, VALUE obj)
+{
+  VALUE range, mapping, info_hash, data;
+  struct AtomSampleIndex *index;
+  struct AtomMovie *movie;
+  const unsigned char *bytes;
+  uint64_t start = UINT64_MAX, end = 0;
+  uint32_t first, last, i, media_time_scale;
+  
+  rb_scan_args(argc, argv, "01", &range);
+#ifdef RETURN_ENUMERATOR
+  RETURN_ENUMERATOR(obj, argc, argv);
+#endif
+  index = track_sample_index(obj);
+  media_time_scale = TRACK_ATOMS(obj)->media_time_scale;
+  movie = ATOM_TRACK_MEDIA(TRACK_ATOMS(obj))->movie;
+  track_sample_range(range, index->count, &first, &last);
+  
+  // the movie may be disposed by the block, so it is held until the strings go
+  atom_movie_retain(movie);
+  mapping = Data_Wrap_Struct(0, 0, track_mapping_free, movie);
+  
+  for (i = first; i <= last; i++) {
+    if (index->offsets[i-1] < start) start = index->offsets[i-1];
+    if (index->offsets[i-1] + index->sizes[i-1] > end) end = index->offsets[i-1] + index->sizes[i-1];
+  }
+  atom_movie_advise_sequential(movie, start, end);
+  
+  for (i = first; i <= last; i++) {
+    info_hash = track_sample_info_hash(index, i - 1, media_time_scale);
+    rb_hash_aset(info_hash, ID2SYM(rb_intern("number")), UINT2NUM(i));
+    bytes = atom_movie_bytes(movie, index->offsets[i-1], index->sizes[i-1]);
+    if (movie->map && !bytes)
+      rb_raise(eQuickTime, "Sample %u is outside of the movie file", i);
+    if (bytes) {
+#ifdef HAVE_RB_STR_NEW_STATIC
+      data = rb_str_new_static((const char*)bytes, index->sizes[i-1]);
+      rb_ivar_set(data, rb_intern("mapping"), mapping);
+#else
+      data = rb_str_new((const char*)bytes, index->sizes[i-1]);
+#endif
+    } else {
+      data = rb_str_new(NULL, index->sizes[i-1]);
+      if (pread(movie->fd, RSTRING_PTR(data), index->sizes[i-1], index->offsets[i-1]) != (ssize_t)index->sizes[i-1])
+        rb_raise(eQuickTime, "Unable to read sample %u of the movie file", i);
+    }
+    OBJ_FREEZE(data);
+    rb_yield_values(2, info_hash, data);
+  }
+  RB_GC_GUARD(mapping);
+  return obj;
+}
+
+/*
+  call-seq: each_text_sample() { |text_hash| ... }
+  
+  Yields each sample of a text track, in the QuickTime 'text' or 3GPP 
+  'tx3g' format, as a hash with its :text (a UTF-8 string with newlines 
+  ending its lines), the :start time in the movie and :duration in 
+  seconds. The text is read straight from the sample data, styles are 
+  ignored. Empty samples, which leave gaps between subtitles, and samples 
+  the edits of the track don't show are skipped.
+*/
+static VALUE track_each_text_sample(VALUE obj)
+{
+  struct AtomTrack *atoms = TRACK_ATOMS(obj), *media = ATOM_TRACK_MEDIA(atoms);
+  struct AtomSampleIndex *index;
+  struct AtomMovie *movie = media->movie;
+  const unsigned char *bytes;
+  unsigned char *buffer;
+  VALUE mapping, text_hash, text;
+  int64_t start, end;
+  uint32_t i;
+  size_t length;
+  char *decoded;
+  
+#ifdef RETURN_ENUMERATOR
+  RETURN_ENUMERATOR(obj, 0, 0);
+#endif
+  if (media->sample_description_count == 0 || !atom_text_description(&media->sample_descriptions[0]))
+    rb_raise(eQuickTime, "Track %d is not a text track", atoms->id);
+  index = track_sample_index(obj);
+  
+  // the movie may be disposed by the block
+  atom_movie_retain(movie);
+  mapping = Data_Wrap_Struct(0, 0, track_mapping_free, movie);
+  
+  for (i = 0; i < index->count; i++) {
+    if (index->sizes[i] <= 2 || (start = atom_track_movie_time(atoms, index->dts[i])) < 0) continue;
+    end = (i + 1 < index->count ? index->dts[i + 1] : index->end_time) - index->dts[i];
+    end = start + (int64_t)((double)end * atoms->movie->time_scale / media->media_time_scale + 0.5);
+    
+    buffer = NULL;
+    if (!(bytes = atom_movie_bytes(movie, index->offsets[i], index->sizes[i]))) {
+      if (movie->map || !(buffer = (unsigned char*)malloc(index->sizes[i])))
+        rb_raise(eQuickTime, "Unable to read sample %u of the movie file", i + 1);
+      if (pread(movie->fd, buffer, index->sizes[i], index->offsets[i]) != (ssize_t)index->sizes[i]) {
+        free(buffer);
+        rb_raise(eQuickTime, "Unable to read sample %u of the movie file", i + 1);
+      }
+      bytes = buffer;
+    }
+    decoded = atom_text_decode(bytes, index->sizes[i], &length);
+    free(buffer);
+    if (!decoded)
+      rb_raise(rb_eNoMemError, "Unable to read text of sample %u", i + 1);
+    if (length == 0) {
+      free(decoded);
+      continue;
+    }
+    text = rb_str_new(decoded, length);
+    free(decoded);
+#ifdef HAVE_RUBY_ENCODING_H
+    rb_enc_associate(text, rb_utf8_encoding());
+#endif
+    
+    text_hash = rb_hash_new();
+    rb_hash_aset(text_hash, ID2SYM(rb_intern("text")), text);
+    rb_hash_aset(text_hash, ID2SYM(rb_intern("start")), rb_float_new((double)start / atoms->movie->time_scale));
+    rb_hash_aset(text_hash, ID2SYM(rb_intern("duration")), rb_float_new((double)(end - start) / atoms->movie->time_scale));
+    rb_yield(text_hash);
+  }
+  RB_GC_GUARD(mapping);
+  return obj;
+}
+
+/*  helper function, runs the fingerprint batch with the given number of threads.
+*/
+struct FingerprintArgs {
+  struct AtomFingerprintBatch *batch;
+  uint32_t thread_count;
+  int ok;
+};
+
+static void *track_fingerprints_run(void *arg)
+{
+  struct FingerprintArgs *args = (struct FingerprintArgs*)arg;
+  args->ok = atom_fingerprint_many(args->batch, args->thread_count);
+  return NULL;
+}
+
+/*
+  Fingerprints the sample data of the tracks on a pool of native threads 
+  without holding the Ruby interpreter lock and returns an array with the 
+  hex digest of each. The options are :algo (:xxh64 or :crc32c) and 
+  :threads (4 by default). See Track#fingerprint.
+*/
+VALUE track_fingerprints(struct AtomTrack **tracks, uint32_t count, VALUE options)
+{
+  struct FingerprintArgs args;
+  VALUE algo = Qnil, threads = Qnil, digests;
+  char error[1024], hex[17];
+  int algorithm = ATOM_FINGERPRINT_XXH64;
+  uint32_t i;
+  
+  if (!NIL_P(options)) {
+    Check_Type(options, T_HASH);
+    algo = rb_hash_aref(options, ID2SYM(rb_intern("algo")));
+    threads = rb_hash_aref(options, ID2SYM(rb_intern("threads")));
+  }
+  if (algo == ID2SYM(rb_intern("crc32c"))) {
+    algorithm = ATOM_FINGERPRINT_CRC32C;
+  } else if (!NIL_P(algo) && algo != ID2SYM(rb_intern("xxh64"))) {
+    rb_raise(rb_eArgError, "Unknown fingerprint algorithm %s, use :xxh64 or :crc32c", RSTRING_PTR(rb_inspect(algo)));
+  }
+  args.thread_count = NIL_P(threads) ? 4 : NUM2UINT(threads);
+  
+  if (!(args.batch = atom_fingerprint_batch_new(tracks, count, algorithm, error, sizeof(error))))
+    rb_raise(eQuickTime, "%s", error);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(track_fingerprints_run, &args, atom_fingerprint_cancel, args.batch);
+#else
+  track_fingerprints_run(&args);
+#endif
+  
+  if (!args.ok) {
+    if (args.batch->cancelled) {
+      atom_fingerprint_batch_free(args.batch);
+      rb_thread_check_ints();
+      rb_raise(eQuickTime, "Fingerprinting was interrupted.");
+    }
+    strcpy(error, args.batch->error);
+    atom_fingerprint_batch_free(args.batch);
+    rb_raise(eQuickTime, "%s", error);
+  }
+  
+  digests = rb_ary_new2(count);
+  for (i = 0; i < count; i++) {
+    if (algorithm == ATOM_FINGERPRINT_CRC32C) {
+      snprintf(hex, sizeof(hex), "%08x", (unsigned int)args.batch->digests[i]);
+    } else {
+      snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)args.batch->digests[i]);
+    }
+    rb_ary_push(digests, rb_str_new2(hex));
+  }
+  atom_fingerprint_batch_free(args.batch);
+  return digests;
+}
+
+/*
+  call-seq: fingerprint(options = {}) -> string
+  
+  Returns a hex digest of the sample data of the track. Only the bytes of 
+  the samples are hashed, in decode order, so the fingerprint stays the 
+  same when the movie is flattened, interleaved or fast started. All 
+  samples of the track media are hashed, edits are ignored. The data 
+  is split into shards of about 4 MB which are hashed on several threads. 
+  These options are supported.
+  
+  :algo     - :xxh64 (default) hashes the XXH64 digests of the shards, 
+              :crc32c is the CRC-32C of all the sample data
+  :threads  - number of threads hashing shards, 4 by default
+*/
+static VALUE track_fingerprint(int argc, VALUE *argv, VALUE obj)
+{
+  struct AtomTrack *atoms;
+  VALUE options;
+  
+  rb_scan_args(argc, argv, "01", &options);
+  atoms = TRACK_ATOMS(obj);
+  return rb_ary_entry(track_fingerprints(&atoms, 1, options), 0);
+}
+
+/*
+  call-seq: image_format() -> :jpeg, :png or nil
+  
+  Returns the format every frame of this video track can be written as 
+  without decoding it, see export_image_sequence. JPEG, PNG and 
+  Motion-JPEG frames are written as they are stored, uncompressed ones 
+  become PNG. Returns nil if the frames need decoding.
+*/
+static VALUE track_image_format(VALUE obj)
+{
+  struct AtomTrack *media = ATOM_TRACK_MEDIA(TRACK_ATOMS(obj));
+  int format = ATOM_IMAGE_NONE;
+  uint32_t i;
+  
+  if (media->handler_type != VideoMediaType) return Qnil;
+  for (i = 0; i < media->sample_description_count; i++) {
+    if (i == 0)
+      format = atom_image_description_format(&media->sample_descriptions[i]);
+    else if (atom_image_description_format(&media->sample_descriptions[i]) != format)
+      format = ATOM_IMAGE_NONE;
+  }
+  return format == ATOM_IMAGE_NONE ? Qnil : movie_image_format_symbol(format);
+}
+
+/*  helper function, writes the frames of an export with the given number 
+    of threads.
+*/
+struct ExportArgs {
+  struct AtomSequenceExport *export;
+  uint32_t thread_count;
+  int ok;
+};
+
+static void *track_write_image_sequence_run(void *arg)
+{
+  struct ExportArgs *args = (struct ExportArgs*)arg;
+  args->ok = atom_sequence_export(args->export, args->thread_count);
+  return NULL;
+}
+
+/*
+  call-seq: write_image_sequence(filepaths, first, thread_count)
+  
+  Writes the frames numbered from first (starting at 1) to an image file 
+  each at the filepaths, in the format given by image_format. The frames 
+  are read and written on a pool of native threads without holding the 
+  Ruby interpreter lock. Usually you go through export_image_sequence.
+*/
+static VALUE track_write_image_sequence(VALUE obj, VALUE filepaths, VALUE first, VALUE thread_count)
+{
+  struct ExportArgs args;
+  char error[1024];
+  long i;
+  
+  Check_Type(filepaths, T_ARRAY);
+  for (i = 0; i < RARRAY_LEN(filepaths); i++) {
+    StringValueCStr(RARRAY_PTR(filepaths)[i]);
+  }
+  if (NUM2UINT(first) < 1)
+    rb_raise(rb_eArgError, "Frames are numbered from 1");
+  track_sample_index(obj);
+  args.thread_count = NUM2UINT(thread_count);
+  
+  args.export = atom_sequence_export_new(TRACK_ATOMS(obj), NUM2UINT(first) - 1, RARRAY_LEN(filepaths));
+  if (!args.export)
+    rb_raise(eQuickTime, "Track %u has no frames %u to %u", TRACK_ATOMS(obj)->id, NUM2UINT(first), NUM2UINT(first) + (uint32_t)RARRAY_LEN(filepaths) - 1);
+  for (i = 0; i < RARRAY_LEN(filepaths); i++) {
+    args.export->filepaths[i] = strdup(RSTRING_PTR(RARRAY_PTR(filepaths)[i]));
+  }
+  
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(track_write_image_sequence_run, &args, atom_sequence_export_cancel, args.export);
+#else
+  track_write_image_sequence_run(&args);
+#endif
+  
+  if (args.export->cancelled) {
+    atom_sequence_export_free(args.export);
+    rb_thread_check_ints();
+    rb_raise(eQuickTime, "Exporting the image sequence was interrupted.");
+  }
+  snprintf(error, sizeof(error), "%s", args.export->error);
+  atom_sequence_export_free(args.export);
+  if (!args.ok)
+    rb_raise(eQuickTime, "%s", error);
+  return Qnil;
 }
 
 /*  helper function, returns media type of the track
@@ -74,7 +646,13 @@ static VALUE track_frame_count(VALUE obj)
 static OSType track_get_media_type(VALUE obj)
 {
   OSType media_type;
-  GetMediaHandlerDescription(TRACK_MEDIA(obj), &media_type, 0, 0);  
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj)) {
+    GetMediaHandlerDescription(TRACK_MEDIA(obj), &media_type, 0, 0);  
+    return media_type;
+  }
+#endif
+  media_type = TRACK_ATOMS(obj)->handler_type;
   return media_type;
 }
 
@@ -85,47 +663,133 @@ static OSType track_get_media_type(VALUE obj)
 */
 static VALUE track_media_type(VALUE obj)
 {
-  OSType media_type;
+  OSType media_type = track_get_media_type(obj);
   
-  GetMediaHandlerDescription(TRACK_MEDIA(obj), &media_type, 0, 0);
   if (media_type == SoundMediaType) {
-    return ID2SYM(rb_intern("audio"));
+    return sym_audio;
   } else if (media_type == VideoMediaType) {
-    return ID2SYM(rb_intern("video"));
+    return sym_video;
   } else if (media_type == TextMediaType) {
-    return ID2SYM(rb_intern("text"));
+    return sym_text;
   } else {
     return Qnil;
   }
 }
 
-/*  returns the ImageDescriptionHandle for the track.
-    If it's not a video track, return NULL
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+/*  helper function, reads the sample description at index (1 based) of 
+    the track media into desc.
 */
-static ImageDescriptionHandle track_image_description(VALUE obj)
+static OSErr track_read_description(VALUE obj, long index, struct AtomSampleDescription *desc)
 {
   OSErr osErr;
+  SampleDescriptionHandle sample_description = (SampleDescriptionHandle)NewHandle(sizeof(SampleDescription));
+  if (LMGetMemErr() != noErr)
+    return LMGetMemErr();
+  
+  GetMediaSampleDescription(TRACK_MEDIA(obj), index, sample_description);
+  osErr = GetMoviesError();
+  if (osErr != noErr) goto bail;
+  
+  desc->format = (*sample_description)->dataFormat;
+  desc->data_reference_index = (*sample_description)->dataRefIndex;
+  
+  if (track_get_media_type(obj) == VideoMediaType) {
+    ImageDescriptionHandle image_description = (ImageDescriptionHandle)sample_description;
+    UInt8 *codecStr = (*image_description)->name;
+    UInt8 length = codecStr[0] > 31 ? 31 : codecStr[0];
+    SInt32 width, height;
+    PixelAspectRatioImageDescriptionExtension dimension;
+    
+    memcpy(desc->compressor_name, codecStr+1, length);
+    desc->compressor_name[length] = '\0';
+    desc->width = (*image_description)->width;
+    desc->height = (*image_description)->height;
+    desc->depth = (*image_description)->depth;
+    
+    osErr = ICMImageDescriptionGetProperty(image_description, kQTPropertyClass_ImageDescription, kICMImageDescriptionPropertyID_DisplayWidth, sizeof(width), &width, NULL);
+    if (osErr != noErr) goto bail;
+    osErr = ICMImageDescriptionGetProperty(image_description, kQTPropertyClass_ImageDescription, kICMImageDescriptionPropertyID_DisplayHeight, sizeof(height), &height, NULL);
+    if (osErr != noErr) goto bail;
+    desc->display_width = width;
+    desc->display_height = height;
+    
+    osErr = ICMImageDescriptionGetProperty(image_description, kQTPropertyClass_ImageDescription, kICMImageDescriptionPropertyID_PixelAspectRatio, sizeof(dimension), &dimension, NULL);
+    if (osErr != noErr) goto bail;
+    desc->pasp_h_spacing = dimension.hSpacing;
+    desc->pasp_v_spacing = dimension.vSpacing;
+  } else if (track_get_media_type(obj) == SoundMediaType) {
+    SoundDescriptionHandle sound_description = (SoundDescriptionHandle)sample_description;
+    
+    desc->sound_version = (*sound_description)->version;
+    desc->channels = (*sound_description)->numChannels;
+    desc->sample_size = (*sound_description)->sampleSize;
+    desc->sample_rate = (*sound_description)->sampleRate / 65536.0;
+  }
+  
+  bail:
+    DisposeHandle((Handle)sample_description);
+    return osErr;
+}
 
-	/* restrict reporting to video track */
-  if (track_get_media_type(obj) != VideoMediaType)
-    return NULL;
+/*  helper function, returns all sample descriptions of a QuickTime track 
+    and sets count. They are read from the media the first time and again 
+    only after the movie has been edited.
+*/
+static struct AtomSampleDescription *track_descriptions(VALUE obj, uint32_t *count)
+{
+  struct RTrack *rTrack = RTRACK(obj);
+  unsigned long edit_count = RMOVIE(rTrack->movie)->edit_count;
+  struct AtomSampleDescription *descriptions;
+  uint32_t i, description_count;
+  OSErr osErr;
   
-	SampleDescriptionHandle sample_description = NULL;
-  sample_description = (SampleDescriptionHandle)NewHandle(sizeof(SampleDescription));
-  if (LMGetMemErr() != noErr) {
-    rb_raise(eQuickTime, "Memory Error %d when determining image description", LMGetMemErr());
-    return NULL;
+  if (!rTrack->descriptions || rTrack->edit_count != edit_count) {
+    free(rTrack->descriptions);
+    rTrack->descriptions = NULL;
+    
+    description_count = GetMediaSampleDescriptionCount(TRACK_MEDIA(obj));
+    descriptions = (struct AtomSampleDescription*)calloc(description_count ? description_count : 1, sizeof(struct AtomSampleDescription));
+    if (descriptions == NULL)
+      rb_raise(eQuickTime, "Memory Error when determining sample descriptions");
+    
+    for (i = 0; i < description_count; i++) {
+      osErr = track_read_description(obj, i+1, &descriptions[i]);
+      if (osErr != noErr) {
+        free(descriptions);
+        rb_raise(eQuickTime, "Movie Error %d when determining sample descriptions", osErr);
+      }
+    }
+    
+    rTrack->descriptions = descriptions;
+    rTrack->description_count = description_count;
+    rTrack->edit_count = edit_count;
   }
+  
+  *count = rTrack->description_count;
+  return rTrack->descriptions;
+}
+#endif
 
-	GetMediaSampleDescription(TRACK_MEDIA(obj), 1, sample_description);
-	osErr = GetMoviesError();
-  if (osErr != noErr) {
-    rb_raise(eQuickTime, "Movie Error %d when determining image description", osErr);
-    DisposeHandle((Handle)sample_description);
+/*  returns the first sample description of a video track.
+    If it's not a video track, return NULL
+*/
+static struct AtomSampleDescription *track_video_description(VALUE obj)
+{
+  struct AtomSampleDescription *descriptions;
+  uint32_t count;
+  
+  if (track_get_media_type(obj) != VideoMediaType)
     return NULL;
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj)) {
+    descriptions = track_descriptions(obj, &count);
+    return count ? &descriptions[0] : NULL;
   }
-  
-  return (ImageDescriptionHandle)sample_description;
+#endif
+  descriptions = TRACK_ATOMS(obj)->sample_descriptions;
+  count = TRACK_ATOMS(obj)->sample_description_count;
+  return count ? &descriptions[0] : NULL;
 }
 
 
@@ -136,18 +800,12 @@ static ImageDescriptionHandle track_image_description(VALUE obj)
 */
 static VALUE track_codec(VALUE obj)
 {
-	ImageDescriptionHandle image_description = track_image_description(obj);
-	
-	if (image_description == NULL)
+  struct AtomSampleDescription *description = track_video_description(obj);
+  
+  if (description == NULL)
     return Qnil;
-
-  UInt8 *codecStr = (*image_description)->name;
   
-  VALUE out_str = rb_str_new( (char*)codecStr+1, (UInt8)codecStr[0] );
-
-  DisposeHandle((Handle)image_description);
-
-  return out_str;
+  return rb_str_new2(description->compressor_name);
 }
 
 
@@ -158,16 +816,12 @@ static VALUE track_codec(VALUE obj)
 */
 static VALUE track_width(VALUE obj)
 {
-	ImageDescriptionHandle image_description = track_image_description(obj);
-	
-	if (image_description == NULL)
+  struct AtomSampleDescription *description = track_video_description(obj);
+  
+  if (description == NULL)
     return Qnil;
-
-  short width = (*image_description)->width;
   
-  DisposeHandle((Handle)image_description);
-
-  return INT2NUM(width);
+  return INT2NUM(description->width);
 }
 
 /*
@@ -177,16 +831,12 @@ static VALUE track_width(VALUE obj)
 */
 static VALUE track_height(VALUE obj)
 {
-	ImageDescriptionHandle image_description = track_image_description(obj);
-	
-	if (image_description == NULL)
+  struct AtomSampleDescription *description = track_video_description(obj);
+  
+  if (description == NULL)
     return Qnil;
-
-  short height = (*image_description)->height;
   
-  DisposeHandle((Handle)image_description);
-
-  return INT2NUM(height);
+  return INT2NUM(description->height);
 }
 
 
@@ -198,7 +848,11 @@ static VALUE track_height(VALUE obj)
 */
 static VALUE track_id(VALUE obj)
 {
-  return INT2NUM(GetTrackID(TRACK(obj)));
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj))
+    return INT2NUM(GetTrackID(TRACK(obj)));
+#endif
+  return UINT2NUM(TRACK_ATOMS(obj)->id);
 }
 
 /*
@@ -208,7 +862,16 @@ static VALUE track_id(VALUE obj)
 */
 static VALUE track_delete(VALUE obj)
 {
-  DisposeMovieTrack(TRACK(obj));
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj)) {
+    DisposeMovieTrack(TRACK(obj));
+    RMOVIE(RTRACK(obj)->movie)->edit_count++;
+    return Qnil;
+  }
+#endif
+  if (!atom_movie_delete_track(MOVIE_ATOMS(RTRACK(obj)->movie), TRACK_ATOMS(obj)))
+    rb_raise(eQuickTime, "Unable to delete track, the movie's tracks could not be read.");
+  RMOVIE(RTRACK(obj)->movie)->edit_count++;
   return Qnil;
 }
 
@@ -217,9 +880,16 @@ static VALUE track_delete(VALUE obj)
   
   Disables the track. See enabled? to determine if it's disabled already.
 */
-static VALUE track_disable(VALUE obj, VALUE boolean)
+static VALUE track_disable(VALUE obj)
 {
-  SetTrackEnabled(TRACK(obj), FALSE);
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj)) {
+    SetTrackEnabled(TRACK(obj), FALSE);
+    return obj;
+  }
+#endif
+  TRACK_ATOMS(obj)->flags &= ~1;
+  RMOVIE(RTRACK(obj)->movie)->edit_count++;
   return obj;
 }
 
@@ -228,9 +898,16 @@ static VALUE track_disable(VALUE obj, VALUE boolean)
   
   Enables the track. See enabled? to determine if it's enabled already.
 */
-static VALUE track_enable(VALUE obj, VALUE boolean)
+static VALUE track_enable(VALUE obj)
 {
-  SetTrackEnabled(TRACK(obj), TRUE);
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj)) {
+    SetTrackEnabled(TRACK(obj), TRUE);
+    return obj;
+  }
+#endif
+  TRACK_ATOMS(obj)->flags |= 1;
+  RMOVIE(RTRACK(obj)->movie)->edit_count++;
   return obj;
 }
 
@@ -239,9 +916,18 @@ static VALUE track_enable(VALUE obj, VALUE boolean)
   
   Returns true/false depending on if the track is enabled.
 */
-static VALUE track_enabled(VALUE obj, VALUE boolean)
+static VALUE track_enabled(VALUE obj)
 {
-  if (GetTrackEnabled(TRACK(obj)) == TRUE) {
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj)) {
+    if (GetTrackEnabled(TRACK(obj)) == TRUE) {
+      return Qtrue;
+    } else {
+      return Qfalse;
+    }
+  }
+#endif
+  if (TRACK_ATOMS(obj)->flags & 1) {
     return Qtrue;
   } else {
     return Qfalse;
@@ -255,7 +941,11 @@ static VALUE track_enabled(VALUE obj, VALUE boolean)
 */
 static VALUE track_get_volume(VALUE obj)
 {
-  return rb_float_new((double)GetTrackVolume(TRACK(obj))/0x0100);
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj))
+    return rb_float_new((double)GetTrackVolume(TRACK(obj))/0x0100);
+#endif
+  return rb_float_new((double)TRACK_ATOMS(obj)->volume/0x0100);
 }
 
 /*
@@ -265,7 +955,14 @@ static VALUE track_get_volume(VALUE obj)
 */
 static VALUE track_set_volume(VALUE obj, VALUE volume_obj)
 {
-  SetTrackVolume(TRACK(obj), (short)(0x0100*NUM2DBL(volume_obj)));
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj)) {
+    SetTrackVolume(TRACK(obj), (short)(0x0100*NUM2DBL(volume_obj)));
+    return Qnil;
+  }
+#endif
+  TRACK_ATOMS(obj)->volume = (int16_t)(0x0100*NUM2DBL(volume_obj));
+  RMOVIE(RTRACK(obj)->movie)->edit_count++;
   return Qnil;
 }
 
@@ -276,7 +973,13 @@ static VALUE track_set_volume(VALUE obj, VALUE volume_obj)
 */
 static VALUE track_get_offset(VALUE obj)
 {
-  return rb_float_new((double)GetTrackOffset(TRACK(obj))/GetMediaTimeScale(TRACK_MEDIA(obj)));
+  uint32_t time_scale;
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj))
+    return rb_float_new((double)GetTrackOffset(TRACK(obj))/GetMediaTimeScale(TRACK_MEDIA(obj)));
+#endif
+  time_scale = MOVIE_ATOMS(RTRACK(obj)->movie)->time_scale;
+  return rb_float_new(time_scale ? (double)atom_track_offset(TRACK_ATOMS(obj))/time_scale : 0.0);
 }
 
 /*
@@ -286,10 +989,22 @@ static VALUE track_get_offset(VALUE obj)
 */
 static VALUE track_set_offset(VALUE obj, VALUE seconds)
 {
-  SetTrackOffset(TRACK(obj), TRACK_TIME(obj, seconds));
+  struct AtomMovie *movie;
+  
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj)) {
+    SetTrackOffset(TRACK(obj), TRACK_TIME(obj, seconds));
+    return Qnil;
+  }
+#endif
+  movie = MOVIE_ATOMS(RTRACK(obj)->movie);
+  if (!atom_track_set_offset(TRACK_ATOMS(obj), (int64_t)floor(NUM2DBL(seconds)*movie->time_scale + 0.5)))
+    rb_raise(rb_eNoMemError, "Unable to allocate edit list");
+  RMOVIE(RTRACK(obj)->movie)->edit_count++;
   return Qnil;
 }
 
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
 /*
   call-seq: new_video_media()
   
@@ -301,6 +1016,7 @@ static VALUE track_set_offset(VALUE obj, VALUE seconds)
 static VALUE track_new_video_media(VALUE obj)
 {
   NewTrackMedia(TRACK(obj), VideoMediaType, 600, 0, 0);
+  RMOVIE(RTRACK(obj)->movie)->edit_count++;
   return obj;
 }
 
@@ -315,6 +1031,7 @@ static VALUE track_new_video_media(VALUE obj)
 static VALUE track_new_audio_media(VALUE obj)
 {
   NewTrackMedia(TRACK(obj), SoundMediaType, 44100, 0, 0);
+  RMOVIE(RTRACK(obj)->movie)->edit_count++;
   return obj;
 }
 
@@ -329,6 +1046,7 @@ static VALUE track_new_audio_media(VALUE obj)
 static VALUE track_new_text_media(VALUE obj)
 {
   NewTrackMedia(TRACK(obj), TextMediaType, 600, 0, 0);
+  RMOVIE(RTRACK(obj)->movie)->edit_count++;
   return obj;
 }
 
@@ -391,6 +1109,7 @@ static VALUE track_rotate(VALUE obj, VALUE degrees)
   SetTrackMatrix(TRACK(obj), &matrix);
   return obj;
 }
+#endif
 
 /*
   call-seq: bounds() -> bounds_hash
@@ -401,18 +1120,26 @@ static VALUE track_rotate(VALUE obj, VALUE degrees)
 static VALUE track_bounds(VALUE obj)
 {
   VALUE bounds_hash = rb_hash_new();
-  RgnHandle region;
-  Rect bounds;
-  region = GetTrackDisplayBoundsRgn(TRACK(obj));
-  GetRegionBounds(region, &bounds);
-  DisposeRgn(region);
-  rb_hash_aset(bounds_hash, ID2SYM(rb_intern("left")), INT2NUM(bounds.left));
-  rb_hash_aset(bounds_hash, ID2SYM(rb_intern("top")), INT2NUM(bounds.top));
-  rb_hash_aset(bounds_hash, ID2SYM(rb_intern("right")), INT2NUM(bounds.right));
-  rb_hash_aset(bounds_hash, ID2SYM(rb_intern("bottom")), INT2NUM(bounds.bottom));
+  double left, top, right, bottom;
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+  if (TRACK(obj)) {
+    RgnHandle region;
+    Rect bounds;
+    region = GetTrackDisplayBoundsRgn(TRACK(obj));
+    GetRegionBounds(region, &bounds);
+    DisposeRgn(region);
+    left = bounds.left; top = bounds.top; right = bounds.right; bottom = bounds.bottom;
+  } else
+#endif
+  atom_track_bounds(TRACK_ATOMS(obj), &left, &top, &right, &bottom);
+  rb_hash_aset(bounds_hash, ID2SYM(rb_intern("left")), INT2NUM((int)left));
+  rb_hash_aset(bounds_hash, ID2SYM(rb_intern("top")), INT2NUM((int)top));
+  rb_hash_aset(bounds_hash, ID2SYM(rb_intern("right")), INT2NUM((int)right));
+  rb_hash_aset(bounds_hash, ID2SYM(rb_intern("bottom")), INT2NUM((int)bottom));
   return bounds_hash;
 }
 
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
 /*
   call-seq: reset_transformations()
   
@@ -426,6 +1153,44 @@ static VALUE track_reset_transformations(VALUE obj)
   SetTrackMatrix(TRACK(obj), &matrix);
   return obj;
 }
+#endif
+
+/*  helper function, builds a channel layout from the 'chan' extension of
+    the track's sound description. Without one the layout is derived from
+    the channel count as QuickTime does.
+*/
+static AudioChannelLayout* track_atoms_audio_channel_layout(VALUE obj)
+{
+  struct AtomTrack *atoms = TRACK_ATOMS(obj);
+  struct AtomSampleDescription *description;
+  AudioChannelLayout *layout;
+  UInt32 x, count;
+
+  if (atoms->sample_description_count == 0)
+    rb_raise(eQuickTime, "Error %d when getting audio channel layout", -2041);
+  description = &atoms->sample_descriptions[0];
+  count = description->channel_description_count;
+
+  layout = (AudioChannelLayout*)calloc(1, sizeof(AudioChannelLayout) + count * sizeof(AudioChannelDescription));
+  if (layout == NULL)
+    rb_raise(eQuickTime, "Error %d when getting audio channel layout", -108);
+
+  if (description->has_channel_layout) {
+    layout->mChannelLayoutTag = description->channel_layout_tag;
+    layout->mChannelBitmap = description->channel_bitmap;
+    layout->mNumberChannelDescriptions = count;
+    for (x = 0; x < count; x++) {
+      layout->mChannelDescriptions[x].mChannelLabel = description->channel_labels[x];
+    }
+  } else if (description->channels == 1) {
+    layout->mChannelLayoutTag = kAudioChannelLayoutTag_Mono;
+  } else if (description->channels == 2) {
+    layout->mChannelLayoutTag = kAudioChannelLayoutTag_Stereo;
+  } else {
+    layout->mChannelLayoutTag = kAudioChannelLayoutTag_Unknown | description->channels;
+  }
+  return layout;
+}
 
 /*  helper function to return the channel layouts
     returns layout == NULL if there is a problem
@@ -435,6 +1200,11 @@ static AudioChannelLayout* track_get_audio_channel_layout(VALUE obj)
 	/* restrict reporting to audio track */
   if (track_get_media_type(obj) != SoundMediaType) return NULL;
 
+#ifndef HAVE_QUICKTIME_QUICKTIME_H
+  return track_atoms_audio_channel_layout(obj);
+#else
+  if (!TRACK(obj)) return track_atoms_audio_channel_layout(obj);
+
   UInt32 size = 0;
   OSErr osErr;
   AudioChannelLayout* layout = NULL;
@@ -458,6 +1228,7 @@ static AudioChannelLayout* track_get_audio_channel_layout(VALUE obj)
     rb_raise(eQuickTime, "Error %d when getting audio channel layout", osErr);
     free(layout);
     return NULL;
+#endif
 }
 
 /*
@@ -475,108 +1246,150 @@ static VALUE track_get_audio_channel_count(VALUE obj)
   return INT2NUM(numChannels);
 }
 
-// add a channel hash with a given value(v)
-#define ADD_CHANNEL(ary, c, v) c=rb_hash_new(); rb_ary_push(ary, c); rb_hash_aset(c, ID2SYM(rb_intern("assignment")), ID2SYM(rb_intern(v)))
+/*  audio channel labels rmov knows, with their symbols interned by 
+    Init_quicktime_track
+*/
+static struct {
+  UInt32 label;
+  const char *name;
+  VALUE symbol;
+} track_channel_labels[] = {
+  { kAudioChannelLabel_Left, "Left" },
+  { kAudioChannelLabel_Right, "Right" },
+  { kAudioChannelLabel_Center, "Center" },
+  { kAudioChannelLabel_LFEScreen, "LFEScreen" },
+  { kAudioChannelLabel_LeftSurround, "LeftSurround" },
+  { kAudioChannelLabel_RightSurround, "RightSurround" },
+  { kAudioChannelLabel_LeftCenter, "LeftCenter" },
+  { kAudioChannelLabel_RightCenter, "RightCenter" },
+  { kAudioChannelLabel_CenterSurround, "CenterSurround" },
+  { kAudioChannelLabel_LeftSurroundDirect, "LeftSurroundDirect" },
+  { kAudioChannelLabel_RightSurroundDirect, "RightSurroundDirect" },
+  { kAudioChannelLabel_TopCenterSurround, "TopCenterSurround" },
+  { kAudioChannelLabel_VerticalHeightLeft, "VerticalHeightLeft" },
+  { kAudioChannelLabel_VerticalHeightCenter, "VerticalHeightCenter" },
+  { kAudioChannelLabel_VerticalHeightRight, "VerticalHeightRight" },
+  { kAudioChannelLabel_TopBackLeft, "TopBackLeft" },
+  { kAudioChannelLabel_TopBackCenter, "TopBackCenter" },
+  { kAudioChannelLabel_TopBackRight, "TopBackRight" },
+  { kAudioChannelLabel_RearSurroundLeft, "RearSurroundLeft" },
+  { kAudioChannelLabel_RearSurroundRight, "RearSurroundRight" },
+  { kAudioChannelLabel_LeftWide, "LeftWide" },
+  { kAudioChannelLabel_RightWide, "RightWide" },
+  { kAudioChannelLabel_LFE2, "LFE2" },
+  { kAudioChannelLabel_LeftTotal, "LeftTotal" },
+  { kAudioChannelLabel_RightTotal, "RightTotal" },
+  { kAudioChannelLabel_HearingImpaired, "HearingImpaired" },
+  { kAudioChannelLabel_Narration, "Narration" },
+  { kAudioChannelLabel_Mono, "Mono" },
+  { kAudioChannelLabel_DialogCentricMix, "DialogCentricMix" },
+  { kAudioChannelLabel_CenterSurroundDirect, "CenterSurroundDirect" }
+};
+
+#define TRACK_CHANNEL_LABEL_COUNT (sizeof(track_channel_labels) / sizeof(track_channel_labels[0]))
+
+/*  channel labels of the layout tags rmov supports
+*/
+static const UInt32 track_mono_labels[] = { kAudioChannelLabel_Mono };
+static const UInt32 track_stereo_labels[] = { kAudioChannelLabel_Left, kAudioChannelLabel_Right };
+static const UInt32 track_matrix_stereo_labels[] = { kAudioChannelLabel_LeftTotal, kAudioChannelLabel_RightTotal };
+static const UInt32 track_smpte_dtv_labels[] = {
+  kAudioChannelLabel_Left, kAudioChannelLabel_Right, kAudioChannelLabel_Center,
+  kAudioChannelLabel_LFEScreen, kAudioChannelLabel_LeftSurround, kAudioChannelLabel_RightSurround,
+  kAudioChannelLabel_LeftTotal, kAudioChannelLabel_RightTotal
+};
+
+/*  helper function, returns the symbol of an audio channel label or nil 
+    if rmov doesn't support it.
+*/
+static VALUE track_symbol_for_AudioChannelLabel(UInt32 label)
+{
+  unsigned int i;
+  for (i = 0; i < TRACK_CHANNEL_LABEL_COUNT; i++) {
+    if (track_channel_labels[i].label == label)
+      return track_channel_labels[i].symbol;
+  }
+  return Qnil;
+}
 
-static char* track_str_for_AudioChannelLabel(label) {
-  
-  char *trackStr = NULL;
+/*  helper function, writes the hash of one channel: {:assignment => assignment} 
+    with a :message when it's unsupported.
+*/
+static void track_write_channel(struct ReportWriter *writer, VALUE assignment, const char *message)
+{
+  report_begin_hash(writer, REPORT_ELEMENT);
+  report_value(writer, REPORT_ASSIGNMENT, assignment);
+  if (message)
+    report_string(writer, REPORT_MESSAGE, message);
+  report_end(writer);
+}
+
+/*  helper function, writes the channel map of layout as an array at key.
+*/
+static void track_write_channel_map(AudioChannelLayout *layout, struct ReportWriter *writer, int key)
+{
+  UInt32 numChannels, x, highLayoutTag, labelCount = 0;
+  const UInt32 *labels = NULL;
+  VALUE assignment;
+  char message[256];
+  AudioChannelLayoutTag layoutTag = layout->mChannelLayoutTag;
   
-  switch (label) {
-    
-    case kAudioChannelLabel_Left:
-      trackStr = "Left";
-      break;
-    case kAudioChannelLabel_Right:
-      trackStr = "Right";
-      break;
-    case kAudioChannelLabel_Center:
-      trackStr = "Center";
-      break;
-    case kAudioChannelLabel_LFEScreen:
-      trackStr = "LFEScreen";
-      break;
-    case kAudioChannelLabel_LeftSurround:
-      trackStr = "LeftSurround";
-      break;
-    case kAudioChannelLabel_RightSurround:
-      trackStr = "RightSurround";
-      break;
-    case kAudioChannelLabel_LeftCenter:
-      trackStr = "LeftCenter";
-      break;
-    case kAudioChannelLabel_RightCenter:
-      trackStr = "RightCenter";
-      break;
-    case kAudioChannelLabel_CenterSurround:
-      trackStr = "CenterSurround";
-      break;
-    case kAudioChannelLabel_LeftSurroundDirect:
-      trackStr = "LeftSurroundDirect";
-      break;
-    case kAudioChannelLabel_RightSurroundDirect:
-      trackStr = "RightSurroundDirect";
-      break;
-    case kAudioChannelLabel_TopCenterSurround:
-      trackStr = "TopCenterSurround";
-      break;
-    case kAudioChannelLabel_VerticalHeightLeft:
-      trackStr = "VerticalHeightLeft";
-      break;
-    case kAudioChannelLabel_VerticalHeightCenter:
-      trackStr = "VerticalHeightCenter";
-      break;
-    case kAudioChannelLabel_VerticalHeightRight:
-      trackStr = "VerticalHeightRight";
-      break;
-    case kAudioChannelLabel_TopBackLeft:
-      trackStr = "TopBackLeft";
-      break;
-    case kAudioChannelLabel_TopBackCenter:
-      trackStr = "TopBackCenter";
-      break;
-    case kAudioChannelLabel_TopBackRight:
-      trackStr = "TopBackRight";
-      break;
-    case kAudioChannelLabel_RearSurroundLeft:
-      trackStr = "RearSurroundLeft";
-      break;
-    case kAudioChannelLabel_RearSurroundRight:
-      trackStr = "RearSurroundRight";
-      break;
-    case kAudioChannelLabel_LeftWide:
-      trackStr = "LeftWide";
-      break;
-    case kAudioChannelLabel_RightWide:
-      trackStr = "RightWide";
-      break;
-    case kAudioChannelLabel_LFE2:
-      trackStr = "LFE2";
-      break;
-    case kAudioChannelLabel_LeftTotal:
-      trackStr = "LeftTotal";
-      break;
-    case kAudioChannelLabel_RightTotal:
-      trackStr = "RightTotal";
-      break;
-    case kAudioChannelLabel_HearingImpaired:
-      trackStr = "HearingImpaired";
-      break;
-    case kAudioChannelLabel_Narration:
-      trackStr = "Narration";
-      break;
-    case kAudioChannelLabel_Mono:
-      trackStr = "Mono";
-      break;
-    case kAudioChannelLabel_DialogCentricMix:
-      trackStr = "DialogCentricMix";
-      break;
-    case kAudioChannelLabel_CenterSurroundDirect:
-      trackStr = "CenterSurroundDirect";
-      break;
-  }
-  
-  return trackStr;
+  report_begin_array(writer, key);
+  if (layoutTag == kAudioChannelLayoutTag_UseChannelDescriptions) {
+    // using the descriptions
+    numChannels = layout->mNumberChannelDescriptions;
+    for (x=0; x < numChannels; x++) {
+      assignment = track_symbol_for_AudioChannelLabel(layout->mChannelDescriptions[x].mChannelLabel);
+      if (assignment != Qnil) {
+        track_write_channel(writer, assignment, NULL);
+      } else {
+        // unsupported audio channel labels
+        sprintf(message, "ChannelLabel unsupported by rmov: %d", (int)layout->mChannelDescriptions[x].mChannelLabel);
+        track_write_channel(writer, sym_unsupported, message);
+      }
+    }
+  } else if (layoutTag == kAudioChannelLayoutTag_UseChannelBitmap) {
+    // use the bitmap approach
+    // not implemented
+    numChannels = AudioChannelLayoutTag_GetNumberOfChannels(layoutTag);
+    for (x=0; x < numChannels; x++) {
+      track_write_channel(writer, sym_unsupported, "UseChannelBitmap unsupported by rmov");
+    }
+  } else {
+    // using a standard LayoutTag
+    switch (layoutTag) {
+      case kAudioChannelLayoutTag_Mono:
+        labels = track_mono_labels;
+        labelCount = 1;
+        break;
+      case kAudioChannelLayoutTag_Stereo:
+        labels = track_stereo_labels;
+        labelCount = 2;
+        break;
+      case kAudioChannelLayoutTag_MatrixStereo:
+        labels = track_matrix_stereo_labels;
+        labelCount = 2;
+        break;
+      case kAudioChannelLayoutTag_SMPTE_DTV:
+        labels = track_smpte_dtv_labels;
+        labelCount = 8;
+        break;
+    }
+    if (labels) {
+      for (x=0; x < labelCount; x++) {
+        track_write_channel(writer, track_symbol_for_AudioChannelLabel(labels[x]), NULL);
+      }
+    } else {
+      // unsupported channels
+      numChannels = AudioChannelLayoutTag_GetNumberOfChannels(layoutTag);
+      highLayoutTag = (layoutTag & 0xff0000) >> 16;
+      sprintf(message, "layoutTag unsupported by rmov: (%dL << 16) | %d", (int)highLayoutTag, (int)numChannels);
+      for (x=0; x < numChannels; x++) {
+        track_write_channel(writer, sym_unsupported, message);
+      }
+    }
+  }
+  report_end(writer);
 }
 
 /*
@@ -589,101 +1402,229 @@ static char* track_str_for_AudioChannelLabel(label) {
 static VALUE track_get_audio_channel_map(VALUE obj)
 {
   AudioChannelLayout *layout = track_get_audio_channel_layout(obj);
+  struct ReportWriter writer;
   if (layout == NULL) return Qnil;
   
-  VALUE channels = Qnil;
-  UInt32 numChannels, x, highLayoutTag;
-  VALUE channel;
-  char message[256];
-  AudioChannelLayoutTag layoutTag = layout->mChannelLayoutTag;
+  report_writer_init(&writer, 0);
+  track_write_channel_map(layout, &writer, REPORT_ELEMENT);
+  free(layout);
   
-  if (layoutTag == kAudioChannelLayoutTag_UseChannelDescriptions) {
-    // using the descriptions
-    // not implemented
-    numChannels = layout->mNumberChannelDescriptions;
-    channels = rb_ary_new2(numChannels);
-    
-    // loop through all channels, adding assignment descriptions
-    AudioChannelDescription desc;
-    char *trackStr;
-    for (x=0; x < numChannels; x++) {
-      desc = layout->mChannelDescriptions[x];
-      trackStr = track_str_for_AudioChannelLabel(desc.mChannelLabel);
-
-      if (trackStr != NULL) {
-        ADD_CHANNEL(channels, channel, trackStr);
+  return report_writer_result(&writer);
+}
 
-      } else {
-         // unsupported audio channel labels
-         ADD_CHANNEL(channels, channel, "UnsupportedByRMov");
-         sprintf(message, "ChannelLabel unsupported by rmov: %d", (int)desc.mChannelLabel);
-         rb_hash_aset(channel, ID2SYM(rb_intern("message")), rb_str_new2(message));
-      }
-    }
-    
+/*  helper function, runs the measurement of a track.
+*/
+struct AudioLevelsArgs {
+  struct AtomTrack *track;
+  struct AtomAudioLevels levels;
+  int ok;
+  char error[1024];
+};
+
+static void *track_audio_levels_run(void *arg)
+{
+  struct AudioLevelsArgs *args = (struct AudioLevelsArgs*)arg;
+  args->ok = atom_track_audio_levels(args->track, &args->levels, args->error, sizeof(args->error));
+  return NULL;
+}
 
-  } else {
-    numChannels = AudioChannelLayoutTag_GetNumberOfChannels(layoutTag);
-    channels = rb_ary_new2(numChannels);
+static void track_audio_levels_cancel(void *arg)
+{
+  ((struct AudioLevelsArgs*)arg)->levels.cancelled = 1;
+}
 
-    if (layoutTag == kAudioChannelLayoutTag_UseChannelBitmap) {
-      // use the bitmap approach
-      // not implemented
-      //rb_raise(eQuickTime, "Not Implemented: kAudioChannelLayoutTag_UseChannelBitmap in track_get_audio_channel_map");
-      for (x=0; x < numChannels; x++) {
-        ADD_CHANNEL(channels, channel, "UnsupportedByRMov");
-        rb_hash_aset(channel, ID2SYM(rb_intern("message")), rb_str_new2("UseChannelBitmap unsupported by rmov"));
-      }
+/*  helper function, decibels relative to full scale.
+*/
+static VALUE track_decibels(double value)
+{
+  return rb_float_new(value > 0 ? 20 * log10(value) : -HUGE_VAL);
+}
 
+/*
+  call-seq: audio_levels() -> {:loudness => lufs, :channels => [channel_hash, ...]}
+  
+  Measures the levels of an uncompressed PCM audio track (lpcm, twos, 
+  sowt, in24, in32, fl32 or fl64) in a single pass over its samples, 
+  without holding the Ruby interpreter lock. Every sample of the track 
+  media is measured, edits are ignored. The :loudness is the EBU R128 
+  integrated loudness of all channels together in LUFS, weighted as in 
+  ITU-R BS.1770 (LFE left out, side surrounds at 1.41). Each channel hash 
+  is the one of channel_map with these keys added.
+  
+  :peak     - largest absolute sample, 1.0 is full scale
+  :peak_db  - peak in dBFS
+  :rms      - root mean square of the samples
+  :rms_db   - rms in dBFS
+  :loudness - integrated loudness of the channel alone in LUFS
+  
+  Silence is reported as -Infinity decibels.
+*/
+static VALUE track_audio_levels(VALUE obj)
+{
+  struct AudioLevelsArgs args;
+  VALUE channel_map, channels, channel, assignment, levels_hash;
+  double *weights, *alone, rms;
+  uint32_t c;
+  
+  memset(&args, 0, sizeof(struct AudioLevelsArgs));
+  args.track = TRACK_ATOMS(obj);
+  channel_map = track_get_audio_channel_map(obj);
+  // another thread may dispose of the movie while the samples are read
+  atom_movie_retain(args.track->movie);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(track_audio_levels_run, &args, track_audio_levels_cancel, &args);
+#else
+  track_audio_levels_run(&args);
+#endif
+  atom_movie_free(args.track->movie);
+  if (!args.ok) {
+    if (args.levels.cancelled) rb_thread_check_ints();
+    rb_raise(eQuickTime, "%s", args.error);
+  }
+  
+  weights = ALLOCA_N(double, args.levels.channels);
+  alone = ALLOCA_N(double, args.levels.channels);
+  channels = rb_ary_new2(args.levels.channels);
+  for (c = 0; c < args.levels.channels; c++) {
+    channel = NIL_P(channel_map) ? Qnil : rb_ary_entry(channel_map, c);
+    channel = NIL_P(channel) ? rb_hash_new() : rb_hash_dup(channel);
+    assignment = rb_hash_aref(channel, ID2SYM(rb_intern("assignment")));
+    if (assignment == ID2SYM(rb_intern("LFEScreen")) || assignment == ID2SYM(rb_intern("LFE2"))) {
+      weights[c] = 0;
+    } else if (assignment == ID2SYM(rb_intern("LeftSurround")) || assignment == ID2SYM(rb_intern("RightSurround")) ||
+               assignment == ID2SYM(rb_intern("LeftSurroundDirect")) || assignment == ID2SYM(rb_intern("RightSurroundDirect"))) {
+      weights[c] = 1.41;
+    } else {
+      weights[c] = 1.0;
+    }
+    
+    rms = args.levels.frames ? sqrt(args.levels.squares[c] / args.levels.frames) : 0;
+    memset(alone, 0, args.levels.channels * sizeof(double));
+    alone[c] = 1.0;
+    rb_hash_aset(channel, ID2SYM(rb_intern("peak")), rb_float_new(args.levels.peaks[c]));
+    rb_hash_aset(channel, ID2SYM(rb_intern("peak_db")), track_decibels(args.levels.peaks[c]));
+    rb_hash_aset(channel, ID2SYM(rb_intern("rms")), rb_float_new(rms));
+    rb_hash_aset(channel, ID2SYM(rb_intern("rms_db")), track_decibels(rms));
+    rb_hash_aset(channel, ID2SYM(rb_intern("loudness")), rb_float_new(atom_audio_loudness(&args.levels, alone)));
+    rb_ary_push(channels, channel);
+  }
+  
+  levels_hash = rb_hash_new();
+  rb_hash_aset(levels_hash, ID2SYM(rb_intern("loudness")), rb_float_new(atom_audio_loudness(&args.levels, weights)));
+  rb_hash_aset(levels_hash, ID2SYM(rb_intern("channels")), channels);
+  atom_audio_levels_free(&args.levels);
+  return levels_hash;
+}
 
+/*  helper function, fills in the waveform of a track.
+*/
+struct WaveformArgs {
+  struct AtomTrack *track;
+  const char *sidecar;
+  struct AtomWaveform waveform;
+  int ok;
+  char error[1024];
+};
+
+static void *track_waveform_run(void *arg)
+{
+  struct WaveformArgs *args = (struct WaveformArgs*)arg;
+  args->ok = atom_track_waveform(args->track, args->sidecar, &args->waveform, args->error, sizeof(args->error));
+  return NULL;
+}
 
-    } else {
-      // using a standard LayoutTag
-      switch (layoutTag) {
-
-        case kAudioChannelLayoutTag_Mono:
-          ADD_CHANNEL(channels, channel, "Mono");
-          break;
-        
-        case kAudioChannelLayoutTag_Stereo:
-          ADD_CHANNEL(channels, channel, "Left");
-          ADD_CHANNEL(channels, channel, "Right");
-          break;
-          
-        case kAudioChannelLayoutTag_MatrixStereo:
-          ADD_CHANNEL(channels, channel, "LeftTotal");
-          ADD_CHANNEL(channels, channel, "RightTotal");
-          break;
-          
-        case kAudioChannelLayoutTag_SMPTE_DTV:
-          ADD_CHANNEL(channels, channel, "Left");
-          ADD_CHANNEL(channels, channel, "Right");
-          ADD_CHANNEL(channels, channel, "Center");
-          ADD_CHANNEL(channels, channel, "LFEScreen");
-          ADD_CHANNEL(channels, channel, "LeftSurround");
-          ADD_CHANNEL(channels, channel, "RightSurround");
-          ADD_CHANNEL(channels, channel, "LeftTotal");
-          ADD_CHANNEL(channels, channel, "RightTotal");
-          break;
-
-        default:
-          // unsupported channels
-          highLayoutTag = (layoutTag & 0xff0000) >> 16;
-          sprintf(message, "layoutTag unsupported by rmov: (%dL << 16) | %d", (int)highLayoutTag, (int)numChannels);
-          for (x=0; x < numChannels; x++) {
-            ADD_CHANNEL(channels, channel, "UnsupportedByRMov");
-            rb_hash_aset(channel, ID2SYM(rb_intern("message")), rb_str_new2(message));
-          }
-          //rb_raise(eQuickTime, "Unsupported ChannelLayoutTag in track_get_audio_channel_map: %d", layoutTag);
-          break;
-      }
+static void track_waveform_cancel(void *arg)
+{
+  ((struct WaveformArgs*)arg)->waveform.cancelled = 1;
+}
 
+/*
+  call-seq: waveform(buckets, options = {}) -> [channel_hash, ...]
+  
+  Returns the waveform of an uncompressed PCM audio track split into the 
+  given number of buckets. Each channel hash is the one of channel_map 
+  with :min and :max arrays holding the lowest and highest sample (-1.0 to 
+  1.0) of each bucket.
+  
+  The first call reads every sample once and keeps a pyramid of minimum 
+  and maximum values, halving the resolution at each level, in a sidecar 
+  file next to the movie. Later calls for any number of buckets are 
+  served from the sidecar without touching the media, until the movie 
+  file changes. These options are supported.
+  
+  :sidecar - path of the sidecar file, false to not keep one. Defaults to 
+             the movie path followed by ".track<id>.waveform", which is 
+             skipped if it can't be written
+*/
+static VALUE track_waveform(int argc, VALUE *argv, VALUE obj)
+{
+  struct WaveformArgs args;
+  VALUE buckets, options, sidecar = Qnil, channel_map, channels, channel, mins, maxs;
+  const char *movie_path;
+  double *low, *high;
+  uint32_t count, c, i;
+  int explicit_sidecar = 0;
+  
+  rb_scan_args(argc, argv, "11", &buckets, &options);
+  count = NUM2UINT(buckets);
+  if (count == 0)
+    rb_raise(rb_eArgError, "buckets must be positive");
+  
+  memset(&args, 0, sizeof(struct WaveformArgs));
+  args.track = TRACK_ATOMS(obj);
+  channel_map = track_get_audio_channel_map(obj);
+  if (!NIL_P(options)) {
+    Check_Type(options, T_HASH);
+    if (RTEST(rb_funcall(options, rb_intern("has_key?"), 1, ID2SYM(rb_intern("sidecar"))))) {
+      sidecar = rb_hash_aref(options, ID2SYM(rb_intern("sidecar")));
+      explicit_sidecar = RTEST(sidecar);
+      if (!explicit_sidecar) sidecar = Qfalse;
     }
-
   }
+  movie_path = RMOVIE(RTRACK(obj)->movie)->filepath;
+  if (NIL_P(sidecar) && movie_path)
+    sidecar = rb_str_plus(rb_str_new2(movie_path), rb_sprintf(".track%u.waveform", args.track->id));
+  if (RTEST(sidecar))
+    args.sidecar = StringValueCStr(sidecar);
   
-  free(layout);
+  // another thread may dispose of the movie while the samples are read
+  atom_movie_retain(args.track->movie);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(track_waveform_run, &args, track_waveform_cancel, &args);
+#else
+  track_waveform_run(&args);
+#endif
+  atom_movie_free(args.track->movie);
+  RB_GC_GUARD(sidecar);
+  if (!args.ok) {
+    if (args.waveform.cancelled) rb_thread_check_ints();
+    rb_raise(eQuickTime, "%s", args.error);
+  }
+  if (explicit_sidecar && args.waveform.save_failed) {
+    atom_waveform_free(&args.waveform);
+    rb_raise(eQuickTime, "Unable to write waveform sidecar %s", args.sidecar);
+  }
   
+  low = ALLOC_N(double, count);
+  high = ALLOC_N(double, count);
+  channels = rb_ary_new2(args.waveform.channels);
+  for (c = 0; c < args.waveform.channels; c++) {
+    atom_waveform_buckets(&args.waveform, c, count, low, high);
+    mins = rb_ary_new2(count);
+    maxs = rb_ary_new2(count);
+    for (i = 0; i < count; i++) {
+      rb_ary_push(mins, rb_float_new(low[i]));
+      rb_ary_push(maxs, rb_float_new(high[i]));
+    }
+    channel = NIL_P(channel_map) ? Qnil : rb_ary_entry(channel_map, c);
+    channel = NIL_P(channel) ? rb_hash_new() : rb_hash_dup(channel);
+    rb_hash_aset(channel, ID2SYM(rb_intern("min")), mins);
+    rb_hash_aset(channel, ID2SYM(rb_intern("max")), maxs);
+    rb_ary_push(channels, channel);
+  }
+  xfree(low);
+  xfree(high);
+  atom_waveform_free(&args.waveform);
   return channels;
 }
 
@@ -695,29 +1636,16 @@ static VALUE track_get_audio_channel_map(VALUE obj)
 */
 static VALUE track_encoded_pixel_dimensions(VALUE obj)
 {
-  OSErr osErr = noErr;
-  ImageDescriptionHandle image_description = track_image_description(obj);
-  if (image_description == NULL) goto bail;
-  
-  SInt32 width, height;
-  osErr = ICMImageDescriptionGetProperty(image_description, kQTPropertyClass_ImageDescription, kICMImageDescriptionPropertyID_EncodedWidth, sizeof(width), &width, NULL);
-  if (osErr != noErr) goto bail;
-
-  osErr = ICMImageDescriptionGetProperty(image_description, kQTPropertyClass_ImageDescription, kICMImageDescriptionPropertyID_EncodedHeight, sizeof(height), &height, NULL);
-  if (osErr != noErr) goto bail;
+  struct AtomSampleDescription *description = track_video_description(obj);
+  if (description == NULL)
+    rb_raise(eQuickTime, "Error %d when getting track_encoded_pixel_dimensions", noErr);
 
   VALUE size_hash = rb_hash_new();
 
-  rb_hash_aset(size_hash, ID2SYM(rb_intern("width")), INT2NUM(width));
-  rb_hash_aset(size_hash, ID2SYM(rb_intern("height")), INT2NUM(height));
+  rb_hash_aset(size_hash, ID2SYM(rb_intern("width")), INT2NUM(description->width));
+  rb_hash_aset(size_hash, ID2SYM(rb_intern("height")), INT2NUM(description->height));
 
-  DisposeHandle((Handle)image_description);
   return size_hash;
-
-  bail:
-    DisposeHandle((Handle)image_description);
-    rb_raise(eQuickTime, "Error %d when getting track_encoded_pixel_dimensions", osErr);
-    return Qnil;
 }
 
 
@@ -729,29 +1657,16 @@ static VALUE track_encoded_pixel_dimensions(VALUE obj)
 */
 static VALUE track_display_pixel_dimensions(VALUE obj)
 {
-  OSErr osErr = noErr;
-  ImageDescriptionHandle image_description = track_image_description(obj);
-  if (image_description == NULL) goto bail;
-  
-  SInt32 width, height;
-  osErr = ICMImageDescriptionGetProperty(image_description, kQTPropertyClass_ImageDescription, kICMImageDescriptionPropertyID_DisplayWidth, sizeof(width), &width, NULL);
-  if (osErr != noErr) goto bail;
-
-  osErr = ICMImageDescriptionGetProperty(image_description, kQTPropertyClass_ImageDescription, kICMImageDescriptionPropertyID_DisplayHeight, sizeof(height), &height, NULL);
-  if (osErr != noErr) goto bail;
+  struct AtomSampleDescription *description = track_video_description(obj);
+  if (description == NULL)
+    rb_raise(eQuickTime, "Error %d when getting track_display_pixel_dimensions", noErr);
 
   VALUE size_hash = rb_hash_new();
 
-  rb_hash_aset(size_hash, ID2SYM(rb_intern("width")), INT2NUM(width));
-  rb_hash_aset(size_hash, ID2SYM(rb_intern("height")), INT2NUM(height));
+  rb_hash_aset(size_hash, ID2SYM(rb_intern("width")), INT2NUM(description->display_width));
+  rb_hash_aset(size_hash, ID2SYM(rb_intern("height")), INT2NUM(description->display_height));
 
-  DisposeHandle((Handle)image_description);
   return size_hash;
-
-  bail:
-    DisposeHandle((Handle)image_description);
-    rb_raise(eQuickTime, "Error %d when getting track_display_pixel_dimensions", osErr);
-    return Qnil;
 }
 
 
@@ -761,29 +1676,117 @@ static VALUE track_display_pixel_dimensions(VALUE obj)
 */
 static VALUE track_pixel_aspect_ratio(VALUE obj)
 {
-  OSErr osErr = noErr;
-  ImageDescriptionHandle image_description = track_image_description(obj);
-  if (image_description == NULL) goto bail;
-  
-  PixelAspectRatioImageDescriptionExtension dimension;
-  osErr = ICMImageDescriptionGetProperty(image_description, kQTPropertyClass_ImageDescription, kICMImageDescriptionPropertyID_PixelAspectRatio, sizeof(dimension), &dimension, NULL);
-  if (osErr != noErr) goto bail;
+  struct AtomSampleDescription *description = track_video_description(obj);
+  if (description == NULL)
+    rb_raise(eQuickTime, "Error %d when getting track_encoded_pixel_dimensions", noErr);
+
+  return rb_ary_new3(2, UINT2NUM(description->pasp_h_spacing), UINT2NUM(description->pasp_v_spacing));
+}
+
+/*  helper function, writes a {:width => width, :height => height} hash at key.
+*/
+static void track_write_dimensions(struct ReportWriter *writer, int key, int width, int height)
+{
+  report_begin_hash(writer, key);
+  report_value(writer, REPORT_WIDTH, INT2NUM(width));
+  report_value(writer, REPORT_HEIGHT, INT2NUM(height));
+  report_end(writer);
+}
+
+/*  helper function, writes the report of a track (see Track#report).
+*/
+static void track_write_report(VALUE obj, struct ReportWriter *writer, int key)
+{
+  struct AtomSampleDescription *description = track_video_description(obj);
+  OSType media_type = track_get_media_type(obj);
+  AudioChannelLayout *layout;
+  VALUE frame_count = track_frame_count(obj);
+  double duration = NUM2DBL(track_raw_duration(obj)) / NUM2DBL(track_time_scale(obj));
   
-//  printf("\naspect ratio: %d:%d\n", dimension.hSpacing, dimension.vSpacing);
-  VALUE aspect_ratio = rb_ary_new3(2, INT2NUM(dimension.hSpacing), INT2NUM(dimension.vSpacing));
+  report_begin_hash(writer, key);
+  report_value(writer, REPORT_ID, track_id(obj));
+  report_value(writer, REPORT_MEDIA_TYPE, track_media_type(obj));
+  if (description) {
+    report_string(writer, REPORT_CODEC, description->compressor_name);
+  } else {
+    report_value(writer, REPORT_CODEC, Qnil);
+  }
+  report_value(writer, REPORT_DURATION, rb_float_new(duration));
+  report_value(writer, REPORT_FRAME_COUNT, frame_count);
+  report_value(writer, REPORT_ENABLED, track_enabled(obj));
+  report_value(writer, REPORT_OFFSET, track_get_offset(obj));
+  report_value(writer, REPORT_WIDTH, description ? INT2NUM(description->width) : Qnil);
+  report_value(writer, REPORT_HEIGHT, description ? INT2NUM(description->height) : Qnil);
+  if (media_type == VideoMediaType) {
+    if (description == NULL)
+      rb_raise(eQuickTime, "Error %d when getting track_encoded_pixel_dimensions", noErr);
+    report_value(writer, REPORT_FRAME_RATE, rb_float_new(NUM2DBL(frame_count) / duration));
+    track_write_dimensions(writer, REPORT_ENCODED_PIXEL_DIMENSIONS, description->width, description->height);
+    track_write_dimensions(writer, REPORT_DISPLAY_PIXEL_DIMENSIONS, description->display_width, description->display_height);
+    report_begin_array(writer, REPORT_PIXEL_ASPECT_RATIO);
+    report_value(writer, REPORT_ELEMENT, UINT2NUM(description->pasp_h_spacing));
+    report_value(writer, REPORT_ELEMENT, UINT2NUM(description->pasp_v_spacing));
+    report_end(writer);
+  } else if (media_type == SoundMediaType) {
+    report_value(writer, REPORT_VOLUME, track_get_volume(obj));
+    layout = track_get_audio_channel_layout(obj);
+    track_write_channel_map(layout, writer, REPORT_CHANNEL_MAP);
+    free(layout);
+  }
+  report_end(writer);
+}
 
-  DisposeHandle((Handle)image_description);
-  return aspect_ratio;
+/*
+  Writes the reports of the count tracks of a movie into an open array of 
+  writer. A single track instance is loaded with each track in turn.
+*/
+void track_write_reports(VALUE movie_obj, int count, struct ReportWriter *writer)
+{
+  VALUE track = track_new(cTrack);
+  int i;
+  
+  for (i = 1; i <= count; i++) {
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
+    free(RTRACK(track)->descriptions);
+    RTRACK(track)->descriptions = NULL;
+    RTRACK(track)->track = NULL;
+#endif
+    RTRACK(track)->atoms = NULL;
+    track_load(track, movie_obj, INT2NUM(i));
+    track_write_report(track, writer, REPORT_ELEMENT);
+  }
+  RB_GC_GUARD(track);
+}
 
-  bail:
-    DisposeHandle((Handle)image_description);
-    rb_raise(eQuickTime, "Error %d when getting track_encoded_pixel_dimensions", osErr);
-    return Qnil;
+/*
+  call-seq: report() -> report_hash
+  
+  Returns a hash describing this track: :id, :media_type, :codec, 
+  :duration, :frame_count, :enabled, :offset, :width and :height. Video 
+  tracks add :frame_rate, their pixel dimensions and :pixel_aspect_ratio, 
+  audio tracks their :volume and :channel_map. It's collected in one call.
+*/
+static VALUE track_report(VALUE obj)
+{
+  struct ReportWriter writer;
+  report_writer_init(&writer, 0);
+  track_write_report(obj, &writer, REPORT_ELEMENT);
+  return report_writer_result(&writer);
 }
 
 void Init_quicktime_track()
 {
   VALUE mQuickTime;
+  unsigned int i;
+  
+  sym_audio = ID2SYM(rb_intern("audio"));
+  sym_video = ID2SYM(rb_intern("video"));
+  sym_text = ID2SYM(rb_intern("text"));
+  sym_unsupported = ID2SYM(rb_intern("UnsupportedByRMov"));
+  for (i = 0; i < TRACK_CHANNEL_LABEL_COUNT; i++) {
+    track_channel_labels[i].symbol = ID2SYM(rb_intern(track_channel_labels[i].name));
+  }
+  
   mQuickTime = rb_define_module("QuickTime");
   cTrack = rb_define_class_under(mQuickTime, "Track", rb_cObject);
   rb_define_alloc_func(cTrack, track_new);
@@ -791,6 +1794,15 @@ void Init_quicktime_track()
   rb_define_method(cTrack, "raw_duration", track_raw_duration, 0);
   rb_define_method(cTrack, "time_scale", track_time_scale, 0);
   rb_define_method(cTrack, "frame_count", track_frame_count, 0);
+  rb_define_method(cTrack, "frame_timing", track_frame_timing, 0);
+  rb_define_method(cTrack, "sample_at", track_sample_at, 1);
+  rb_define_method(cTrack, "keyframe_before", track_keyframe_before, 1);
+  rb_define_method(cTrack, "sample_info", track_sample_info, 1);
+  rb_define_method(cTrack, "each_sample", track_each_sample, -1);
+  rb_define_method(cTrack, "each_text_sample", track_each_text_sample, 0);
+  rb_define_method(cTrack, "fingerprint", track_fingerprint, -1);
+  rb_define_method(cTrack, "image_format", track_image_format, 0);
+  rb_define_method(cTrack, "write_image_sequence", track_write_image_sequence, 3);
   rb_define_method(cTrack, "media_type", track_media_type, 0);
 
   rb_define_method(cTrack, "codec", track_codec, 0);
@@ -802,16 +1814,21 @@ void Init_quicktime_track()
   
   rb_define_method(cTrack, "channel_count", track_get_audio_channel_count, 0);
   rb_define_method(cTrack, "channel_map", track_get_audio_channel_map, 0);
+  rb_define_method(cTrack, "audio_levels", track_audio_levels, 0);
+  rb_define_method(cTrack, "waveform", track_waveform, -1);
+  rb_define_method(cTrack, "report", track_report, 0);
 
   rb_define_method(cTrack, "id", track_id, 0);
-  rb_define_method(cTrack, "delete", track_delete, 0);
   rb_define_method(cTrack, "enabled?", track_enabled, 0);
+  rb_define_method(cTrack, "volume", track_get_volume, 0);
+  rb_define_method(cTrack, "offset", track_get_offset, 0);
+  rb_define_method(cTrack, "bounds", track_bounds, 0);
+  rb_define_method(cTrack, "delete", track_delete, 0);
   rb_define_method(cTrack, "enable", track_enable, 0);
   rb_define_method(cTrack, "disable", track_disable, 0);
-  rb_define_method(cTrack, "volume", track_get_volume, 0);
   rb_define_method(cTrack, "volume=", track_set_volume, 1);
-  rb_define_method(cTrack, "offset", track_get_offset, 0);
   rb_define_method(cTrack, "offset=", track_set_offset, 1);
+#ifdef HAVE_QUICKTIME_QUICKTIME_H
   rb_define_method(cTrack, "new_video_media", track_new_video_media, 0);
   rb_define_method(cTrack, "new_audio_media", track_new_audio_media, 0);
   rb_define_method(cTrack, "new_text_media", track_new_text_media, 0);
@@ -819,6 +1836,6 @@ void Init_quicktime_track()
   rb_define_method(cTrack, "scale", track_scale, 2);
   rb_define_method(cTrack, "translate", track_translate, 2);
   rb_define_method(cTrack, "rotate", track_rotate, 1);
-  rb_define_method(cTrack, "bounds", track_bounds, 0);
   rb_define_method(cTrack, "reset_transformations", track_reset_transformations, 0);
+#endif
 }
@@ -6,10 +6,88 @@ module QuickTime
       new.load_from_file(filepath)
     end
     
+    # Opens a movie at filepath reading only its headers. This is much
+    # quicker than open for large files since the media data and sample
+    # tables are never read, but the movie can only be used for reporting.
+    def self.probe(filepath)
+      new.load_headers_from_file(filepath)
+    end
+    
+    # Reads a movie from io, such as a pipe or socket, without it ever
+    # landing on disk. The stream is read once from the start and the
+    # movie returned as soon as its header was read, the media before it
+    # is read and dropped in small chunks and the rest of the stream is
+    # left unread. Only the header is held in memory, a header larger than
+    # :buffer_limit bytes (64 MB by default) raises QuickTime::Error. Like
+    # a probed movie it can only be used for reporting.
+    #
+    #   movie = QuickTime::Movie.from_io($stdin, :buffer_limit => 16 * 1024 * 1024)
+    def self.from_io(io, options = {})
+      new.load_from_io(io, options[:buffer_limit])
+    end
+
+    # Probes many movies at once on a pool of native threads and returns
+    # a report hash (see report) for each of the filepaths, in the same
+    # order. A file which can not be read gets a hash with its :path and
+    # :error message instead, the rest of the batch is unaffected.
+    #
+    # Reports of files which haven't changed are taken from the :cache
+    # option or the current ProbeCache without opening the files, the
+    # others are probed and stored.
+    #
+    #   QuickTime::Movie.probe_many(Dir["media/*.mov"], :threads => 8)
+    def self.probe_many(filepaths, options = {})
+      filepaths = filepaths.map { |path| path.to_s }
+      cache = options.has_key?(:cache) ? options[:cache] : ProbeCache.current
+      reports = filepaths.map { |path| cache && cache.fetch(path) }
+      missing = (0...filepaths.size).reject { |i| reports[i] }
+      results = probe_files(missing.map { |i| filepaths[i] }, options[:threads] || 4)
+      missing.zip(results).each do |i, movie|
+        if movie.kind_of? QuickTime::Error
+          reports[i] = { :error => movie.message }
+        else
+          begin
+            reports[i] = cache ? cache.report(movie) : movie.report
+          rescue QuickTime::Error => e
+            reports[i] = { :error => e.message }
+          ensure
+            movie.dispose
+          end
+        end
+      end
+      filepaths.zip(reports).map { |path, report| { :path => path }.merge(report) }
+    end
+    
     # Returns a new, empty movie.
     def self.empty
       new.load_empty
     end
+
+    # Makes a movie at filepath playing the JPEG or PNG image files matching
+    # pattern (as in Dir.glob, in order of their names), or an array of
+    # image files, as frames at :fps frames per second (24 by default).
+    # NTSC rates such as 29.97 play at exactly 30000/1001. The images are
+    # copied into the movie as they are, nothing is decoded or compressed
+    # again, and the files are inspected on :threads native threads (4 by
+    # default). All of them must have the same format and size. Returns
+    # the new movie.
+    #
+    #   QuickTime::Movie.from_image_sequence("render/shot_*.png", "shot.mov", :fps => 23.976)
+    def self.from_image_sequence(pattern, filepath, options = {})
+      files = pattern.kind_of?(Array) ? pattern.map { |path| path.to_s } : Dir.glob(pattern.to_s).sort
+      raise QuickTime::Error, "No image files found matching #{pattern}" if files.empty?
+      fps = (options[:fps] || 24).to_f
+      raise ArgumentError, "Frame rate must be positive" unless fps > 0
+      if fps != fps.round && ((fps * 1.001) - (fps * 1.001).round).abs < 0.001
+        time_scale, frame_duration = (fps * 1.001).round * 1000, 1001
+      else
+        time_scale, frame_duration = (fps * 1000).round, 1000
+        divisor = time_scale.gcd(frame_duration)
+        time_scale, frame_duration = time_scale / divisor, frame_duration / divisor
+      end
+      write_image_sequence(files, filepath.to_s, time_scale, frame_duration, options[:threads] || 4)
+      open(filepath.to_s)
+    end
     
     # Returns the length of this movie in seconds
     # using raw_duration and time_scale.
@@ -49,6 +127,49 @@ module QuickTime
       tracks.select { |t| t.text? }
     end
     
+    # Returns the chapters of this movie as an array of hashes with the
+    # :title and :time (in seconds) of each, read from the text track the
+    # other tracks refer to for their chapters. Empty if there are none.
+    def chapters
+      chapters = []
+      track = chapter_track
+      track.each_text_sample { |sample| chapters << { :title => sample[:text], :time => sample[:start] } } if track
+      chapters
+    end
+    
+    # Replaces the chapters of this movie by an array of hashes with the
+    # :title and :time (in seconds) of each, an empty array removes them.
+    # The titles are written to the movie file as the samples of a text
+    # track, taking the place of the old titles where they fit so the file
+    # doesn't keep growing, and the movie header is written once with its
+    # sample tables, so the movie is saved (see save) and loaded again.
+    #
+    #   movie.chapters = [{ :title => "Intro", :time => 0 }, { :title => "Credits", :time => 95.5 }]
+    def chapters=(chapters)
+      list = chapters.map do |chapter|
+        title = chapter[:title].to_s
+        title = title.encode("UTF-8") if title.respond_to? :encode
+        [chapter[:time].to_f, title]
+      end
+      write_chapters(list.sort_by { |time, title| time })
+    end
+
+    # Changes the metadata of this movie (see metadata) by a hash of the
+    # fields to set, keyed like metadata returns them. Fields which aren't
+    # given are kept and a nil value removes a field. Only the movie header
+    # is rewritten, usually in place, so the movie is saved (see save) and
+    # loaded again.
+    #
+    #   movie.metadata = { :title => "Holiday", :comment => nil, "com.example.rating" => "5" }
+    def metadata=(metadata)
+      changes = metadata.map do |name, value|
+        value = value.to_s unless value.nil?
+        value = value.encode("UTF-8") if value.respond_to? :encode
+        [name.to_s, value]
+      end
+      write_metadata(changes)
+    end
+
     # Returns an Exporter instance for this movie.
     def exporter
       Exporter.new(self)
@@ -84,6 +205,10 @@ module QuickTime
     # The image format is automatically determined from the file extension. If this
     # cannot be determined from the extension then you can use export_image_type to
     # specify the ostype manually.
+    #
+    # When the frame is already stored as a JPEG or PNG image (see image_format) 
+    # and the extension asks for that format, its bytes are written to the file 
+    # as they are instead of rendering the frame.
     def export_image(filepath, seconds)
       # TODO support more file types
       type = case File.extname(filepath).downcase
@@ -96,7 +221,14 @@ module QuickTime
         when '.psd'          then '8BPS'
         else raise QuickTime::Error, "Unable to guess ostype from file extension of #{filepath}"
       end
-      export_image_type(filepath, seconds, type)
+      format = { 'JPEG' => :jpeg, 'PNGf' => :png }[type]
+      if format && image_format(seconds) == format
+        File.open(filepath, 'wb') { |file| file.write(contact_sheet([seconds]).first[:data]) }
+      elsif respond_to? :export_image_type
+        export_image_type(filepath, seconds, type)
+      else
+        raise QuickTime::Error, "Unable to export the frame at #{seconds} seconds as #{type} without decoding it"
+      end
     end
     
     # Reset selection to beginning
@@ -0,0 +1,34 @@
+module QuickTime
+  # see ext/probe_cache.c for additional methods
+  #
+  # A file of movie reports (see Movie#report) kept across runs, keyed by
+  # the device, inode, size and modification time of each movie file. A
+  # report is only returned while its file is unchanged, which takes a
+  # single stat of the file to check.
+  #
+  # Reports are stored with Marshal and loaded from the file as they are,
+  # so the cache path must be trusted, anyone able to write the file can
+  # run code in the process reading it. New cache files are created only
+  # readable and writable by their owner.
+  class ProbeCache
+    # Opens the cache at path, creating it if needed, and makes it the
+    # current cache which Movie#report and Movie.probe_many consult. Given
+    # a block the cache is yielded, then closed and the previous current
+    # cache is restored.
+    #
+    #   QuickTime::ProbeCache.open("library.cache") do
+    #     QuickTime::Movie.probe_many(Dir["media/**/*.mov"])
+    #   end
+    def self.open(path)
+      cache = new.load_from_file(path)
+      previous, self.current = current, cache
+      return cache unless block_given?
+      begin
+        yield cache
+      ensure
+        cache.close
+        self.current = previous if previous.nil? || !previous.closed?
+      end
+    end
+  end
+end
@@ -0,0 +1,46 @@
+module QuickTime
+  # see ext/scanner.c for additional methods
+  class Scanner
+  end
+
+  # Scans the directory tree at dir for movie files and yields a report
+  # hash (see Movie#report) for each, with its :path. Files are probed on
+  # a pool of native threads which open the next files and read their
+  # headers ahead while others are parsed, reports are yielded as they
+  # complete rather than in any particular order. A file which can not be
+  # read gets a hash with its :path and :error message instead.
+  #
+  # Only file names matching the :pattern option (as in File.fnmatch,
+  # "*.mov" by default) are probed. Hidden files and directories are
+  # skipped and symbolic links to directories are not followed, as with
+  # Dir.glob. Without a block an Enumerator is returned.
+  #
+  #   QuickTime.scan("/archive", :pattern => "*.mp4", :threads => 16) do |report|
+  #     puts "#{report[:path]}: #{report[:error] || report[:duration]}"
+  #   end
+  def self.scan(dir, options = {})
+    return to_enum(:scan, dir, options) unless block_given?
+    cache = options.has_key?(:cache) ? options[:cache] : ProbeCache.current
+    scanner = Scanner.new.start(dir.to_s, options[:pattern] || "*.mov", options[:threads] || 4)
+    begin
+      while result = scanner.next_movie
+        path, movie = result
+        if movie.kind_of? QuickTime::Error
+          yield :path => path, :error => movie.message
+        else
+          begin
+            report = cache ? cache.report(movie) : movie.report
+          rescue QuickTime::Error => e
+            report = { :error => e.message }
+          ensure
+            movie.dispose
+          end
+          yield({ :path => path }.merge(report))
+        end
+      end
+    ensure
+      scanner.close
+    end
+    nil
+  end
+end
@@ -1,3 +1,5 @@
+require 'fileutils'
+
 module QuickTime
   # see ext/track.c for additional methods
   class Track
@@ -47,6 +49,58 @@ module QuickTime
       bounds[:bottom] - bounds[:top]
     end
 
-        
+    # Writes each frame of this video track, or those numbered in :range
+    # (starting at 1, as in each_sample), to an image file in directory.
+    # Files are named after the :pattern with the frame number (as in
+    # format, "%06d" by default), the extension of image_format is added
+    # unless the pattern has one. Frames are read and written on :threads
+    # native threads (4 by default), nothing is decoded: JPEG, PNG and
+    # Motion-JPEG frames are written as they are stored and uncompressed
+    # frames are converted to PNG. Returns the paths of the written files.
+    #
+    #   track.export_image_sequence("stills", :pattern => "shot_%05d", :range => 1..240)
+    def export_image_sequence(directory, options = {})
+      format = image_format
+      raise QuickTime::Error, "Unable to export the frames of track #{id} without decoding its '#{codec}' codec" unless format
+      pattern = options[:pattern] || "%06d"
+      pattern += (format == :png ? ".png" : ".jpg") if File.extname(pattern).empty?
+      range = options[:range] || (1..frame_count)
+      first = [range.first, 1].max
+      last = [range.exclude_end? ? range.last - 1 : range.last, frame_count].min
+      paths = (first..last).map { |number| File.join(directory.to_s, pattern % number) }
+      FileUtils.mkdir_p(directory.to_s)
+      write_image_sequence(paths, first, options[:threads] || 4) unless paths.empty?
+      paths
+    end
+
+    # Writes the samples of this text track (see each_text_sample) to a
+    # subtitle file at filepath as they are read. The :format is :srt or
+    # :webvtt, by default WebVTT for a .vtt extension and SRT otherwise.
+    #
+    #   movie.text_tracks.first.export_subtitles("captions.vtt")
+    def export_subtitles(filepath, options = {})
+      format = options[:format] || (File.extname(filepath.to_s).downcase == ".vtt" ? :webvtt : :srt)
+      raise ArgumentError, "Unknown subtitle format #{format.inspect}, use :srt or :webvtt" unless [:srt, :webvtt].include? format
+      File.open(filepath.to_s, "wb") do |file|
+        file.write("WEBVTT\n\n") if format == :webvtt
+        number = 0
+        each_text_sample do |sample|
+          times = [sample[:start], sample[:start] + sample[:duration]].map { |seconds| subtitle_time(seconds, format == :srt ? "," : ".") }
+          # a blank line would end the cue
+          text = sample[:text].gsub(/\n+/, "\n").chomp
+          text = text.gsub("&", "&amp;").gsub("<", "&lt;").gsub(">", "&gt;") if format == :webvtt
+          file.write("#{number += 1}\n") if format == :srt
+          file.write("#{times.join(" --> ")}\n#{text}\n\n")
+        end
+      end
+    end
+    
+    private
+    
+    # Formats seconds as the hours, minutes, seconds and milliseconds of a subtitle cue.
+    def subtitle_time(seconds, separator)
+      milliseconds = (seconds * 1000).round
+      "%02d:%02d:%02d%s%03d" % [milliseconds / 3600000, milliseconds / 60000 % 60, milliseconds / 1000 % 60, separator, milliseconds % 1000]
+    end
   end
 end
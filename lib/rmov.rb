@@ -5,6 +5,8 @@ require File.dirname(__FILE__) + '/../ext/rmov_ext'
 require 'quicktime/movie'
 require 'quicktime/track'
 require 'quicktime/exporter'
+require 'quicktime/probe_cache'
+require 'quicktime/scanner'
 
 
 # RMov is made up of several parts. To start, see QuickTime::Movie.
@@ -91,6 +91,13 @@ describe QuickTime::Movie do
       @movie.duration.should == 2.5
     end
     
+    it "clone_section should keep its content after the original movie is disposed" do
+      mov = @movie.clone_section(1, 0.6)
+      @movie.dispose
+      mov.duration.should == 0.6
+      mov.video_tracks.first.codec.should == 'H.264'
+    end
+    
     it "should have an exporter with this movie" do
       exporter = @movie.exporter
       exporter.should be_kind_of(QuickTime::Exporter)
@@ -117,6 +124,89 @@ describe QuickTime::Movie do
       mov.duration.should == 3.1
     end
     
+    it "flatten should keep the other atoms of the movie and its tracks" do
+      path = File.dirname(__FILE__) + '/../output/flattened_atoms.mov'
+      File.delete(path) if File.exist?(path)
+      @movie.flatten(path)
+      tapt = lambda { |data| data[data.index("tapt") - 4, 68] }
+      tapt.call(File.open(path, 'rb') { |f| f.read }).should == tapt.call(File.open(File.dirname(__FILE__) + '/../fixtures/example.mov', 'rb') { |f| f.read })
+      File.delete(path)
+      QuickTime::Movie.open(File.dirname(__FILE__) + '/../fixtures/fragmented.mp4').flatten(path)
+      QuickTime::Movie.open(path).should_not be_fragmented
+    end
+    
+    it "flatten should write interleaved movie with header after media" do
+      path = File.dirname(__FILE__) + '/../output/interleaved_example.mov'
+      File.delete(path) if File.exist?(path)
+      mov = @movie.flatten(path, :interleave => true, :moov_first => false)
+      mov.duration.should == 3.1
+      mov.video_tracks.first.frame_count.should == 31
+      File.open(path, 'rb') { |f| f.read(32) }.should_not include('moov')
+    end
+    
+    it "flatten should only write the edited section" do
+      mov = @movie.clone_section(1, 1.2)
+      path = File.dirname(__FILE__) + '/../output/flattened_section.mov'
+      File.delete(path) if File.exist?(path)
+      mov.flatten(path).duration.should == 1.2
+      File.size(path).should < File.size(File.dirname(__FILE__) + '/../fixtures/example.mov')
+    end
+    
+    it "seek_report should show interleaving removes seeks" do
+      report = @movie.seek_report(:interleave => true, :max_distance => 4000)
+      report[:before][:seeks].should > 0
+      report[:after][:seeks].should == 0
+      report[:after][:max_distance].should <= 4000
+      report[:after][:chunks].should == report[:before][:chunks]
+    end
+    
+    it "flatten should write the layout planned by seek_report" do
+      path = File.dirname(__FILE__) + '/../output/planned_example.mov'
+      File.delete(path) if File.exist?(path)
+      options = { :interleave => true, :chunk_duration => 0.25 }
+      mov = @movie.flatten(path, options)
+      mov.seek_report(options)[:before].should == @movie.seek_report(options)[:after]
+    end
+    
+    it "fingerprints should not change when the movie is flattened" do
+      path = File.dirname(__FILE__) + '/../output/fingerprinted_example.mov'
+      File.delete(path) if File.exist?(path)
+      mov = @movie.flatten(path, :interleave => true, :moov_first => false)
+      mov.fingerprints.should == @movie.fingerprints
+      mov.fingerprints(:algo => :crc32c, :threads => 1).should == @movie.fingerprints(:algo => :crc32c)
+      @movie.fingerprints.keys.sort.should == [1, 2]
+    end
+    
+    it "faststart! should move movie header in front of media" do
+      path = File.dirname(__FILE__) + '/../output/faststart_example.mov'
+      File.delete(path) if File.exist?(path)
+      @movie.flatten(path, :moov_first => false)
+      File.open(path, 'rb') { |f| f.read(32) }.should_not include('moov')
+      QuickTime::Movie.faststart!(path).should be_true
+      File.open(path, 'rb') { |f| f.read(32) }.should include('moov')
+      QuickTime::Movie.faststart!(path).should be_false
+      mov = QuickTime::Movie.open(path)
+      mov.duration.should == 3.1
+      mov.video_tracks.first.sample_info(1)[:size].should == 388
+    end
+    
+    it "faststart! should use free space in front of media and drop the old header" do
+      path = File.dirname(__FILE__) + '/../output/faststart_free.mov'
+      File.delete(path) if File.exist?(path)
+      @movie.flatten(path)
+      data = File.open(path, 'rb') { |f| f.read }
+      moov = data.index('moov') - 4
+      size = data[moov, 4].unpack('N').first
+      original = data.size
+      data << data[moov, size]
+      data[moov + 4, 4] = 'free'
+      File.open(path, 'wb') { |f| f.write(data) }
+      QuickTime::Movie.faststart!(path).should be_true
+      File.size(path).should == original
+      File.open(path, 'rb') { |f| f.read }[moov + 4, 4].should == 'moov'
+      QuickTime::Movie.open(path).duration.should == 3.1
+    end
+    
     it "save should update movie in current file" do
       path = File.dirname(__FILE__) + '/../output/saved_example.mov'
       File.delete(path) if File.exist?(path)
@@ -128,11 +218,132 @@ describe QuickTime::Movie do
       mov2.audio_tracks.should be_empty
     end
     
+    it "save should keep the header fields it doesn't change" do
+      path = File.dirname(__FILE__) + '/../output/saved_headers.mov'
+      data = File.open(File.dirname(__FILE__) + '/../fixtures/example.mov', 'rb') { |file| file.read }
+      # put the first track in alternate group 1
+      data[data.index("tkhd") + 4 + 34, 2] = [1].pack("n")
+      File.open(path, 'wb') { |file| file.write(data) }
+      headers = lambda do
+        saved = File.open(path, 'rb') { |file| file.read }
+        mvhd, tkhd = saved.index("mvhd") + 4, saved.index("tkhd") + 4
+        [saved[mvhd + 4, 8], saved[mvhd + 20, 6], saved[tkhd + 4, 8], saved[tkhd + 32, 4]]
+      end
+      before = headers.call
+      mov = QuickTime::Movie.open(path)
+      mov.poster_time = 1.0
+      mov.save
+      headers.call.should == before
+      QuickTime::Movie.open(path).poster_time.should == 1.0
+    end
+    
+    it "save should write metadata changes in place" do
+      path = File.dirname(__FILE__) + '/../output/saved_metadata.mov'
+      File.delete(path) if File.exist?(path)
+      @movie.flatten(path)
+      size = File.size(path)
+      mov = QuickTime::Movie.open(path)
+      mov.poster_time = 1.5
+      mov.audio_tracks.first.volume = 0.5
+      mov.save
+      File.size(path).should == size
+      mov2 = QuickTime::Movie.open(path)
+      mov2.poster_time.should == 1.5
+      mov2.audio_tracks.first.volume.should == 0.5
+    end
+    
     it "save should raise exception when saving new movie without filepath" do
       mov = QuickTime::Movie.empty
       lambda { mov.save }.should raise_error
     end
     
+    it "should have no chapters" do
+      @movie.chapters.should == []
+      @movie.chapter_track.should be_nil
+    end
+    
+    it "chapters= should add the chapters to the movie file and replace them" do
+      path = File.dirname(__FILE__) + '/../output/chaptered_example.mov'
+      File.delete(path) if File.exist?(path)
+      @movie.flatten(path)
+      mov = QuickTime::Movie.open(path)
+      mov.chapters = [{ :title => "Credits", :time => 2.5 }, { :title => "Intro", :time => 0 }]
+      mov.chapters.should == [{ :title => "Intro", :time => 0 }, { :title => "Credits", :time => 2.5 }]
+      QuickTime::Movie.open(path).chapters.map { |c| c[:title] }.should == ["Intro", "Credits"]
+      mov.chapters = [{ :title => "Middle", :time => 1.5 }]
+      mov.text_tracks.size.should == 1
+      mov.chapters.should == [{ :title => "Middle", :time => 1.5 }]
+      mov.chapters = []
+      mov.text_tracks.should be_empty
+    end
+    
+    it "chapters= should reuse the space of the chapters it replaces" do
+      path = File.dirname(__FILE__) + '/../output/rechaptered_example.mov'
+      File.delete(path) if File.exist?(path)
+      @movie.flatten(path)
+      mov = QuickTime::Movie.open(path)
+      chapters = [{ :title => "Intro", :time => 0 }, { :title => "Credits", :time => 2.5 }]
+      mov.chapters = chapters
+      size = File.size(path)
+      3.times { mov.chapters = chapters }
+      File.size(path).should == size
+      mov.chapters = [{ :title => "Middle", :time => 1.5 }]
+      File.size(path).should == size
+      QuickTime::Movie.open(path).chapters.should == [{ :title => "Middle", :time => 1.5 }]
+      mov.dispose
+    end
+    
+    it "chapters= should keep the creation times of the movie and its tracks" do
+      path = File.dirname(__FILE__) + '/../output/chaptered_headers.mov'
+      File.open(path, 'wb') { |file| file.write(File.open(File.dirname(__FILE__) + '/../fixtures/example.mov', 'rb') { |source| source.read }) }
+      times = lambda do
+        saved = File.open(path, 'rb') { |file| file.read }
+        %w(mvhd tkhd).map { |type| saved[saved.index(type) + 8, 8] }
+      end
+      before = times.call
+      QuickTime::Movie.open(path).chapters = [{ :title => "Intro", :time => 0 }]
+      times.call.should == before
+    end
+    
+    it "chapters= should raise an exception for a chapter after the end" do
+      mov = QuickTime::Movie.open(File.dirname(__FILE__) + '/../fixtures/example.mov')
+      lambda { mov.chapters = [{ :title => "Later", :time => 5 }] }.should raise_error(QuickTime::Error)
+    end
+    
+    it "should have no metadata" do
+      @movie.metadata.should == {}
+    end
+    
+    it "metadata= should change the metadata in place and remove fields" do
+      path = File.dirname(__FILE__) + '/../output/tagged_example.mov'
+      File.delete(path) if File.exist?(path)
+      @movie.flatten(path)
+      mov = QuickTime::Movie.open(path)
+      mov.metadata = { :title => "Example", :artist => "Someone" }
+      size = File.size(path)
+      mov.metadata = { :title => "Another example", "com.example.rating" => "5" }
+      File.size(path).should == size
+      QuickTime::Movie.open(path).metadata.should == { :title => "Another example", :artist => "Someone", "com.example.rating" => "5" }
+      mov.metadata = { :artist => nil, "com.example.rating" => nil }
+      mov.metadata.should == { :title => "Another example" }
+      mov.duration.should == 3.1
+    end
+    
+    it "flatten should keep metadata" do
+      path = File.dirname(__FILE__) + '/../output/tagged_example.mov'
+      flattened = File.dirname(__FILE__) + '/../output/flattened_tagged_example.mov'
+      [path, flattened].each { |p| File.delete(p) if File.exist?(p) }
+      @movie.flatten(path)
+      mov = QuickTime::Movie.open(path)
+      mov.metadata = { :title => "Example", :artist => "Someone" }
+      mov.flatten(flattened)
+      QuickTime::Movie.open(flattened).metadata.should == { :title => "Example", :artist => "Someone" }
+    end
+    
+    it "metadata= should raise an exception for an unknown field" do
+      lambda { @movie.metadata = { :rating => "5" } }.should raise_error(ArgumentError)
+    end
+    
     it "export_pict should output a pict file at a given duration" do
       path = File.dirname(__FILE__) + '/../output/example.pct'
       File.delete(path) rescue nil
@@ -164,6 +375,256 @@ describe QuickTime::Movie do
     end
   end
   
+  describe "probed example.mov" do
+    before(:each) do
+      @movie = QuickTime::Movie.probe(File.dirname(__FILE__) + '/../fixtures/example.mov')
+    end
+    
+    it "should report the same as an opened movie" do
+      @movie.duration.should == 3.1
+      @movie.bounds.should == { :top => 0, :left => 0, :bottom => 50, :right => 60 }
+      @movie.tracks.map { |t| t.id }.should == [1, 2]
+    end
+    
+    it "should read tracks on demand" do
+      @movie.video_tracks.first.codec.should == 'H.264'
+      @movie.video_tracks.first.frame_count.should == 31
+      @movie.audio_tracks.first.channel_map.should == [{:assignment => :Mono}]
+    end
+    
+    it "report should match the accessors of the movie and its tracks" do
+      report = @movie.report
+      report[:width].should == @movie.width
+      report[:bounds].should == @movie.bounds
+      video = report[:tracks].last
+      video[:frame_rate].should == @movie.video_tracks.first.frame_rate
+      video[:display_pixel_dimensions].should == { :width => 60, :height => 50 }
+      video[:pixel_aspect_ratio].should == [1, 1]
+      report[:tracks].first[:volume].should == 1.0
+      report[:tracks].first[:width].should be_nil
+    end
+    
+    it "report_json should hold the report" do
+      require 'json'
+      JSON.parse(@movie.report_json).should == JSON.parse(JSON.generate(@movie.report))
+    end
+  end
+  
+  it "should probe a movie with its movie data at the end" do
+    movie = QuickTime::Movie.probe(File.dirname(__FILE__) + '/../fixtures/exampleUnsupportAudio.mov')
+    movie.tracks.should have(2).records
+  end
+  
+  it "should raise an exception when attempting to probe a non movie file" do
+    lambda { QuickTime::Movie.probe(__FILE__) }.should raise_error(QuickTime::Error)
+  end
+  
+  describe "from_io" do
+    before(:each) do
+      @path = File.dirname(__FILE__) + '/../fixtures/example.mov'
+    end
+    
+    it "should read the movie header from a pipe" do
+      IO.popen("cat #{@path}") do |io|
+        movie = QuickTime::Movie.from_io(io)
+        movie.duration.should == 3.1
+        movie.tracks.map { |t| t.frame_count }.should == [134, 31]
+        movie.video_tracks.first.codec.should == "H.264"
+      end
+    end
+    
+    it "should raise an exception when the movie header is larger than the buffer limit" do
+      File.open(@path, 'rb') do |file|
+        lambda { QuickTime::Movie.from_io(file, :buffer_limit => 1000) }.should raise_error(QuickTime::Error)
+      end
+    end
+    
+    it "should raise an exception when the stream ends before the movie header" do
+      File.open(__FILE__, 'rb') do |file|
+        lambda { QuickTime::Movie.from_io(file) }.should raise_error(QuickTime::Error)
+      end
+    end
+  end
+  
+  describe "probe_many" do
+    before(:each) do
+      @paths = ['/../fixtures/example.mov', '/../fixtures/dot.png', '/../fixtures/exampleUnsupportAudio.mov'].map { |p| File.dirname(__FILE__) + p }
+      @reports = QuickTime::Movie.probe_many(@paths, :threads => 2)
+    end
+    
+    it "should return a report for each file in order" do
+      @reports.map { |r| r[:path] }.should == @paths
+    end
+    
+    it "should report movie and track properties" do
+      @reports.first[:duration].should == 3.1
+      @reports.first[:bounds].should == { :top => 0, :left => 0, :bottom => 50, :right => 60 }
+      @reports.first[:tracks].map { |t| t[:id] }.should == [1, 2]
+      @reports.first[:tracks].last[:codec].should == 'H.264'
+      @reports.first[:tracks].first[:channel_map].should == [{:assignment => :Mono}]
+    end
+    
+    it "should report an error for a non movie file without failing the batch" do
+      @reports[1][:error].should be_kind_of(String)
+      @reports.last[:tracks].should have(2).records
+    end
+  end
+  
+  describe "with a probe cache" do
+    before(:each) do
+      @cache_path = File.dirname(__FILE__) + '/../output/probe.cache'
+      @path = File.dirname(__FILE__) + '/../output/probed.mov'
+      File.delete(@cache_path) if File.exist?(@cache_path)
+      File.open(@path, 'wb') { |f| f.write(File.read(File.dirname(__FILE__) + '/../fixtures/example.mov')) }
+    end
+    
+    after(:each) do
+      [@cache_path, @path].each { |path| File.delete(path) if File.exist?(path) }
+    end
+    
+    it "should store the report of a probed movie and keep it across opens" do
+      report = QuickTime::ProbeCache.open(@cache_path) { QuickTime::Movie.probe(@path).report }
+      QuickTime::ProbeCache.current.should be_nil
+      QuickTime::ProbeCache.open(@cache_path) do |cache|
+        cache.size.should == 1
+        cache.fetch(@path).should == report
+        QuickTime::Movie.probe_many([@path]).should == [{ :path => @path }.merge(report)]
+      end
+    end
+    
+    it "should create the cache file readable only by its owner" do
+      QuickTime::ProbeCache.open(@cache_path) { |cache| cache.store(@path, { :duration => 1.0 }) }
+      (File.stat(@cache_path).mode & 0777).should == 0600
+    end
+    
+    it "should not return a report once the file changed" do
+      QuickTime::ProbeCache.open(@cache_path) do |cache|
+        cache.store(@path, { :duration => 1.0 })
+        cache.fetch(@path).should == { :duration => 1.0 }
+        File.utime(Time.now, Time.now + 10, @path)
+        cache.fetch(@path).should be_nil
+        QuickTime::Movie.probe_many([@path], :cache => cache).first[:duration].should == 3.1
+      end
+    end
+    
+    it "should drop reports of files which are gone when compacting" do
+      cache = QuickTime::ProbeCache.open(@cache_path)
+      cache.store(@path, { :duration => 1.0 })
+      File.delete(@path)
+      cache.compact.size.should == 0
+      cache.close
+      cache.should be_closed
+    end
+  end
+
+  describe "fragmented.mp4" do
+    before(:each) do
+      @path = File.dirname(__FILE__) + '/../fixtures/fragmented.mp4'
+      @movie = QuickTime::Movie.open(@path)
+    end
+    
+    it "should be fragmented" do
+      @movie.should be_fragmented
+      QuickTime::Movie.open(File.dirname(__FILE__) + '/../fixtures/example.mov').should_not be_fragmented
+    end
+    
+    it "should read the samples of every fragment" do
+      example = QuickTime::Movie.open(File.dirname(__FILE__) + '/../fixtures/example.mov')
+      @movie.tracks.map { |t| t.frame_count }.should == [134, 31]
+      @movie.video_tracks.first.duration.should == 3.1
+      @movie.video_tracks.first.sample_at(1.55).should == example.video_tracks.first.sample_at(1.55)
+      info = @movie.video_tracks.first.sample_info(2)
+      info.delete(:offset)
+      info.should == example.video_tracks.first.sample_info(2).reject { |key, value| key == :offset }
+    end
+    
+    it "refresh! should read the fragments appended to a growing file" do
+      path = File.dirname(__FILE__) + '/../output/growing.mp4'
+      data = File.open(@path, 'rb') { |file| file.read }
+      File.open(path, 'wb') { |file| file.write(data[0, 3000]) }
+      mov = QuickTime::Movie.open(path)
+      mov.duration.should == 0
+      File.open(path, 'wb') { |file| file.write(data[0, 20000]) }
+      mov.refresh!.should == 3
+      mov.video_tracks.first.frame_count.should == 15
+      File.open(path, 'wb') { |file| file.write(data) }
+      mov.refresh!.should == 4
+      mov.tracks.map { |t| t.frame_count }.should == [134, 31]
+      mov.duration.should == @movie.duration
+    end
+    
+    it "sample data should stay readable when refresh! maps the grown file again" do
+      path = File.dirname(__FILE__) + '/../output/growing.mp4'
+      data = File.open(@path, 'rb') { |file| file.read }
+      File.open(path, 'wb') { |file| file.write(data[0, 9000]) }
+      mov = QuickTime::Movie.open(path)
+      samples = []
+      mov.video_tracks.first.each_sample { |info, bytes| samples << bytes }
+      copies = samples.map { |bytes| bytes.dup.force_encoding("BINARY") }
+      File.open(path, 'wb') { |file| file.write(data) }
+      mov.refresh!.should == 6
+      samples.map { |bytes| bytes.dup.force_encoding("BINARY") }.should == copies
+    end
+  end
+  
+  describe "slideshow.mov" do
+    before(:each) do
+      @movie = QuickTime::Movie.probe(File.dirname(__FILE__) + '/../fixtures/slideshow.mov')
+    end
+
+    it "image_format should tell the format of the frame without decoding it" do
+      @movie.image_format(1).should == :jpeg
+      QuickTime::Movie.probe(File.dirname(__FILE__) + '/../fixtures/example.mov').image_format(1).should be_nil
+    end
+
+    it "contact_sheet should return the encoded frames at the given times" do
+      frames = @movie.contact_sheet([2.5, 0, 1.5, 1.2])
+      frames.map { |f| f[:time] }.should == [2.5, 0, 1.5, 1.2]
+      frames.map { |f| f[:format] }.uniq.should == [:jpeg]
+      frames.each { |f| f[:data].unpack('C2').should == [0xFF, 0xD8] }
+      frames[2][:data].object_id.should == frames[3][:data].object_id
+      frames[0][:data].should_not == frames[1][:data]
+    end
+
+    it "export_image should write the frame as it is stored" do
+      path = File.dirname(__FILE__) + '/../output/slideshow.jpg'
+      File.delete(path) rescue nil
+      @movie.export_image(path, 1.2)
+      File.open(path, 'rb') { |f| f.read }.should == @movie.contact_sheet([1]).first[:data]
+      File.delete(path)
+    end
+
+    it "should raise an exception when a frame would need to be decoded" do
+      lambda { @movie.export_image(File.dirname(__FILE__) + '/../output/slideshow.png', 1) }.should raise_error(QuickTime::Error)
+      lambda { QuickTime::Movie.probe(File.dirname(__FILE__) + '/../fixtures/example.mov').contact_sheet([1]) }.should raise_error(QuickTime::Error)
+    end
+  end
+
+  describe "from_image_sequence" do
+    before(:each) do
+      @image = File.dirname(__FILE__) + '/../fixtures/dot.png'
+      @path = File.dirname(__FILE__) + '/../output/sequence.mov'
+      File.delete(@path) if File.exist?(@path)
+    end
+    
+    after(:each) do
+      File.delete(@path) if File.exist?(@path)
+    end
+    
+    it "should make a movie playing the image files as they are" do
+      movie = QuickTime::Movie.from_image_sequence([@image] * 3, @path, :fps => 29.97)
+      movie.time_scale.should == 30000
+      movie.video_tracks.first.codec.should == 'PNG'
+      movie.video_tracks.first.frame_count.should == 3
+      movie.contact_sheet([0.05]).first[:data].should == File.open(@image, 'rb') { |f| f.read }
+    end
+    
+    it "should raise an exception when a file isn't an image of the same size and format" do
+      lambda { QuickTime::Movie.from_image_sequence([@image, __FILE__], @path) }.should raise_error(QuickTime::Error)
+      File.exist?(@path).should be_false
+    end
+  end
+  
   describe "empty movie" do
     before(:each) do
       @movie = QuickTime::Movie.empty
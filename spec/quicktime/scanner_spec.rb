@@ -0,0 +1,30 @@
+require File.dirname(__FILE__) + '/../spec_helper.rb'
+
+describe QuickTime::Scanner do
+  before(:each) do
+    @fixtures = File.dirname(__FILE__) + '/../fixtures'
+  end
+  
+  it "should yield a report for each movie in the tree" do
+    reports = []
+    QuickTime.scan(@fixtures, :threads => 2) { |report| reports << report }
+    paths = Dir[@fixtures + '/*.mov'].sort
+    reports.sort_by { |r| r[:path] }.should == QuickTime::Movie.probe_many(paths)
+  end
+  
+  it "should only probe files matching the pattern" do
+    reports = QuickTime.scan(@fixtures, :pattern => '*.png').to_a
+    reports.map { |r| r[:path] }.should == [@fixtures + '/dot.png']
+    reports.first[:error].should be_kind_of(String)
+  end
+  
+  it "should stop scanning when the block breaks" do
+    count = 0
+    QuickTime.scan(@fixtures, :threads => 1) { |report| count += 1; break }
+    count.should == 1
+  end
+  
+  it "should raise an exception when the directory does not exist" do
+    lambda { QuickTime.scan(@fixtures + '/missing') { } }.should raise_error(QuickTime::Error)
+  end
+end
@@ -40,6 +40,56 @@ describe QuickTime::Track do
         @track.height.should == 50
       end
       
+      it "should report square pixels with the encoded size as display size" do
+        @track.pixel_aspect_ratio.should == [1, 1]
+        @track.encoded_pixel_dimensions.should == { :width => 60, :height => 50 }
+        @track.display_pixel_dimensions.should == @track.encoded_pixel_dimensions
+        @track.aspect_ratio.should == :other
+      end
+      
+      it "should report exact frame timing" do
+        timing = @track.frame_timing
+        timing[:frame_rate].should == [10, 1]
+        timing[:constant].should == true
+        timing[:min_duration].should == 0.1
+        timing[:max_duration].should == 0.1
+        timing[:histogram].should == { 1 => 31 }
+      end
+      
+      it "should find the sample at a given time" do
+        @track.sample_at(0).should == 1
+        @track.sample_at(2.3).should == 24
+        @track.sample_at(10).should == 31
+      end
+      
+      it "should find the key frame before a given time" do
+        @track.keyframe_before(2.3).should == 1
+      end
+      
+      it "should report offset, size, timing and sync flag of a sample" do
+        @track.sample_info(1).should == { :offset => 15994, :size => 388, :dts => 0.0, :pts => 0.0, :duration => 0.1, :sync => true }
+        @track.sample_info(31)[:sync].should == false
+        lambda { @track.sample_info(32) }.should raise_error(QuickTime::Error)
+      end
+      
+      it "should yield each sample with its data from the file" do
+        bytes = File.open(File.dirname(__FILE__) + '/../fixtures/example.mov', 'rb') { |f| f.read }
+        numbers = []
+        @track.each_sample(2..4) do |info, data|
+          numbers << info[:number]
+          data.should be_frozen
+          data.should == bytes[info[:offset], info[:size]]
+        end
+        numbers.should == [2, 3, 4]
+        @track.each_sample.to_a.size.should == 31
+      end
+      
+      it "should fingerprint the sample data with CRC-32C" do
+        @track.fingerprint(:algo => :crc32c).should == "3e3bab54"
+        @track.fingerprint.should =~ /\A[0-9a-f]{16}\z/
+        lambda { @track.fingerprint(:algo => :md5) }.should raise_error(ArgumentError)
+      end
+      
       it "should be able to delete a track" do
         @track.delete
         @movie.video_tracks.should == []
@@ -109,6 +159,154 @@ describe QuickTime::Track do
         @track.volume = 0.5
         @track.volume.should == 0.5
       end
+      
+      it "should raise an exception measuring levels of compressed audio" do
+        lambda { @track.audio_levels }.should raise_error(QuickTime::Error)
+      end
+    end
+  end
+  
+  describe "pcm_tone.mov" do
+    before(:each) do
+      @movie = QuickTime::Movie.open(File.dirname(__FILE__) + '/../fixtures/pcm_tone.mov')
+      @track = @movie.audio_tracks.first
+    end
+    
+    it "should measure peak and rms of each channel" do
+      levels = @track.audio_levels
+      levels[:channels].map { |c| c[:assignment] }.should == [:Left, :Right]
+      levels[:channels].map { |c| c[:peak] }.should == [0.5, 0.25]
+      levels[:channels].first[:peak_db].should be_close(-6.02, 0.01)
+      levels[:channels].first[:rms_db].should be_close(-9.03, 0.01)
+    end
+    
+    it "should measure integrated loudness of the channels together and alone" do
+      levels = @track.audio_levels
+      levels[:loudness].should be_close(-8.0, 0.1)
+      levels[:channels].first[:loudness].should be_close(-9.0, 0.1)
+      levels[:channels].last[:loudness].should be_close(-15.0, 0.1)
+    end
+    
+    it "should build a waveform of each channel kept in a sidecar" do
+      path = File.dirname(__FILE__) + '/../output/pcm_tone.waveform'
+      File.delete(path) if File.exist?(path)
+      waveform = @track.waveform(4, :sidecar => path)
+      waveform.map { |c| c[:assignment] }.should == [:Left, :Right]
+      waveform.first[:max].size.should == 4
+      waveform.first[:max].each { |v| v.should be_close(0.5, 0.001) }
+      waveform.last[:min].each { |v| v.should be_close(-0.25, 0.001) }
+      File.exist?(path).should be_true
+      @track.waveform(16, :sidecar => path).first[:min].size.should == 16
+      File.delete(path)
+    end
+    
+    it "should give each frame its size when stsz gives it 1" do
+      @track.sample_info(1)[:offset].should == 28
+      @track.sample_info(1)[:size].should == 4
+      @track.sample_info(2)[:offset].should == 32
+      @track.sample_info(16000)[:size].should == 4
+    end
+    
+    it "should yield the data of every frame" do
+      bytes = File.open(File.dirname(__FILE__) + '/../fixtures/pcm_tone.mov', 'rb') { |f| f.read }
+      total = 0
+      @track.each_sample do |info, data|
+        data.should == bytes[info[:offset], info[:size]] if [1000, 9000].include?(info[:number])
+        total += data.size
+      end
+      # the four chunks of the mdat payload are 16 bytes apart
+      mdat = bytes.index('mdat') - 4
+      total.should == bytes[mdat, 4].unpack('N').first - 8 - 4 * 16
+    end    
+    it "should fingerprint all of the audio" do
+      path = File.dirname(__FILE__) + '/../output/pcm_tone_changed.mov'
+      data = File.open(File.dirname(__FILE__) + '/../fixtures/pcm_tone.mov', 'rb') { |f| f.read }
+      data[28 + 10000] = (data[28 + 10000].ord ^ 1).chr
+      File.open(path, 'wb') { |f| f.write(data) }
+      movie = QuickTime::Movie.open(path)
+      movie.audio_tracks.first.fingerprint.should_not == @track.fingerprint
+      movie.audio_tracks.first.fingerprint(:algo => :crc32c).should_not == @track.fingerprint(:algo => :crc32c)
+      movie.dispose
+      File.delete(path)
+    end    
+    it "should keep all of its audio when the movie is flattened" do
+      path = File.dirname(__FILE__) + '/../output/pcm_tone_flat.mov'
+      File.delete(path) if File.exist?(path)
+      @movie.flatten(path)
+      movie = QuickTime::Movie.open(path)
+      movie.duration.should == 1.0
+      track = movie.audio_tracks.first
+      track.sample_info(16000)[:size].should == 4
+      track.audio_levels[:loudness].should be_close(@track.audio_levels[:loudness], 0.001)
+      track.audio_levels[:channels].map { |c| c[:peak] }.should == [0.5, 0.25]
+      File.open(path, 'rb') { |f| f.read }.should include("stsz\0\0\0\0\0\0\0\1")
+      movie.dispose
+      File.delete(path)
+    end    
+    it "should raise when the sample count is more than its tables hold" do
+      path = File.dirname(__FILE__) + '/../output/pcm_tone_corrupt.mov'
+      data = File.open(File.dirname(__FILE__) + '/../fixtures/pcm_tone.mov', 'rb') { |f| f.read }
+      data[data.index('stsz') + 12, 4] = [0xfffffff0].pack('N')
+      File.open(path, 'wb') { |f| f.write(data) }
+      track = QuickTime::Movie.open(path).audio_tracks.first
+      lambda { track.sample_info(1) }.should raise_error(QuickTime::Error)
+      File.delete(path)
+    end
+  end
+  
+  describe "slideshow.mov" do
+    before(:each) do
+      @movie = QuickTime::Movie.open(File.dirname(__FILE__) + '/../fixtures/slideshow.mov')
+      @track = @movie.video_tracks.first
+      @directory = File.dirname(__FILE__) + '/../output/stills'
+    end
+    
+    after(:each) do
+      FileUtils.rm_rf(@directory)
+    end
+    
+    it "should export frames as images named by their number" do
+      @track.image_format.should == :jpeg
+      paths = @track.export_image_sequence(@directory, :pattern => "still_%03d", :range => 2..3, :threads => 2)
+      paths.map { |path| File.basename(path) }.should == ["still_002.jpg", "still_003.jpg"]
+      File.open(paths.last, 'rb') { |f| f.read }.should == @movie.contact_sheet([2.5]).first[:data]
+    end
+    
+    it "should raise an exception exporting frames which need decoding" do
+      track = QuickTime::Movie.open(File.dirname(__FILE__) + '/../fixtures/example.mov').video_tracks.first
+      track.image_format.should be_nil
+      lambda { track.export_image_sequence(@directory) }.should raise_error(QuickTime::Error)
+    end
+  end
+  
+  describe "chapter track" do
+    before(:each) do
+      @path = File.dirname(__FILE__) + '/../output/subtitled.mov'
+      File.delete(@path) if File.exist?(@path)
+      QuickTime::Movie.open(File.dirname(__FILE__) + '/../fixtures/example.mov').flatten(@path)
+      @movie = QuickTime::Movie.open(@path)
+      @movie.chapters = [{ :title => "One", :time => 0.5 }, { :title => "Two\nlines", :time => 2 }]
+      @track = @movie.chapter_track
+    end
+    
+    after(:each) do
+      File.delete(@path) if File.exist?(@path)
+    end
+    
+    it "should yield the text of each sample with its time in the movie" do
+      samples = []
+      @track.each_text_sample { |sample| samples << sample }
+      samples.should == [{ :text => "One", :start => 0.5, :duration => 1.5 }, { :text => "Two\nlines", :start => 2.0, :duration => 1.1 }]
+      lambda { @movie.video_tracks.first.each_text_sample { } }.should raise_error(QuickTime::Error)
+    end
+    
+    it "should export the samples as subtitles" do
+      srt = File.dirname(__FILE__) + '/../output/subtitled.srt'
+      @track.export_subtitles(srt)
+      File.read(srt).should == "1\n00:00:00,500 --> 00:00:02,000\nOne\n\n2\n00:00:02,000 --> 00:00:03,100\nTwo\nlines\n\n"
+      @track.export_subtitles(srt, :format => :webvtt)
+      File.read(srt).should include("WEBVTT\n\n00:00:00.500 --> 00:00:02.000\nOne\n")
+      File.delete(srt)
     end
   end
 end